@@ -38,13 +38,53 @@
 
 #define PP_HISTORY		10000
 
+/*
+ * SMART: reads are assigned to streams, a stream which moved by the
+ * same stride PP_CONF_MIN times in a row is prefetched ahead, the
+ * depth doubles with every further hit up to pp_prefetch. Reads which
+ * belong to no stream are looked up in a table of successors, learned
+ * from the history by the pp thread. A successor seen PP_MARKOV_MIN
+ * times is prefetched, followed by its own successors. If more than
+ * half of the blocks prefetched are evicted unused, the maximum depth
+ * is halved, if less than a quarter, it grows again. Streams and
+ * successors are kept per device, LBAs of different devices never
+ * predict each other.
+ */
+#define PP_STREAMS		16	/* streams tracked at the same time */
+#define PP_STREAM_WINDOW	256	/* max LBA distance within a stream */
+#define PP_CONF_MIN		2	/* equal strides before prefetching */
+#define PP_CONF_MAX		7
+#define PP_MARKOV		8192	/* successor table size, power of 2 */
+#define PP_MARKOV_WAYS		2
+#define PP_MARKOV_MIN		2	/* successor repeated before use */
+#define PP_MARKOV_MAX		3
+#define PP_FEEDBACK_MIN		32	/* blocks prefetched before throttling */
+#define PP_SMART_INTERVAL_MS	100
+
 static int _pp_strategy = PP_STRATEGY_UPDOWN;
 static int _pp_history = PP_HISTORY;
 
 struct __lba {
+	int dev;
 	off_t lba;
 	unsigned int nblocks;
 	unsigned long usecs;
+	int _read;
+};
+
+struct __stream {
+	int dev;
+	off_t last;		/* last LBA read */
+	off_t stride;		/* LBA difference seen last */
+	unsigned int conf;	/* times in a row stride was seen */
+	unsigned long stamp;	/* 0: unused, LRU otherwise */
+};
+
+struct __succ {
+	int dev;
+	off_t lba;
+	off_t next;		/* LBA read after lba */
+	unsigned int count;	/* saturating confidence */
 };
 
 struct __pp {
@@ -56,8 +96,19 @@ struct __pp {
 	unsigned int lba_ridx;	/* read index */
 	unsigned int lba_widx;	/* write index */
 	unsigned int lba_num;	/* valid entries */
+	unsigned long lba_total;	/* entries ever added */
 	pthread_t tid;
 
+	/* SMART */
+	struct __stream streams[PP_STREAMS];
+	unsigned long stamp;
+	struct __succ *succ;	/* PP_MARKOV entries */
+	unsigned long lba_trained;	/* history consumed by the pp thread */
+	off_t lba_prev[PP_DEVS_MAX];	/* per device, last read trained */
+	unsigned int depth_max;	/* throttled prefetch depth */
+	unsigned long issued;	/* blocks prefetched, see pp_feedback() */
+	unsigned long wasted;	/* blocks evicted unused */
+
 	void *put_data;
 	size_t put_nblocks;
 	int (* pp_put_offslist)(void *put_data, int *offslist, unsigned int n, size_t nblocks);
@@ -68,8 +119,10 @@ struct __pp {
 
 struct pp_funcs {
 	unsigned int flags;
-	int (* pp_add_lba)(off_t lba, size_t nblocks, unsigned long usecs, int _read);
+	unsigned int interval_ms;	/* pp thread period, 0: 1 sec */
+	int (* pp_add_lba)(int dev, off_t lba, size_t nblocks, unsigned long usecs, int _read);
 	int (* pp_get_offslist)(int *offslist, unsigned int n, size_t nblocks);
+	int (* pp_predict)(int dev, off_t lba, size_t nblocks, off_t *lbas, unsigned int n);
 	void * (* pp_thread)(struct __pp *pp);
 };
 
@@ -81,22 +134,24 @@ static struct __pp pp;
  * the optimal priolist every once in a while, e.g. every 1 sec.
  *
  * @p:         priority detector
+ * @dev:       device of the LBA
  * @lba:       requested LBA
  * @nblocks:   how many blocks per LBA
  */
-static int __pp_add_lba(off_t lba  __attribute__((unused)),
-		size_t nblocks  __attribute__((unused)),
-		unsigned long usecs  __attribute__((unused)),
-		int _read __attribute__((unused)))
+static int __pp_add_lba(int dev, off_t lba, size_t nblocks,
+		unsigned long usecs, int _read)
 {
 	if ((pp.f->flags & PP_FLAG_ALLOC_LBA_LIST) != PP_FLAG_ALLOC_LBA_LIST)
 		return -1;
 
 	pthread_mutex_lock(&pp.lock);
 
+	pp.lba_list[pp.lba_widx].dev = dev;
 	pp.lba_list[pp.lba_widx].lba = lba;
 	pp.lba_list[pp.lba_widx].nblocks = nblocks;
 	pp.lba_list[pp.lba_widx].usecs = usecs;
+	pp.lba_list[pp.lba_widx]._read = _read;
+	pp.lba_total++;
 
 	if (pp.lba_num < pp.lba_max) {
 		pp.lba_num++;
@@ -187,37 +242,247 @@ static void *__pp_thread(struct __pp *pp)
 	return NULL;
 }
 
+/*
+ * SMART: find the stream lba of dev continues. The one whose stride
+ * leads exactly to lba wins, otherwise the closest one within
+ * PP_STREAM_WINDOW. Returns NULL if there is none. Called with lock.
+ */
+static struct __stream *__stream_find(int dev, off_t lba)
+{
+	unsigned int i;
+	off_t d, dmin = PP_STREAM_WINDOW + 1;
+	struct __stream *s, *best = NULL;
+
+	for (i = 0; i < PP_STREAMS; i++) {
+		s = &pp.streams[i];
+		if ((s->stamp == 0) || (s->dev != dev))
+			continue;
+		if (s->stride && (s->last + s->stride == lba))
+			return s;
+		d = (lba > s->last) ? lba - s->last : s->last - lba;
+		if (d < dmin) {
+			dmin = d;
+			best = s;
+		}
+	}
+	return best;
+}
+
+static void __stream_update(int dev, off_t lba)
+{
+	unsigned int i;
+	off_t stride;
+	struct __stream *s = __stream_find(dev, lba);
+
+	if (s == NULL) {	/* start a new one, replacing the LRU */
+		s = &pp.streams[0];
+		for (i = 1; i < PP_STREAMS; i++)
+			if (pp.streams[i].stamp < s->stamp)
+				s = &pp.streams[i];
+		s->dev = dev;
+		s->last = lba;
+		s->stride = 0;
+		s->conf = 0;
+		s->stamp = ++pp.stamp;
+		return;
+	}
+
+	s->stamp = ++pp.stamp;
+	stride = lba - s->last;
+	if (stride == 0)	/* same LBA again */
+		return;
+	if (stride == s->stride) {
+		if (s->conf < PP_CONF_MAX)
+			s->conf++;
+	} else {
+		s->stride = stride;
+		s->conf = 1;
+	}
+	s->last = lba;
+}
+
+static int __pp_smart_add_lba(int dev, off_t lba, size_t nblocks,
+		unsigned long usecs, int _read)
+{
+	int rc;
+
+	rc = __pp_add_lba(dev, lba, nblocks, usecs, _read);
+	if ((rc != 0) || !_read)
+		return rc;
+
+	pthread_mutex_lock(&pp.lock);
+	__stream_update(dev, lba);
+	pthread_mutex_unlock(&pp.lock);
+	return 0;
+}
+
+/* The successor table is PP_MARKOV_WAYS set associative */
+static inline struct __succ *__succ_set(int dev, off_t lba)
+{
+	off_t h = lba ^ (lba >> 12) ^ ((off_t)dev << 9);
+
+	return &pp.succ[(h * PP_MARKOV_WAYS) & (PP_MARKOV - 1)];
+}
+
+static struct __succ *__succ_lookup(int dev, off_t lba)
+{
+	unsigned int i;
+	struct __succ *e = __succ_set(dev, lba);
+
+	for (i = 0; i < PP_MARKOV_WAYS; i++)
+		if ((e[i].count > 0) && (e[i].dev == dev) &&
+		    (e[i].lba == lba))
+			return &e[i];
+	return NULL;
+}
+
+/* Learn that next was read after lba on dev, called with lock */
+static void __succ_train(int dev, off_t lba, off_t next)
+{
+	unsigned int i;
+	struct __succ *e = __succ_lookup(dev, lba), *set;
+
+	if (e == NULL) {	/* take the weakest way of the set */
+		set = __succ_set(dev, lba);
+		e = &set[0];
+		for (i = 1; i < PP_MARKOV_WAYS; i++)
+			if (set[i].count < e->count)
+				e = &set[i];
+	} else if (e->next == next) {
+		if (e->count < PP_MARKOV_MAX)
+			e->count++;
+		return;
+	}
+
+	if (e->count > 0) {	/* age the old one, replace once it is 0 */
+		e->count--;
+		return;
+	}
+	e->dev = dev;
+	e->lba = lba;
+	e->next = next;
+	e->count = 1;
+}
+
+/*
+ * SMART: predict the LBAs to read ahead of a read of lba on dev.
+ * Returns the number of LBAs stored in lbas, at most n.
+ */
+static int __pp_smart_predict(int dev, off_t lba,
+			size_t nblocks __attribute__((unused)),
+			off_t *lbas, unsigned int n)
+{
+	unsigned int k, depth;
+	struct __stream *s;
+	struct __succ *e;
+
+	pthread_mutex_lock(&pp.lock);
+
+	n = (n < pp.depth_max) ? n : pp.depth_max;
+
+	s = __stream_find(dev, lba);
+	if ((s != NULL) && s->stride && (s->last + s->stride == lba) &&
+	    (s->conf >= PP_CONF_MIN)) {
+		depth = 1u << (s->conf - PP_CONF_MIN);
+		depth = (depth < n) ? depth : n;
+		for (k = 0; k < depth; k++)
+			lbas[k] = lba + (k + 1) * s->stride;
+		pthread_mutex_unlock(&pp.lock);
+		return depth;
+	}
+
+	for (k = 0; k < n; k++) {	/* follow the chain of successors */
+		e = __succ_lookup(dev, lba);
+		if ((e == NULL) || (e->count < PP_MARKOV_MIN))
+			break;
+		lba = e->next;
+		lbas[k] = lba;
+	}
+
+	pthread_mutex_unlock(&pp.lock);
+	return k;
+}
+
+/*
+ * SMART: train the successor table with the reads added since the
+ * last run and adjust the depth to the prefetched blocks which were
+ * not used. Called with lock.
+ */
+static void *__pp_smart_thread(struct __pp *pp)
+{
+	unsigned long seq, issued, wasted;
+	struct __lba *l;
+	off_t *prev;
+
+	if (pp->lba_total - pp->lba_trained > pp->lba_max)
+		pp->lba_trained = pp->lba_total - pp->lba_max;
+
+	for (seq = pp->lba_trained; seq < pp->lba_total; seq++) {
+		l = &pp->lba_list[seq % pp->lba_max];
+		if (!l->_read || (l->dev < 0) || (l->dev >= PP_DEVS_MAX))
+			continue;
+		prev = &pp->lba_prev[l->dev];
+		if ((*prev >= 0) && (l->lba != *prev))
+			__succ_train(l->dev, *prev, l->lba);
+		*prev = l->lba;
+	}
+	pp->lba_trained = pp->lba_total;
+
+	issued = __atomic_exchange_n(&pp->issued, 0, __ATOMIC_RELAXED);
+	wasted = __atomic_exchange_n(&pp->wasted, 0, __ATOMIC_RELAXED);
+	if (issued + wasted >= PP_FEEDBACK_MIN) {
+		if (wasted * 2 > issued)
+			pp->depth_max /= 2;
+		else if ((wasted * 4 < issued) &&
+			 (pp->depth_max < (unsigned int)pp->pp_prefetch))
+			pp->depth_max = pp->depth_max ? pp->depth_max * 2 : 1;
+		if (pp->depth_max > (unsigned int)pp->pp_prefetch)
+			pp->depth_max = pp->pp_prefetch;
+	} else if (pp->depth_max == 0)
+		pp->depth_max = 1;	/* probe again */
+
+	pp_trace("[%s] trained up to %lu issued=%lu wasted=%lu depth_max=%u\n",
+		__func__, pp->lba_trained, issued, wasted, pp->depth_max);
+	return NULL;
+}
+
 static struct pp_funcs pp_funcs[] = {
 	/* 0: PP_STRATEGY_UP */
 	{ .flags = 0x0,
 	  .pp_add_lba = NULL,
 	  .pp_get_offslist = __pp_up_offslist,
+	  .pp_predict = NULL,
 	  .pp_thread = __pp_thread },
 	/* 1: PP_STRATEGY_DOWN */
 	{ .flags = 0x0,
 	  .pp_add_lba = NULL,
 	  .pp_get_offslist = __pp_down_offslist,
+	  .pp_predict = NULL,
 	  .pp_thread = __pp_thread },
 	/* 2: PP_STRATEGY_UPDOWN */
 	{ .flags = 0x0,
 	  .pp_add_lba = NULL,
 	  .pp_get_offslist = __pp_updown_offslist,
+	  .pp_predict = NULL,
 	  .pp_thread = __pp_thread },
 	/* 3: PP_STRATEGY_SMART */
 	{ .flags = (PP_FLAG_ALLOC_LBA_LIST | PP_FLAG_START_THREAD),
-	  .pp_add_lba = __pp_add_lba,
+	  .interval_ms = PP_SMART_INTERVAL_MS,
+	  .pp_add_lba = __pp_smart_add_lba,
 	  .pp_get_offslist = __pp_updown_offslist,
-	  .pp_thread = __pp_thread },
+	  .pp_predict = __pp_smart_predict,
+	  .pp_thread = __pp_smart_thread },
 };
 
-int pp_add_lba(off_t lba, size_t nblocks, unsigned long usecs, int _read)
+int pp_add_lba(int dev, off_t lba, size_t nblocks, unsigned long usecs,
+	       int _read)
 {
-	pp_trace("  [%s] %s[%4u] LBA=%ld nblocks=%i %ld usecs\n",
+	pp_trace("  [%s] %s[%4u] dev=%d LBA=%ld nblocks=%i %ld usecs\n",
 		__func__, _read ? "lba_read" : "lba_write",
-		pp.lba_widx, lba, (int)nblocks, usecs);
+		pp.lba_widx, dev, lba, (int)nblocks, usecs);
 
 	if (pp.f->pp_add_lba)
-		return pp.f->pp_add_lba(lba, nblocks, usecs, _read);
+		return pp.f->pp_add_lba(dev, lba, nblocks, usecs, _read);
 	return 0;
 }
 
@@ -230,6 +495,22 @@ int pp_get_offslist(int *offslist, unsigned int n, size_t nblocks)
 	return 0;
 }
 
+int pp_predict(int dev, off_t lba, size_t nblocks, off_t *lbas,
+	       unsigned int n)
+{
+	if (pp.f->pp_predict)
+		return pp.f->pp_predict(dev, lba, nblocks, lbas, n);
+	return -1;
+}
+
+void pp_feedback(unsigned int issued, unsigned int wasted)
+{
+	if (issued)
+		__atomic_add_fetch(&pp.issued, issued, __ATOMIC_RELAXED);
+	if (wasted)
+		__atomic_add_fetch(&pp.wasted, wasted, __ATOMIC_RELAXED);
+}
+
 static void *pp_thread(void *arg __attribute__((unused)))
 {
 	struct __pp *pp = (struct __pp *)arg;
@@ -245,7 +526,10 @@ static void *pp_thread(void *arg __attribute__((unused)))
 			pp->pp_put_offslist(pp->put_data, NULL,
 				pp->pp_prefetch, pp->put_nblocks);
 
-		sleep(1);
+		if (pp->f->interval_ms)
+			usleep(pp->f->interval_ms * 1000);
+		else
+			sleep(1);
 		pthread_testcancel();	/* go home if requested */
 	}
 
@@ -261,19 +545,38 @@ int pp_init(int pp_prefetch, pp_put_offslist_t put,  size_t put_nblocks,
 	void *put_data)
 {
 	int rc;
+	unsigned int i;
 
 	pthread_mutex_init(&pp.lock, NULL);
 
 	pp.f = &pp_funcs[_pp_strategy];
 	pp.lba_list = NULL;
 
+	pp.succ = NULL;
+
 	if (pp.f->flags & PP_FLAG_ALLOC_LBA_LIST) {
 		pp.lba_list = calloc(1, _pp_history * sizeof(struct __lba));
 		if (!pp.lba_list)
 			return -1;
 		pp.lba_ridx = 0;
 		pp.lba_widx = 0;
+		pp.lba_num = 0;
 		pp.lba_max = _pp_history;
+		pp.lba_total = 0;
+	}
+
+	if (pp.f->pp_predict) {
+		pp.succ = calloc(PP_MARKOV, sizeof(*pp.succ));
+		if (!pp.succ)
+			goto err_out;
+		memset(pp.streams, 0, sizeof(pp.streams));
+		pp.stamp = 0;
+		pp.lba_trained = 0;
+		for (i = 0; i < PP_DEVS_MAX; i++)
+			pp.lba_prev[i] = -1;
+		pp.depth_max = pp_prefetch;
+		pp.issued = 0;
+		pp.wasted = 0;
 	}
 
 	pp.pp_prefetch = pp_prefetch;
@@ -289,21 +592,28 @@ int pp_init(int pp_prefetch, pp_put_offslist_t put,  size_t put_nblocks,
 	}
 	return 0;
  err_out:
+	free(pp.succ);
+	pp.succ = NULL;
 	free(pp.lba_list);
+	pp.lba_list = NULL;
 	return -1;
 }
 void pp_done(void)
 {
-	if (pp.lba_list) {
-		free(pp.lba_list);
-		pp.lba_list = NULL;
-	}
-
+	/* The thread works on the history, stop it first */
 	if (pp.tid != 0) {
 		pthread_cancel(pp.tid);
 		pthread_join(pp.tid, NULL);
 		pp.tid = 0;
 	}
+
+	if (pp.lba_list) {
+		free(pp.lba_list);
+		pp.lba_list = NULL;
+	}
+
+	free(pp.succ);
+	pp.succ = NULL;
 }
 
 static void _init(void) __attribute__((constructor));
@@ -31,6 +31,8 @@
 
 #include <stdint.h>
 
+#define PP_DEVS_MAX	8	/* device numbers 0..PP_DEVS_MAX-1 */
+
 enum pp_strategy {
 	PP_STRATEGY_UP = 0,
 	PP_STRATEGY_DOWN,
@@ -49,10 +51,12 @@ void pp_done(void);
  * our list of the last lba_max LBAs. This is required to calculate
  * the optimal priolist every once in a while, e.g. every 1 sec.
  *
+ * @dev:       device the LBA belongs to, 0..PP_DEVS_MAX-1
  * @lba:       requested LBA
  * @nblocks:   how many blocks per LBA
  */
-int pp_add_lba(off_t lba, size_t nblocks, unsigned long usecs, int _read);
+int pp_add_lba(int dev, off_t lba, size_t nblocks, unsigned long usecs,
+	       int _read);
 
 /*
  * The user is asked to update the priolist in a regular fashion such
@@ -63,4 +67,25 @@ int pp_add_lba(off_t lba, size_t nblocks, unsigned long usecs, int _read);
  */
 int pp_get_offslist(int *offslist, unsigned int n, size_t nblocks);
 
+/*
+ * Strategies learning from the history (SMART) predict the LBAs to
+ * prefetch after a read instead of using fixed offsets.
+ *
+ * @dev:       device being read
+ * @lba:       LBA being read
+ * @lbas:      LBAs to prefetch on the same device, nblocks each
+ * @n:         size of lbas
+ *
+ * Returns the number of LBAs stored, -1 if the strategy uses offsets.
+ */
+int pp_predict(int dev, off_t lba, size_t nblocks, off_t *lbas,
+	       unsigned int n);
+
+/*
+ * Tell how many prefetched blocks were started (issued) and how many
+ * were evicted without being used (wasted), such that the prefetch
+ * depth can be throttled. Lock free, can be called anywhere.
+ */
+void pp_feedback(unsigned int issued, unsigned int wasted);
+
 #endif /* __PP_H__ */
@@ -32,6 +32,7 @@
 
 #include "snap_internal.h"
 #include "force_cpu.h"
+#include "workload.h"
 #include <capiblock.h> /* FIXME fake fake */
 
 int verbose_flag = 0;
@@ -47,6 +48,7 @@ typedef enum {
 	OP_WRITE = 1,
 	OP_FORMAT = 2,
 	OP_RW = 3,
+	OP_BENCH = 4,
 } cblk_operation_t;
 
 static chunk_id_t cid = (chunk_id_t)-1; /* global to close device via sig_INT */
@@ -66,6 +68,7 @@ static void usage(const char *prog)
 	       "  -w, --write               write entire device.\n"
 	       "  -r, --read                read entire device.\n"
 	       "  -x, --rw                  read write testcase.\n"
+	       "  -B, --bench               workload generator, see below.\n"
 	       "  -R, --random <seed>       random seek ordering\n"
 	       "  -s, --start_lba <start_lba> start offset.\n"
 	       "  -n, --num_lba <num_lba>   number of lbas to read or write\n"
@@ -73,12 +76,27 @@ static void usage(const char *prog)
 	       "                            The size of a logical block is 4KiB.\n"
 	       "  -b, --lba_blocks <lba_blocks> number of lbas to read\n"
 	       "                            or write in one operation.\n"
+	       "                            <min>-<max> for --bench.\n"
 	       "  -p, --pattern <pattern>   pattern for formatting or INC\n"
 	       "                            INC is filling the blocks with\n"
 	       "                            and increasing number.\n"
 	       "  -M, --use-mmap            create output file using mmap.\n"
 	       "  <file.bin>\n"
 	       "\n"
+	       "Workload generator (--bench), -n 0 uses the whole device:\n"
+	       "  -m, --rwmix <pct>         percentage of reads, 100: default.\n"
+	       "  -d, --dist <dist>         LBA distribution: uniform (default),\n"
+	       "                            seq, zipf:<theta> (0 < theta < 1)\n"
+	       "                            or hotspot:<range%%>:<io%%>.\n"
+	       "  -Q, --iodepth <n>         requests in flight per thread (1..16),\n"
+	       "                            -b up to 32 blocks if above 1.\n"
+	       "  -L, --rate <iops>         limit of all threads, 0: no limit.\n"
+	       "  -T, --runtime <sec>       run time limit.\n"
+	       "  -N, --ios <n>             number of requests, default without\n"
+	       "                            -T: one pass over the range.\n"
+	       "  -P, --replay <lbalog>     replay the LBA=<n> lines of a log.\n"
+	       "  -J, --json <file>         results as JSON, - for stdout.\n"
+	       "\n"
 	       "Known limitation:\n"
 	       "  We create an in-memory copy of the data. That restricts\n"
 	       "  the max possible -n <N> to whatever maximum possible memory\n"
@@ -94,6 +112,10 @@ static void usage(const char *prog)
 	       "\n"
 	       "  Write file content into the NVMe device:\n"
 	       "    snap_cblk -C0 --write cblk_read.bin\n"
+	       "\n"
+	       "  70/30 read/write mix, 1-8 blocks, zipf, 4 threads x 8 deep:\n"
+	       "    snap_cblk -C0 --bench -m70 -b1-8 -d zipf:0.9 -t4 -Q8 \\\n"
+	       "      -T30 -J result.json\n"
 	       "\n",
 	       prog);
 }
@@ -306,7 +328,7 @@ static int rqueue_init(struct rqueue *rq, void *buf,
 		rq->lba[i] = start_lba + i * nblocks;
 
 	if (random_seed)
-		randperm(rq->buf, num_lba/nblocks);
+		randperm(rq->lba, num_lba/nblocks);
 
 	return 0;
 }
@@ -413,9 +435,15 @@ static void *rw_thread(void *data)
 	struct thread_data *d = (struct thread_data *)data;
 	struct rqueue *rq = d->rq;
 	int do_read = 0;
-	uint8_t _buf[__CBLK_BLOCK_SIZE * 32];
+	uint8_t *_buf = NULL;
 
 	block_trace("[%s] NEW THREAD ALIVE %u\n", __func__, d->num);
+	if (posix_memalign((void **)&_buf, __CBLK_BLOCK_SIZE,
+			   rq->nblocks * rq->lba_size) != 0) {
+		fprintf(stderr, "err: cannot allocate %u blocks\n",
+			rq->nblocks);
+		goto err_out;
+	}
 	while (!err_detected) {
 		pthread_mutex_lock(&rq->read_lock);
 
@@ -469,10 +497,12 @@ static void *rw_thread(void *data)
 		pthread_testcancel();
 	}
 	block_trace("[%s] THREAD %u STOPPED\n", __func__, d->num);
+	__free(_buf);
 	d->thread_rc = 0;
 	pthread_exit(&d->thread_rc);
 
 err_out:
+	__free(_buf);
 	err_detected = 1;		/* inform others to stop */
 	d->thread_rc = -2;
 	pthread_exit(&d->thread_rc);
@@ -540,8 +570,12 @@ int main(int argc, char *argv[])
 	int pattern = 0xff;
 	int incremental_pattern = 0;
 	unsigned int threads = 1;
-	int random_seed = 0;
 	int use_mmap = 0;
+	struct wl_config wl;
+	struct wl_result wl_res;
+	const char *json = NULL;
+
+	wl_config_init(&wl);
 
 	while (1) {
 		int option_index = 0;
@@ -563,6 +597,17 @@ int main(int argc, char *argv[])
 			{ "write",	no_argument,	   NULL, 'w' },
 			{ "read",	no_argument,	   NULL, 'r' },
 			{ "rw",		no_argument,	   NULL, 'x' },
+			{ "bench",	no_argument,	   NULL, 'B' },
+
+			/* workload generator */
+			{ "rwmix",	required_argument, NULL, 'm' },
+			{ "dist",	required_argument, NULL, 'd' },
+			{ "iodepth",	required_argument, NULL, 'Q' },
+			{ "rate",	required_argument, NULL, 'L' },
+			{ "runtime",	required_argument, NULL, 'T' },
+			{ "ios",	required_argument, NULL, 'N' },
+			{ "replay",	required_argument, NULL, 'P' },
+			{ "json",	required_argument, NULL, 'J' },
 
 			/* misc/support */
 			{ "version",	no_argument,	   NULL, 'V' },
@@ -573,7 +618,8 @@ int main(int argc, char *argv[])
 			{ 0,		no_argument,	   NULL, 0   },
 		};
 
-		ch = getopt_long(argc, argv, "MR:p:C:X:xfwrs:t:n:b:p:Vqrvh",
+		ch = getopt_long(argc, argv,
+				 "MR:p:C:X:xfwrs:t:n:b:p:Bm:d:Q:L:T:N:P:J:Vqrvh",
 				 long_options, &option_index);
 		if (ch == -1)	/* all params processed ? */
 			break;
@@ -590,7 +636,9 @@ int main(int argc, char *argv[])
 			threads = strtoul(optarg, NULL, 0);
 			break;
 		case 'b':
-			lba_blocks = strtoul(optarg, NULL, 0);
+			if (wl_parse_bs(&wl, optarg) != 0)
+				exit(EXIT_FAILURE);
+			lba_blocks = wl.bs_max;
 			break;
 		case 's':
 			start_lba = strtoul(optarg, NULL, 0);
@@ -623,6 +671,34 @@ int main(int argc, char *argv[])
 		case 'x':
 			_op = OP_RW;
 			break;
+		case 'B':
+			_op = OP_BENCH;
+			break;
+		case 'm':
+			wl.read_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			if (wl_parse_dist(&wl, optarg) != 0)
+				exit(EXIT_FAILURE);
+			break;
+		case 'Q':
+			wl.iodepth = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			wl.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			wl.runtime_sec = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			wl.ios = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			wl.replay = optarg;
+			break;
+		case 'J':
+			json = optarg;
+			break;
 		case 'V':
 			printf("%s\n", version);
 			exit(EXIT_SUCCESS);
@@ -643,9 +719,8 @@ int main(int argc, char *argv[])
 	if (argc >= optind + 1)
 		fname = argv[optind++];
 
-	if ((lba_blocks <= 0) || (lba_blocks > 32)) {
-		fprintf(stderr, "err: %zu blocks not yet supported (1, 2, 4, ..., 32)!\n",
-			lba_blocks);
+	if ((_op != OP_BENCH) && (wl.bs_min != wl.bs_max)) {
+		fprintf(stderr, "err: block range only for --bench!\n");
 		usage(argv[0]);
 		goto err_out;
 	}
@@ -695,6 +770,23 @@ int main(int argc, char *argv[])
 		num_lba = lun_size; */
 
 	switch (_op) {
+	case OP_BENCH: {
+		wl.cid = cid;
+		wl.start_lba = start_lba;
+		wl.num_lba = num_lba ? num_lba : lun_size - start_lba;
+		wl.threads = threads;
+		wl.seed = random_seed;
+		if (!wl.ios && !wl.runtime_sec && !wl.replay)
+			wl.ios = wl.num_lba / wl.bs_max;
+
+		rc = wl_run(&wl, &wl_res);
+		wl_report(stdout, &wl, &wl_res);
+		if (json && (wl_report_json(json, &wl, &wl_res) != 0))
+			goto err_out;
+		if (rc != 0)
+			goto err_out;
+		break;
+	}
 	case OP_READ: {
 		int fd = -1;
 
@@ -0,0 +1,571 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark for the key/value store in snapkv.c: loads the keys, runs
+ * a get/put/delete mix, scans the store and measures the recovery
+ * after reopening it. Each value starts with the number of its key,
+ * such that gets and the scan can check what they find.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <snap_tools.h>
+
+#include "force_cpu.h"
+#include "workload.h"
+#include "snapkv.h"
+#include <capiblock.h>
+
+int verbose_flag = 0;
+static const char *version = GIT_VERSION;
+
+enum kv_op {
+	KV_OP_GET = 0,
+	KV_OP_PUT,
+	KV_OP_DELETE,
+	KV_OP_MAX,
+};
+
+static const char *kv_op_name[KV_OP_MAX] = { "get", "put", "delete" };
+
+struct kv_bench {
+	struct kv_db *db;
+	unsigned long keys;
+	unsigned int key_size;
+	unsigned int val_size;
+	unsigned int get_pct;
+	unsigned int del_pct;
+	unsigned long ops;		/* of all threads, 0: no limit */
+	unsigned long issued;
+	uint64_t deadline;		/* nsec, 0: none */
+	int failed;
+};
+
+struct kv_thread {
+	pthread_t tid;
+	struct kv_bench *b;
+	unsigned int seed;
+	unsigned long from;		/* keys loaded by this thread */
+	unsigned long to;
+	int load;
+	struct wl_stats st[KV_OP_MAX];
+};
+
+static inline uint64_t kv_bench_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void kv_make_key(struct kv_bench *b, char *key, unsigned long id)
+{
+	char tmp[32];
+	int n = snprintf(tmp, sizeof(tmp), "%lu", id);
+
+	memset(key, 'k', b->key_size);
+	memcpy(key + b->key_size - n, tmp, n);
+}
+
+static void kv_make_val(struct kv_bench *b, uint8_t *val, unsigned long id)
+{
+	uint64_t v = id;
+
+	memset(val, id & 0xff, b->val_size);
+	memcpy(val, &v, sizeof(v));
+}
+
+static int kv_check_val(const uint8_t *val, size_t vlen, unsigned long id)
+{
+	uint64_t v;
+
+	if (vlen < sizeof(v))
+		return -1;
+	memcpy(&v, val, sizeof(v));
+	return (v == id) ? 0 : -1;
+}
+
+static void *kv_bench_thread(void *arg)
+{
+	struct kv_thread *t = (struct kv_thread *)arg;
+	struct kv_bench *b = t->b;
+	char key[KV_KEY_MAX];
+	uint8_t *val;
+	unsigned long id;
+	unsigned int r;
+	enum kv_op op;
+	uint64_t stime;
+	size_t vlen;
+	int rc;
+
+	val = malloc(b->val_size);
+	if (val == NULL) {
+		b->failed = 1;
+		return NULL;
+	}
+
+	for (id = t->from; ; id++) {
+		if (t->load) {
+			if (id >= t->to)
+				break;
+			op = KV_OP_PUT;
+		} else {
+			if (b->failed || (b->deadline &&
+					  kv_bench_now() >= b->deadline))
+				break;
+			if (b->ops &&
+			    (__sync_fetch_and_add(&b->issued, 1) >= b->ops))
+				break;
+			id = rand_r(&t->seed) % b->keys;
+			r = rand_r(&t->seed) % 100;
+			op = (r < b->get_pct) ? KV_OP_GET :
+				(r < b->get_pct + b->del_pct) ? KV_OP_DELETE :
+				KV_OP_PUT;
+		}
+
+		kv_make_key(b, key, id);
+		stime = kv_bench_now();
+		switch (op) {
+		case KV_OP_GET:
+			vlen = b->val_size;
+			rc = kv_get(b->db, key, b->key_size, val, &vlen);
+			if ((rc == 0) && (kv_check_val(val, vlen, id) != 0)) {
+				fprintf(stderr, "err: key %lu has a wrong "
+					"value\n", id);
+				errno = EILSEQ;
+				rc = -1;
+			}
+			if ((rc != 0) && (errno == ENOENT) && b->del_pct)
+				rc = 0;		/* deleted before */
+			break;
+		case KV_OP_DELETE:
+			rc = kv_delete(b->db, key, b->key_size);
+			break;
+		default:
+			kv_make_val(b, val, id);
+			rc = kv_put(b->db, key, b->key_size, val, b->val_size);
+			break;
+		}
+		if (rc != 0) {
+			fprintf(stderr, "err: %s of key %lu failed: %s\n",
+				kv_op_name[op], id, strerror(errno));
+			t->st[op].errors++;
+			b->failed = 1;
+			break;
+		}
+		wl_stats_add(&t->st[op], 0, kv_bench_now() - stime);
+	}
+	free(val);
+	return NULL;
+}
+
+static int kv_bench_run(struct kv_bench *b, unsigned int threads, int load,
+			struct wl_stats *st)
+{
+	struct kv_thread *t;
+	unsigned int i, j;
+
+	t = calloc(threads, sizeof(*t));
+	if (t == NULL)
+		return -1;
+
+	for (i = 0; i < threads; i++) {
+		t[i].b = b;
+		t[i].load = load;
+		t[i].seed = rand();
+		t[i].from = b->keys * i / threads;
+		t[i].to = b->keys * (i + 1) / threads;
+		if (pthread_create(&t[i].tid, NULL, kv_bench_thread,
+				   &t[i]) != 0) {
+			b->failed = 1;
+			threads = i;
+			break;
+		}
+	}
+	memset(st, 0, KV_OP_MAX * sizeof(*st));
+	for (i = 0; i < threads; i++) {
+		pthread_join(t[i].tid, NULL);
+		for (j = 0; j < KV_OP_MAX; j++)
+			wl_stats_merge(&st[j], &t[i].st[j]);
+	}
+	free(t);
+	return b->failed ? -1 : 0;
+}
+
+static void kv_report(const char *phase, const struct wl_stats *st,
+		      uint64_t usec)
+{
+	unsigned int op;
+
+	for (op = 0; op < KV_OP_MAX; op++) {
+		if (st[op].ios == 0)
+			continue;
+		printf("%-5s %-6s: %8lld ops %10.1f ops/s  avg %7.1f "
+		       "p50 %7.1f p99 %7.1f p99.9 %7.1f max %7.1f usec\n",
+		       phase, kv_op_name[op], (long long)st[op].ios,
+		       usec ? st[op].ios * 1000000.0 / usec : 0.0,
+		       st[op].lat_sum / 1000.0 / st[op].ios,
+		       wl_percentile(&st[op], 50.0) / 1000.0,
+		       wl_percentile(&st[op], 99.0) / 1000.0,
+		       wl_percentile(&st[op], 99.9) / 1000.0,
+		       st[op].lat_max / 1000.0);
+	}
+}
+
+static void kv_report_stats(struct kv_db *db)
+{
+	struct kv_stats s;
+
+	kv_get_stats(db, &s);
+	printf("store: %lld keys, log %lld/%lld blocks, %lld batches "
+	       "(%.1f records, %.1f blocks each), %lld batches compacted, "
+	       "%lld records relocated\n",
+	       (long long)s.keys, (long long)s.log_used,
+	       (long long)s.log_size, (long long)s.batches,
+	       s.batches ? (double)s.batch_records / s.batches : 0.0,
+	       s.batches ? (double)s.batch_blocks / s.batches : 0.0,
+	       (long long)s.compactions, (long long)s.relocated);
+}
+
+struct kv_scan_arg {
+	struct kv_bench *b;
+	unsigned long records;
+	unsigned long bytes;
+	unsigned long bad;
+};
+
+static int kv_scan_cb(void *arg, const void *key, size_t klen,
+		      const void *val, size_t vlen)
+{
+	struct kv_scan_arg *s = (struct kv_scan_arg *)arg;
+	const char *k = key;
+	unsigned long id = 0;
+	size_t i;
+
+	for (i = 0; i < klen; i++)
+		if ((k[i] >= '0') && (k[i] <= '9'))
+			id = id * 10 + k[i] - '0';
+	if (kv_check_val(val, vlen, id) != 0)
+		s->bad++;
+	s->records++;
+	s->bytes += klen + vlen;
+	return 0;
+}
+
+/**
+ * @brief Prints valid command line options
+ *
+ * @param prog	current program name
+ */
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -C, --card <cardno> can be (0...3)\n"
+	       "  -V, --version             print version.\n"
+	       "  -X, --cpu <id>            only run on this CPU.\n"
+	       "  -s, --start_lba <lba>     superblock of the store.\n"
+	       "  -n, --num_lba <n>         blocks of the store, 0: up to the end.\n"
+	       "  -o, --open                use the existing store, no load.\n"
+	       "  -t, --threads <n>         threads issuing requests.\n"
+	       "  -k, --keys <n>            number of keys, default 10000.\n"
+	       "  -K, --key_size <bytes>    default 16.\n"
+	       "  -S, --val_size <bytes>    default 100.\n"
+	       "  -g, --get <pct>           gets in the mix, default 90.\n"
+	       "  -D, --delete <pct>        deletes in the mix, default 0.\n"
+	       "  -T, --runtime <sec>       length of the mixed run.\n"
+	       "  -N, --ops <n>             requests of the mixed run,\n"
+	       "                            default without -T: 2 x keys.\n"
+	       "  -b, --batch <blocks>      blocks per log write (1..32).\n"
+	       "  -c, --commit_usec <usec>  wait for more puts per write.\n"
+	       "  -a, --async               puts return before they are durable.\n"
+	       "  -z, --compact <pct>       compact above this log usage.\n"
+	       "  -R, --random <seed>       seed for the key choice.\n"
+	       "\n"
+	       "Example:\n"
+	       "  Load 100000 keys into the first GiB, 80%% gets for 30 sec:\n"
+	       "    snap_kv -C0 -n 0x40000 -k 100000 -g 80 -t 8 -T 30\n"
+	       "\n",
+	       prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, rc = 0;
+	int card_no = 0;
+	int cpu = -1;
+	char device[128];
+	chunk_id_t cid;
+	struct kv_options opts;
+	struct kv_bench b;
+	struct kv_db *db;
+	struct kv_stats s;
+	struct kv_scan_arg scan;
+	struct wl_stats st[KV_OP_MAX];
+	unsigned int threads = 1;
+	unsigned int random_seed = 0;
+	unsigned long runtime_sec = 0;
+	uint64_t stime, usec, keys;
+	int create = 1;
+
+	kv_options_init(&opts);
+	memset(&b, 0, sizeof(b));
+	b.keys = 10000;
+	b.key_size = 16;
+	b.val_size = 100;
+	b.get_pct = 90;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "card",	 required_argument, NULL, 'C' },
+			{ "cpu",	 required_argument, NULL, 'X' },
+			{ "start_lba",	 required_argument, NULL, 's' },
+			{ "num_lba",	 required_argument, NULL, 'n' },
+			{ "open",	 no_argument,	    NULL, 'o' },
+			{ "threads",	 required_argument, NULL, 't' },
+			{ "keys",	 required_argument, NULL, 'k' },
+			{ "key_size",	 required_argument, NULL, 'K' },
+			{ "val_size",	 required_argument, NULL, 'S' },
+			{ "get",	 required_argument, NULL, 'g' },
+			{ "delete",	 required_argument, NULL, 'D' },
+			{ "runtime",	 required_argument, NULL, 'T' },
+			{ "ops",	 required_argument, NULL, 'N' },
+			{ "batch",	 required_argument, NULL, 'b' },
+			{ "commit_usec", required_argument, NULL, 'c' },
+			{ "async",	 no_argument,	    NULL, 'a' },
+			{ "compact",	 required_argument, NULL, 'z' },
+			{ "random",	 required_argument, NULL, 'R' },
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv,
+				 "C:X:s:n:ot:k:K:S:g:D:T:N:b:c:az:R:Vvh",
+				 long_options, &option_index);
+		if (ch == -1)	/* all params processed ? */
+			break;
+
+		switch (ch) {
+		case 'C':
+			card_no = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'X':
+			cpu = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opts.start_lba = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.nblocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			create = 0;
+			break;
+		case 't':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			b.keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'K':
+			b.key_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			b.val_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			b.get_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			b.del_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			runtime_sec = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			b.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.batch_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.commit_usec = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			opts.sync = 0;
+			break;
+		case 'z':
+			opts.compact_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			random_seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((b.keys == 0) || (threads == 0) ||
+	    (b.key_size < 8) || (b.key_size > KV_KEY_MAX) ||
+	    (b.val_size < sizeof(uint64_t)) ||
+	    (b.get_pct + b.del_pct > 100)) {
+		fprintf(stderr, "err: invalid keys, threads, sizes or mix!\n");
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((card_no < 0) || (card_no > 4)) {
+		fprintf(stderr, "err: (%d) is a invalid card number!\n",
+			card_no);
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((runtime_sec == 0) && (b.ops == 0))
+		b.ops = 2 * b.keys;
+
+	srand(random_seed);
+	switch_cpu(cpu, verbose_flag);
+	cblk_init(NULL, 0);
+
+	snprintf(device, sizeof(device)-1, "/dev/cxl/afu%d.0s", card_no);
+	cid = cblk_open(device, 128, O_RDWR, 0ull, 0);
+	if (cid < 0) {
+		fprintf(stderr, "err: opening %s failed rc=%d!\n",
+			device, (int)cid);
+		rc = -1;
+		goto err_term;
+	}
+
+	stime = kv_bench_now();
+	db = kv_open(cid, &opts, create ? KV_CREATE : 0);
+	if (db == NULL) {
+		fprintf(stderr, "err: opening the store failed: %s\n",
+			strerror(errno));
+		rc = -1;
+		goto err_close;
+	}
+	b.db = db;
+	if (!create) {
+		kv_get_stats(db, &s);
+		printf("open: %lld keys from %lld records in %lld usec\n",
+		       (long long)s.keys, (long long)s.recovered,
+		       (long long)s.recovery_usec);
+	}
+
+	/* Load */
+	if (create) {
+		stime = kv_bench_now();
+		rc = kv_bench_run(&b, threads, 1, st);
+		if (rc == 0)
+			rc = kv_sync(db);
+		usec = (kv_bench_now() - stime) / 1000;
+		kv_report("load", st, usec);
+		if (rc != 0)
+			goto err_kv;
+	}
+
+	/* Mixed run */
+	if (runtime_sec)
+		b.deadline = kv_bench_now() + runtime_sec * 1000000000ull;
+	stime = kv_bench_now();
+	rc = kv_bench_run(&b, threads, 0, st);
+	if (rc == 0)
+		rc = kv_sync(db);
+	usec = (kv_bench_now() - stime) / 1000;
+	kv_report("run", st, usec);
+	kv_report_stats(db);
+	if (rc != 0)
+		goto err_kv;
+
+	/* Scan */
+	memset(&scan, 0, sizeof(scan));
+	scan.b = &b;
+	stime = kv_bench_now();
+	rc = kv_scan(db, kv_scan_cb, &scan);
+	usec = (kv_bench_now() - stime) / 1000;
+	kv_get_stats(db, &s);
+	keys = s.keys;
+	printf("scan  : %lu records %.3f MiB in %lld usec %.3f MiB/sec\n",
+	       scan.records, scan.bytes / (1024.0 * 1024.0),
+	       (long long)usec,
+	       usec ? scan.bytes / (1024.0 * 1024.0) * 1000000.0 / usec : 0.0);
+	if ((rc != 0) || scan.bad || (scan.records != keys)) {
+		fprintf(stderr, "err: scan found %lu records, %lu bad, "
+			"%lld keys\n", scan.records, scan.bad,
+			(long long)keys);
+		rc = -1;
+		goto err_kv;
+	}
+	if (create && (keys > b.keys)) {
+		fprintf(stderr, "err: %lld keys in a new store of %lu keys\n",
+			(long long)keys, b.keys);
+		rc = -1;
+		goto err_kv;
+	}
+
+	/* Reopen */
+	rc = kv_close(db);
+	db = NULL;
+	if (rc != 0)
+		goto err_close;
+	db = kv_open(cid, &opts, 0);
+	if (db == NULL) {
+		fprintf(stderr, "err: reopening the store failed: %s\n",
+			strerror(errno));
+		rc = -1;
+		goto err_close;
+	}
+	kv_get_stats(db, &s);
+	printf("reopen: %lld keys from %lld records in %lld usec\n",
+	       (long long)s.keys, (long long)s.recovered,
+	       (long long)s.recovery_usec);
+	if (s.keys != keys) {
+		fprintf(stderr, "err: %lld keys after reopen, expected %lld\n",
+			(long long)s.keys, (long long)keys);
+		rc = -1;
+	}
+
+ err_kv:
+	if ((db != NULL) && (kv_close(db) != 0))
+		rc = -1;
+ err_close:
+	cblk_close(cid, 0);
+ err_term:
+	cblk_term(NULL, 0);
+	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+}
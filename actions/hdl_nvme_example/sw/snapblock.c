@@ -26,14 +26,17 @@
 #include <sched.h>
 #include <execinfo.h>
 #include <limits.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <sys/mman.h>
-#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "snap_internal.h"
 #include "libsnap.h"
 #include "snap_hls_if.h"
+#include "snap_stats.h"
 #include "capiblock.h"
 #include "pp.h"
 
@@ -43,15 +46,48 @@
 #define CBLK_PREFETCH_THRESHOLD		10 /* only prefetch if reads_in_flight is small than the threshold */
 #define CBLK_NBLOCKS			2 /* tuneup for the prefetch strategy */
 
-#define CONFIG_COMPLETION_THREADS	1 /* 1 works best */
+#define CONFIG_COMPLETION_THREADS	4 /* max per device */
+#define CONFIG_POLL_SPINS		64 /* empty polls before sleeping */
+#define CONFIG_POLL_SLEEP_MAX_USEC	64u /* max sleep between polls */
 #define CONFIG_MAX_RETRIES		0 /* 5 is good, 0: no retries */
 #define CONFIG_BUSY_TIMEOUT_SEC		10
 #define CONFIG_REQ_TIMEOUT_SEC		5
+#define CONFIG_TIMER_TICK_USEC		1000 /* timer wheel resolution */
+#define CONFIG_TIMER_SLOTS		1024 /* power of 2, one round */
 #define CONFIG_REQ_DURATION_USEC	100000 /* usec */
+#define CONFIG_WRITE_DEPTH		1 /* write segments in flight, 1: serial */
+#define CONFIG_STRIPE_BLOCKS		32 /* chunk group stripe, one read slot */
+#define CONFIG_CACHE_SIZE_MIB		16 /* 256 sets * 16 ways * 4 KiB */
+#define CONFIG_CACHE_WAYS		16
+#define CONFIG_DIRTY_LIMIT_DIV		4 /* write-back: 1/4 of the cache */
+#define CONFIG_RA_STREAMS		4 /* sequential streams per device */
+#define CONFIG_URGENT_SLOTS		2 /* kept for CBLK_IO_PRIORITY_REQ */
+#define CONFIG_BACKGROUND_SLOTS		8 /* prefetch, read-ahead, flushes */
+#define CONFIG_WARM_BATCH		256 /* cache warm-up: LBAs sorted at once */
+#define CONFIG_WARM_SLEEP_USEC		1000 /* no background slot free */
+#define CONFIG_SW_THREADS		16 /* software backend I/O threads */
 
 static int cblk_maxretries = CONFIG_MAX_RETRIES;
 static int cblk_reqtimeout = CONFIG_REQ_TIMEOUT_SEC;
+static int cblk_timeout_fatal = 0;	/* CBLK_TIMEOUT_POLICY=FATAL */
+static __thread uint64_t cblk_thread_timeout = 0;	/* usec, 0: default */
 static int cblk_busytimeout = CONFIG_BUSY_TIMEOUT_SEC;
+static int cblk_write_depth = CONFIG_WRITE_DEPTH;
+static int cblk_stripe = CONFIG_STRIPE_BLOCKS;
+static int cblk_completion_threads = 1;
+static unsigned int cblk_cache_size = CONFIG_CACHE_SIZE_MIB;
+static unsigned int cblk_cache_ways = CONFIG_CACHE_WAYS;
+static int cblk_writeback = 0;
+static unsigned long cblk_dirty_limit = 0;	/* blocks, 0: default */
+static int cblk_zerocopy = 0;	/* read into aligned caller buffers */
+static int cblk_readahead = 0;
+static size_t cblk_readahead_max = 0;	/* blocks, 0: drive limit */
+static int cblk_urgent_slots = CONFIG_URGENT_SLOTS;
+static int cblk_background_slots = CONFIG_BACKGROUND_SLOTS;
+static const char *cblk_cache_save = NULL;	/* directory for hot LBAs */
+static const char *cblk_completion_cpus = NULL;	/* e.g. "8,9" */
+static const char *cblk_software = NULL;	/* file instead of the card */
+static int cblk_sw_threads = CONFIG_SW_THREADS;
 
 static int cblk_prefetch = 0;
 static int cblk_nblocks = CBLK_NBLOCKS;
@@ -105,41 +141,34 @@ static inline void __free(void *ptr)
 	free(ptr);
 }
 
-/* FIXME gettimeofday() is affected by readjusting of time during program runtime */
-static inline long int timediff_sec(struct timeval *a, struct timeval *b)
+/*
+ * Timestamps come from CLOCK_MONOTONIC, adjusting the wall clock while
+ * requests are in flight must not produce bogus latencies or timeouts.
+ */
+static inline void time_now(struct timespec *t)
 {
-	struct timeval res;
-	static int count = 0;
-
-	timersub(a, b , &res);
-
-	/* FIXME In simulation this warning is annoying ... */
-	if ((res.tv_sec > 1000) && (count++ < 5))
-		fprintf(stderr, "err: Strange time diff "
-			"a.tv_sec=%ld a.tv_usec=%ld "
-			"b.tv_sec=%ld b.tv_usec=%ld "
-			"r.tv_sec=%ld r.tv_usec=%ld\n",
-			(long int)a->tv_sec, (long int)a->tv_usec,
-			(long int)b->tv_sec, (long int)b->tv_usec,
-			(long int)res.tv_sec, (long int)res.tv_usec);
-
-	return res.tv_sec;
+	clock_gettime(CLOCK_MONOTONIC, t);
 }
 
-static inline long int timediff_msec(struct timeval *a, struct timeval *b)
+static inline long int timediff_nsec(struct timespec *a, struct timespec *b)
 {
-	struct timeval res;
+	return (a->tv_sec - b->tv_sec) * 1000000000L +
+		(a->tv_nsec - b->tv_nsec);
+}
 
-	timersub(a, b , &res);
-	return res.tv_sec * 1000 + res.tv_usec / 1000;
+static inline long int timediff_sec(struct timespec *a, struct timespec *b)
+{
+	return timediff_nsec(a, b) / 1000000000L;
 }
 
-static inline long int timediff_usec(struct timeval *a, struct timeval *b)
+static inline long int timediff_msec(struct timespec *a, struct timespec *b)
 {
-	struct timeval res;
+	return timediff_nsec(a, b) / 1000000L;
+}
 
-	timersub(a, b , &res);
-	return res.tv_sec * 1000000 + res.tv_usec;
+static inline long int timediff_usec(struct timespec *a, struct timespec *b)
+{
+	return timediff_nsec(a, b) / 1000L;
 }
 
 typedef struct atomic_t {
@@ -167,7 +196,8 @@ static inline unsigned long atomic_inc(atomic_t *a)
 
 #define CBLK_IDX_MAX		16	/* FIXME Should be 16 */
 #define CBLK_NBLOCKS_MAX	32	/* 128 KiB / 4KiB */
-#define CBLK_NBLOCKS_WRITE_MAX	2	/* writing is just 1 or 2 blocks */
+#define CBLK_NBLOCKS_WRITE_MAX	2	/* per request, larger writes are split */
+#define CBLK_READ_DEPTH		15	/* read IDs 1..15, larger reads are split */
 
 enum cblk_status {
 	CBLK_IDLE = 0,
@@ -181,7 +211,93 @@ static const char *cblk_status_str[] = {
 	"IDLE", "READING", "WRITING", "READY", "ERROR"
 };
 
+/*
+ * Scheduling classes for the request slots, see slot_get(). Lower
+ * values go first. Each class only gets a slot while more than
+ * slot_reserve[class] slots are free and no request of a higher class
+ * waits for one.
+ */
+enum cblk_prio {
+	CBLK_PRIO_URGENT = 0,		/* CBLK_IO_PRIORITY_REQ */
+	CBLK_PRIO_NORMAL = 1,
+	CBLK_PRIO_BACKGROUND = 2,	/* prefetch, read-ahead, flushes */
+	CBLK_PRIO_MAX,
+};
+
+static unsigned int slot_reserve[CBLK_PRIO_MAX];
+
+/*
+ * Statistics are counted per CPU, such that threads doing I/O on
+ * different CPUs do not bounce the same cache lines. A thread can
+ * migrate between looking up its CPU and the update, so the updates
+ * stay atomic, they are just not contended anymore. Readers sum up
+ * all CPUs, see dev_stats_sum(). All counters are uint64_t.
+ */
+struct dev_counters {
+	uint64_t prefetches;
+	uint64_t cache_hits;
+	uint64_t   cache_hits_4k;
+	uint64_t prefetch_collisions;
+	uint64_t hw_block_reads;
+	uint64_t hw_block_writes;
+	uint64_t block_reads;		/* cblk_read(), cblk_aread() */
+	uint64_t   block_reads_4k;
+	uint64_t block_writes;		/* cblk_write(), cblk_awrite() */
+	uint64_t   block_writes_4k;
+	uint64_t areads;
+	uint64_t awrites;
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	uint64_t zerocopy_reads;	/* into the caller's buffer */
+	uint64_t ra_hits;		/* reads served by the read-ahead */
+	uint64_t ra_blocks;		/* blocks read ahead */
+	uint64_t ra_wasted;		/* of those, dropped unused */
+	uint64_t wbytes_total;
+	uint64_t rbytes_total;
+	uint64_t read_usecs;		/* sum, hardware requests */
+	uint64_t write_usecs;
+	uint64_t hw_read_usecs;
+	uint64_t hw_write_usecs;
+	uint64_t errors;
+	uint64_t retries;
+	uint64_t timeouts;
+	uint64_t fail_timeouts;
+	uint64_t late_completions;	/* slots back after a timeout */
+	uint64_t no_cmds_free;
+	uint64_t no_cmds_free_fail;
+	uint64_t urgent_reqs;		/* slots taken by CBLK_PRIO_URGENT */
+	uint64_t bg_throttled;		/* background requests not started */
+	uint64_t aresult_no_cmplt;
+	uint64_t wb_flushes;
+	uint64_t wb_flush_writes;
+	uint64_t wb_flush_blocks;
+	uint64_t warm_blocks;		/* cache warm-up reads */
+};
+
+enum dev_hist {
+	DEV_HIST_READ = 0,
+	DEV_HIST_WRITE = 1,
+	DEV_HIST_CACHE_HIT = 2,
+	DEV_HIST_CACHE_MISS = 3,
+	DEV_HIST_MAX = 4,
+};
+
+struct dev_pcpu_stats {
+	struct dev_counters cnt;
+	cblk_hist_t hist[DEV_HIST_MAX];
+} __attribute__((aligned(64)));
+
+/* Classes for the num_act_* and max_num_act_* counters */
+enum dev_act {
+	DEV_ACT_READ = 0,
+	DEV_ACT_WRITE = 1,
+	DEV_ACT_AREAD = 2,
+	DEV_ACT_AWRITE = 3,
+	DEV_ACT_MAX = 4,
+};
+
 struct cache_way;
+struct ra_seg;
 
 struct cblk_req {
 	uint8_t slot;		/* r/w request slot number */
@@ -190,6 +306,7 @@ struct cblk_req {
 	enum cblk_status status;
 	sem_t wait_sem;		/* wait here for completion */
 	uint8_t *buf;		/* data is r/w from there */
+	uint8_t *data;		/* read data lands here, buf or caller's */
 
 	uint32_t action;
 	uint64_t dst;
@@ -199,12 +316,30 @@ struct cblk_req {
 	int is_write;
 	unsigned int err_total;
 
-	struct timeval stime;	/* start time */
-	struct timeval etime;	/* completion time */
-	struct timeval h_stime;	/* hardware start time */
-	struct timeval h_etime;	/* hardware completion time */
+	struct timespec stime;	/* start time */
+	struct timespec etime;	/* completion time */
+	struct timespec h_stime;	/* hardware start time */
+	struct timespec h_etime;	/* hardware completion time */
 	int use_wait_sem;	/* blocking or prefetch */
+	enum dev_act act;	/* counted in c->inflight[], DEV_ACT_MAX: not */
 	struct cache_way *pblock[CBLK_NBLOCKS_MAX];
+	struct ra_seg *ra;	/* read-ahead into this segment */
+
+	/* timeout, see __timer_arm() */
+	uint64_t timeout_usec;
+	uint64_t tw_expires;	/* tick */
+	int tw_linked;
+	struct cblk_req *tw_next;
+	struct cblk_req *tw_prev;
+	unsigned int parked;	/* REQ_PARKED_* of a request timed out */
+	int sw_errno;		/* software backend: transfer failed */
+
+	/* cblk_aread()/cblk_awrite(), harvested by cblk_aresult() */
+	int is_async;
+	int tag;		/* slot number or tag defined by the caller */
+	int user_tag;		/* tag was defined by the caller */
+	void *user_buf;		/* read data is copied here on completion */
+	cblk_arw_status_t *user_status;	/* if set, updated on completion */
 };
 
 static inline void cblk_set_status(struct cblk_req *req,
@@ -212,7 +347,30 @@ static inline void cblk_set_status(struct cblk_req *req,
 {
 	/* block_trace("  [%s] req slot %d new status is %s\n", __func__,
 		req->slot, cblk_status_str[status]); */
-	req->status = status;
+	__atomic_store_n(&req->status, status, __ATOMIC_RELEASE);
+}
+
+static inline enum cblk_status cblk_get_status(struct cblk_req *req)
+{
+	return __atomic_load_n(&req->status, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Completion thread and timeout handling race for requests in flight.
+ * Only the one which moves the request out of READING/WRITING may
+ * complete it. Returns the old status or CBLK_IDLE if it lost.
+ */
+static inline enum cblk_status cblk_finish_status(struct cblk_req *req,
+				enum cblk_status status)
+{
+	enum cblk_status old = cblk_get_status(req);
+
+	while ((old == CBLK_READING) || (old == CBLK_WRITING)) {
+		if (__atomic_compare_exchange_n(&req->status, &old, status,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return old;
+	}
+	return CBLK_IDLE;
 }
 
 static inline int cblk_is_write(struct cblk_req *req)
@@ -225,9 +383,45 @@ static inline int cblk_is_read(struct cblk_req *req)
 	return !cblk_is_write(req);
 }
 
+/*
+ * Sequential read-ahead, see ra_read(). Each stream reads ahead into
+ * two segments of its own, one being consumed and the next one. They
+ * are separate from the cache, streaming through does not evict the
+ * blocks random readers need.
+ */
+enum ra_status {
+	RA_IDLE = 0,
+	RA_READING = 1,
+	RA_READY = 2,
+};
+
+struct ra_seg {
+	enum ra_status status;
+	int stale;		/* dropped while READING, ignore the data */
+	off_t lba;
+	size_t nblocks;
+	size_t used;		/* blocks copied out, the rest was wasted */
+	uint8_t *buf;
+	size_t size;		/* allocated blocks */
+};
+
+struct ra_stream {
+	off_t start_lba;	/* where the stream started */
+	off_t next_lba;		/* where the next sequential read starts */
+	size_t win;		/* blocks to read ahead next */
+	unsigned long last;	/* ra_tick of the last access */
+	struct ra_seg seg[2];
+};
+
+struct sw_dev;
+
 struct cblk_dev {
+	chunk_id_t id;		/* index in chunks[] */
+	char path[64];
+	unsigned int opens;	/* cblk_open() calls not closed yet */
 	struct snap_card *card;
 	struct snap_action *act;
+	struct sw_dev *sw;	/* software backend instead of card */
 	pthread_mutex_t dev_lock;
 	enum cblk_status status;
 	unsigned int status_read_count;
@@ -237,51 +431,457 @@ struct cblk_dev {
 	int timeout;
 	uint8_t *buf;
 
-	unsigned int idx;
+	unsigned int idx;	/* round robin hint for slot_alloc() */
+	uint32_t free_slots;	/* bitmap of IDLE request slots */
 	struct cblk_req req[CBLK_IDX_MAX];
 	enum cblk_status req_status;
 	int prefetch_offs[CBLK_IDX_MAX];	/* list of LBA offsets to prefetch */
 
-	sem_t busy_sem;	/* wait if there is no slot */
+	/* request timeouts, see __timer_arm(), protected by dev_lock */
+	struct cblk_req *wheel[CONFIG_TIMER_SLOTS];
+	uint64_t wheel_tick;	/* next tick to expire */
+
+	/* slot scheduler, see slot_get() */
+	int slots_free;
+	sem_t write_sem;	/* the write slot, see write_get() */
+	unsigned int slot_waiters[CBLK_PRIO_MAX];
+	pthread_mutex_t slot_lock;	/* for waiting only */
+	pthread_cond_t slot_c[CBLK_PRIO_MAX];
 
 	pthread_t done_tid[CONFIG_COMPLETION_THREADS];	/* completion thread(s) */
+	unsigned int done_threads;	/* started, cblk_completion_threads */
 	pthread_cond_t idle_c;	/* idle management for completion thread */
 	pthread_mutex_t idle_m;
 	int work_in_flight;
 
-	/* statistics */
-	long int prefetches;
-	long int cache_hits;
-	long int   cache_hits_4k;
-	long int prefetch_collisions;
-	long int hw_block_reads;
-	long int hw_block_writes;
-	long int block_reads;
-	long int   block_reads_4k;
-	long int block_writes;
-	long int   block_writes_4k;
-	long long int wbytes_total;
-	long long int rbytes_total;
-	struct timeval start_time;	/* time when loading this */
-	struct timeval rtime_total;	/* total time spent in reads */
-	struct timeval wtime_total;	/* total time spent in writes */
-	long int idle_wakeups;
+	pthread_cond_t async_c;	/* signaled on async request completion */
+	pthread_mutex_t async_m;
+	unsigned int async_in_flight;	/* async requests not harvested yet */
+
+	/* statistics, see dev_stat_add() */
+	struct dev_pcpu_stats *pcpu;	/* cblk_ncpus entries */
+	struct timespec start_time;	/* time when loading this */
+	long int idle_wakeups;		/* protected by idle_m */
 
 	time_t max_read_usecs;
 	time_t max_write_usecs;
-	time_t avg_read_usecs;
-	time_t avg_write_usecs;
 	time_t min_read_usecs;
 	time_t min_write_usecs;
-	time_t avg_hw_read_usecs;
-	time_t avg_hw_write_usecs;
+
+	unsigned int inflight[DEV_ACT_MAX];	/* requests per class */
+	unsigned int inflight_max[DEV_ACT_MAX];	/* high water marks */
+
+	/* write-back, see cache_flush() */
+	int writeback;		/* cblk_write() leaves dirty blocks in the cache */
+	long int dirty;		/* dirty blocks in the cache */
+	pthread_mutex_t flush_lock;	/* one flush at a time */
+
+	/* read-ahead, see ra_read() */
+	pthread_mutex_t ra_lock;
+	pthread_cond_t ra_c;		/* signaled when a segment is read */
+	unsigned long ra_tick;
+	struct ra_stream ra[CONFIG_RA_STREAMS];
+
+	/* cache warm-up, see cache_warm() */
+	pthread_t warm_tid;
+	int warm_stop;
+	off_t *warm_lbas;
+	size_t warm_n;
+
+	struct snap_stats_blk *stats;	/* shared for snap_top, can be NULL */
 };
 
-/* Use just one for now ... */
-static struct cblk_dev chunk = {
-	.dev_lock = PTHREAD_MUTEX_INITIALIZER,
+static unsigned int cblk_ncpus = 1;	/* per CPU statistics */
+
+static inline struct dev_pcpu_stats *dev_pcpu(struct cblk_dev *c)
+{
+	int cpu = sched_getcpu();
+
+	return &c->pcpu[(cpu > 0) ? (unsigned int)cpu % cblk_ncpus : 0];
+}
+
+/* Statistics are updated without holding dev_lock */
+#define dev_stat_add(c, field, v)					\
+	__atomic_add_fetch(&dev_pcpu(c)->cnt.field, (v), __ATOMIC_RELAXED)
+#define dev_stat_inc(c, field)		dev_stat_add(c, field, 1)
+
+/* Latency histograms, bucket i counts 2^i <= nsec < 2^(i+1) */
+static inline void dev_stat_hist(struct cblk_dev *c, enum dev_hist h,
+				long int nsecs)
+{
+	cblk_hist_t *hist = &dev_pcpu(c)->hist[h];
+	uint64_t v = (nsecs > 0) ? (uint64_t)nsecs : 0;
+	unsigned int b = v ? 63 - __builtin_clzll(v) : 0;
+	uint64_t old = __atomic_load_n(&hist->max_nsec, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->sum_nsec, v, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->bucket[MIN(b, CBLK_HIST_BUCKETS - 1u)], 1,
+			__ATOMIC_RELAXED);
+	while ((v > old) && !__atomic_compare_exchange_n(&hist->max_nsec,
+				&old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void dev_stat_max(time_t *max, time_t v)
+{
+	time_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while ((v > old) && !__atomic_compare_exchange_n(max, &old, v, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void dev_stat_min(time_t *min, time_t v)
+{
+	time_t old = __atomic_load_n(min, __ATOMIC_RELAXED);
+
+	while (((old == 0) || (v < old)) &&
+	       !__atomic_compare_exchange_n(min, &old, v, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Requests in flight per class. Unlike the counters these are gauges,
+ * readers want the current value, so they are kept per device.
+ */
+static inline void dev_act_inc(struct cblk_dev *c, enum dev_act a)
+{
+	unsigned int n = __atomic_add_fetch(&c->inflight[a], 1,
+					__ATOMIC_RELAXED);
+	unsigned int old = __atomic_load_n(&c->inflight_max[a],
+					__ATOMIC_RELAXED);
+
+	while ((n > old) && !__atomic_compare_exchange_n(&c->inflight_max[a],
+				&old, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void dev_act_dec(struct cblk_dev *c, enum dev_act a)
+{
+	__atomic_sub_fetch(&c->inflight[a], 1, __ATOMIC_RELAXED);
+}
+
+static void dev_hist_add(cblk_hist_t *sum, cblk_hist_t *h)
+{
+	unsigned int i;
+	uint64_t max = __atomic_load_n(&h->max_nsec, __ATOMIC_RELAXED);
+
+	sum->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	sum->sum_nsec += __atomic_load_n(&h->sum_nsec, __ATOMIC_RELAXED);
+	sum->max_nsec = MAX(sum->max_nsec, max);
+	for (i = 0; i < CBLK_HIST_BUCKETS; i++)
+		sum->bucket[i] += __atomic_load_n(&h->bucket[i],
+						__ATOMIC_RELAXED);
+}
+
+/*
+ * Add the counters and histograms of all CPUs to sum. Concurrent
+ * updates are not stopped, each value is exact but they are not a
+ * snapshot taken at one point in time.
+ */
+static void dev_stats_sum(struct cblk_dev *c, struct dev_pcpu_stats *sum)
+{
+	unsigned int cpu, i;
+
+	for (cpu = 0; cpu < cblk_ncpus; cpu++) {
+		uint64_t *src = (uint64_t *)&c->pcpu[cpu].cnt;
+		uint64_t *dst = (uint64_t *)&sum->cnt;
+
+		for (i = 0; i < sizeof(sum->cnt) / sizeof(uint64_t); i++)
+			dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		for (i = 0; i < DEV_HIST_MAX; i++)
+			dev_hist_add(&sum->hist[i], &c->pcpu[cpu].hist[i]);
+	}
+}
+
+static struct dev_pcpu_stats *dev_stats_alloc(void)
+{
+	struct dev_pcpu_stats *pcpu;
+
+	if (posix_memalign((void **)&pcpu, __alignof__(*pcpu),
+			   cblk_ncpus * sizeof(*pcpu)) != 0)
+		return NULL;
+	memset(pcpu, 0, cblk_ncpus * sizeof(*pcpu));
+	return pcpu;
+}
+
+/*
+ * The action takes one write at a time, on slot 0, and reads on the
+ * slots 1..15, see the description of the action below. A
+ * cblk_write_depth above 1 is for actions which report the slot of
+ * each write, writes then take any slot like reads.
+ */
+#define WRITE_SLOT		0
+
+static inline int write_serial(void)
+{
+	return cblk_write_depth == 1;
+}
+
+/* Slots managed by the slot scheduler */
+static inline int sched_slots(void)
+{
+	return write_serial() ? CBLK_IDX_MAX - 1 : CBLK_IDX_MAX;
+}
+
+static inline uint32_t slot_mask(int is_write)
+{
+	uint32_t all = (1u << CBLK_IDX_MAX) - 1;
+
+	if (!write_serial())
+		return all;
+	return is_write ? (1u << WRITE_SLOT) : all & ~(1u << WRITE_SLOT);
+}
+
+/*
+ * Request slots are allocated from the free_slots bitmap with a
+ * compare and swap, slots_free counts them for slot_get().
+ * Searching starts at the round robin hint c->idx, such that the
+ * slots are used evenly. Returns the slot or -1 if none is free.
+ */
+static int slot_alloc(struct cblk_dev *c, int is_write)
+{
+	uint32_t old, mask, rot, avail;
+	unsigned int hint, slot;
+
+	old = __atomic_load_n(&c->free_slots, __ATOMIC_ACQUIRE);
+	do {
+		avail = old & slot_mask(is_write);
+		if (avail == 0)
+			return -1;
+		hint = __atomic_load_n(&c->idx, __ATOMIC_RELAXED);
+		rot = (avail >> hint) | (avail << ((CBLK_IDX_MAX - hint) %
+						CBLK_IDX_MAX));
+		rot &= (1u << CBLK_IDX_MAX) - 1;
+		slot = (hint + __builtin_ctz(rot)) % CBLK_IDX_MAX;
+		mask = 1u << slot;
+	} while (!__atomic_compare_exchange_n(&c->free_slots, &old,
+				old & ~mask, 1, __ATOMIC_ACQ_REL,
+				__ATOMIC_ACQUIRE));
+
+	__atomic_store_n(&c->idx, (slot + 1) % CBLK_IDX_MAX,
+			__ATOMIC_RELAXED);
+	return slot;
+}
+
+static inline void slot_free(struct cblk_dev *c, unsigned int slot)
+{
+	__atomic_fetch_or(&c->free_slots, 1u << slot, __ATOMIC_RELEASE);
+}
+
+/*
+ * Slot scheduler. Before a request takes a slot from the bitmap, it
+ * takes one from slots_free in its class. Urgent requests can use
+ * all slots, normal ones leave cblk_urgent_slots free and background
+ * requests only start while less than cblk_background_slots are busy.
+ * While a request waits for a slot, new requests of its class and
+ * of lower classes queue up behind it, such that foreground requests
+ * overtake queued background requests and nobody is starved within a
+ * class. Taking and returning a slot is lock free, slot_lock and
+ * slot_c[] are only used when somebody waits.
+ */
+static int slot_try(struct cblk_dev *c, enum cblk_prio prio, int queued)
+{
+	int old;
+	unsigned int p;
+
+	for (p = 0; p < prio + !queued; p++)
+		if (__atomic_load_n(&c->slot_waiters[p], __ATOMIC_SEQ_CST))
+			return 0;
+
+	old = __atomic_load_n(&c->slots_free, __ATOMIC_SEQ_CST);
+	do {
+		if (old <= (int)slot_reserve[prio])
+			return 0;
+	} while (!__atomic_compare_exchange_n(&c->slots_free, &old, old - 1,
+				1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return 1;
+}
+
+/* Wake a waiter of the highest class waiting */
+static void slot_wake(struct cblk_dev *c)
+{
+	unsigned int p;
+
+	for (p = 0; p < CBLK_PRIO_MAX; p++) {
+		if (__atomic_load_n(&c->slot_waiters[p], __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&c->slot_lock);
+			pthread_cond_signal(&c->slot_c[p]);
+			pthread_mutex_unlock(&c->slot_lock);
+			return;
+		}
+	}
+}
+
+/**
+ * Take a slot for a request of class prio. Waits up to
+ * cblk_busytimeout seconds unless nowait is set. Returns 0 or -1 with
+ * errno EAGAIN (nowait), ETIMEDOUT or ENOENT (device broken).
+ */
+static int slot_get(struct cblk_dev *c, enum cblk_prio prio, int nowait)
+{
+	int rc = 0, got;
+	struct timespec ts;
+
+	if (slot_try(c, prio, 0))
+		goto out;
+	if (nowait) {
+		if (prio == CBLK_PRIO_BACKGROUND)
+			dev_stat_inc(c, bg_throttled);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	dev_stat_inc(c, no_cmds_free);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += cblk_busytimeout;
+
+	pthread_mutex_lock(&c->slot_lock);
+	__atomic_add_fetch(&c->slot_waiters[prio], 1, __ATOMIC_SEQ_CST);
+	while (!(got = slot_try(c, prio, 1))) {
+		if (c->status != CBLK_READY) {
+			rc = ENOENT;
+			break;
+		}
+		if (rc == ETIMEDOUT)
+			break;
+		rc = pthread_cond_timedwait(&c->slot_c[prio], &c->slot_lock,
+					&ts);
+	}
+	__atomic_sub_fetch(&c->slot_waiters[prio], 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&c->slot_lock);
+	slot_wake(c);		/* lower classes may go now */
+
+	if (!got) {
+		if (rc == ETIMEDOUT)
+			dev_stat_inc(c, no_cmds_free_fail);
+		errno = rc;
+		return -1;
+	}
+ out:
+	if (prio == CBLK_PRIO_URGENT)
+		dev_stat_inc(c, urgent_reqs);
+	return 0;
+}
+
+static void slot_put(struct cblk_dev *c)
+{
+	__atomic_add_fetch(&c->slots_free, 1, __ATOMIC_SEQ_CST);
+	slot_wake(c);
+}
+
+/*
+ * Serial writes wait for the write slot on write_sem instead of the
+ * slot scheduler, slots_free only counts the read slots then. Same
+ * return values as slot_get().
+ */
+static int write_get(struct cblk_dev *c, int nowait)
+{
+	struct timespec ts;
+
+	if (sem_trywait(&c->write_sem) == 0)
+		return 0;
+	if (nowait) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	dev_stat_inc(c, no_cmds_free);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += cblk_busytimeout;
+	while (sem_timedwait(&c->write_sem, &ts) != 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno == ETIMEDOUT)
+			dev_stat_inc(c, no_cmds_free_fail);
+		return -1;
+	}
+	return 0;
+}
+
+static int req_slot_get(struct cblk_dev *c, int is_write,
+			enum cblk_prio prio, int nowait)
+{
+	if (is_write && write_serial())
+		return write_get(c, nowait);
+	return slot_get(c, prio, nowait);
+}
+
+static void req_slot_put(struct cblk_dev *c, int is_write)
+{
+	if (is_write && write_serial())
+		sem_post(&c->write_sem);
+	else
+		slot_put(c);
+}
+
+/* Class of a request from the caller's flags */
+static inline enum cblk_prio flags_prio(int flags, int prio_flag)
+{
+	return (flags & prio_flag) ? CBLK_PRIO_URGENT : CBLK_PRIO_NORMAL;
+}
+
+/*
+ * Device table, the chunk_id_t is the index. Each device has its own
+ * lock, request slots and completion thread(s). Cache and prefetch
+ * strategy are shared, cblk_devs_lock protects opening and closing.
+ */
+#define CBLK_DEVS_MAX		8
+#if CBLK_DEVS_MAX > PP_DEVS_MAX
+#error "pp keeps its state for PP_DEVS_MAX devices"
+#endif
+
+static struct cblk_dev chunks[CBLK_DEVS_MAX] = {
+	[0 ... CBLK_DEVS_MAX - 1] = {
+		.dev_lock = PTHREAD_MUTEX_INITIALIZER,
+		.flush_lock = PTHREAD_MUTEX_INITIALIZER,
+		.ra_lock = PTHREAD_MUTEX_INITIALIZER,
+		.ra_c = PTHREAD_COND_INITIALIZER,
+		.slot_lock = PTHREAD_MUTEX_INITIALIZER,
+		.slot_c = { [0 ... CBLK_PRIO_MAX - 1] =
+			    PTHREAD_COND_INITIALIZER },
+	},
 };
 
+static pthread_mutex_t cblk_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cblk_ndevs = 0;	/* devices opened */
+
+static inline int cblk_dev_used(struct cblk_dev *c)
+{
+	return (c->card != NULL) || (c->sw != NULL);
+}
+
+/* The paths of the open devices for snap_top, as many as fit */
+static void stats_paths(struct snap_stats_blk *st)
+{
+	unsigned int i;
+	size_t len = 0, n;
+	char buf[sizeof(st->path)] = { 0 };
+
+	for (i = 0; i < CBLK_DEVS_MAX; i++) {
+		if (!cblk_dev_used(&chunks[i]))
+			continue;
+		n = strlen(chunks[i].path) + (len ? 1 : 0);
+		if (len + n >= sizeof(buf))
+			break;
+		snprintf(buf + len, sizeof(buf) - len, "%s%s",
+			 len ? "," : "", chunks[i].path);
+		len += n;
+	}
+	memcpy(st->path, buf, sizeof(st->path));
+}
+
+static inline struct cblk_dev *cblk_dev_get(chunk_id_t id)
+{
+	if ((id < 0) || (id >= CBLK_DEVS_MAX) || !cblk_dev_used(&chunks[id])) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return &chunks[id];
+}
+
 /* Action related definitions. Used to access the hardware */
 
 /*
@@ -350,10 +950,19 @@ static const char *action_name[] = {
 #define NVME_DRIVE_SIZE		(4 * GIGA_BYTE)	  /* NVME Drive Size */
 #define NVME_MAX_TRANSFER_SIZE	(32 * MEGA_BYTE)  /* NVME limit to Transfer in one chunk */
 
-/* NVME lba cache */
-#define CACHE_MASK		0x000000ff
-#define CACHE_WAYS		16 /* 4 * n */
-#define CACHE_ENTRIES		(CACHE_MASK + 1)
+/*
+ * NVME lba cache
+ *
+ * Set associative, the geometry is defined when the first device is
+ * opened: cblk_open() ext_arg or CBLK_CACHE_SIZE in MiB and
+ * CBLK_CACHE_WAYS. Changing a way happens under the way_lock of its
+ * set. Readers do not take the lock, they pin a VALID way with refs
+ * and copy the data outside of any lock, see cache_get(). Ways which
+ * are pinned are never reused, see __cache_claim().
+ */
+#define CACHE_WAYS_MAX		64 /* fits into the skip mask */
+#define CACHE_DEV_SHIFT		40 /* LBAs of all devices share the cache */
+#define CACHE_GHOSTS		16 /* 2Q: evicted keys remembered per set */
 
 enum cache_block_status {
 	CACHE_BLOCK_UNUSED = 0,	/* not in use yset */
@@ -371,45 +980,112 @@ struct cache_way {
 	size_t nblocks;		/* use 1 to keep things simple */
 	unsigned int used;	/* # times this block was used */
 	unsigned int count;	/* eviction counter */
+	int refs;		/* readers copying buf right now */
+	uint8_t ref;		/* referenced since inserted or last sweep */
+	uint8_t hot;		/* 2Q: in the protected part of the set */
+	uint8_t prefetched;	/* read ahead, low priority until used */
+	uint8_t dirty;		/* write-back: not written to the device yet */
+	unsigned int wseq;	/* write-back: bumped on every dirty write */
 	void *buf;		/* data if status is CBLK_BLOCK_VALID */
 };
 
 struct cache_entry {
 	pthread_mutex_t way_lock;
 	unsigned int count;
-	struct cache_way way[CACHE_WAYS];
+	struct cache_way *way;	/* cache_ways entries */
+	unsigned int hand;	/* CLOCK */
+	unsigned int ghost_idx;	/* 2Q */
+	off_t ghost[CACHE_GHOSTS];
+	long int hits;		/* statistics, per set to avoid sharing */
+	long int misses;
 };
 
 typedef uint8_t cache_block_t[__CBLK_BLOCK_SIZE];
 
-static struct cache_entry cache_entries[CACHE_ENTRIES];
+static unsigned int cache_sets = 0;	/* power of 2 */
+static unsigned int cache_ways = 0;
+static struct cache_entry *cache_entries = NULL;
+static struct cache_way *cache_way_tab = NULL;
 static cache_block_t *cache_blocks = NULL;
 static long int cache_trashing = 0;	/* statistics */
+static long int cache_dirty = 0;	/* dirty blocks of all devices */
+static unsigned long cache_dirty_max = 0;	/* flush above */
+
+static inline struct cache_entry *cache_set(off_t lba)
+{
+	return &cache_entries[lba & (cache_sets - 1)];
+}
 
-static int cache_init(void)
+static inline enum cache_block_status way_status(struct cache_way *w)
+{
+	return __atomic_load_n(&w->status, __ATOMIC_ACQUIRE);
+}
+
+static inline void way_set_status(struct cache_way *w,
+				enum cache_block_status status)
+{
+	__atomic_store_n(&w->status, status, __ATOMIC_RELEASE);
+}
+
+static void cache_done(void);
+
+/* size_mib 0 uses CBLK_CACHE_SIZE */
+static int cache_init(unsigned int size_mib)
 {
 	int rc;
+	size_t sets;
 	unsigned int i, j;
 
+	if (size_mib == 0)
+		size_mib = cblk_cache_size;
+	cache_ways = cblk_cache_ways;
+	sets = ((size_t)size_mib << 20) / (cache_ways * __CBLK_BLOCK_SIZE);
+	for (cache_sets = 1; cache_sets * 2 <= sets; cache_sets *= 2)
+		;
+
+	cache_entries = calloc(cache_sets, sizeof(*cache_entries));
+	cache_way_tab = calloc((size_t)cache_sets * cache_ways,
+			sizeof(*cache_way_tab));
+	if ((cache_entries == NULL) || (cache_way_tab == NULL)) {
+		perror("err: calloc");
+		cache_done();
+		return -1;
+	}
+
 	rc = posix_memalign((void **)&cache_blocks, __CBLK_BLOCK_SIZE,
-		CACHE_ENTRIES * CACHE_WAYS * __CBLK_BLOCK_SIZE);
+		(size_t)cache_sets * cache_ways * __CBLK_BLOCK_SIZE);
 	if (rc != 0) {
 		perror("err: posix_memalign");
+		cache_blocks = NULL;
+		cache_done();
 		return rc;
 	}
 
-	for (i = 0; i < CACHE_ENTRIES; i++) {
+	for (i = 0; i < cache_sets; i++) {
 		struct cache_entry *entry = &cache_entries[i];
-		struct cache_way *way = entry->way;
+		struct cache_way *way = &cache_way_tab[i * cache_ways];
 
 		pthread_mutex_init(&entry->way_lock, NULL);
-		for (j = 0; j < CACHE_WAYS; j++) {
+		entry->way = way;
+		for (j = 0; j < CACHE_GHOSTS; j++)
+			entry->ghost[j] = -1;
+		for (j = 0; j < cache_ways; j++) {
 			way[j].status = CACHE_BLOCK_UNUSED;
 			way[j].count = 0;
 			way[j].used = 0;
-			way[j].buf = &cache_blocks[i * CACHE_WAYS + j];
+			way[j].refs = 0;
+			way[j].ref = 0;
+			way[j].hot = 0;
+			way[j].prefetched = 0;
+			way[j].dirty = 0;
+			way[j].wseq = 0;
+			way[j].buf = &cache_blocks[i * cache_ways + j];
 		}
 	}
+
+	cache_dirty = 0;
+	cache_dirty_max = cblk_dirty_limit ? cblk_dirty_limit :
+		(size_t)cache_sets * cache_ways / CONFIG_DIRTY_LIMIT_DIV;
 	return 0;
 }
 
@@ -418,14 +1094,13 @@ static inline void __dump_entry(struct cache_entry *entry)
 	unsigned int i;
 	struct cache_way *w = entry->way;
 
-	for (i = 0; i < CACHE_WAYS; i += 4) {
-		fprintf(stderr, "  e[%p/%2d]: "
-			"%s %ld %2d %d | %s %ld %2d %d | %s %ld %2d %d | %s %ld %2d %d\n",
-			entry, i,
-			block_status_str[w[i+0].status], w[i+0].lba, w[i+0].count, w[i+0].used,
-			block_status_str[w[i+1].status], w[i+1].lba, w[i+1].count, w[i+1].used,
-			block_status_str[w[i+2].status], w[i+2].lba, w[i+2].count, w[i+2].used,
-			block_status_str[w[i+3].status], w[i+3].lba, w[i+3].count, w[i+3].used);
+	for (i = 0; i < cache_ways; i++) {
+		if ((i % 4) == 0)
+			fprintf(stderr, "  e[%p/%2d]:", entry, i);
+		fprintf(stderr, " %s %ld %2d %d %d %s",
+			block_status_str[w[i].status], w[i].lba, w[i].count,
+			w[i].used, w[i].refs,
+			((i % 4) == 3) || (i == cache_ways - 1) ? "\n" : "|");
 	}
 }
 
@@ -433,164 +1108,536 @@ static void cache_done(void)
 {
 	__free(cache_blocks);
 	cache_blocks = NULL;
+	free(cache_way_tab);
+	cache_way_tab = NULL;
+	free(cache_entries);
+	cache_entries = NULL;
+	cache_sets = 0;
 }
 
-/**
- * Returns 0 if data was found and copied to the output buffer.
- *         1 if data is in flight and requested for reading.
- *         negative on error.
+/* The cache works on keys made of device id and LBA */
+static inline off_t cache_key(struct cblk_dev *c, off_t lba)
+{
+	return ((off_t)c->id << CACHE_DEV_SHIFT) | lba;
+}
+
+/*
+ * Write-back: mark a VALID way dirty or clean again, the caller holds
+ * the way_lock. Dirty blocks are counted per device and in total.
+ * Every dirty write bumps wseq, such that a flush can tell if the
+ * block was written again while its old data was in flight.
  */
-static int cache_read(off_t lba, void *buf)
+static void __way_dirty(struct cache_way *e, int dirty)
 {
-	unsigned int i = lba & CACHE_MASK, j;
-	struct cache_entry *entry = &cache_entries[i];
-	struct cache_way *way = entry->way;
+	struct cblk_dev *c = &chunks[e->lba >> CACHE_DEV_SHIFT];
 
-	pthread_mutex_lock(&entry->way_lock);
-	for (j = 0; j < CACHE_WAYS; j++) {
-		if ((way[j].status == CACHE_BLOCK_VALID) && (lba == way[j].lba)) {
-			way[j].count = entry->count++;
-			way[j].used++;
-			memcpy(buf, way[j].buf, __CBLK_BLOCK_SIZE);
-			pthread_mutex_unlock(&entry->way_lock);
-			return 0;
-		}
-		if  ((way[j].status == CACHE_BLOCK_READING) && (lba == way[j].lba)) {
-			pthread_mutex_unlock(&entry->way_lock);
-			return 1;
-		}
-	}
-	pthread_mutex_unlock(&entry->way_lock);
+	if (dirty)
+		e->wseq++;
+	if (e->dirty == dirty)
+		return;
 
-	return -1; /* not found */
+	e->dirty = dirty;
+	__sync_fetch_and_add(&c->dirty, dirty ? 1 : -1);
+	__sync_fetch_and_add(&cache_dirty, dirty ? 1 : -1);
 }
 
-/**
- * Returns 0 if data was found and copied to the output buffer.
- *         1 if data is in flight and requested for reading.
- *         negative on error.
+/*
+ * Replacement policies, CBLK_CACHE_POLICY selects one. Free ways are
+ * always used first, blocks read ahead but not used yet are evicted
+ * next. Among the remaining VALID ways of the set:
+ *
+ *   LRU:   the one with the oldest access
+ *   CLOCK: second chance, hits set ref, the hand of the set clears
+ *          it when passing by and evicts the first way without ref
+ *   2Q:    new blocks are probationary, a block hit again is promoted
+ *          to the protected part (3/4 of the ways) when the set needs
+ *          a victim. Probationary blocks are evicted first (LRU), so
+ *          a scan only cycles through them. Keys evicted from
+ *          probation are remembered as ghosts, when they come back
+ *          they go straight to the protected part.
+ *
+ * hit() is called without way_lock, insert(), evict() and victim()
+ * with it. victim() only gets ways which can be claimed.
  */
-static enum cblk_status cache_info(off_t lba)
+struct cache_policy {
+	const char *name;
+	void (*hit)(struct cache_entry *entry, struct cache_way *w);
+	void (*insert)(struct cache_entry *entry, struct cache_way *w,
+		int prefetch);
+	void (*evict)(struct cache_entry *entry, struct cache_way *w);
+	int (*victim)(struct cache_entry *entry, uint64_t skip);
+};
+
+static void way_hit_ref(struct cache_entry *entry __attribute__((unused)),
+			struct cache_way *w)
 {
-	unsigned int j;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
-	struct cache_way *way = entry->way;
+	__atomic_store_n(&w->ref, 1, __ATOMIC_RELAXED);
+}
 
-	pthread_mutex_lock(&entry->way_lock);
+static void way_insert(struct cache_entry *entry __attribute__((unused)),
+			struct cache_way *w, int prefetch)
+{
+	w->ref = !prefetch;
+	w->hot = 0;
+}
+
+/* Oldest way with hot == hot, -1 if there is none */
+static int __way_lru(struct cache_entry *entry, uint64_t skip, int hot)
+{
+	unsigned int j, min_count = UINT_MAX;
+	int idx = -1;
 
-	for (j = 0; j < CACHE_WAYS; j++) {
-		if ((lba == way[j].lba) &&
-		    ((way[j].status == CACHE_BLOCK_VALID) ||
-		     (way[j].status == CACHE_BLOCK_READING))) {
-			pthread_mutex_unlock(&entry->way_lock);
-			return way[j].status;
+	for (j = 0; j < cache_ways; j++) {
+		struct cache_way *w = &entry->way[j];
+
+		if ((skip & (1ull << j)) || ((hot >= 0) && (w->hot != hot)))
+			continue;
+		if ((idx == -1) || (w->count < min_count)) {
+			min_count = w->count;
+			idx = j;
 		}
 	}
+	return idx;
+}
 
-	pthread_mutex_unlock(&entry->way_lock);
-	return CACHE_BLOCK_UNUSED;
+static int lru_victim(struct cache_entry *entry, uint64_t skip)
+{
+	return __way_lru(entry, skip, -1);
 }
 
-/**
- * Lockfree version of cache_reserve. Please use this only if you hold
- * the lock to the cache entry.
- *
- * @force Enforce reservation. For read this is no trecommended, but
- *        for write it is, since we like to replace the old data as
- *        fast as needed once this LBA is written to.
- */
-static struct cache_way *__cache_reserve(off_t lba, int force)
+static int clock_victim(struct cache_entry *entry, uint64_t skip)
+{
+	unsigned int i, j;
+	struct cache_way *w;
+
+	for (i = 0; i < 2 * cache_ways; i++) {
+		j = entry->hand;
+		entry->hand = (entry->hand + 1) % cache_ways;
+		if (skip & (1ull << j))
+			continue;
+
+		w = &entry->way[j];
+		if (__atomic_exchange_n(&w->ref, 0, __ATOMIC_RELAXED))
+			continue;	/* second chance */
+		return j;
+	}
+	return -1;
+}
+
+static void twoq_insert(struct cache_entry *entry, struct cache_way *w,
+			int prefetch)
+{
+	unsigned int i;
+
+	w->ref = 0;
+	w->hot = 0;
+	if (prefetch)
+		return;
+
+	for (i = 0; i < CACHE_GHOSTS; i++) {
+		if (entry->ghost[i] == w->lba) {
+			entry->ghost[i] = -1;
+			w->hot = 1;	/* came back after eviction */
+			break;
+		}
+	}
+}
+
+static void twoq_evict(struct cache_entry *entry, struct cache_way *w)
+{
+	if (w->hot)
+		return;
+	entry->ghost[entry->ghost_idx] = w->lba;
+	entry->ghost_idx = (entry->ghost_idx + 1) % CACHE_GHOSTS;
+}
+
+static int twoq_victim(struct cache_entry *entry, uint64_t skip)
+{
+	int idx;
+	unsigned int j, nhot = 0, max_hot = MAX(cache_ways * 3 / 4, 1u);
+
+	/* Promote blocks hit again, demote the oldest if too many */
+	for (j = 0; j < cache_ways; j++) {
+		struct cache_way *w = &entry->way[j];
+
+		if (w->status != CACHE_BLOCK_VALID)
+			continue;
+		if (!w->hot && __atomic_exchange_n(&w->ref, 0,
+						__ATOMIC_RELAXED))
+			w->hot = 1;
+		nhot += w->hot;
+	}
+	while (nhot > max_hot) {
+		idx = __way_lru(entry, skip, 1);
+		if (idx < 0)
+			break;
+		entry->way[idx].hot = 0;
+		nhot--;
+	}
+
+	idx = __way_lru(entry, skip, 0);
+	if (idx < 0)
+		idx = __way_lru(entry, skip, 1);
+	return idx;
+}
+
+static const struct cache_policy cache_policies[] = {
+	{ "LRU",   NULL,	way_insert,  NULL,	 lru_victim   },
+	{ "CLOCK", way_hit_ref, way_insert,  NULL,	 clock_victim },
+	{ "2Q",	   way_hit_ref, twoq_insert, twoq_evict, twoq_victim  },
+};
+
+static const struct cache_policy *cache_pol = &cache_policies[2];
+
+static int cache_set_policy(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(cache_policies); i++) {
+		if (strcasecmp(cache_policies[i].name, name) == 0) {
+			cache_pol = &cache_policies[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Block lookups of the current policy, summed up over all sets */
+static void cache_counters(long int *hits, long int *misses)
+{
+	unsigned int i;
+
+	*hits = *misses = 0;
+	for (i = 0; i < cache_sets; i++) {
+		*hits += __atomic_load_n(&cache_entries[i].hits,
+					__ATOMIC_RELAXED);
+		*misses += __atomic_load_n(&cache_entries[i].misses,
+					__ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Drop all blocks of a device, e.g. when it is closed. Pinned blocks
+ * can be marked UNUSED, they are reused once the readers are done.
+ */
+static void cache_invalidate(struct cblk_dev *c)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < cache_sets; i++) {
+		struct cache_entry *entry = &cache_entries[i];
+
+		pthread_mutex_lock(&entry->way_lock);
+		for (j = 0; j < cache_ways; j++) {
+			if ((entry->way[j].lba >> CACHE_DEV_SHIFT) != c->id)
+				continue;
+			if (entry->way[j].dirty)	/* flush failed */
+				__way_dirty(&entry->way[j], 0);
+			way_set_status(&entry->way[j], CACHE_BLOCK_UNUSED);
+		}
+		pthread_mutex_unlock(&entry->way_lock);
+	}
+}
+
+/**
+ * Pin the VALID way for key without taking the way_lock. Pinning
+ * increments refs and checks the way afterwards, __cache_claim()
+ * marks the way first and checks refs afterwards, so one of both
+ * backs off. Returns NULL if the block is not cached, *reading is set
+ * if it is in flight.
+ */
+static struct cache_way *__cache_pin(struct cache_entry *entry, off_t key,
+				int *reading)
+{
+	unsigned int j;
+	struct cache_way *way = entry->way;
+	enum cache_block_status status;
+
+	*reading = 0;
+	for (j = 0; j < cache_ways; j++) {
+		if (__atomic_load_n(&way[j].lba, __ATOMIC_RELAXED) != key)
+			continue;
+
+		status = way_status(&way[j]);
+		if (status == CACHE_BLOCK_READING) {
+			*reading = 1;
+			return NULL;
+		}
+		if (status != CACHE_BLOCK_VALID)
+			continue;
+
+		__atomic_add_fetch(&way[j].refs, 1, __ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(&way[j].status, __ATOMIC_SEQ_CST) ==
+		     CACHE_BLOCK_VALID) &&
+		    (__atomic_load_n(&way[j].lba, __ATOMIC_SEQ_CST) == key))
+			return &way[j];
+		__atomic_sub_fetch(&way[j].refs, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static inline void cache_put(struct cache_way *w)
+{
+	__atomic_sub_fetch(&w->refs, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pin the VALID block for lba. The caller can use (*w)->buf until it
+ * calls cache_put().
+ *
+ * Returns 0 if the block was found and pinned.
+ *         1 if data is in flight and requested for reading.
+ *         negative if it is not in the cache.
+ */
+static int cache_get(struct cblk_dev *c, off_t lba, struct cache_way **w)
+{
+	int reading;
+	struct cache_entry *entry = cache_set(lba);
+	struct cache_way *way;
+
+	lba = cache_key(c, lba);
+
+	way = __cache_pin(entry, lba, &reading);
+	if (reading) {
+		snap_probe1(snapblock, cache__reading, lba);
+		return 1;
+	}
+	if (way == NULL) {
+		__atomic_add_fetch(&entry->misses, 1, __ATOMIC_RELAXED);
+		snap_probe1(snapblock, cache__miss, lba);
+		return -1; /* not found */
+	}
+
+	__atomic_store_n(&way->count,
+		__atomic_fetch_add(&entry->count, 1, __ATOMIC_RELAXED),
+		__ATOMIC_RELAXED);
+	/* First use of a block read ahead is no re-reference */
+	if ((__atomic_add_fetch(&way->used, 1, __ATOMIC_RELAXED) > 1 ||
+	     !way->prefetched) && cache_pol->hit)
+		cache_pol->hit(entry, way);
+	__atomic_add_fetch(&entry->hits, 1, __ATOMIC_RELAXED);
+	*w = way;
+	snap_probe2(snapblock, cache__hit, lba, way - entry->way);
+	return 0;
+}
+
+/*
+ * Write-back: data read from the device can be older than the cache,
+ * dirty blocks were not written yet. Cached blocks are never older
+ * than the device, so copy all of them over the data read. Nothing to
+ * do for devices without write-back.
+ */
+static void cache_overlay(struct cblk_dev *c, off_t lba, void *buf,
+			size_t nblocks)
+{
+	int reading;
+	size_t i;
+	struct cache_way *w;
+
+	if (!c->writeback)
+		return;
+
+	for (i = 0; i < nblocks; i++) {
+		w = __cache_pin(cache_set(lba + i), cache_key(c, lba + i),
+				&reading);
+		if (w == NULL)
+			continue;
+		memcpy(buf + i * __CBLK_BLOCK_SIZE, w->buf, __CBLK_BLOCK_SIZE);
+		cache_put(w);
+	}
+}
+
+/**
+ * Returns 0 if data was found and copied to the output buffer.
+ *         1 if data is in flight and requested for reading.
+ *         negative on error.
+ */
+static int cache_read(struct cblk_dev *c, off_t lba, void *buf)
+{
+	int rc;
+	struct cache_way *w;
+
+	rc = cache_get(c, lba, &w);
+	if (rc != 0)
+		return rc;
+
+	memcpy(buf, w->buf, __CBLK_BLOCK_SIZE);
+	cache_put(w);
+	return 0;
+}
+
+/**
+ * Returns the status of the block, without locking this is a hint.
+ */
+static enum cache_block_status cache_info(struct cblk_dev *c, off_t lba)
+{
+	unsigned int j;
+	struct cache_entry *entry = cache_set(lba);
+	struct cache_way *way = entry->way;
+	enum cache_block_status status;
+
+	lba = cache_key(c, lba);
+
+	for (j = 0; j < cache_ways; j++) {
+		if (__atomic_load_n(&way[j].lba, __ATOMIC_RELAXED) != lba)
+			continue;
+		status = way_status(&way[j]);
+		if ((status == CACHE_BLOCK_VALID) ||
+		    (status == CACHE_BLOCK_READING))
+			return status;
+	}
+	return CACHE_BLOCK_UNUSED;
+}
+
+/*
+ * Take a way out of use for refilling it, the caller holds the
+ * way_lock. Fails if a reader has the way pinned.
+ */
+static int __cache_claim(struct cache_way *e)
+{
+	enum cache_block_status old = e->status;
+
+	__atomic_store_n(&e->status, CACHE_BLOCK_READING, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&e->refs, __ATOMIC_SEQ_CST) == 0)
+		return 0;
+
+	way_set_status(e, old);
+	return -1;
+}
+
+/**
+ * Lockfree version of cache_reserve. Please use this only if you hold
+ * the lock to the cache entry. lba is the cache_key() here.
+ *
+ * @force Enforce reservation. For read this is no trecommended, but
+ *        for write it is, since we like to replace the old data as
+ *        fast as needed once this LBA is written to. If the old data
+ *        is pinned by a reader, it is marked UNUSED and a different
+ *        way gets the new data.
+ * @prefetch The block is read ahead, it goes in with low priority.
+ */
+static struct cache_way *__cache_reserve(struct cblk_dev *c, off_t lba,
+					int force, int prefetch)
 {
 	unsigned int j;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
+	struct cache_entry *entry = cache_set(lba);
 	struct cache_way *e, *way = entry->way;
-	int reserve_idx = -1;
-	unsigned int min_count = INT_MAX;
+	int reserve_idx;
+	unsigned int min_count;
+	uint64_t skip = 0;	/* ways which cannot be claimed */
+	enum cache_block_status old;
+
+	/* avoid double entries */
+	for (j = 0; j < cache_ways; j++) {
+		e = &way[j];
+		if ((e->lba != lba) || (e->status == CACHE_BLOCK_UNUSED))
+			continue;
+
+		/* cache_trace("[%s] %p LBA=%ld/%ld is already %s!\n",
+			__func__, e, lba, e->lba,
+			block_status_str[e->status]); */
+		if (!force)
+			return NULL;
+
+		old = e->status;
+		if (__cache_claim(e) == 0)
+			goto reserve_entry;
 
-	for (j = 0; j < CACHE_WAYS; j++) {
+		if (e->dirty)		/* superseded by the new data */
+			__way_dirty(e, 0);
+		way_set_status(e, CACHE_BLOCK_UNUSED);	/* stale now */
+		skip |= 1ull << j;
+		break;
+	}
+
+ retry:
+	reserve_idx = -1;
+	min_count = UINT_MAX;
+	for (j = 0; j < cache_ways; j++) {
 		e = &way[j];
+		if (__atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) ||
+		    (e->status == CACHE_BLOCK_READING) || e->dirty)
+			skip |= 1ull << j;	/* do not throw this out */
+		if (skip & (1ull << j))
+			continue;
 
-		switch (e->status) {
-		/* continue, since maybe we find one with matching lba */
-		case CACHE_BLOCK_UNUSED:
+		if (e->status == CACHE_BLOCK_UNUSED) {
 			reserve_idx = j;
-			min_count = e->count;
-			break;
-		/* avoid double entries */
-		case CACHE_BLOCK_VALID:
-			if (e->lba == lba) {	/* entry is already in cache */
-				/* cache_trace("[%s] %p LBA=%ld/%ld is already VALID!\n",
-					__func__, e, lba, e->lba); */
-				if (force) {
-					min_count = e->count;
-					reserve_idx = j;
-					goto reserve_entry;
-				} else
-					return NULL;
-			}
-			if (e->count < min_count) {
-				min_count = e->count;
-				reserve_idx = j;/* replace candidate with smallest count */
-			}
-			break;
-		/* do not throw this out unless forced to */
-		case CACHE_BLOCK_READING:
-			if (e->lba == lba) {	/* entry is already in cache */
-				/* cache_trace("[%s] %p LBA=%ld/%ld is already READING!\n",
-					__func__, e, lba, e->lba); */
-				if (force) {
-					min_count = e->count;
-					reserve_idx = j;
-					goto reserve_entry;
-				} else
-					return NULL;
-			}
 			break;
 		}
+		/* read ahead but never used, oldest first */
+		if (e->prefetched && (e->used == 0) && (e->count < min_count)) {
+			min_count = e->count;
+			reserve_idx = j;
+		}
 	}
+	if (reserve_idx == -1)
+		reserve_idx = cache_pol->victim(entry, skip);
 	if (reserve_idx == -1) {
-		dfprintf(stderr, "[%s] warn: No free entry found for LBA=%ld\n",
+		cache_trace("[%s] warn: No free entry found for LBA=%ld\n",
 			__func__, lba);
-		__dump_entry(entry);
+		if (cache_trace_enabled())
+			__dump_entry(entry);
 		return NULL;	/* no entry found! */
 	}
 
-reserve_entry:
-	/* Now reserve */
 	e = &way[reserve_idx];
-	if ((e->status == CACHE_BLOCK_VALID) && (e->used == 0))
-		cache_trashing++;	/* discarding an used entry */
+	old = e->status;
+	if (__cache_claim(e) != 0) {
+		skip |= 1ull << reserve_idx;
+		goto retry;
+	}
+
+ reserve_entry:
+	/* Now reserve */
+	if (e->dirty)		/* same LBA, the caller brings new data */
+		__way_dirty(e, 0);
+	if (old == CACHE_BLOCK_VALID) {
+		if (e->used == 0) {
+			__sync_fetch_and_add(&cache_trashing, 1); /* discarding an unused entry */
+			snap_stats_add(c->stats, cache_trashing, 1);
+			if (e->prefetched)
+				pp_feedback(0, 1);
+		}
+		if (cache_pol->evict)
+			cache_pol->evict(entry, e);
+	}
 
 	/* dfprintf(stderr, "[%s] debug: reserve %p for LBA=%ld %s\n",
-		__func__, e, lba, block_status_str[e->status]); */
-	e->lba = lba;
-	e->count = entry->count++;
+		__func__, e, lba, block_status_str[old]); */
+	__atomic_store_n(&e->lba, lba, __ATOMIC_RELAXED);
+	e->count = __atomic_fetch_add(&entry->count, 1, __ATOMIC_RELAXED);
 	e->used = 0;
-	e->status = CACHE_BLOCK_READING;
-	
+	e->prefetched = prefetch;
+	cache_pol->insert(entry, e, prefetch);
+
 	return e;
 }
 
 /**
- * Reserve entry for reading later. Set status to READING and
- * therefore take it out of the replacement circle. After reserving
- * Filling it needs to happen under the way_lock, such that it can
- * be reused later on. Failing to fill the entry will cause resource
- * leakage and cache malfunction.
+ * Reserve ways for the blocks of a read request, __read_complete()
+ * fills them. Blocks which are cached or being read already are not
+ * reserved, put_req() drops reservations which were not filled.
  */
-#if 0
-static struct cache_way *cache_reserve(off_t lba, int force)
+static void cache_reserve_req(struct cblk_dev *c, struct cblk_req *req,
+			int prefetch)
 {
-	struct cache_way *e;
-	struct cache_entry *entry = &cache_entries[lba & CACHE_MASK];
+	size_t i;
+	off_t lba;
+	struct cache_entry *entry;
 
-	pthread_mutex_lock(&entry->way_lock);
-	e = __cache_reserve(lba, force);
-	pthread_mutex_unlock(&entry->way_lock);
+	if (!cblk_caching)
+		return;
 
-	return e;
+	for (i = 0; i < req->nblocks; i++) {
+		lba = req->lba + i;
+		entry = cache_set(lba);
+		pthread_mutex_lock(&entry->way_lock);
+		req->pblock[i] = __cache_reserve(c, cache_key(c, lba), 0,
+						prefetch);
+		pthread_mutex_unlock(&entry->way_lock);
+	}
 }
-#endif
 
 /**
  * It might happen that a prefetch/write operation changes the state
@@ -603,7 +1650,7 @@ static struct cache_way *cache_reserve(off_t lba, int force)
  * We added _used to identify entries which were read by the prefetch
  * code but thrown out before they got actually used.
  */
-static int cache_write_reserved(struct cache_way **e,
+static int cache_write_reserved(struct cblk_dev *c, struct cache_way **e,
 				off_t lba, const void *buf,
 				int _used)
 {
@@ -617,34 +1664,40 @@ static int cache_write_reserved(struct cache_way **e,
 	if (_e == NULL)
 		return -2;
 
-	entry = &cache_entries[lba & CACHE_MASK];
+	entry = cache_set(lba);
+	lba = cache_key(c, lba);
 	pthread_mutex_lock(&entry->way_lock);
 
+	/*
+	 * Reservation can be lost due to write happening in parallel,
+	 * the way might even be reused for a different LBA already.
+	 */
 	if (_e->lba != lba) {
-		dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld reservation lost %s\n",
+		cache_trace("[%s] warn: %p LBA=%ld/%ld reservation lost %s\n",
 			__func__, _e, lba, _e->lba, block_status_str[_e->status]);
+		*e = NULL;
 		pthread_mutex_unlock(&entry->way_lock);
 		return -1;
 	}
-
-	/* Reservation can be lost due to write happening in parallel */
 	if (_e->status != CACHE_BLOCK_READING) {
 		/* dfprintf(stderr, "[%s] warn: %p LBA=%ld/%ld State is not READING but %s\n",
 			__func__, _e, lba, _e->lba, block_status_str[_e->status]); */
+		*e = NULL;
 		pthread_mutex_unlock(&entry->way_lock);
 		return -2;
 	}
 
 	memcpy(_e->buf, buf, __CBLK_BLOCK_SIZE);
 	_e->used = _used;
-	_e->status = CACHE_BLOCK_VALID;
+	way_set_status(_e, CACHE_BLOCK_VALID);
 	*e = NULL;	/* mark as not accessible anymore */
 
 	pthread_mutex_unlock(&entry->way_lock);
 	return 0;
 }
 
-static int cache_unreserve(struct cache_way *e, off_t lba)
+static int cache_unreserve(struct cblk_dev *c, struct cache_way *e,
+			off_t lba)
 {
 	struct cache_entry *entry;
 
@@ -654,14 +1707,13 @@ static int cache_unreserve(struct cache_way *e, off_t lba)
 	/* dfprintf(stderr, "[%s] debug: unreserve %p for LBA=%ld %s\n",
 		__func__, e, lba, block_status_str[e->status]); */
 
-	entry = &cache_entries[lba & CACHE_MASK];
+	entry = cache_set(lba);
+	lba = cache_key(c, lba);
 	pthread_mutex_lock(&entry->way_lock);
 
-	if (e->lba != lba) {
-		dfprintf(stderr, "[%s] err: LBA=%ld/%ld not consistent!\n",
+	if (e->lba != lba) {	/* lost, belongs to a different LBA now */
+		cache_trace("[%s] warn: LBA=%ld/%ld reservation lost\n",
 			__func__, lba, e->lba);
-		e->status = CACHE_BLOCK_UNUSED;
-		/* __backtrace(); */
 		pthread_mutex_unlock(&entry->way_lock);
 		return -1;
 	}
@@ -669,7 +1721,7 @@ static int cache_unreserve(struct cache_way *e, off_t lba)
 		dfprintf(stderr, "[%s] warn: %p forcing status LBA=%ld/%ld "
 			"cache from %s to UNUSED!\n",
 			__func__, e, lba, e->lba, block_status_str[e->status]);
-		e->status = CACHE_BLOCK_UNUSED;
+		way_set_status(e, CACHE_BLOCK_UNUSED);
 		/* __backtrace(); */
 	}
 
@@ -681,55 +1733,64 @@ static int cache_unreserve(struct cache_way *e, off_t lba)
  * FIXME The non-atomic cache_reserve() -> cache_write_reserved() 
  *       sequence is not working if we allow reservations to be
  *       changed in certain cases. This needs fixups.
+ *
+ * Returns 1 if all ways of the set are pinned, being read or dirty.
+ * The block is not cached then, old data for lba was dropped already.
+ * With dirty set, the block still needs to be written to the device,
+ * see cache_flush().
  */
-static int cache_write(off_t lba, const void *buf, int _used)
+static int cache_write(struct cblk_dev *c, off_t lba, const void *buf,
+			int _used, int dirty)
 {
 	struct cache_way *e;
 	struct cache_entry *entry;
 
-	entry = &cache_entries[lba & CACHE_MASK];
+	entry = cache_set(lba);
+	lba = cache_key(c, lba);
 	pthread_mutex_lock(&entry->way_lock);
 
-	e = __cache_reserve(lba, 1);	/* enforce reservation */
+	e = __cache_reserve(c, lba, 1, 0);	/* enforce reservation */
 	if (e == NULL) {
-		fprintf(stderr, "[%s] cache reservation for LBA=%ld failed!\n",
+		cache_trace("[%s] cache reservation for LBA=%ld failed!\n",
 			__func__, lba);
-		__dump_entry(entry);
 		pthread_mutex_unlock(&entry->way_lock);
-		return -1;	/* no entry free! */
+		return 1;	/* no entry free! */
 	}
 
 	memcpy(e->buf, buf, __CBLK_BLOCK_SIZE);
 	e->used = _used;
-	e->status = CACHE_BLOCK_VALID;
+	if (dirty)
+		__way_dirty(e, 1);
+	way_set_status(e, CACHE_BLOCK_VALID);
 	pthread_mutex_unlock(&entry->way_lock);
 
 	return 0;
 }
 
+/*
+ * The completion thread checks work_in_flight under idle_m before it
+ * sleeps, so only the 0 -> 1 transition needs the lock to wake it up.
+ */
 static void inc_work_in_flight(struct cblk_dev *c)
 {
-	pthread_mutex_lock(&c->idle_m);
-	c->work_in_flight++;
-	if (c->work_in_flight == 1)
+	snap_stats_add(c->stats, reqs_in_flight, 1);
+	if (__sync_fetch_and_add(&c->work_in_flight, 1) == 0) {
+		pthread_mutex_lock(&c->idle_m);
 		/* pthread_cond_signal(&c->idle_c); */
 		pthread_cond_broadcast(&c->idle_c);
-	pthread_mutex_unlock(&c->idle_m);
+		pthread_mutex_unlock(&c->idle_m);
+	}
 }
 
 static void dec_work_in_flight(struct cblk_dev *c)
 {
-	pthread_mutex_lock(&c->idle_m);
-	c->work_in_flight--;
-	pthread_mutex_unlock(&c->idle_m);
+	__sync_fetch_and_sub(&c->work_in_flight, 1);
+	snap_stats_sub(c->stats, reqs_in_flight, 1);
 }
 
 static inline unsigned int work_in_flight(struct cblk_dev *c)
 {
-	int r;
-
-	sem_getvalue(&c->busy_sem, &r);
-	return CBLK_IDX_MAX - r;
+	return __atomic_load_n(&c->work_in_flight, __ATOMIC_RELAXED);
 }
 
 static inline void dev_set_status(struct cblk_dev *c,
@@ -781,74 +1842,412 @@ static int __cblk_read(struct cblk_dev *c, uint32_t addr, uint32_t *data)
 	return rc;
 }
 
-static void req_setup(struct cblk_req *req,
-		uint32_t action_code,
-		uint64_t dst,
-		uint64_t src,
-		uint32_t size)
-{
-	req->action = action_code | (req->slot << 8);
-	req->dst = dst;
-	req->src = src;
-	req->size = size;
-	req->tries = 0;
-}
-
 /*
- * NVMe: For NVMe transfers n is representing a NVME_LB_SIZE (512)
- *       byte block.
+ * Software backend. Devices opened with CBLK_OPN_SOFTWARE, or all
+ * devices with CBLK_SOFTWARE=<file>, transfer the data from and to a
+ * file or block device instead of the card. Everything above the
+ * request slots stays the same: slot scheduling, cache, prefetching,
+ * read-ahead, timeouts and the completion threads. __req_start()
+ * marks the slot as started instead of programming the action
+ * registers. CBLK_SW_THREADS I/O threads do the transfers with
+ * pread()/pwrite() on the file opened with O_DIRECT and mark the slot
+ * as done, completion_status() picks it up instead of reading
+ * ACTION_STATUS. That compares the card with the kernel block layer
+ * on the same code, and works on machines without a card.
  */
-static void req_start(struct cblk_req *req, struct cblk_dev *c)
-{
-	uint8_t action_code = req->action & 0x00ff;
-	int slot = req->slot;
-
-	req->tries++;
-	block_trace("    [%s] HW %s memcpy_%x(slot=%u dest=0x%llx, "
-		"src=0x%llx n=%lld bytes) LBA=%ld attempts=%d\n",
-		__func__, action_name[action_code % ACTION_CONFIG_MAX],
-		req->action, slot, (long long)req->dst, (long long)req->src,
-		(long long)req->size, req->lba, req->tries);
-
-	pthread_mutex_lock(&c->dev_lock);
+struct sw_dev {
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t todo_c;
+	uint32_t todo;		/* slots started, bitmap */
+	uint32_t busy;		/* slots an I/O thread works on */
+	uint32_t done;		/* slots completed, not reported yet */
+	int stop;
+	unsigned int nthreads;
+	pthread_t tid[CBLK_IDX_MAX];
+};
 
-	__cblk_write(c, ACTION_CONFIG,    req->action);
-	__cblk_write(c, ACTION_DEST_LOW,  (uint32_t)(req->dst & 0xffffffff));
-	__cblk_write(c, ACTION_DEST_HIGH, (uint32_t)(req->dst >> 32));
-	__cblk_write(c, ACTION_SRC_LOW,   (uint32_t)(req->src & 0xffffffff));
-	__cblk_write(c, ACTION_SRC_HIGH,  (uint32_t)(req->src >> 32));
-	__cblk_write(c, ACTION_CNT,       req->size);
+/* Returns 0 or the errno of the failed transfer */
+static int sw_transfer(struct sw_dev *sw, struct cblk_req *req)
+{
+	int write = ((req->action & 0xff) == ACTION_CONFIG_COPY_HN);
+	uint8_t *buf = (uint8_t *)(uintptr_t)(write ? req->src : req->dst);
+	off_t offs = (write ? req->dst : req->src) * NVME_LB_SIZE;
+	size_t n = 0;
+	ssize_t rc;
+
+	while (n < req->size) {
+		if (write)
+			rc = pwrite(sw->fd, buf + n, req->size - n, offs + n);
+		else
+			rc = pread(sw->fd, buf + n, req->size - n, offs + n);
+		if ((rc < 0) && (errno == EINTR))
+			continue;
+		if (rc < 0)
+			return errno;
+		if (rc == 0)
+			return EIO;	/* behind the end */
+		n += rc;
+	}
+	return 0;
+}
 
-	/* Wait for Action to go back to Idle */
-	snap_action_start(c->act);
-	gettimeofday(&req->stime, NULL);
-	gettimeofday(&req->h_stime, NULL);
+static void *sw_thread(void *arg)
+{
+	struct cblk_dev *c = (struct cblk_dev *)arg;
+	struct sw_dev *sw = c->sw;
+	uint32_t avail;
+	int slot, err;
 
-	/*
-	 * Update statistics under device lock.
-	 * Otherwise it might be off a little bit.
-	 */
-	req->tries++;
-	if (action_code == ACTION_CONFIG_COPY_HN) {
-		c->hw_block_writes++;
-		c->wbytes_total += req->size;
-	} else {
-		c->hw_block_reads++;
-		c->rbytes_total += req->size;
+	pthread_mutex_lock(&sw->lock);
+	while (1) {
+		/* A slot started again waits until the first try is done */
+		avail = sw->todo & ~sw->busy;
+		if (avail == 0) {
+			if (sw->stop)
+				break;
+			pthread_cond_wait(&sw->todo_c, &sw->lock);
+			continue;
+		}
+		slot = __builtin_ctz(avail);
+		sw->todo &= ~(1u << slot);
+		sw->busy |= 1u << slot;
+		pthread_mutex_unlock(&sw->lock);
+
+		err = sw_transfer(sw, &c->req[slot]);
+
+		pthread_mutex_lock(&sw->lock);
+		c->req[slot].sw_errno = err;
+		sw->busy &= ~(1u << slot);
+		__atomic_or_fetch(&sw->done, 1u << slot, __ATOMIC_RELEASE);
+		if (sw->todo & (1u << slot))
+			pthread_cond_signal(&sw->todo_c);
 	}
-
-	pthread_mutex_unlock(&c->dev_lock);
+	pthread_mutex_unlock(&sw->lock);
+	return NULL;
 }
 
-int cblk_init(void *arg __attribute__((unused)),
-		uint64_t flags __attribute__((unused)))
+static void sw_start(struct sw_dev *sw, int slot)
 {
-	block_trace("[%s] arg=%p flags=%llx\n", __func__, arg,
-		(long long)flags);
-	return 0;
+	pthread_mutex_lock(&sw->lock);
+	sw->todo |= 1u << slot;
+	pthread_cond_signal(&sw->todo_c);
+	pthread_mutex_unlock(&sw->lock);
 }
 
-int cblk_term(void *arg __attribute__((unused)),
+/* A slot the I/O threads are done with or -1, polled without lock */
+static int sw_done(struct sw_dev *sw)
+{
+	int slot = -1;
+
+	if (__atomic_load_n(&sw->done, __ATOMIC_ACQUIRE) == 0)
+		return -1;
+	pthread_mutex_lock(&sw->lock);
+	if (sw->done) {
+		slot = __builtin_ctz(sw->done);
+		sw->done &= ~(1u << slot);
+	}
+	pthread_mutex_unlock(&sw->lock);
+	return slot;
+}
+
+static void sw_close(struct cblk_dev *c)
+{
+	unsigned int i;
+	struct sw_dev *sw = c->sw;
+
+	if (sw == NULL)
+		return;
+	pthread_mutex_lock(&sw->lock);
+	sw->stop = 1;
+	pthread_cond_broadcast(&sw->todo_c);
+	pthread_mutex_unlock(&sw->lock);
+	for (i = 0; i < sw->nthreads; i++)
+		pthread_join(sw->tid[i], NULL);
+
+	close(sw->fd);
+	pthread_mutex_destroy(&sw->lock);
+	pthread_cond_destroy(&sw->todo_c);
+	__free(sw);
+	c->sw = NULL;
+}
+
+/* Open path as the device, sets c->sw and c->nblocks */
+static int sw_open(struct cblk_dev *c, const char *path)
+{
+	struct sw_dev *sw;
+	struct stat st;
+	uint64_t size = 0;
+	unsigned int i;
+
+	sw = calloc(1, sizeof(*sw));
+	if (sw == NULL)
+		return -1;
+
+	sw->fd = open(path, O_RDWR | O_DIRECT);
+	if ((sw->fd < 0) && (errno == EINVAL)) {
+		fprintf(stderr, "[%s] warn: %s does not support O_DIRECT, "
+			"using the page cache\n", __func__, path);
+		sw->fd = open(path, O_RDWR);
+	}
+	if (sw->fd < 0) {
+		fprintf(stderr, "[%s] err: cannot open %s: %s\n", __func__,
+			path, strerror(errno));
+		__free(sw);
+		return -1;
+	}
+
+	if (fstat(sw->fd, &st) != 0)
+		goto out_err;
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(sw->fd, BLKGETSIZE64, &size) != 0)
+			goto out_err;
+	} else
+		size = st.st_size;
+	if (size < __CBLK_BLOCK_SIZE) {
+		fprintf(stderr, "[%s] err: %s is smaller than one block\n",
+			__func__, path);
+		errno = EINVAL;
+		goto out_err;
+	}
+
+	pthread_mutex_init(&sw->lock, NULL);
+	pthread_cond_init(&sw->todo_c, NULL);
+	c->sw = sw;
+	c->nblocks = size / __CBLK_BLOCK_SIZE;
+
+	for (i = 0; i < (unsigned int)cblk_sw_threads; i++) {
+		if (pthread_create(&sw->tid[i], NULL, sw_thread, c) != 0)
+			break;
+		sw->nthreads++;
+	}
+	if (sw->nthreads == 0) {
+		sw_close(c);
+		return -1;
+	}
+	block_trace("[%s] %s: %zu blocks, %u I/O threads\n", __func__,
+		path, c->nblocks, sw->nthreads);
+	return 0;
+
+ out_err:
+	close(sw->fd);
+	__free(sw);
+	return -1;
+}
+
+/*
+ * With CBLK_ZEROCOPY=1, reads which bypass the cache go straight into
+ * the caller's buffer if it is block aligned, which saves copying the
+ * data out of the slot buffer. The card works on the process' virtual
+ * addresses, the buffer needs no pinning. Reads filling the cache and
+ * unaligned buffers use the slot buffer. It is off by default: a
+ * request which timed out is given back to the caller while the card
+ * or a software backend thread might still complete it, a direct read
+ * would then write to a buffer the caller owns again. Call after
+ * cache_reserve_req().
+ */
+static inline uint8_t *req_read_dst(struct cblk_dev *c,
+				struct cblk_req *req, void *buf)
+{
+	unsigned int i;
+
+	if (!cblk_zerocopy || (buf == NULL) ||
+	    ((uintptr_t)buf % __CBLK_BLOCK_SIZE) != 0)
+		return req->buf;
+	for (i = 0; i < req->nblocks; i++)
+		if (req->pblock[i] != NULL)
+			return req->buf;	/* cacheable */
+
+	dev_stat_inc(c, zerocopy_reads);
+	return buf;
+}
+
+static void req_setup(struct cblk_req *req,
+		uint32_t action_code,
+		uint64_t dst,
+		uint64_t src,
+		uint32_t size)
+{
+	req->action = action_code | (req->slot << 8);
+	req->dst = dst;
+	req->src = src;
+	req->size = size;
+	req->tries = 0;
+}
+
+/* Prefetches are not counted, nobody asked for them */
+static inline enum dev_act req_act(struct cblk_req *req)
+{
+	if (req->is_async)
+		return cblk_is_write(req) ? DEV_ACT_AWRITE : DEV_ACT_AREAD;
+	if (req->use_wait_sem)
+		return cblk_is_write(req) ? DEV_ACT_WRITE : DEV_ACT_READ;
+	return DEV_ACT_MAX;
+}
+
+/*
+ * Request timeouts. A request in flight is linked into the bucket of
+ * the tick its deadline falls into, a hashed timer wheel with
+ * CONFIG_TIMER_SLOTS buckets of CONFIG_TIMER_TICK_USEC. The completion
+ * threads advance the wheel and expire the requests in the buckets
+ * passed, entries due in a later round stay. Arming and unlinking are
+ * O(1) under dev_lock. Completed requests are not unlinked right away,
+ * that would cost the lock on every completion. They are dropped when
+ * their bucket comes along or when the slot is started again.
+ */
+static inline uint64_t timer_tick(struct cblk_dev *c, struct timespec *t)
+{
+	return timediff_usec(t, &c->start_time) / CONFIG_TIMER_TICK_USEC;
+}
+
+/* Deadline for a new request of class prio, see cblk_set_timeout() */
+static inline uint64_t req_timeout_usec(enum cblk_prio prio)
+{
+	if (cblk_thread_timeout && (prio != CBLK_PRIO_BACKGROUND))
+		return cblk_thread_timeout;
+	return (uint64_t)cblk_reqtimeout * 1000000;
+}
+
+static void __timer_unlink(struct cblk_dev *c, struct cblk_req *req)
+{
+	if (!req->tw_linked)
+		return;
+	if (req->tw_prev != NULL)
+		req->tw_prev->tw_next = req->tw_next;
+	else
+		c->wheel[req->tw_expires % CONFIG_TIMER_SLOTS] = req->tw_next;
+	if (req->tw_next != NULL)
+		req->tw_next->tw_prev = req->tw_prev;
+	req->tw_linked = 0;
+}
+
+/* Caller holds dev_lock, req->stime is the start of this try */
+static void __timer_arm(struct cblk_dev *c, struct cblk_req *req)
+{
+	struct cblk_req **head;
+
+	__timer_unlink(c, req);
+	req->tw_expires = MAX(timer_tick(c, &req->stime) + 1 +
+			(req->timeout_usec + CONFIG_TIMER_TICK_USEC - 1) /
+			CONFIG_TIMER_TICK_USEC, c->wheel_tick);
+
+	head = &c->wheel[req->tw_expires % CONFIG_TIMER_SLOTS];
+	req->tw_prev = NULL;
+	req->tw_next = *head;
+	if (*head != NULL)
+		(*head)->tw_prev = req;
+	*head = req;
+	req->tw_linked = 1;
+}
+
+/*
+ * Expire the buckets up to now. Requests still in flight are returned
+ * in expired[], which has room for CBLK_IDX_MAX.
+ */
+static unsigned int timer_advance(struct cblk_dev *c, struct timespec *now,
+				struct cblk_req *expired[])
+{
+	unsigned int i, n = 0;
+	uint64_t t, tick = timer_tick(c, now);
+	struct cblk_req *req, *next;
+
+	if (tick < __atomic_load_n(&c->wheel_tick, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&c->dev_lock);
+	t = c->wheel_tick;
+	for (i = 0; (i < CONFIG_TIMER_SLOTS) && (t <= tick); i++, t++) {
+		req = c->wheel[t % CONFIG_TIMER_SLOTS];
+		for (; req != NULL; req = next) {
+			enum cblk_status status = cblk_get_status(req);
+
+			next = req->tw_next;
+			if (req->tw_expires > tick)
+				continue;	/* later round */
+			__timer_unlink(c, req);
+			if ((status == CBLK_READING) ||
+			    (status == CBLK_WRITING))
+				expired[n++] = req;
+		}
+	}
+	__atomic_store_n(&c->wheel_tick, MAX(t, tick + 1),	/* all seen */
+			__ATOMIC_RELAXED);
+	pthread_mutex_unlock(&c->dev_lock);
+	return n;
+}
+
+/*
+ * NVMe: For NVMe transfers n is representing a NVME_LB_SIZE (512)
+ *       byte block.
+ *
+ * Lockfree version of req_start(), the caller must hold c->dev_lock.
+ * Used to start a list of requests with one lock acquisition. The lock
+ * only serializes programming the action registers, slots and request
+ * status are managed with atomics.
+ */
+static void __req_start(struct cblk_req *req, struct cblk_dev *c)
+{
+	uint8_t action_code = req->action & 0x00ff;
+	int slot = req->slot;
+
+	if ((req->tries == 0) && (req->act == DEV_ACT_MAX)) {
+		req->act = req_act(req);
+		if (req->act != DEV_ACT_MAX)
+			dev_act_inc(c, req->act);
+	}
+	req->tries++;
+	block_trace("    [%s] HW %s memcpy_%x(slot=%u dest=0x%llx, "
+		"src=0x%llx n=%lld bytes) LBA=%ld attempts=%d\n",
+		__func__, action_name[action_code % ACTION_CONFIG_MAX],
+		req->action, slot, (long long)req->dst, (long long)req->src,
+		(long long)req->size, req->lba, req->tries);
+
+	if (c->sw != NULL) {
+		/* An I/O thread might be done right away */
+		time_now(&req->stime);
+		req->h_stime = req->stime;
+		__timer_arm(c, req);
+		sw_start(c->sw, slot);
+	} else {
+		__cblk_write(c, ACTION_CONFIG,    req->action);
+		__cblk_write(c, ACTION_DEST_LOW,  (uint32_t)(req->dst & 0xffffffff));
+		__cblk_write(c, ACTION_DEST_HIGH, (uint32_t)(req->dst >> 32));
+		__cblk_write(c, ACTION_SRC_LOW,   (uint32_t)(req->src & 0xffffffff));
+		__cblk_write(c, ACTION_SRC_HIGH,  (uint32_t)(req->src >> 32));
+		__cblk_write(c, ACTION_CNT,       req->size);
+
+		/* Wait for Action to go back to Idle */
+		snap_action_start(c->act);
+		time_now(&req->stime);
+		req->h_stime = req->stime;
+		__timer_arm(c, req);
+	}
+
+	if (action_code == ACTION_CONFIG_COPY_HN) {
+		dev_stat_inc(c, hw_block_writes);
+		dev_stat_add(c, wbytes_total, req->size);
+	} else {
+		dev_stat_inc(c, hw_block_reads);
+		dev_stat_add(c, rbytes_total, req->size);
+	}
+}
+
+static void req_start(struct cblk_req *req, struct cblk_dev *c)
+{
+	pthread_mutex_lock(&c->dev_lock);
+	__req_start(req, c);
+	pthread_mutex_unlock(&c->dev_lock);
+}
+
+int cblk_init(void *arg __attribute__((unused)),
+		uint64_t flags __attribute__((unused)))
+{
+	block_trace("[%s] arg=%p flags=%llx\n", __func__, arg,
+		(long long)flags);
+	return 0;
+}
+
+int cblk_term(void *arg __attribute__((unused)),
 		uint64_t flags __attribute__((unused)))
 {
 	block_trace("[%s] arg=%p flags=%llx\n", __func__, arg,
@@ -859,10 +2258,10 @@ int cblk_term(void *arg __attribute__((unused)),
 static void cblk_req_dump(struct cblk_dev *c)
 {
 	unsigned int i;
-	struct timeval now;
+	struct timespec now;
 	time_t usecs;
 
-	gettimeofday(&now, NULL);
+	time_now(&now);
 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
 		struct cblk_req *req = &c->req[i];
 
@@ -886,10 +2285,10 @@ static void cblk_req_dump(struct cblk_dev *c)
 static void stat_req_dump(struct cblk_dev *c)
 {
 	unsigned int i;
-	struct timeval now;
+	struct timespec now;
 	time_t usecs;
 
-	gettimeofday(&now, NULL);
+	time_now(&now);
 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
 		struct cblk_req *req = &c->req[i];
 
@@ -911,41 +2310,29 @@ static void stat_req_dump(struct cblk_dev *c)
 }
 
 /**
- * Allocate a free slot for reading. Numbers will go from 0..15.
+ * Allocate a free slot, see slot_mask() for which ones.
  * Updates work_in_flight and sets the request status to CBLK_READING/WRITING.
- * Returns NULL if no free request is available. Assumes that
- * requests can be completed out of order, so it searches all available
- * blocks. Holds the device lock temporarily to sync updating the
- * internal device status. Sets c->idx to enable round robin searching
- * for a free slot.
+ * Returns NULL if no free request is available. If nowait is set, it
+ * does not wait for a slot and fails with EAGAIN instead. Assumes that
+ * requests can be completed out of order. req_slot_get() guarantees
+ * that a matching bit in c->free_slots is set, slot_alloc() claims it
+ * without locking.
  */
 static struct cblk_req *get_req(struct cblk_dev *c,
 				int use_wait_sem,
 				off_t lba, size_t nblocks,
-				int is_write)
+				int is_write, int nowait,
+				enum cblk_prio prio)
 {
-	int i, slot;
+	int slot;
 	struct cblk_req *req;
 
 	while (c->status == CBLK_READY) {
-		int rc;
-		struct timespec ts;
-
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += cblk_busytimeout;
-	retry:
-		rc = sem_timedwait(&c->busy_sem, &ts);
-		if (rc == -1) {
-			if (errno == EINTR)
-				goto retry;
-			if (errno == ETIMEDOUT) {
+		if (req_slot_get(c, is_write, prio, nowait) != 0) {
+			if (errno == ETIMEDOUT)
 				fprintf(stderr, "[%s] warn: %s\n",
 					__func__, strerror(errno));
-				//goto retry;
-				return NULL;
-			}
-			fprintf(stderr, "[%s] warn: sem_timedwait returned rc=%d %s\n",
-				__func__, rc, strerror(errno));
+			return NULL;	/* EAGAIN: nowait and no slot */
 		}
 
 		/* Check if device is still healthy after waiting */
@@ -957,31 +2344,27 @@ static struct cblk_req *get_req(struct cblk_dev *c,
 			return NULL;
 		}
 
-		pthread_mutex_lock(&c->dev_lock);
-
-		for (i = 0; i < CBLK_IDX_MAX; i++) {
-			slot = c->idx;			/* try next slot */
-
+		slot = slot_alloc(c, is_write);
+		if (slot >= 0) {
 			req = &c->req[slot];
-			if (req->status == CBLK_IDLE) {	/* nice it is free */
-				block_trace("[%s] GIVE OUT WRITE slot %u LBA=%ld\n",
-					__func__, slot, lba);
-
-				gettimeofday(&req->stime, NULL);
-				req->use_wait_sem = use_wait_sem;
-				req->lba = lba;
-				req->nblocks = nblocks;
-				req->is_write = is_write;
-				cblk_set_status(req, is_write ? CBLK_WRITING : CBLK_READING);
-
-				inc_work_in_flight(c);
-				pthread_mutex_unlock(&c->dev_lock);
-				return req;
-			}
-			c->idx = (c->idx + 1) % CBLK_IDX_MAX;	/* pick next idx */
+			block_trace("[%s] GIVE OUT %s slot %u LBA=%ld\n",
+				__func__, is_write ? "WRITE" : "READ", slot, lba);
+
+			time_now(&req->stime);
+			req->use_wait_sem = use_wait_sem;
+			req->lba = lba;
+			req->nblocks = nblocks;
+			req->is_write = is_write;
+			req->timeout_usec = req_timeout_usec(prio);
+			cblk_set_status(req, is_write ? CBLK_WRITING : CBLK_READING);
+
+			inc_work_in_flight(c);
+			return req;
 		}
-		pthread_mutex_unlock(&c->dev_lock);
-		fprintf(stderr, "[%s] warn: No IDLE write req for LBA=%ld found!\n",
+
+		/* Slots stuck in ERROR are not given back */
+		req_slot_put(c, is_write);
+		fprintf(stderr, "[%s] warn: No IDLE req for LBA=%ld found!\n",
 			__func__, lba);
 		cblk_req_dump(c);
 	}
@@ -989,49 +2372,175 @@ static struct cblk_req *get_req(struct cblk_dev *c,
 	return NULL;
 }
 
+static void ra_write(struct cblk_dev *c, struct cblk_req *req);
+
+/*
+ * A request which timed out stays in its slot until the card reports
+ * it after all, until then it might still transfer data from or to
+ * the buffer. Whichever comes last of put_req() and the late
+ * completion gives the slot back.
+ */
+#define REQ_PARKED_PUT		1	/* released by its owner */
+#define REQ_PARKED_DONE		2	/* reported by the card */
+
+static void req_park(struct cblk_dev *c, struct cblk_req *req,
+		unsigned int why)
+{
+	unsigned int old;
+
+	old = __atomic_fetch_or(&req->parked, why, __ATOMIC_ACQ_REL);
+	if (!(old & (REQ_PARKED_PUT | REQ_PARKED_DONE) & ~why))
+		return;
+
+	__atomic_store_n(&req->parked, 0, __ATOMIC_RELAXED);
+	dev_stat_inc(c, late_completions);
+	dec_work_in_flight(c);
+	cblk_set_status(req, CBLK_IDLE);
+	slot_free(c, req->slot);
+	req_slot_put(c, req->is_write);
+}
+
 static void put_req(struct cblk_dev *c, struct cblk_req *req)
 {
 	unsigned int i;
 	time_t usecs;
 
-	pthread_mutex_lock(&c->dev_lock);
-	gettimeofday(&req->etime, NULL);
+	time_now(&req->etime);
 	usecs = timediff_usec(&req->etime, &req->stime);
 
 	if (cblk_is_write(req)) {
-		if (usecs > c->max_write_usecs)
-			c->max_write_usecs = usecs;
-		if ((c->min_write_usecs == 0) || (usecs < c->min_write_usecs))
-			c->min_write_usecs = usecs;
-		c->avg_write_usecs += usecs;
+		dev_stat_max(&c->max_write_usecs, usecs);
+		dev_stat_min(&c->min_write_usecs, usecs);
+		dev_stat_add(c, write_usecs, usecs);
+		ra_write(c, req);
 	} else {
-		if (usecs > c->max_read_usecs)
-			c->max_read_usecs = usecs;
-		if ((c->min_read_usecs == 0) || (usecs < c->min_read_usecs))
-			c->min_read_usecs = usecs;
-		c->avg_read_usecs += usecs;
+		dev_stat_max(&c->max_read_usecs, usecs);
+		dev_stat_min(&c->min_read_usecs, usecs);
+		dev_stat_add(c, read_usecs, usecs);
 
 		if (cblk_caching) {
 			for (i = 0; i < ARRAY_SIZE(req->pblock); i++) {
-				cache_unreserve(req->pblock[i], req->lba + i);
+				cache_unreserve(c, req->pblock[i], req->lba + i);
 				req->pblock[i] = NULL;
 			}
 		}
 	}
 
-	if (req->status != CBLK_ERROR)
-		cblk_set_status(req, CBLK_IDLE);
+	if (req->act != DEV_ACT_MAX) {
+		dev_act_dec(c, req->act);
+		req->act = DEV_ACT_MAX;
+	}
+	if (cblk_get_status(req) == CBLK_ERROR)
+		dev_stat_inc(c, errors);
+
+	req->is_async = 0;
+	req->user_status = NULL;
+	req->data = req->buf;
+	req->ra = NULL;
+
+	/* Timed out, keep polling until the card reports it */
+	if ((cblk_get_status(req) == CBLK_ERROR) &&
+	    (c->status == CBLK_READY)) {
+		req_park(c, req, REQ_PARKED_PUT);
+		return;
+	}
 
 	dec_work_in_flight(c);
-	sem_post(&c->busy_sem);
 
-	/* FIXME Should we do the sem_post(&c->busy_sem); here? */
-	pthread_mutex_unlock(&c->dev_lock);
+	/* Slots in ERROR stay allocated, they cannot be used anymore */
+	if (cblk_get_status(req) != CBLK_ERROR) {
+		cblk_set_status(req, CBLK_IDLE);
+		slot_free(c, req->slot);
+	}
+	req_slot_put(c, req->is_write);
+}
+
+static inline int io_is_write(const cblk_io_t *io)
+{
+	return io->request_type == CBLK_IO_TYPE_WRITE;
+}
+
+/**
+ * Batch version of get_req() for cblk_listio(). Takes up to n free
+ * slots for the requests in ios, in their order and each in its class.
+ * If wait is set, it waits for the first slot, the others are only
+ * taken if they are free right now. With serial writes a batch ends
+ * before its second write. Returns the number of requests stored in
+ * reqs or -1 with errno set.
+ */
+static int get_reqs(struct cblk_dev *c, cblk_io_t *ios[],
+			struct cblk_req *reqs[], int n, int wait)
+{
+	int i, k = 0, got = 0;
+
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		errno = EBADFD;
+		return -1;
+	}
+
+	while ((got < n) && (req_slot_get(c, io_is_write(ios[got]),
+				flags_prio(ios[got]->flags,
+					CBLK_IO_PRIORITY_REQ),
+				!wait || got) == 0))
+		got++;
+	if (got == 0)
+		return -1;
+
+	while (k < got) {
+		struct cblk_req *req;
+		cblk_io_t *io = ios[k];
+		int slot = slot_alloc(c, io_is_write(io));
+
+		if (slot < 0)
+			break;
+		req = &c->req[slot];
+		time_now(&req->stime);
+		req->use_wait_sem = 0;
+		req->lba = io->lba;
+		req->nblocks = io->nblocks;
+		req->timeout_usec = req_timeout_usec(CBLK_PRIO_NORMAL);
+		req->is_write = io_is_write(io);
+		cblk_set_status(req, req->is_write ? CBLK_WRITING :
+				CBLK_READING);
+		inc_work_in_flight(c);
+		reqs[k++] = req;
+	}
+
+	/* put_req() releases slots stuck in ERROR, they cannot be used */
+	for (i = k; i < got; i++)
+		req_slot_put(c, io_is_write(ios[i]));
+
+	return k;
 }
 
 /**
  * Check action results and kick potential waiting threads.
  */
+static void sw_failed(struct cblk_dev *c, struct cblk_req *req);
+
+/* Software backend, see sw_thread() */
+static int sw_completion_status(struct cblk_dev *c)
+{
+	int slot = sw_done(c->sw);
+	struct cblk_req *req;
+
+	if (slot < 0)
+		return -3;
+	req = &c->req[slot];
+	if (req->sw_errno) {
+		sw_failed(c, req);
+		return -3;
+	}
+	time_now(&req->h_etime);
+	if (cblk_is_write(req))
+		dev_stat_add(c, hw_write_usecs,
+			timediff_usec(&req->h_etime, &req->h_stime));
+	else
+		dev_stat_add(c, hw_read_usecs,
+			timediff_usec(&req->h_etime, &req->h_stime));
+	return slot;
+}
+
 static int completion_status(struct cblk_dev *c, int timeout __attribute__((unused)))
 {
 	int rc = ETIME;
@@ -1042,6 +2551,9 @@ static int completion_status(struct cblk_dev *c, int timeout __attribute__((unus
 	time_t usecs;
 	static int count = 0;
 
+	if (c->sw != NULL)
+		return sw_completion_status(c);
+
 #ifdef CONFIG_WAIT_FOR_IRQ
 	rc = snap_action_completed(c->act, NULL, timeout);
 	if (rc == 0) {
@@ -1086,75 +2598,119 @@ static int completion_status(struct cblk_dev *c, int timeout __attribute__((unus
 	}
 
 	/* statistics: figure out hardware completion time ... */
-	gettimeofday(&req->h_etime, NULL);
+	time_now(&req->h_etime);
 	usecs = timediff_usec(&req->h_etime, &req->h_stime);
 	if (cblk_is_write(req))
-		c->avg_hw_write_usecs += usecs;
+		dev_stat_add(c, hw_write_usecs, usecs);
 	else
-		c->avg_hw_read_usecs += usecs;
+		dev_stat_add(c, hw_read_usecs, usecs);
 
 	return slot;
 }
 
+static void __async_complete(struct cblk_dev *c, struct cblk_req *req,
+				int finish);
+static void async_wakeup(struct cblk_dev *c);
+static int cache_flush(struct cblk_dev *c, int all);
+static void ra_complete(struct cblk_dev *c, struct cblk_req *req);
+static int __read_complete(struct cblk_dev *c,
+				struct cblk_req *req, int _used);
+
+/* Wake up whoever waits for a request which failed */
+static void req_wake_failed(struct cblk_dev *c, struct cblk_req *req,
+			int async, int finish)
+{
+	if (req->use_wait_sem)
+		sem_post(&req->wait_sem);
+	else if (async) {
+		__async_complete(c, req, finish);
+		async_wakeup(c);
+	} else if (req->ra != NULL)
+		ra_complete(c, req);
+	else
+		__read_complete(c, req, 0);	/* prefetch */
+}
+
 /*
- * We are checking status in struct cblk_req and we saw req->stime to
- * be all 0s during testing. Therefore we try to aquire the c->dev_lock
- * to avoid any possible inconsistencies here.
+ * A request expired on the timer wheel. It is started again up to
+ * CBLK_MAXRETRIES times, then it fails with ETIME and the slot is
+ * parked, see req_park(). The device stays usable. With
+ * CBLK_TIMEOUT_POLICY=FATAL the device goes into error state instead.
+ * The completion thread might complete the request while we look at
+ * it, cblk_finish_status() makes sure only one of us completes it.
  */
-static int check_req_timeouts(struct cblk_dev *c, long int timeout_sec)
+static void req_timeout(struct cblk_dev *c, struct cblk_req *req)
 {
-	unsigned int i;
-	long int diff_sec = 0;
-	int err = 0;
-	struct timeval etime;
+	uint32_t errbits = 0;
+	int async = req->is_async;
+	int finish = (req->user_status != NULL);
+	struct timespec now;
+
+	time_now(&now);
+	if (timediff_usec(&now, &req->stime) < (long long)req->timeout_usec)
+		return;			/* slot was reused meanwhile */
+	dev_stat_inc(c, timeouts);
+	fprintf(stderr, "[%s] err: req[%2d]: %s %lld/%lld usec LBA=%ld "
+		"TIMEOUT\n", __func__, req->slot,
+		cblk_status_str[cblk_get_status(req)],
+		(long long)timediff_usec(&now, &req->stime),
+		(long long)req->timeout_usec, req->lba);
+
+	if (req->tries <= cblk_maxretries) {
+		/* FIXME Helps but is not optimal ... */
+		req->err_total++;
+		dev_stat_inc(c, retries);
+		req_start(req, c);
+		return;
+	}
 
-	gettimeofday(&etime, NULL);
-	pthread_mutex_lock(&c->dev_lock);
+	if (cblk_finish_status(req, CBLK_ERROR) == CBLK_IDLE)
+		return;			/* just completed */
+	dev_stat_inc(c, fail_timeouts);
 
-	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		struct cblk_req *req = &c->req[i];
+	if (cblk_timeout_fatal) {
+		errno = ETIME;
+		dev_set_status(c, CBLK_ERROR);
+		if (c->card != NULL)
+			__cblk_read(c, ACTION_ERROR_BITS, &errbits);
+		if (errbits != 0)
+			fprintf(stderr, "[%s] err: req[%2d]: "
+				"ACTION_ERROR_BITS=%08x\n",
+				__func__, req->slot, errbits);
+	}
+	req_wake_failed(c, req, async, finish);
+}
 
-		if ((req->status != CBLK_READING) && (req->status != CBLK_WRITING))
-			continue;
+/*
+ * Software backend: the transfer failed, e.g. with EIO. It is started
+ * again up to CBLK_MAXRETRIES times, then it fails like a request
+ * which timed out. Nothing is in flight anymore, the slot is given
+ * back once its owner released it.
+ */
+static void sw_failed(struct cblk_dev *c, struct cblk_req *req)
+{
+	int async = req->is_async;
+	int finish = (req->user_status != NULL);
 
-		diff_sec = timediff_sec(&etime, &req->stime);
-		if (diff_sec > timeout_sec) {
-			err++;
-			
-			fprintf(stderr, "[%s] err: req[%2d]: "
-				"%s %lu/%lu sec LBA=%ld TIMEOUT\n",
-				__func__, i, cblk_status_str[req->status],
-				timeout_sec, diff_sec, req->lba);
-
-			if (req->tries >= cblk_maxretries) {
-				uint32_t errbits;
-
-				errno = ETIME;
-				cblk_set_status(req, CBLK_ERROR);
-				dev_set_status(c, CBLK_ERROR);
-				__cblk_read(c, ACTION_ERROR_BITS, &errbits);
-
-				if (errbits != 0)
-					fprintf(stderr, "[%s] err: req[%2d]: "
-						"ACTION_ERROR_BITS=%08x\n",
-						__func__, i, errbits);
-
-				if (req->use_wait_sem)
-					sem_post(&req->wait_sem);
-			} else {
-				/* FIXME Helps but is not optimal ... */
-				req->err_total++;
-
-				/* req_start() will use the lock too */
-				pthread_mutex_unlock(&c->dev_lock);
-				req_start(req, c);
-				pthread_mutex_lock(&c->dev_lock);
-			}
-		}
+	fprintf(stderr, "[%s] err: req[%2d]: %s LBA=%ld failed: %s\n",
+		__func__, req->slot, cblk_status_str[cblk_get_status(req)],
+		req->lba, strerror(req->sw_errno));
+
+	if (req->tries <= cblk_maxretries) {
+		req->err_total++;
+		dev_stat_inc(c, retries);
+		req_start(req, c);
+		return;
 	}
-	pthread_mutex_unlock(&c->dev_lock);
 
-	return err;
+	if (cblk_finish_status(req, CBLK_ERROR) == CBLK_IDLE) {
+		if ((cblk_get_status(req) == CBLK_ERROR) &&
+		    (c->status == CBLK_READY))
+			req_park(c, req, REQ_PARKED_DONE);	/* late */
+		return;
+	}
+	req_park(c, req, REQ_PARKED_DONE);
+	req_wake_failed(c, req, async, finish);
 }
 
 static void completion_thread_cleanup(void *arg)
@@ -1181,13 +2737,17 @@ static int __prefetch_read_start(struct cblk_dev *c, off_t lba,
 	/* Check if we can really prefetch this lba */
 	if ((lba < 0) || (lba >= (off_t)c->nblocks))
 		return -1;
+	if (nblocks > CBLK_NBLOCKS_MAX)		/* does not fit into slot */
+		return -1;
 
 	/* Check if the block is already in cache or requested */
-	status = cache_info(lba);
+	status = cache_info(c, lba);
 	if ((status == CACHE_BLOCK_VALID) || (status == CACHE_BLOCK_READING)) {
 		block_trace("[%s] skip prefetch LBA=%lu %d KiB status=%s\n",
 			__func__, lba, mem_size/1024, block_status_str[status]);
-		c->prefetch_collisions++;
+		dev_stat_inc(c, prefetch_collisions);
+		snap_stats_add(c->stats, prefetch_collisions, 1);
+		snap_probe2(snapblock, prefetch__skip, lba, status);
 		return -2;
 	}
 
@@ -1196,13 +2756,17 @@ static int __prefetch_read_start(struct cblk_dev *c, off_t lba,
 
 	/*
 	 * Get a free read slot, we can read CBLK_NBLOCKS_MAX blocks,
-	 * pysically request the block.
+	 * pysically request the block. Do not wait for it, the caller
+	 * might hold slots itself.
 	 */
-	req = get_req(c, 0, lba, nblocks, 0);
+	req = get_req(c, 0, lba, nblocks, 0, 1, CBLK_PRIO_BACKGROUND);
 	if (req == NULL)
 		return -2;
 
-	c->prefetches++;
+	dev_stat_inc(c, prefetches);
+	snap_stats_add(c->stats, prefetches, 1);
+	snap_probe3(snapblock, prefetch__start, lba, nblocks, req->slot);
+	cache_reserve_req(c, req, 1);
 	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
 		(uint64_t)req->buf,			/* dst */
 		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
@@ -1214,26 +2778,35 @@ static int __prefetch_read_start(struct cblk_dev *c, off_t lba,
 
 static int __prefetch_blocks(struct cblk_dev *c, off_t lba, unsigned int nblocks)
 {
-	int rc = 0;
+	int rc = 0, m;
 	unsigned int k, n = 0;
+	off_t lbas[CBLK_IDX_MAX];
 
 	if (!cblk_prefetch)
 		return -1;
 
 	/* pp_get_offslist(c->prefetch_offs, cblk_prefetch, nblocks); */
 
-	for (k = 0; (k < (unsigned int)cblk_prefetch); k++) {
+	/* SMART predicts the LBAs, the others use fixed offsets */
+	m = pp_predict(c->id, lba, nblocks, lbas, cblk_prefetch);
+	if (m < 0) {
+		for (k = 0; k < (unsigned int)cblk_prefetch; k++)
+			lbas[k] = lba + c->prefetch_offs[k];
+		m = cblk_prefetch;
+	}
+
+	for (k = 0; k < (unsigned int)m; k++) {
 		if (work_in_flight(c) >= CBLK_PREFETCH_THRESHOLD)
 			continue;
 
-		block_trace("[%s] LBA=%ld+(%d)\n",
-			__func__, lba, c->prefetch_offs[k]);
-		rc = __prefetch_read_start(c, lba + c->prefetch_offs[k],
-					nblocks);
+		block_trace("[%s] LBA=%ld+(%ld)\n",
+			__func__, lba, (long)(lbas[k] - lba));
+		rc = __prefetch_read_start(c, lbas[k], nblocks);
 		if (rc >= 0)
 			n++;
 	}
 
+	pp_feedback(n * nblocks, 0);
 	return n;
 }
 
@@ -1242,7 +2815,7 @@ static int __read_complete(struct cblk_dev *c,
 {
 	unsigned int i;
 
-	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
+	if ((c->status == CBLK_ERROR) || (cblk_get_status(req) == CBLK_ERROR)) {
 		errno = ETIME;
 		put_req(c, req);
 		return -1;
@@ -1251,8 +2824,8 @@ static int __read_complete(struct cblk_dev *c,
 	if (cblk_caching) {
 		/* ... push blocks to cache for later use */
 		for (i = 0; i < req->nblocks; i++) {
-			cache_write_reserved(&req->pblock[i], req->lba + i,
-					req->buf + i * __CBLK_BLOCK_SIZE,
+			cache_write_reserved(c, &req->pblock[i], req->lba + i,
+					req->data + i * __CBLK_BLOCK_SIZE,
 					_used);
 		}
 	}
@@ -1261,620 +2834,2767 @@ static int __read_complete(struct cblk_dev *c,
 	return 0;
 }
 
-/**
- * Try to ping process to a specific CPU. Returns the CPU we are
- * currently running on.
+/*
+ * Sequential read-ahead. A stream is a sequence of cblk_read() calls
+ * where each one starts where the previous one ended. Once a stream
+ * is seen, it reads ahead up to two segments: the one the reader is
+ * in and the next one, which is started as soon as the reader enters
+ * the last segment. Each new segment is twice as large as the one
+ * before, up to cblk_readahead_max blocks, the drive's limit for one
+ * transfer, and never larger than what the stream has read so far. A
+ * read close to a stream which does not continue it halves the window,
+ * other reads start a new stream in the least recently used slot.
+ * Completed writes update the segments they overlap, segments still
+ * being read are dropped.
+ *
+ * Segments are not blocks of the cache, they are owned by ra_lock.
+ * Readers copy under the lock, there is mostly one reader per stream.
  */
-static inline int __pin_cpu(void)
+static inline size_t ra_win_min(void)
 {
-	cpu_set_t *cpusetp;
-	size_t size;
-	int num_cpus, run_cpu = sched_getcpu();
-
-	num_cpus = CPU_SETSIZE; /* take default, currently 1024 */
-	cpusetp = CPU_ALLOC(num_cpus);
-	if (cpusetp == NULL)
-		return -1;
-
-	size = CPU_ALLOC_SIZE(num_cpus);
-	CPU_ZERO_S(size, cpusetp);
-	CPU_SET_S(run_cpu, size, cpusetp);
+	return MIN((size_t)CBLK_NBLOCKS_MAX, cblk_readahead_max);
+}
 
-	if (sched_setaffinity(0, size, cpusetp) < 0) {
-		CPU_FREE(cpusetp);
-		return -2;
+/* Must hold ra_lock. READING segments stay busy until ra_complete(). */
+static void ra_seg_drop(struct cblk_dev *c, struct ra_seg *seg)
+{
+	if (seg->status == RA_READY) {
+		dev_stat_add(c, ra_wasted, seg->nblocks - seg->used);
+		seg->status = RA_IDLE;
+	} else if ((seg->status == RA_READING) && !seg->stale) {
+		dev_stat_add(c, ra_wasted, seg->nblocks);
+		seg->stale = 1;
 	}
+}
 
-	CPU_FREE(cpusetp);
-	return run_cpu;
+static inline int ra_seg_has(struct ra_seg *seg, off_t lba, size_t nblocks)
+{
+	return (seg->status != RA_IDLE) && !seg->stale &&
+		(lba >= seg->lba) &&
+		(lba + (off_t)nblocks <= seg->lba + (off_t)seg->nblocks);
 }
 
-/**
- * This thread contains performane critical code which is supposed
- * to identify request/slot completion and inform  the waiting threads
- * as quick as possible. Rescheduling or any other delay will have
- * direct influence on performance.
- */
-static void *completion_thread(void *arg)
+static void ra_start(struct cblk_dev *c, struct ra_seg *seg, off_t lba,
+			size_t nblocks)
 {
-	static unsigned long no_result_counter = 0;
-	struct cblk_dev *c = (struct cblk_dev *)arg;
+	struct cblk_req *req;
 
-	block_trace("[%s] arg=%p enter\n", __func__, arg);
-	pthread_cleanup_push(completion_thread_cleanup, c);
+	if (lba >= (off_t)c->nblocks)
+		return;
+	nblocks = MIN(nblocks, c->nblocks - lba);
+
+	if (seg->size < nblocks) {
+		__free(seg->buf);
+		seg->size = 0;
+		seg->buf = snap_malloc(nblocks * __CBLK_BLOCK_SIZE);
+		if (seg->buf == NULL)
+			return;
+		seg->size = nblocks;
+	}
 
-	while (1) {
-		int slot;
-		struct timeval now;
-		struct timespec timeout;
+	/* Like prefetches, do not wait for a slot */
+	req = get_req(c, 0, lba, nblocks, 0, 1, CBLK_PRIO_BACKGROUND);
+	if (req == NULL)
+		return;
 
-		pthread_mutex_lock(&c->idle_m);
-		while (c->work_in_flight == 0) {
-			/* 5 sec delay should be noticable ... */
-			gettimeofday(&now, NULL);
-			timeout.tv_sec = now.tv_sec + 5;
-			timeout.tv_nsec = now.tv_usec;
-
-			/* int rc =  */
-			pthread_cond_timedwait(&c->idle_c, &c->idle_m, &timeout);
-			/* if (rc == ETIMEDOUT)
-				fprintf(stderr, "[%s] info: timedwait returned ETIMEDOUT\n",
-					__func__); */
+	seg->status = RA_READING;
+	seg->stale = 0;
+	seg->lba = lba;
+	seg->nblocks = nblocks;
+	seg->used = 0;
+	req->ra = seg;
+	dev_stat_add(c, ra_blocks, nblocks);
+	snap_probe3(snapblock, readahead__start, lba, nblocks, req->slot);
 
-			c->idle_wakeups++;
-		}
-		pthread_mutex_unlock(&c->idle_m);
+	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
+		(uint64_t)seg->buf,			/* dst */
+		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
+		nblocks * __CBLK_BLOCK_SIZE);		/* size */
+	req_start(req, c);
+}
 
-		slot = completion_status(c, c->timeout);
-		if ((slot >= 0) && (slot < CBLK_IDX_MAX)) {
-			struct cblk_req *req = &c->req[slot];
-			if ((req->status == CBLK_READING) ||
-			    (req->status == CBLK_WRITING)) {
-				block_trace("  [%s] waking up slot %d LBA=%ld\n",
-					__func__, slot, req->lba);
-
-				cblk_set_status(req, CBLK_READY);
-				if (req->use_wait_sem) {
-					sem_post(&req->wait_sem);
-				} else {
-					__read_complete(c, req, 0);
-				}
-			} else {
-				block_trace("  [%s] err: slot %d status is %s "
-					"ILLEGAL STATUS (%lu) LBA=%ld\n", __func__,
-					slot, cblk_status_str[req->status],
-					no_result_counter,
-					req->lba);
-			}
-		} else no_result_counter++;
+/*
+ * The reader continued the stream up to next_lba. Make sure the data
+ * from there on is read or being read, and that the segment after the
+ * one the reader is in is on its way.
+ */
+static void ra_advance(struct cblk_dev *c, struct ra_stream *s)
+{
+	struct ra_seg *cur = NULL, *next;
+	unsigned int i;
 
-		check_req_timeouts(c, cblk_reqtimeout); /* sec */
-		pthread_testcancel();	/* go home if requested */
+	for (i = 0; i < ARRAY_SIZE(s->seg); i++)
+		if (ra_seg_has(&s->seg[i], s->next_lba, 1))
+			cur = &s->seg[i];
+
+	if (cur == NULL) {
+		/* Nothing there, data behind next_lba was consumed */
+		for (i = 0; i < ARRAY_SIZE(s->seg); i++) {
+			if (s->seg[i].status == RA_READY)
+				ra_seg_drop(c, &s->seg[i]);
+			if (s->seg[i].status == RA_IDLE)
+				cur = &s->seg[i];
+		}
+		if (cur == NULL)
+			return;
+		ra_start(c, cur, s->next_lba, s->win);
+		if (cur->status != RA_READING)
+			return;
 	}
 
-	pthread_cleanup_pop(1);
-	return NULL;
+	next = &s->seg[cur == &s->seg[0]];
+	if ((next->status != RA_IDLE) && !next->stale &&
+	    (next->lba == cur->lba + (off_t)cur->nblocks))
+		return;				/* already ahead */
+	if (next->status == RA_READING)
+		return;				/* busy, try later */
+
+	ra_seg_drop(c, next);
+	s->win = MIN(MIN(s->win * 2, cblk_readahead_max),
+		     MAX((size_t)(s->next_lba - s->start_lba), ra_win_min()));
+	ra_start(c, next, cur->lba + cur->nblocks, s->win);
 }
 
-static int put_offslist(void *put_data, int *offslist, unsigned int n,
-			size_t nblocks __attribute__((unused)))
+/* Copy from the segments, waiting for them. 0 if they went away. */
+static int ra_copy(struct cblk_dev *c, struct ra_stream *s, off_t lba,
+		void *buf, size_t nblocks)
 {
-	struct cblk_dev *c = (struct cblk_dev *)put_data;
+	unsigned int i;
+	size_t n, done = 0;
+	struct timespec ts;
 
-	if (offslist == NULL) {
-		block_trace("[%s] warn: no offset list provided!\n", __func__);
-		return -1;
-	}
+	while (done < nblocks) {
+		struct ra_seg *seg = NULL;
 
-	pthread_mutex_lock(&c->dev_lock);
-	memcpy(c->prefetch_offs, offslist, n * sizeof(int));
-	pthread_mutex_unlock(&c->dev_lock);
-	return 0;
+		for (i = 0; i < ARRAY_SIZE(s->seg); i++)
+			if (ra_seg_has(&s->seg[i], lba + done, 1))
+				seg = &s->seg[i];
+		if (seg == NULL)
+			return 0;
+		if (seg->status == RA_READING) {
+			if (c->status != CBLK_READY)
+				return 0;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&c->ra_c, &c->ra_lock, &ts);
+			continue;		/* look again */
+		}
+		n = MIN(nblocks - done, seg->lba + seg->nblocks -
+			(lba + done));
+		memcpy(buf + done * __CBLK_BLOCK_SIZE, seg->buf +
+			(lba + done - seg->lba) * __CBLK_BLOCK_SIZE,
+			n * __CBLK_BLOCK_SIZE);
+		seg->used += n;
+		done += n;
+	}
+	return 1;
 }
 
-chunk_id_t cblk_open(const char *path,
-		int max_num_requests __attribute__((unused)),
-		int mode, uint64_t ext_arg __attribute__((unused)),
-		int flags)
+/**
+ * Serve a cblk_read() from the read-ahead segments. Returns nblocks if
+ * all blocks were copied to buf, 0 if the caller has to read them.
+ */
+static int ra_read(struct cblk_dev *c, off_t lba, void *buf, size_t nblocks)
 {
-	int rc;
-	unsigned int i, j;
-	int timeout = ACTION_WAIT_TIME;
-	unsigned long have_nvme = 0;
-	snap_action_flag_t attach_flags = 0;
-	struct cblk_dev *c = &chunk;
-
-	block_trace("[%s] opening (%s)\n", __func__, path);
+	int hit = 0;
+	unsigned int i, k;
+	struct ra_stream *s = NULL, *lru = &c->ra[0];
 
-	pthread_mutex_lock(&c->dev_lock);
+	if ((lba < 0) || (lba + nblocks > c->nblocks))
+		return 0;			/* block_read() complains */
 
-#ifdef CONFIG_WAIT_FOR_IRQ
-	attach_flags |= (SNAP_ACTION_DONE_IRQ | SNAP_ATTACH_IRQ);
-#endif
-	if (flags & CBLK_OPN_VIRT_LUN) {
-		fprintf(stderr, "err: Virtual luns not supported in capi stub\n");
-		goto out_err0;
-	}
+	pthread_mutex_lock(&c->ra_lock);
+	c->ra_tick++;
 
-	if (mode != O_RDWR) {
-		fprintf(stderr, "err: Only O_RDWR file mode is supported in capi stub\n");
-		goto out_err0;
+	for (i = 0; (i < ARRAY_SIZE(c->ra)) && (s == NULL); i++) {
+		if (c->ra[i].win == 0)
+			continue;
+		if (c->ra[i].next_lba == lba)
+			s = &c->ra[i];
+		for (k = 0; k < ARRAY_SIZE(c->ra[i].seg); k++)
+			if (ra_seg_has(&c->ra[i].seg[k], lba, nblocks))
+				s = &c->ra[i];
 	}
 
-	if (c->card != NULL) { /* already initialized */
-		pthread_mutex_unlock(&c->dev_lock);
-		return 0;
+	if (s != NULL) {			/* sequential */
+		hit = ra_copy(c, s, lba, buf, nblocks);
+		if (lba + (off_t)nblocks > s->next_lba)
+			s->next_lba = lba + nblocks;
+		ra_advance(c, s);
+		s->last = c->ra_tick;
+		goto out;
 	}
 
-	/* path must match the following scheme: "/dev/cxl/afu%d.0m" */
-	c->card = snap_card_alloc_dev(path, SNAP_VENDOR_ID_IBM,
-					 SNAP_DEVICE_ID_SNAP);
-	if (NULL == c->card) {
-		fprintf(stderr, "err: Cannot open SNAP device %s\n", path);
-		goto out_err0;
-	}
+	for (i = 0; i < ARRAY_SIZE(c->ra); i++) {
+		struct ra_stream *r = &c->ra[i];
 
-	/* Check if i do have NVME on this card */
-	snap_card_ioctl(c->card, GET_NVME_ENABLED, (unsigned long)&have_nvme);
-	if (0 == have_nvme) {
-		fprintf(stderr, "err: SNAP NVMe is not enabled on card %s!\n",
-			path);
-		goto out_err1;
+		if ((r->win != 0) && (lba + (off_t)r->win > r->next_lba) &&
+		    (lba < r->next_lba + (off_t)r->win)) {
+			s = r;			/* close, but not sequential */
+			break;
+		}
+		if (r->last < lru->last)
+			lru = r;
 	}
-
-	c->act = snap_attach_action(c->card, ACTION_TYPE_NVME_EXAMPLE,
-					attach_flags, timeout);
-	if (NULL == c->act) {
-		fprintf(stderr, "err: Cannot Attach Action: %x\n",
-			ACTION_TYPE_NVME_EXAMPLE);
-		goto out_err1;
+	if (s != NULL) {
+		s->win = MAX(s->win / 2, ra_win_min());
+	} else {
+		s = lru;
+		s->win = ra_win_min();
 	}
+	for (k = 0; k < ARRAY_SIZE(s->seg); k++)
+		ra_seg_drop(c, &s->seg[k]);
+	s->start_lba = lba;
+	s->next_lba = lba + nblocks;
+	s->last = c->ra_tick;
+ out:
+	pthread_mutex_unlock(&c->ra_lock);
 
-	c->buf = snap_malloc(CBLK_IDX_MAX * __CBLK_BLOCK_SIZE * CBLK_NBLOCKS_MAX);
-	if (c->buf == NULL) {
-		fprintf(stderr, "err: Cannot alloc temporary buffer\n");
-		goto out_err2;
-	}
+	if (!hit)
+		return 0;
 
-	c->status = CBLK_READY;
-	c->req_status = CBLK_IDLE;
-	c->drive = 0;
-	c->nblocks = SNAP_N250S_NVME_SIZE / __CBLK_BLOCK_SIZE;
-	c->timeout = timeout;
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++)
-		c->done_tid[i] = 0;
-	c->idx = 0;
-	c->status_read_count = 0;
-	c->cache_hits = 0;
-	c->cache_hits_4k = 0;
-	c->prefetch_collisions = 0;
-	c->hw_block_reads = 0;
-	c->hw_block_writes = 0;
-	c->block_reads = 0;
-	c->block_writes = 0;
-	c->block_reads_4k = 0;
-	c->block_writes_4k = 0;
-	c->max_read_usecs = 0;
-	c->max_write_usecs = 0;
-	c->avg_read_usecs = 0;
-	c->avg_write_usecs = 0;
-	c->min_read_usecs = 0;
-	c->min_write_usecs = 0;
-	c->avg_hw_read_usecs = 0;
-	c->avg_hw_write_usecs = 0;
-	c->wbytes_total = 0;
-	c->rbytes_total = 0;
-	c->idle_wakeups = 0;
+	cache_overlay(c, lba, buf, nblocks);	/* newer dirty blocks */
+	dev_stat_inc(c, ra_hits);
+	return nblocks;
+}
 
-	c->wtime_total.tv_sec = 0;
-	c->wtime_total.tv_usec = 0;
-	c->rtime_total.tv_sec = 0;
-	c->rtime_total.tv_usec = 0;
-	gettimeofday(&c->start_time, NULL);
+static void ra_complete(struct cblk_dev *c, struct cblk_req *req)
+{
+	struct ra_seg *seg = req->ra;
+
+	pthread_mutex_lock(&c->ra_lock);
+	if (seg->stale || (c->status == CBLK_ERROR) ||
+	    (cblk_get_status(req) == CBLK_ERROR)) {
+		if (!seg->stale)
+			dev_stat_add(c, ra_wasted, seg->nblocks);
+		seg->status = RA_IDLE;
+	} else
+		seg->status = RA_READY;
+	pthread_cond_broadcast(&c->ra_c);
+	pthread_mutex_unlock(&c->ra_lock);
 
-	sem_init(&c->busy_sem, 0, CBLK_IDX_MAX);
-	pthread_mutex_init(&c->idle_m, NULL);
-	pthread_cond_init(&c->idle_c, NULL);
+	snap_probe3(snapblock, readahead__done, req->lba, req->nblocks,
+		req->slot);
+	put_req(c, req);
+}
 
-	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		struct cblk_req *req = &c->req[i];
+/*
+ * A write completed. READY segments get a copy of the written blocks,
+ * READING ones might get the old data and are dropped, like all
+ * segments the write overlaps if it failed.
+ */
+static void ra_write(struct cblk_dev *c, struct cblk_req *req)
+{
+	unsigned int i, k;
+	off_t lba = req->lba, first, last;
+	int failed = (cblk_get_status(req) == CBLK_ERROR);
 
-		req->slot = i;
-		req->lba = 0;
-		req->nblocks = 0;
-		req->buf = c->buf + i * CBLK_NBLOCKS_MAX * __CBLK_BLOCK_SIZE;
-		req->action = 0;
-		req->dst = 0;
-		req->src = 0;
-		req->size = 0;
-		req->tries = 0;
-		req->err_total = 0;
-		cblk_set_status(req, CBLK_IDLE);
-		sem_init(&req->wait_sem, 0, 0);
+	if (!cblk_readahead)
+		return;
 
-		for (j = 0; j < ARRAY_SIZE(req->pblock); j++) {
-			req->pblock[j] = NULL;
+	pthread_mutex_lock(&c->ra_lock);
+	for (i = 0; i < ARRAY_SIZE(c->ra); i++) {
+		for (k = 0; k < ARRAY_SIZE(c->ra[i].seg); k++) {
+			struct ra_seg *seg = &c->ra[i].seg[k];
+
+			first = MAX(lba, seg->lba);
+			last = MIN(lba + (off_t)req->nblocks,
+				   seg->lba + (off_t)seg->nblocks);
+			if ((seg->status == RA_IDLE) || (first >= last))
+				continue;
+			if (failed || (seg->status == RA_READING)) {
+				ra_seg_drop(c, seg);
+				continue;
+			}
+			memcpy(seg->buf + (first - seg->lba) * __CBLK_BLOCK_SIZE,
+			       req->buf + (first - lba) * __CBLK_BLOCK_SIZE,
+			       (last - first) * __CBLK_BLOCK_SIZE);
 		}
 	}
+	pthread_mutex_unlock(&c->ra_lock);
+}
 
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
-		rc = pthread_create(&c->done_tid[i], NULL,
-				&completion_thread, &chunk);
-		if (rc != 0)
-			goto out_err3;
-	}
-
-	rc = cache_init();
-	if (rc != 0)
-		goto out_err4;
+/*
+ * Drop all streams and wait until the card is done with their
+ * segments. On a broken device the buffers in flight are leaked.
+ */
+static void ra_done(struct cblk_dev *c)
+{
+	unsigned int i, k, busy;
+	struct timespec ts;
+
+	pthread_mutex_lock(&c->ra_lock);
+	do {
+		busy = 0;
+		for (i = 0; i < ARRAY_SIZE(c->ra); i++) {
+			for (k = 0; k < ARRAY_SIZE(c->ra[i].seg); k++) {
+				struct ra_seg *seg = &c->ra[i].seg[k];
+
+				ra_seg_drop(c, seg);
+				if (seg->status == RA_READING) {
+					busy++;
+					continue;
+				}
+				__free(seg->buf);
+				seg->buf = NULL;
+				seg->size = 0;
+			}
+			c->ra[i].win = 0;
+			c->ra[i].last = 0;
+		}
+		if (busy && (c->status == CBLK_READY)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&c->ra_c, &c->ra_lock, &ts);
+		}
+	} while (busy && (c->status == CBLK_READY));
+	pthread_mutex_unlock(&c->ra_lock);
+}
 
-	rc = pp_init(cblk_prefetch, put_offslist, cblk_nblocks, c);
-	if (rc != 0)
-		goto out_err5;
+/**
+ * Finish an asynchronous request: copy the read data to the caller,
+ * update the cache, release the slot and post the status if the
+ * caller provided one. Returns the number of blocks transferred or
+ * -1 with errno set.
+ */
+static int __async_finish(struct cblk_dev *c, struct cblk_req *req)
+{
+	int rc = 0;
+	size_t i, nblocks = req->nblocks;
+	off_t lba = req->lba;
+	uint8_t slot = req->slot;
+	cblk_arw_status_t *status = req->user_status;
+	struct timespec etime;
+	long int nsecs;
+	time_t usecs;
 
-	pp_get_offslist(c->prefetch_offs, cblk_prefetch, cblk_nblocks);
+	time_now(&etime);
+	nsecs = timediff_nsec(&etime, &req->stime);
+	usecs = nsecs / 1000;
 
-	pthread_mutex_unlock(&c->dev_lock);
-	return 0;
+	if ((c->status == CBLK_ERROR) || (cblk_get_status(req) == CBLK_ERROR)) {
+		errno = ETIME;
+		rc = -1;
+	}
 
- out_err5:
-	cache_done();
- out_err4:
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
-		if (c->done_tid[i] == 0)
-			continue;
-		pthread_cancel(c->done_tid[i]);
-		pthread_join(c->done_tid[i], NULL);
-		c->done_tid[i] = 0;
+	if (cblk_is_read(req)) {
+		if (rc == 0) {
+			if (req->data != req->user_buf)
+				memcpy(req->user_buf, req->data,
+					nblocks * __CBLK_BLOCK_SIZE);
+			cache_overlay(c, lba, req->user_buf, nblocks);
+		}
+		rc = __read_complete(c, req, 1);	/* releases slot */
+		snap_probe3(snapblock, block__read__done, lba,
+			rc ? 0 : nblocks, slot);
+		pp_add_lba(c->id, lba, nblocks, usecs, 1);
+		dev_stat_hist(c, DEV_HIST_READ, nsecs);
+		dev_stat_hist(c, DEV_HIST_CACHE_MISS, nsecs);
+
+		snap_stats_add(c->stats, reads, 1);
+		snap_stats_add(c->stats, read_usec, usecs);
+		if (rc == 0) {
+			dev_stat_add(c, blocks_read, nblocks);
+			snap_stats_add(c->stats, read_bytes,
+				nblocks * __CBLK_BLOCK_SIZE);
+		}
+	} else {
+		if ((rc == 0) && cblk_caching) {
+			for (i = 0; i < nblocks; i++)
+				cache_write(c, lba + i, req->buf +
+					i * __CBLK_BLOCK_SIZE, 0, 0);
+		}
+		put_req(c, req);
+		snap_probe3(snapblock, block__write__done, lba,
+			rc ? 0 : nblocks, slot);
+		pp_add_lba(c->id, lba, nblocks, usecs, 0);
+		dev_stat_hist(c, DEV_HIST_WRITE, nsecs);
+
+		snap_stats_add(c->stats, writes, 1);
+		snap_stats_add(c->stats, write_usec, usecs);
+		if (rc == 0) {
+			dev_stat_add(c, blocks_written, nblocks);
+			snap_stats_add(c->stats, write_bytes,
+				nblocks * __CBLK_BLOCK_SIZE);
+		}
 	}
- out_err3:
-	__free(c->buf);
-	c->buf = NULL;
- out_err2:
-	snap_detach_action(c->act);
-	c->act = NULL;
- out_err1:
-	snap_card_free(c->card);
-	c->card = NULL;
- out_err0:
- 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		c->req[i].status = CBLK_IDLE;
-		sem_destroy(&c->req[i].wait_sem);
+
+	if (status != NULL) {
+		status->blocks_transferred = rc ? 0 : nblocks;
+		status->fail_errno = rc ? errno : 0;
+		__sync_synchronize();	/* status is what the caller polls */
+		status->status = rc ? CBLK_ARW_STATUS_FAIL :
+			CBLK_ARW_STATUS_SUCCESS;
 	}
-	pthread_mutex_unlock(&c->dev_lock);
-	return (chunk_id_t)(-1);
+	return rc ? -1 : (int)nblocks;
 }
 
-int cblk_close(chunk_id_t id __attribute__((unused)),
-		int flags __attribute__((unused)))
+/* Wake up cblk_aresult() and cblk_listio() waiters */
+static void async_wakeup(struct cblk_dev *c)
 {
-	int rc;
-	unsigned int i;
-	struct cblk_dev *c = &chunk;
-	struct timeval etime;
+	pthread_mutex_lock(&c->async_m);
+	pthread_cond_broadcast(&c->async_c);
+	pthread_mutex_unlock(&c->async_m);
+}
 
-	if (c->card == NULL) {
-		errno = EINVAL;
+/**
+ * Called from the completion thread once an asynchronous request is
+ * READY or failed. Requests with a user status are finished right
+ * away, the caller polls the status or waits in cblk_listio(). All
+ * others keep their slot until cblk_aresult() harvests them. The
+ * caller wakes up the waiters with async_wakeup(), the completion
+ * thread does that once per batch.
+ */
+static void __async_complete(struct cblk_dev *c, struct cblk_req *req,
+				int finish)
+{
+	if (finish)
+		__async_finish(c, req);
+}
+
+/*
+ * Get the CPUs of the NUMA node the card is attached to, e.g.
+ * /dev/cxl/afu0.0s is /sys/class/cxl/afu0.0s/device/numa_node.
+ */
+static int card_node_cpus(struct cblk_dev *c, cpu_set_t *set)
+{
+	FILE *fp;
+	int node = -1;
+	unsigned int a, b;
+	char fname[PATH_MAX], sep;
+	const char *name = strrchr(c->path, '/');
+
+	snprintf(fname, sizeof(fname), "/sys/class/cxl/%s/device/numa_node",
+		name ? name + 1 : c->path);
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		return -1;
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+	fclose(fp);
+	if (node < 0)
 		return -1;
-	}
 
-	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
-		if (c->done_tid[i] == 0)
-			continue;
-		rc = pthread_cancel(c->done_tid[i]);
-		if (rc != 0)
-			fprintf(stderr, "  [%s] canceling tid %u rc=%d\n",
-				__func__, (unsigned int)c->done_tid[i], rc);
-		
-		rc = pthread_join(c->done_tid[i], NULL);
-		if (rc != 0)
-			fprintf(stderr, "  [%s] joining tid %u rc=%d\n",
-				__func__, (unsigned int)c->done_tid[i], rc);
+	/* cpulist looks like "0-7,16-23" */
+	snprintf(fname, sizeof(fname),
+		"/sys/devices/system/node/node%d/cpulist", node);
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		return -1;
 
-		c->done_tid[i] = 0;
+	CPU_ZERO(set);
+	while (fscanf(fp, "%u", &a) == 1) {
+		b = a;
+		sep = fgetc(fp);
+		if ((sep == '-') && (fscanf(fp, "%u", &b) == 1))
+			sep = fgetc(fp);
+		for (; (a <= b) && (a < CPU_SETSIZE); a++)
+			CPU_SET(a, set);
+		if (sep != ',')
+			break;
 	}
+	fclose(fp);
+	return CPU_COUNT(set) ? 0 : -1;
+}
 
-	gettimeofday(&etime, NULL);
-	block_trace("[%s] id=%d req_status=%s work_in_flight=%d "
-		"now: %lu sec %lu usec ...\n",
-		__func__, (int)id, cblk_status_str[c->req_status],
-		work_in_flight(c),
-		(long)etime.tv_sec, (long)etime.tv_usec);
-
-	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
-		/* c->req[i].status = CBLK_IDLE; */
-		sem_destroy(&c->req[i].wait_sem);
+/**
+ * Pin completion thread n of a device. CBLK_COMPLETION_CPUS gives a
+ * list of CPUs which are used round robin. Otherwise the thread may
+ * run on all CPUs of the NUMA node the card is attached to.
+ */
+static int pin_completion_thread(struct cblk_dev *c, unsigned int n)
+{
+	cpu_set_t set;
+	unsigned int k, ncpus = 0;
+	int cpus[CPU_SETSIZE];
+	const char *p = cblk_completion_cpus;
+
+	if (p != NULL) {
+		while ((*p != 0) && (ncpus < ARRAY_SIZE(cpus))) {
+			cpus[ncpus++] = strtol(p, (char **)&p, 0);
+			if (*p == ',')
+				p++;
+			else
+				break;
+		}
 	}
+	if (ncpus) {
+		k = (c->id * c->done_threads + n) % ncpus;
+		CPU_ZERO(&set);
+		CPU_SET(cpus[k], &set);
+	} else if (card_node_cpus(c, &set) != 0)
+		return 0;	/* nothing known, let the scheduler do it */
+
+	return pthread_setaffinity_np(c->done_tid[n], sizeof(set), &set);
+}
 
-        pthread_cond_destroy(&c->idle_c);
-	snap_detach_action(c->act);
-	snap_card_free(c->card);
-	__free(c->buf);
+/*
+ * Complete one request found by completion_status(). Returns 1 for
+ * asynchronous requests, their waiters are woken up once the batch
+ * is drained. Blocking waiters are woken up right away, they should
+ * not wait for the rest of the batch.
+ */
+static int __complete_slot(struct cblk_dev *c, int slot)
+{
+	struct cblk_req *req = &c->req[slot];
+	/*
+	 * Async requests can be harvested as soon as they are READY,
+	 * look at them before.
+	 */
+	int async = req->is_async;
+	int finish = (req->user_status != NULL);
 
-	c->act = NULL;
-	c->card = NULL;
-	c->nblocks = 0;
-	c->timeout = 0;
-	c->drive = -1;
+	if (cblk_finish_status(req, CBLK_READY) == CBLK_IDLE) {
+		if ((cblk_get_status(req) == CBLK_ERROR) &&
+		    (c->status == CBLK_READY)) {
+			req_park(c, req, REQ_PARKED_DONE);	/* late */
+			return 0;
+		}
+		block_trace("  [%s] err: slot %d status is %s "
+			"ILLEGAL STATUS LBA=%ld\n", __func__,
+			slot, cblk_status_str[cblk_get_status(req)], req->lba);
+		return 0;
+	}
 
-	cache_done();
-	pp_done();
+	block_trace("  [%s] waking up slot %d LBA=%ld\n",
+		__func__, slot, req->lba);
+
+	if (req->use_wait_sem) {
+		sem_post(&req->wait_sem);
+	} else if (async) {
+		__async_complete(c, req, finish);
+		return 1;
+	} else if (req->ra != NULL) {
+		ra_complete(c, req);
+	} else {
+		__read_complete(c, req, 0);
+	}
 	return 0;
 }
 
-int cblk_get_lun_size(chunk_id_t id __attribute__((unused)),
-		      size_t *size, int flags __attribute__((unused)))
-{
-	struct cblk_dev *c = &chunk;
+struct completion_poll {
+	unsigned long no_result_counter;
+	unsigned int empty_polls;	/* polls without completion */
+};
 
-	block_trace("[%s] lun_size=%zu block of %d bytes ...\n",
-		__func__, c->nblocks, __CBLK_BLOCK_SIZE);
-	if (size)
-		*size = c->nblocks;
+/**
+ * This thread contains performane critical code which is supposed
+ * to identify request/slot completion and inform  the waiting threads
+ * as quick as possible. Rescheduling or any other delay will have
+ * direct influence on performance.
+ *
+ * Each ACTION_STATUS read returns one completion. We drain all of
+ * them and wake up the asynchronous waiters once per batch. If
+ * nothing completed, we spin CONFIG_POLL_SPINS times and then sleep
+ * with exponential backoff up to CONFIG_POLL_SLEEP_MAX_USEC. Without
+ * work in flight we sleep on idle_c. Several threads per device can
+ * drain the status in parallel.
+ */
+static void completion_poll(struct cblk_dev *c, struct completion_poll *p)
+{
+	int slot, n = 0, nasync = 0;
+	unsigned int i, nexp;
+	struct timespec now;
+	struct timespec timeout;
+	struct cblk_req *expired[CBLK_IDX_MAX];
+
+	pthread_mutex_lock(&c->idle_m);
+	while (c->work_in_flight == 0) {
+		/* 5 sec delay should be noticable ... */
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 5;
+
+		/* int rc =  */
+		pthread_cond_timedwait(&c->idle_c, &c->idle_m, &timeout);
+		/* if (rc == ETIMEDOUT)
+			fprintf(stderr, "[%s] info: timedwait returned ETIMEDOUT\n",
+				__func__); */
+
+		c->idle_wakeups++;
+		p->empty_polls = 0;
+	}
+	pthread_mutex_unlock(&c->idle_m);
+
+	/* Drain, at most one slot table full per round */
+	while (n < CBLK_IDX_MAX) {
+		slot = completion_status(c, c->timeout);
+		if ((slot < 0) || (slot >= CBLK_IDX_MAX))
+			break;
+		nasync += __complete_slot(c, slot);
+		n++;
+	}
+	if (nasync)
+		async_wakeup(c);
+
+	if (n) {
+		p->empty_polls = 0;
+	} else {
+		p->no_result_counter++;
+		if (++p->empty_polls > CONFIG_POLL_SPINS) {
+			unsigned int shift = MIN(p->empty_polls -
+					CONFIG_POLL_SPINS, 6u);
+
+			usleep(MIN(1u << shift, CONFIG_POLL_SLEEP_MAX_USEC));
+		}
+	}
+
+	time_now(&now);
+	nexp = timer_advance(c, &now, expired);
+	for (i = 0; i < nexp; i++)
+		req_timeout(c, expired[i]);
+}
+
+static void *completion_thread(void *arg)
+{
+	struct cblk_dev *c = (struct cblk_dev *)arg;
+	struct completion_poll poll;
+
+	block_trace("[%s] arg=%p enter\n", __func__, arg);
+	memset(&poll, 0, sizeof(poll));
+	pthread_cleanup_push(completion_thread_cleanup, c);
+
+	while (1) {
+		completion_poll(c, &poll);
+		pthread_testcancel();	/* go home if requested */
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/*
+ * Cache working set. With CBLK_CACHE_SAVE=<dir>, cblk_close() writes
+ * the LBAs the device has in the cache to <dir>/snapblock.<dev>.lbas,
+ * the blocks hit most first. The data is not saved, it might be stale
+ * by the next start. cblk_open() reads the list back and a thread
+ * prefetches the blocks as background requests, such that the
+ * application's requests go first.
+ */
+struct warm_way {
+	off_t lba;
+	unsigned int hot;
+	unsigned int used;
+};
+
+static int warm_way_cmp(const void *a, const void *b)
+{
+	const struct warm_way *x = a, *y = b;
+
+	if (x->hot != y->hot)
+		return (x->hot < y->hot) - (x->hot > y->hot);
+	return (x->used < y->used) - (x->used > y->used);
+}
+
+static int off_cmp(const void *a, const void *b)
+{
+	const off_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void cache_save_name(struct cblk_dev *c, char *fname, size_t size)
+{
+	const char *dev = strrchr(c->path, '/');
+
+	snprintf(fname, size, "%s/snapblock.%s.lbas", cblk_cache_save,
+		dev ? dev + 1 : c->path);
+}
+
+static void cache_save(struct cblk_dev *c)
+{
+	FILE *fp;
+	size_t i, j, n = 0;
+	struct warm_way *ways;
+	char fname[PATH_MAX], tmp[PATH_MAX + 8];
+
+	if ((cblk_cache_save == NULL) || (cache_sets == 0))
+		return;
+
+	ways = malloc((size_t)cache_sets * cache_ways * sizeof(*ways));
+	if (ways == NULL)
+		return;
+
+	for (i = 0; i < cache_sets; i++) {
+		struct cache_entry *entry = &cache_entries[i];
+
+		pthread_mutex_lock(&entry->way_lock);
+		for (j = 0; j < cache_ways; j++) {
+			struct cache_way *w = &entry->way[j];
+
+			if ((w->status != CACHE_BLOCK_VALID) ||
+			    ((w->lba >> CACHE_DEV_SHIFT) != c->id) ||
+			    (w->prefetched && (w->used == 0)))
+				continue;
+			ways[n].lba = w->lba & ((1ull << CACHE_DEV_SHIFT) - 1);
+			ways[n].hot = w->hot;
+			ways[n].used = w->used;
+			n++;
+		}
+		pthread_mutex_unlock(&entry->way_lock);
+	}
+	qsort(ways, n, sizeof(*ways), warm_way_cmp);
+
+	/* Replace the old list only once the new one is complete */
+	cache_save_name(c, fname, sizeof(fname));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "[%s] warn: cannot write %s: %s\n",
+			__func__, tmp, strerror(errno));
+		free(ways);
+		return;
+	}
+	fprintf(fp, "snapblock-cache 1 %zu\n", c->nblocks);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%lld\n", (long long)ways[i].lba);
+	if ((fclose(fp) != 0) || (rename(tmp, fname) != 0)) {
+		fprintf(stderr, "[%s] warn: cannot write %s: %s\n",
+			__func__, fname, strerror(errno));
+		unlink(tmp);
+	} else
+		block_trace("[%s] %zu LBAs of %s saved to %s\n",
+			__func__, n, c->path, fname);
+	free(ways);
+}
+
+/* Read the saved LBAs, at most as many as the cache holds */
+static size_t cache_load(struct cblk_dev *c, off_t **lbas)
+{
+	FILE *fp;
+	size_t n = 0, max = (size_t)cache_sets * cache_ways, nblocks;
+	long long lba;
+	char fname[PATH_MAX];
+
+	*lbas = NULL;
+	cache_save_name(c, fname, sizeof(fname));
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		return 0;
+
+	/* A list of another drive is of no use */
+	if ((fscanf(fp, "snapblock-cache 1 %zu", &nblocks) != 1) ||
+	    (nblocks != c->nblocks) ||
+	    ((*lbas = malloc(max * sizeof(**lbas))) == NULL)) {
+		fclose(fp);
+		return 0;
+	}
+	while ((n < max) && (fscanf(fp, "%lld", &lba) == 1))
+		if ((lba >= 0) && (lba < (long long)c->nblocks))
+			(*lbas)[n++] = lba;
+	fclose(fp);
+	return n;
+}
+
+/*
+ * Prefetch the saved LBAs, the hottest batch first. Within a batch
+ * they are sorted, adjacent blocks are read with one request.
+ */
+static inline int cache_warm_done(struct cblk_dev *c)
+{
+	return __atomic_load_n(&c->warm_stop, __ATOMIC_RELAXED) ||
+		(c->status != CBLK_READY);
+}
+
+static void *cache_warm(void *arg)
+{
+	struct cblk_dev *c = arg;
+	int rc = 0;
+	size_t i, k, n, m;
+
+	for (i = 0; i < c->warm_n; i += m) {
+		m = MIN(c->warm_n - i, (size_t)CONFIG_WARM_BATCH);
+		qsort(c->warm_lbas + i, m, sizeof(off_t), off_cmp);
+
+		for (k = i; k < i + m; k += n) {
+			off_t lba = c->warm_lbas[k];
+
+			for (n = 1; (n < CBLK_NBLOCKS_MAX) && (k + n < i + m) &&
+				     (c->warm_lbas[k + n] == lba + (off_t)n); n++)
+				;
+			while (!cache_warm_done(c)) {
+				rc = __prefetch_read_start(c, lba, n);
+				if ((rc != -2) || (cache_info(c, lba) !=
+						   CACHE_BLOCK_UNUSED))
+					break;
+				usleep(CONFIG_WARM_SLEEP_USEC);	/* no slot */
+			}
+			if (cache_warm_done(c))
+				goto out;
+			if (rc == 0)
+				dev_stat_add(c, warm_blocks, n);
+		}
+	}
+ out:
+	block_trace("[%s] %s: %zu of %zu saved LBAs prefetched\n",
+		__func__, c->path, i, c->warm_n);
+	return NULL;
+}
+
+static void cache_warm_start(struct cblk_dev *c)
+{
+	c->warm_stop = 0;
+	c->warm_n = 0;
+	if ((cblk_cache_save == NULL) || !cblk_caching)
+		return;
+
+	c->warm_n = cache_load(c, &c->warm_lbas);
+	if (c->warm_n == 0)
+		goto out;
+	if (pthread_create(&c->warm_tid, NULL, &cache_warm, c) == 0)
+		return;
+	fprintf(stderr, "[%s] warn: cannot start cache warm-up\n", __func__);
+ out:
+	free(c->warm_lbas);
+	c->warm_lbas = NULL;
+	c->warm_n = 0;
+}
+
+static void cache_warm_stop(struct cblk_dev *c)
+{
+	if (c->warm_n == 0)
+		return;
+	__atomic_store_n(&c->warm_stop, 1, __ATOMIC_RELAXED);
+	pthread_join(c->warm_tid, NULL);
+	free(c->warm_lbas);
+	c->warm_lbas = NULL;
+	c->warm_n = 0;
+}
+
+/* The prefetch strategy is shared, update all devices */
+static int put_offslist(void *put_data __attribute__((unused)),
+			int *offslist, unsigned int n,
+			size_t nblocks __attribute__((unused)))
+{
+	unsigned int i;
+
+	if (offslist == NULL) {
+		block_trace("[%s] warn: no offset list provided!\n", __func__);
+		return -1;
+	}
+
+	for (i = 0; i < CBLK_DEVS_MAX; i++) {
+		struct cblk_dev *c = &chunks[i];
+
+		if (!cblk_dev_used(c))
+			continue;
+		pthread_mutex_lock(&c->dev_lock);
+		memcpy(c->prefetch_offs, offslist, n * sizeof(int));
+		pthread_mutex_unlock(&c->dev_lock);
+	}
+	return 0;
+}
+
+chunk_id_t cblk_open(const char *path,
+		int max_num_requests __attribute__((unused)),
+		int mode, uint64_t ext_arg,
+		int flags)
+{
+	int rc;
+	unsigned int i, j;
+	int timeout = ACTION_WAIT_TIME;
+	unsigned long have_nvme = 0;
+	snap_action_flag_t attach_flags = 0;
+	struct cblk_dev *c;
+
+	block_trace("[%s] opening (%s)\n", __func__, path);
+
+#ifdef CONFIG_WAIT_FOR_IRQ
+	attach_flags |= (SNAP_ACTION_DONE_IRQ | SNAP_ATTACH_IRQ);
+#endif
+	if (flags & CBLK_OPN_VIRT_LUN) {
+		fprintf(stderr, "err: Virtual luns not supported in capi stub\n");
+		errno = EINVAL;
+		return (chunk_id_t)(-1);
+	}
+
+	if (mode != O_RDWR) {
+		fprintf(stderr, "err: Only O_RDWR file mode is supported in capi stub\n");
+		errno = EINVAL;
+		return (chunk_id_t)(-1);
+	}
+
+	pthread_mutex_lock(&cblk_devs_lock);
+
+	for (i = 0; i < CBLK_DEVS_MAX; i++) {
+		c = &chunks[i];
+		if (cblk_dev_used(c) && (strcmp(c->path, path) == 0)) {
+			/* already initialized */
+			c->opens++;
+			pthread_mutex_unlock(&cblk_devs_lock);
+			return c->id;
+		}
+	}
+	for (i = 0; i < CBLK_DEVS_MAX; i++)
+		if (!cblk_dev_used(&chunks[i]))
+			break;
+	if (i == CBLK_DEVS_MAX) {
+		fprintf(stderr, "err: Cannot open more than %d devices\n",
+			CBLK_DEVS_MAX);
+		pthread_mutex_unlock(&cblk_devs_lock);
+		errno = ENOSPC;
+		return (chunk_id_t)(-1);
+	}
+
+	c = &chunks[i];
+	c->id = i;
+	strncpy(c->path, path, sizeof(c->path) - 1);
+	c->path[sizeof(c->path) - 1] = 0;
+	pthread_mutex_lock(&c->dev_lock);
+
+	if ((flags & CBLK_OPN_SOFTWARE) || (cblk_software != NULL)) {
+		if (sw_open(c, (flags & CBLK_OPN_SOFTWARE) ? path :
+			    cblk_software) != 0)
+			goto out_err0;
+		goto have_dev;
+	}
+
+	/* path must match the following scheme: "/dev/cxl/afu%d.0m" */
+	c->card = snap_card_alloc_dev(path, SNAP_VENDOR_ID_IBM,
+					 SNAP_DEVICE_ID_SNAP);
+	if (NULL == c->card) {
+		fprintf(stderr, "err: Cannot open SNAP device %s\n", path);
+		goto out_err0;
+	}
+
+	/* Check if i do have NVME on this card */
+	snap_card_ioctl(c->card, GET_NVME_ENABLED, (unsigned long)&have_nvme);
+	if (0 == have_nvme) {
+		fprintf(stderr, "err: SNAP NVMe is not enabled on card %s!\n",
+			path);
+		goto out_err1;
+	}
+
+	c->act = snap_attach_action(c->card, ACTION_TYPE_NVME_EXAMPLE,
+					attach_flags, timeout);
+	if (NULL == c->act) {
+		fprintf(stderr, "err: Cannot Attach Action: %x\n",
+			ACTION_TYPE_NVME_EXAMPLE);
+		goto out_err1;
+	}
+	c->nblocks = SNAP_N250S_NVME_SIZE / __CBLK_BLOCK_SIZE;
+
+ have_dev:
+
+	c->buf = snap_malloc(CBLK_IDX_MAX * __CBLK_BLOCK_SIZE * CBLK_NBLOCKS_MAX);
+	if (c->buf == NULL) {
+		fprintf(stderr, "err: Cannot alloc temporary buffer\n");
+		goto out_err2;
+	}
+
+	c->pcpu = dev_stats_alloc();
+	if (c->pcpu == NULL) {
+		fprintf(stderr, "err: Cannot alloc statistics\n");
+		goto out_err3;
+	}
+
+	c->status = CBLK_READY;
+	c->req_status = CBLK_IDLE;
+	c->drive = 0;
+	c->timeout = timeout;
+	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++)
+		c->done_tid[i] = 0;
+	c->idx = 0;
+	c->free_slots = (1u << CBLK_IDX_MAX) - 1;
+	c->status_read_count = 0;
+	c->max_read_usecs = 0;
+	c->max_write_usecs = 0;
+	c->min_read_usecs = 0;
+	c->min_write_usecs = 0;
+	c->idle_wakeups = 0;
+	memset(c->inflight, 0, sizeof(c->inflight));
+	memset(c->inflight_max, 0, sizeof(c->inflight_max));
+	c->writeback = cblk_caching &&
+		(cblk_writeback || (flags & CBLK_OPN_WRITEBACK));
+	c->dirty = 0;
+
+	/* Publish counters for snap_top, libsnap owns the segment */
+	c->stats = NULL;
+	if (snap_stats_get() != NULL) {
+		c->stats = &snap_stats_get()->blk;	/* sum of all devices */
+		if (cblk_ndevs == 0)
+			memset(c->stats, 0, sizeof(*c->stats));
+		stats_paths(c->stats);
+	}
+
+	time_now(&c->start_time);
+
+	c->slots_free = sched_slots();
+	sem_init(&c->write_sem, 0, 1);
+	memset(c->slot_waiters, 0, sizeof(c->slot_waiters));
+	memset(c->wheel, 0, sizeof(c->wheel));
+	c->wheel_tick = 0;
+	pthread_mutex_init(&c->idle_m, NULL);
+	pthread_cond_init(&c->idle_c, NULL);
+	pthread_mutex_init(&c->async_m, NULL);
+	pthread_cond_init(&c->async_c, NULL);
+	c->async_in_flight = 0;
+
+	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		struct cblk_req *req = &c->req[i];
+
+		req->slot = i;
+		req->lba = 0;
+		req->nblocks = 0;
+		req->buf = c->buf + i * CBLK_NBLOCKS_MAX * __CBLK_BLOCK_SIZE;
+		req->data = req->buf;
+		req->action = 0;
+		req->dst = 0;
+		req->src = 0;
+		req->size = 0;
+		req->tries = 0;
+		req->err_total = 0;
+		req->act = DEV_ACT_MAX;
+		req->is_async = 0;
+		req->tag = 0;
+		req->user_tag = 0;
+		req->user_buf = NULL;
+		req->user_status = NULL;
+		req->timeout_usec = req_timeout_usec(CBLK_PRIO_NORMAL);
+		req->tw_linked = 0;
+		req->tw_next = NULL;
+		req->tw_prev = NULL;
+		req->parked = 0;
+		cblk_set_status(req, CBLK_IDLE);
+		sem_init(&req->wait_sem, 0, 0);
+
+		for (j = 0; j < ARRAY_SIZE(req->pblock); j++) {
+			req->pblock[j] = NULL;
+		}
+	}
+
+	c->done_threads = cblk_completion_threads;
+	for (i = 0; i < c->done_threads; i++) {
+		rc = pthread_create(&c->done_tid[i], NULL,
+				&completion_thread, c);
+		if (rc != 0) {
+			c->done_tid[i] = 0;
+			goto out_err4;
+		}
+		if (pin_completion_thread(c, i) != 0)
+			fprintf(stderr, "[%s] warn: cannot pin completion "
+				"thread %u\n", __func__, i);
+	}
+
+	if (cblk_ndevs == 0) {
+		rc = cache_init(ext_arg);
+		if (rc != 0)
+			goto out_err4;
+
+		rc = pp_init(cblk_prefetch, put_offslist, cblk_nblocks, NULL);
+		if (rc != 0)
+			goto out_err5;
+	}
+
+	pp_get_offslist(c->prefetch_offs, cblk_prefetch, cblk_nblocks);
+
+	cblk_ndevs++;
+	c->opens = 1;
+	cache_warm_start(c);
+	pthread_mutex_unlock(&c->dev_lock);
+	pthread_mutex_unlock(&cblk_devs_lock);
+	return c->id;
+
+ out_err5:
+	cache_done();
+ out_err4:
+	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
+		if (c->done_tid[i] == 0)
+			continue;
+		pthread_cancel(c->done_tid[i]);
+		pthread_join(c->done_tid[i], NULL);
+		c->done_tid[i] = 0;
+	}
+ out_err3:
+	__free(c->pcpu);
+	c->pcpu = NULL;
+	__free(c->buf);
+	c->buf = NULL;
+ out_err2:
+	if (c->act != NULL)
+		snap_detach_action(c->act);
+	c->act = NULL;
+ out_err1:
+	if (c->card != NULL)
+		snap_card_free(c->card);
+	c->card = NULL;
+	sw_close(c);
+ out_err0:
+ 	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		c->req[i].status = CBLK_IDLE;
+		sem_destroy(&c->req[i].wait_sem);
+	}
+	sem_destroy(&c->write_sem);
+	c->path[0] = 0;
+	pthread_mutex_unlock(&c->dev_lock);
+	pthread_mutex_unlock(&cblk_devs_lock);
+	return (chunk_id_t)(-1);
+}
+
+int cblk_close(chunk_id_t id, int flags __attribute__((unused)))
+{
+	int rc;
+	unsigned int i;
+	struct cblk_dev *c;
+	struct timespec etime;
+
+	pthread_mutex_lock(&cblk_devs_lock);
+	c = cblk_dev_get(id);
+	if (c == NULL) {
+		pthread_mutex_unlock(&cblk_devs_lock);
+		return -1;
+	}
+	if (--c->opens > 0) {	/* still open elsewhere, e.g. in a group */
+		pthread_mutex_unlock(&cblk_devs_lock);
+		return 0;
+	}
+
+	/* Needs the completion threads */
+	cache_warm_stop(c);
+	ra_done(c);
+	if (c->writeback && (cache_flush(c, 1) != 0))
+		fprintf(stderr, "[%s] err: flushing %s failed, %ld dirty "
+			"blocks lost: %s\n", __func__, c->path, c->dirty,
+			strerror(errno));
+	cache_save(c);
+
+	for (i = 0; i < ARRAY_SIZE(c->done_tid); i++) {
+		if (c->done_tid[i] == 0)
+			continue;
+		rc = pthread_cancel(c->done_tid[i]);
+		if (rc != 0)
+			fprintf(stderr, "  [%s] canceling tid %u rc=%d\n",
+				__func__, (unsigned int)c->done_tid[i], rc);
+		
+		rc = pthread_join(c->done_tid[i], NULL);
+		if (rc != 0)
+			fprintf(stderr, "  [%s] joining tid %u rc=%d\n",
+				__func__, (unsigned int)c->done_tid[i], rc);
+
+		c->done_tid[i] = 0;
+	}
+
+	time_now(&etime);
+	block_trace("[%s] id=%d req_status=%s work_in_flight=%d "
+		"now: %lu sec %lu usec ...\n",
+		__func__, (int)id, cblk_status_str[c->req_status],
+		work_in_flight(c),
+		(long)etime.tv_sec, (long)etime.tv_nsec / 1000);
+
+	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		/* c->req[i].status = CBLK_IDLE; */
+		sem_destroy(&c->req[i].wait_sem);
+	}
+	sem_destroy(&c->write_sem);
+
+        pthread_cond_destroy(&c->idle_c);
+	pthread_cond_destroy(&c->async_c);
+	if (c->sw != NULL)
+		sw_close(c);
+	else {
+		snap_detach_action(c->act);
+		snap_card_free(c->card);
+	}
+	__free(c->buf);
+
+	c->act = NULL;
+	c->card = NULL;
+	c->nblocks = 0;
+	c->timeout = 0;
+	c->drive = -1;
+	c->path[0] = 0;
+
+	cache_invalidate(c);
+	__free(c->pcpu);
+	c->pcpu = NULL;
+	if (c->stats != NULL)
+		stats_paths(c->stats);
+	if (--cblk_ndevs == 0) {
+		cache_done();
+		pp_done();
+	}
+	pthread_mutex_unlock(&cblk_devs_lock);
+	return 0;
+}
+
+int cblk_get_lun_size(chunk_id_t id, size_t *size,
+		      int flags __attribute__((unused)))
+{
+	struct cblk_dev *c = cblk_dev_get(id);
+
+	if (c == NULL)
+		return -1;
+
+	block_trace("[%s] lun_size=%zu block of %d bytes ...\n",
+		__func__, c->nblocks, __CBLK_BLOCK_SIZE);
+	if (size)
+		*size = c->nblocks;
+	return 0;
+}
+
+int cblk_get_size(chunk_id_t id, size_t *size, int flags)
+{
+	cblk_get_lun_size(id, size, flags);
+	return 0;
+}
+
+int cblk_set_size(chunk_id_t id __attribute__((unused)),
+		  size_t size __attribute__((unused)),
+		  int flags __attribute__((unused)))
+{
+	fprintf(stderr, "err: Cannot change size of physical luns\n");
+	return -1;
+}
+
+/*
+ * Fill stats from the per CPU counters of one or more devices. Counters
+ * which have no meaning here (FC ports, CAPI events, contexts) stay 0.
+ * With CBLK_STATS_SNAP stats must point to a chunk_snap_stats_t, which
+ * adds prefetch and write-back counters and the latency histograms.
+ */
+static void dev_get_stats(struct cblk_dev *devs[], unsigned int ndevs,
+			chunk_stats_t *stats, int flags)
+{
+	unsigned int i, a;
+	struct dev_pcpu_stats sum;
+	struct dev_counters *n = &sum.cnt;
+	unsigned int inflight[DEV_ACT_MAX], inflight_max[DEV_ACT_MAX];
+	uint64_t threads = 0, dirty = 0;
+	chunk_snap_stats_t *snap = (chunk_snap_stats_t *)stats;
+
+	memset(&sum, 0, sizeof(sum));
+	memset(inflight, 0, sizeof(inflight));
+	memset(inflight_max, 0, sizeof(inflight_max));
+	for (i = 0; i < ndevs; i++) {
+		struct cblk_dev *c = devs[i];
+
+		dev_stats_sum(c, &sum);
+		for (a = 0; a < DEV_ACT_MAX; a++) {
+			inflight[a] += __atomic_load_n(&c->inflight[a],
+						__ATOMIC_RELAXED);
+			inflight_max[a] += __atomic_load_n(&c->inflight_max[a],
+						__ATOMIC_RELAXED);
+		}
+		threads += c->done_threads;
+		dirty += __atomic_load_n(&c->dirty, __ATOMIC_RELAXED);
+	}
+
+	memset(stats, 0, (flags & CBLK_STATS_SNAP) ? sizeof(*snap) :
+		sizeof(*stats));
+	stats->block_size = __CBLK_BLOCK_SIZE;
+	stats->num_paths = 1;
+	stats->max_transfer_size = CBLK_NBLOCKS_MAX;
+	stats->num_reads = n->block_reads - n->areads;
+	stats->num_writes = n->block_writes - n->awrites;
+	stats->num_areads = n->areads;
+	stats->num_awrites = n->awrites;
+	stats->num_act_reads = inflight[DEV_ACT_READ];
+	stats->num_act_writes = inflight[DEV_ACT_WRITE];
+	stats->num_act_areads = inflight[DEV_ACT_AREAD];
+	stats->num_act_awrites = inflight[DEV_ACT_AWRITE];
+	stats->max_num_act_reads = inflight_max[DEV_ACT_READ];
+	stats->max_num_act_writes = inflight_max[DEV_ACT_WRITE];
+	stats->max_num_act_areads = inflight_max[DEV_ACT_AREAD];
+	stats->max_num_act_awrites = inflight_max[DEV_ACT_AWRITE];
+	stats->num_blocks_read = n->blocks_read;
+	stats->num_blocks_written = n->blocks_written;
+	stats->num_errors = n->errors;
+	stats->num_aresult_no_cmplt = n->aresult_no_cmplt;
+	stats->num_retries = n->retries;
+	stats->num_timeouts = n->timeouts;
+	stats->num_fail_timeouts = n->fail_timeouts;
+	stats->num_no_cmds_free = n->no_cmds_free;
+	stats->num_no_cmds_free_fail = n->no_cmds_free_fail;
+	stats->num_success_threads = threads;	/* completion threads */
+	stats->num_active_threads = threads;
+	stats->max_num_act_threads = threads;
+	stats->num_cache_hits = n->cache_hits;
+
+	if (!(flags & CBLK_STATS_SNAP))
+		return;
+
+	snap->num_prefetches = n->prefetches;
+	snap->num_prefetch_collisions = n->prefetch_collisions;
+	snap->num_hw_reads = n->hw_block_reads;
+	snap->num_hw_writes = n->hw_block_writes;
+	snap->num_dirty_blocks = dirty;
+	snap->num_flushes = n->wb_flushes;
+	snap->num_flush_blocks = n->wb_flush_blocks;
+	snap->read = sum.hist[DEV_HIST_READ];
+	snap->write = sum.hist[DEV_HIST_WRITE];
+	snap->cache_hit = sum.hist[DEV_HIST_CACHE_HIT];
+	snap->cache_miss = sum.hist[DEV_HIST_CACHE_MISS];
+}
+
+int cblk_get_stats(chunk_id_t id, chunk_stats_t *stats, int flags)
+{
+	struct cblk_dev *c = cblk_dev_get(id);
+
+	if (c == NULL)
+		return -1;
+	if (stats == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	dev_get_stats(&c, 1, stats, flags);
 	return 0;
 }
 
-int cblk_get_size(chunk_id_t id, size_t *size, int flags)
+/*
+ * Reads larger than CBLK_NBLOCKS_MAX are split into slot sized
+ * segments which are all in flight together, using up to
+ * CBLK_READ_DEPTH slots. Like block_write() we do not block for
+ * more slots while owning some, but complete the oldest segment.
+ */
+static int block_read(struct cblk_dev *c, void *buf, off_t lba,
+		size_t nblocks, enum cblk_prio prio)
+{
+	int rc = 0;
+	size_t n, issued = 0;
+	unsigned int head = 0, inflight = 0;
+	struct cblk_req *req, *reqs[CBLK_IDX_MAX];
+
+	block_trace("[%s] reading (%p LBA=%zu nblocks=%zu) ...\n",
+		__func__, buf, lba, nblocks);
+
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		errno = EBADFD;
+		return -1;
+	}
+	if ((lba < 0) || (lba + nblocks > c->nblocks)) { /* no valid LBA */
+		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
+			__func__, lba, c->nblocks);
+		errno = EFAULT;
+		return 0;
+	}
+
+	while ((inflight > 0) || ((rc == 0) && (issued < nblocks))) {
+		if ((rc == 0) && (issued < nblocks) &&
+		    (inflight < CBLK_READ_DEPTH)) {
+			n = MIN(nblocks - issued, (size_t)CBLK_NBLOCKS_MAX);
+			req = get_req(c, 1, lba + issued, n, 0, inflight > 0,
+				prio);
+			if (req != NULL) {
+				cache_reserve_req(c, req, 0);
+				req->data = req_read_dst(c, req, buf +
+						issued * __CBLK_BLOCK_SIZE);
+				req_setup(req, ACTION_CONFIG_COPY_NH, /* NVMe to Host DDR */
+					(uint64_t)req->data,		/* dst */
+					(lba + issued) * __CBLK_BLOCK_SIZE/NVME_LB_SIZE, /* src */
+					n * __CBLK_BLOCK_SIZE);		/* size */
+				snap_probe3(snapblock, block__read__start,
+					lba + issued, n, req->slot);
+				req_start(req, c);
+
+				/* Prefetch slots hold at most CBLK_NBLOCKS_MAX */
+				if (n == nblocks)
+					__prefetch_blocks(c, lba, nblocks);
+
+				reqs[(head + inflight) % CBLK_IDX_MAX] = req;
+				inflight++;
+				issued += n;
+				continue;
+			}
+			if ((inflight == 0) || (errno != EAGAIN))
+				rc = -1;	/* no slot, do not issue more */
+			if (inflight == 0)
+				break;
+		}
+
+		/* Complete the oldest segment */
+		req = reqs[head];
+		head = (head + 1) % CBLK_IDX_MAX;
+		inflight--;
+
+		while (cblk_get_status(req) == CBLK_READING) {
+			/* block_trace("  [%s] sleeping slot %d status: %s\n",
+				__func__, req->slot, cblk_status_str[req->status]); */
+			sem_wait(&req->wait_sem);
+			/* block_trace("  [%s] continuing slot %d\n",
+				__func__, req->slot); */
+		}
+
+		if ((c->status == CBLK_ERROR) || (cblk_get_status(req) == CBLK_ERROR)) {
+			errno = ETIME;
+			if (rc == 0)
+				rc = 1;		/* report 0 blocks */
+		} else {
+			uint8_t *dst = buf + (req->lba - lba) * __CBLK_BLOCK_SIZE;
+
+			if (req->data != dst)
+				memcpy(dst, req->data,
+					req->nblocks * __CBLK_BLOCK_SIZE);
+			cache_overlay(c, req->lba, dst, req->nblocks);
+		}
+
+		snap_probe3(snapblock, block__read__done, req->lba,
+			rc ? 0 : req->nblocks, req->slot);
+		__read_complete(c, req, 1);	/* mark as used one time */
+	}
+
+	if (rc != 0)
+		return (rc < 0) ? -1 : 0;
+	return nblocks;
+}
+
+/*
+ * Consider using pthread_cond_wait() and pthread_cond_broadcast()
+ * once the data is ready to be absorbed.
+ */
+static int __cache_try_read(struct cblk_dev *c,
+			off_t lba, void *buf, size_t nblocks,
+			unsigned int timeout_usec)
+{
+	int rc;
+	unsigned long usecs = 0;
+	struct timespec s, e;
+	size_t i;
+	size_t from_cache = 0;
+	int prefetch_requested = 0;
+
+	/* Trying to get data from CACHE if we got all blocks ... */
+	for (i = 0; i < nblocks; i++) {
+		time_now(&s);
+		while (usecs < timeout_usec) {
+			rc = cache_read(c, lba + i, buf + i * __CBLK_BLOCK_SIZE);
+			if (rc == 1) {		/* READING LBA was requested */
+				if (!prefetch_requested) {
+					__prefetch_blocks(c, lba, nblocks);
+					prefetch_requested = 1;
+				}
+				time_now(&e);
+				usecs = timediff_usec(&e, &s);
+				continue;	/* Try again */
+			}
+			if (rc == 0) {		/* Success */
+				block_trace("    [%s] got LBA=%ld after %ld usecs\n",
+					__func__, lba + i, usecs);
+				from_cache++;
+				break;
+			}
+			if (rc < 0)		/* Not in cache, not requested */
+				goto out;
+		}
+		if (usecs >= timeout_usec)
+			dfprintf(stderr, "[%s] LBA=%ld did not arrive "
+				"n time %ld usecs\n", __func__, lba + i, usecs);
+	}
+
+ out:
+	if (!prefetch_requested && (nblocks == from_cache)) {
+		block_trace("    [%s] trigger prefetching for LBA=%ld "
+			"nblocks=%ld from_cache=%ld\n",
+			__func__, lba, nblocks, from_cache);
+		__prefetch_blocks(c, lba, nblocks);
+		prefetch_requested = 1;
+	}
+	return from_cache;
+}
+
+int cblk_read(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int flags)
+{
+	int rc;
+	struct cblk_dev *c = cblk_dev_get(id);
+	struct timespec start_time, end_time;
+	unsigned long usecs = 0;
+	long int nsecs;
+	enum dev_hist hist = DEV_HIST_CACHE_MISS;
+
+	if (c == NULL)
+		return -1;
+
+	time_now(&start_time);
+
+	dev_stat_inc(c, block_reads);
+	if (nblocks == 1)
+		dev_stat_inc(c, block_reads_4k);
+
+	if (cblk_readahead) {
+		rc = ra_read(c, lba, buf, nblocks);
+		if (rc == (int)nblocks) {
+			hist = DEV_HIST_CACHE_HIT;
+			goto out;
+		}
+	}
+
+	if (cblk_caching) {
+		/* Trying to get data from CACHE if we got all blocks ... */
+		rc = __cache_try_read(c, lba, buf, nblocks, CONFIG_REQ_DURATION_USEC);
+
+		/* ... we don't need to ask the NVMe hardware */
+		if (rc == (int)nblocks) {
+			block_trace("    [%s] Got %ld..%ld, nice\n", __func__,
+				lba, lba + nblocks - 1);
+
+			dev_stat_inc(c, cache_hits);
+			if (nblocks == 1)
+				dev_stat_inc(c, cache_hits_4k);
+			snap_stats_add(c->stats, cache_hits, 1);
+			hist = DEV_HIST_CACHE_HIT;
+			goto out;
+		}
+	}
+
+	/* Else read them all for simplicity at this point in time ... */
+	rc = block_read(c, buf, lba, nblocks,
+			flags_prio(flags, CBLK_IO_PRIORITY_REQ));
+out:
+	time_now(&end_time);
+	nsecs = timediff_nsec(&end_time, &start_time);
+	usecs = nsecs / 1000;
+	pp_add_lba(c->id, lba, nblocks, usecs, 1);
+	dev_stat_hist(c, DEV_HIST_READ, nsecs);
+	dev_stat_hist(c, hist, nsecs);
+	if (rc > 0)
+		dev_stat_add(c, blocks_read, rc);
+
+	snap_stats_add(c->stats, reads, 1);
+	snap_stats_add(c->stats, read_usec, usecs);
+	if (rc > 0)
+		snap_stats_add(c->stats, read_bytes, rc * __CBLK_BLOCK_SIZE);
+	return rc;
+}
+
+/*
+ * Writes larger than CBLK_NBLOCKS_WRITE_MAX are split into segments.
+ * Up to cblk_write_depth segments are in flight, such that the
+ * transfer of the next segment overlaps the completion of the
+ * previous one. Once we own a slot, we do not block waiting for more,
+ * but complete the oldest segment first. Otherwise threads holding
+ * slots could wait for each other.
+ */
+static int block_write(struct cblk_dev *c, void *buf, off_t lba,
+		size_t nblocks, enum cblk_prio prio)
+{
+	int err = 0;
+	size_t n, issued = 0;
+	unsigned int head = 0, inflight = 0;
+	struct cblk_req *req, *reqs[CBLK_IDX_MAX];
+
+	block_trace("[%s] writing (%p LBA=%zu nblocks=%zu) ...\n",
+		__func__, buf, lba, nblocks);
+
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		errno = EBADFD;
+		return 0;
+	}
+	if ((lba < 0) || (lba + nblocks > c->nblocks)) { /* no valid LBA */
+		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
+			__func__, lba, c->nblocks);
+		errno = EFAULT;
+		return 0;
+	}
+
+	while ((inflight > 0) || (!err && (issued < nblocks))) {
+		if (!err && (issued < nblocks) &&
+		    (inflight < (unsigned int)cblk_write_depth)) {
+			n = MIN(nblocks - issued, (size_t)CBLK_NBLOCKS_WRITE_MAX);
+			req = get_req(c, 1, lba + issued, n, 1, inflight > 0,
+				prio);
+			if (req != NULL) {
+				memcpy(req->buf, buf + issued * __CBLK_BLOCK_SIZE,
+					n * __CBLK_BLOCK_SIZE);
+				req_setup(req, ACTION_CONFIG_COPY_HN, /* Host DDR to NVMe */
+					(lba + issued) * __CBLK_BLOCK_SIZE/NVME_LB_SIZE, /* dst */
+					(uint64_t)req->buf,		/* src */
+					n * __CBLK_BLOCK_SIZE);		/* size */
+				snap_probe3(snapblock, block__write__start,
+					lba + issued, n, req->slot);
+				req_start(req, c);
+
+				reqs[(head + inflight) % CBLK_IDX_MAX] = req;
+				inflight++;
+				issued += n;
+				continue;
+			}
+			if ((inflight == 0) || (errno != EAGAIN))
+				err = 1;	/* no slot, do not issue more */
+			if (inflight == 0)
+				break;
+		}
+
+		/* Complete the oldest segment */
+		req = reqs[head];
+		head = (head + 1) % CBLK_IDX_MAX;
+		inflight--;
+
+		while (cblk_get_status(req) == CBLK_WRITING) {
+			/* block_trace("  [%s] sleeping slot %d\n",
+				__func__, req->slot); */
+			sem_wait(&req->wait_sem);
+			/* block_trace("  [%s] continuing slot %d\n",
+				__func__, req->slot); */
+		}
+
+		if ((c->status == CBLK_ERROR) || (cblk_get_status(req) == CBLK_ERROR)) {
+			errno = ETIME;
+			err = 1;
+		}
+
+		snap_probe3(snapblock, block__write__done, req->lba,
+			err ? 0 : req->nblocks, req->slot);
+		put_req(c, req);
+	}
+
+	/* block_trace("[%s] exit LBA=%zu nblocks=%zu\n", __func__, lba, nblocks); */
+	return err ? 0 : nblocks;
+}
+
+/*
+ * Write-back. cblk_write() only puts the blocks into the cache and
+ * marks them dirty. cache_flush() collects the dirty blocks of a
+ * device, sorts them by LBA and writes runs of adjacent blocks with
+ * one request each, up to cblk_write_depth requests in flight. A
+ * block written again while its old data is in flight stays dirty,
+ * see wseq. Dirty ways are never evicted. Flushes happen on
+ * cblk_flush(), cblk_close(), when more than CBLK_DIRTY_LIMIT blocks
+ * are dirty and when a set has no way left for a dirty block.
+ */
+struct wb_block {
+	off_t lba;		/* device LBA */
+	struct cache_way *w;
+	unsigned int wseq;	/* version of the data in flight */
+};
+
+static int wb_block_cmp(const void *a, const void *b)
+{
+	const struct wb_block *x = a, *y = b;
+
+	return (x->lba > y->lba) - (x->lba < y->lba);
+}
+
+/* Collect up to max dirty blocks of c, sorted by LBA */
+static size_t cache_dirty_blocks(struct cblk_dev *c, struct wb_block *b,
+				size_t max)
+{
+	unsigned int i, j;
+	size_t n = 0;
+
+	for (i = 0; (i < cache_sets) && (n < max); i++) {
+		struct cache_entry *entry = &cache_entries[i];
+
+		pthread_mutex_lock(&entry->way_lock);
+		for (j = 0; (j < cache_ways) && (n < max); j++) {
+			struct cache_way *w = &entry->way[j];
+
+			if (!w->dirty || ((w->lba >> CACHE_DEV_SHIFT) != c->id))
+				continue;
+			b[n].lba = w->lba & ((1ull << CACHE_DEV_SHIFT) - 1);
+			b[n].w = w;
+			n++;
+		}
+		pthread_mutex_unlock(&entry->way_lock);
+	}
+	qsort(b, n, sizeof(*b), wb_block_cmp);
+	return n;
+}
+
+/*
+ * Copy the current data of a block to be flushed. Fails if the way
+ * was dropped meanwhile, e.g. because a newer version went to a
+ * different way.
+ */
+static int cache_flush_copy(struct cblk_dev *c, struct wb_block *b,
+			void *buf)
+{
+	int rc = -1;
+	struct cache_entry *entry = cache_set(b->lba);
+
+	pthread_mutex_lock(&entry->way_lock);
+	if ((b->w->lba == cache_key(c, b->lba)) &&
+	    (b->w->status == CACHE_BLOCK_VALID)) {
+		memcpy(buf, b->w->buf, __CBLK_BLOCK_SIZE);
+		b->wseq = b->w->wseq;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&entry->way_lock);
+	return rc;
+}
+
+/* The data is on the device, clean unless it was written again */
+static void cache_flush_done(struct cblk_dev *c, struct wb_block *b)
+{
+	struct cache_entry *entry = cache_set(b->lba);
+
+	pthread_mutex_lock(&entry->way_lock);
+	if ((b->w->lba == cache_key(c, b->lba)) && b->w->dirty &&
+	    (b->w->wseq == b->wseq))
+		__way_dirty(b->w, 0);
+	pthread_mutex_unlock(&entry->way_lock);
+}
+
+/*
+ * Write the dirty blocks of c to the device. Without all, nothing
+ * happens unless more than cache_dirty_max blocks are dirty, another
+ * thread might have flushed already, and the writes are background
+ * requests. Returns 0 or -1 with errno set, blocks which could not be
+ * written stay dirty.
+ */
+static int cache_flush(struct cblk_dev *c, int all)
+{
+	int err = 0;
+	size_t i = 0, k, m, n, max;
+	unsigned int head = 0, inflight = 0;
+	struct cblk_req *req, *reqs[CBLK_IDX_MAX];
+	size_t first[CBLK_IDX_MAX];
+	struct wb_block *b;
+	uint8_t data[CBLK_NBLOCKS_WRITE_MAX * __CBLK_BLOCK_SIZE];
+
+	pthread_mutex_lock(&c->flush_lock);
+	max = __atomic_load_n(&c->dirty, __ATOMIC_RELAXED);
+	if ((max == 0) || (!all &&
+	    ((unsigned long)__atomic_load_n(&cache_dirty, __ATOMIC_RELAXED) <=
+	     cache_dirty_max))) {
+		pthread_mutex_unlock(&c->flush_lock);
+		return 0;
+	}
+
+	b = malloc(max * sizeof(*b));
+	if (b == NULL) {
+		pthread_mutex_unlock(&c->flush_lock);
+		return -1;
+	}
+	n = cache_dirty_blocks(c, b, max);
+	block_trace("[%s] flushing %zu dirty blocks of %s\n",
+		__func__, n, c->path);
+	dev_stat_inc(c, wb_flushes);
+
+	while ((inflight > 0) || (!err && (i < n))) {
+		if (!err && (i < n) &&
+		    (inflight < (unsigned int)cblk_write_depth)) {
+			/* Coalesce adjacent blocks, stop at dropped ones */
+			for (k = 1; (k < CBLK_NBLOCKS_WRITE_MAX) &&
+				     (i + k < n) &&
+				     (b[i + k].lba == b[i].lba + (off_t)k); k++)
+				;
+			for (m = 0; (m < k) && (cache_flush_copy(c, &b[i + m],
+					data + m * __CBLK_BLOCK_SIZE) == 0); m++)
+				;
+			if (m == 0) {
+				i++;
+				continue;
+			}
+
+			req = get_req(c, 1, b[i].lba, m, 1, inflight > 0,
+				all ? CBLK_PRIO_NORMAL : CBLK_PRIO_BACKGROUND);
+			if (req != NULL) {
+				memcpy(req->buf, data, m * __CBLK_BLOCK_SIZE);
+				req_setup(req, ACTION_CONFIG_COPY_HN, /* Host DDR to NVMe */
+					b[i].lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE, /* dst */
+					(uint64_t)req->buf,		/* src */
+					m * __CBLK_BLOCK_SIZE);		/* size */
+				snap_probe3(snapblock, block__write__start,
+					b[i].lba, m, req->slot);
+				req_start(req, c);
+
+				first[(head + inflight) % CBLK_IDX_MAX] = i;
+				reqs[(head + inflight) % CBLK_IDX_MAX] = req;
+				inflight++;
+				i += m;
+				continue;
+			}
+			if ((inflight == 0) || (errno != EAGAIN))
+				err = 1;	/* no slot, do not issue more */
+			if (inflight == 0)
+				break;
+		}
+
+		/* Complete the oldest request */
+		req = reqs[head];
+		k = first[head];
+		head = (head + 1) % CBLK_IDX_MAX;
+		inflight--;
+
+		while (cblk_get_status(req) == CBLK_WRITING)
+			sem_wait(&req->wait_sem);
+
+		if ((c->status == CBLK_ERROR) ||
+		    (cblk_get_status(req) == CBLK_ERROR)) {
+			errno = ETIME;
+			err = 1;
+		} else {
+			for (m = 0; m < req->nblocks; m++)
+				cache_flush_done(c, &b[k + m]);
+			dev_stat_inc(c, wb_flush_writes);
+			dev_stat_add(c, wb_flush_blocks, req->nblocks);
+		}
+
+		snap_probe3(snapblock, block__write__done, req->lba,
+			err ? 0 : req->nblocks, req->slot);
+		put_req(c, req);
+	}
+
+	free(b);
+	pthread_mutex_unlock(&c->flush_lock);
+	return err ? -1 : 0;
+}
+
+/*
+ * Writes bypassing the write-back cache, cblk_awrite() and
+ * cblk_listio(), supersede dirty blocks. They are marked clean, such
+ * that no flush overwrites the new data later. Taking flush_lock
+ * orders the new write after a flush in progress. Call this before
+ * taking request slots, the flush might need them.
+ */
+static void cache_clean(struct cblk_dev *c, off_t lba, size_t nblocks)
 {
-	cblk_get_lun_size(id, size, flags);
-	return 0;
+	size_t i;
+	unsigned int j;
+	off_t key;
+	struct cache_entry *entry;
+
+	if (!c->writeback || (__atomic_load_n(&c->dirty,
+					__ATOMIC_RELAXED) == 0))
+		return;
+
+	pthread_mutex_lock(&c->flush_lock);
+	for (i = 0; i < nblocks; i++) {
+		entry = cache_set(lba + i);
+		key = cache_key(c, lba + i);
+		pthread_mutex_lock(&entry->way_lock);
+		for (j = 0; j < cache_ways; j++)
+			if ((entry->way[j].lba == key) && entry->way[j].dirty)
+				__way_dirty(&entry->way[j], 0);
+		pthread_mutex_unlock(&entry->way_lock);
+	}
+	pthread_mutex_unlock(&c->flush_lock);
 }
 
-int cblk_set_size(chunk_id_t id __attribute__((unused)),
-		  size_t size __attribute__((unused)),
-		  int flags __attribute__((unused)))
+/*
+ * Put the blocks into the cache as dirty blocks. If a set has no way
+ * left for one, flush the device and try again. If that does not help
+ * either, e.g. the set is full of dirty blocks of other devices, the
+ * block is written through.
+ */
+static int cache_write_back(struct cblk_dev *c, void *buf, off_t lba,
+			size_t nblocks)
 {
-	fprintf(stderr, "err: Cannot change size of physical luns\n");
-	return -1;
+	int rc;
+	size_t i;
+	void *p;
+
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		errno = EBADFD;
+		return 0;
+	}
+	if ((lba < 0) || (lba + nblocks > c->nblocks)) { /* no valid LBA */
+		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
+			__func__, lba, c->nblocks);
+		errno = EFAULT;
+		return 0;
+	}
+
+	for (i = 0; i < nblocks; i++) {
+		p = buf + i * __CBLK_BLOCK_SIZE;
+		rc = cache_write(c, lba + i, p, 0, 1);
+		if (rc == 1) {
+			if (cache_flush(c, 1) != 0)
+				return 0;
+			rc = cache_write(c, lba + i, p, 0, 1);
+		}
+		if (rc == 1) {
+			pthread_mutex_lock(&c->flush_lock);
+			rc = (block_write(c, p, lba + i, 1,
+					CBLK_PRIO_NORMAL) == 1) ? 0 : -1;
+			pthread_mutex_unlock(&c->flush_lock);
+		}
+		if (rc < 0)
+			return 0;
+	}
+
+	if (cache_flush(c, 0) != 0)	/* over CBLK_DIRTY_LIMIT? */
+		return 0;
+	return nblocks;
 }
 
-static int block_read(struct cblk_dev *c, void *buf, off_t lba,
-		size_t nblocks)
+/*
+ * Applies to the requests the calling thread starts after the call.
+ * Background requests, like prefetch and read-ahead, keep
+ * CBLK_REQTIMEOUT, nobody waits for them.
+ */
+uint64_t cblk_set_timeout(uint64_t usec)
 {
-	struct cblk_req *req;
-	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
+	uint64_t old = cblk_thread_timeout;
 
-	block_trace("[%s] reading (%p LBA=%zu nblocks=%zu) ...\n",
-		__func__, buf, lba, nblocks);
+	cblk_thread_timeout = usec;
+	return old;
+}
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
+int cblk_flush(chunk_id_t id, int flags __attribute__((unused)))
+{
+	struct cblk_dev *c = cblk_dev_get(id);
+
+	if (c == NULL)
+		return -1;
+	if (!c->writeback)
+		return 0;
+	return cache_flush(c, 1);
+}
+
+int cblk_write(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int flags)
+{
+	int rc;
+	unsigned  int i;
+	struct cblk_dev *c = cblk_dev_get(id);
+	struct timespec start_time, end_time;
+	time_t usecs;
+	long int nsecs;
+
+	if (c == NULL)
+		return -1;
+
+	time_now(&start_time);
+
+	dev_stat_inc(c, block_writes);
+	if (nblocks == 1)
+		dev_stat_inc(c, block_writes_4k);
+
+	if (c->writeback) {
+		nblocks = cache_write_back(c, buf, lba, nblocks);
+		goto out;
+	}
+
+	nblocks = block_write(c, buf, lba, nblocks,
+			flags_prio(flags, CBLK_IO_PRIORITY_REQ));
+
+	if (cblk_caching) {
+		for (i = 0; i < nblocks; i++) {
+			rc = cache_write(c, lba + i, buf + i * __CBLK_BLOCK_SIZE,
+					0, 0);
+			if (rc < 0) {
+				dfprintf(stderr, "err: cache_write LBA=%ld "
+					"failed rc=%d!\n", (long int)lba, rc);
+				return 0;
+			}
+		}
+	}
+
+ out:
+	time_now(&end_time);
+	nsecs = timediff_nsec(&end_time, &start_time);
+	usecs = nsecs / 1000;
+	pp_add_lba(c->id, lba, nblocks, usecs, 0);
+	dev_stat_hist(c, DEV_HIST_WRITE, nsecs);
+	dev_stat_add(c, blocks_written, nblocks);
+
+	snap_stats_add(c->stats, writes, 1);
+	snap_stats_add(c->stats, write_usec, usecs);
+	snap_stats_add(c->stats, write_bytes, nblocks * __CBLK_BLOCK_SIZE);
+	return nblocks;
+}
+
+/*
+ * Asynchronous I/O. The requests use the same slots as cblk_read()
+ * and cblk_write(), but nobody waits on the wait_sem. The completion
+ * thread marks them READY and wakes up cblk_aresult() callers. Unless
+ * a user status is provided, the slot stays occupied until the result
+ * is harvested.
+ */
+static int __async_check(struct cblk_dev *c, void *buf, off_t lba,
+			size_t nblocks, int is_write)
+{
+	size_t nblocks_max = is_write ? CBLK_NBLOCKS_WRITE_MAX :
+		CBLK_NBLOCKS_MAX;
+
+	if ((buf == NULL) || (nblocks == 0) || (nblocks > nblocks_max)) {
+		fprintf(stderr, "[%s] err: invalid request LBA=%ld "
+			"nblocks=%zu (max=%zu)!\n",
+			__func__, lba, nblocks, nblocks_max);
+		errno = EINVAL;
 		return -1;
 	}
-	if ((lba < 0) || (lba >= (off_t)c->nblocks)) {	/* no valid LBA */
+	if ((lba < 0) || (lba + nblocks > c->nblocks)) {	/* no valid LBA */
 		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
 			__func__, lba, c->nblocks);
 		errno = EFAULT;
+		return -1;
+	}
+	if (c->status != CBLK_READY) {	/* device in fatal error */
+		errno = EBADFD;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void __async_set_status(cblk_arw_status_t *status,
+				cblk_status_type_t type,
+				size_t blocks, int err)
+{
+	if (status == NULL)
+		return;
+
+	status->blocks_transferred = blocks;
+	status->fail_errno = err;
+	status->status = type;
+}
+
+/*
+ * Setup a request taken by get_req() or get_reqs() as asynchronous
+ * request and prepare the transfer. It still needs to be started.
+ */
+static void __async_setup(struct cblk_dev *c, struct cblk_req *req,
+			void *buf, int tag, int user_tag,
+			cblk_arw_status_t *status)
+{
+	uint32_t mem_size = __CBLK_BLOCK_SIZE * req->nblocks;
+
+	req->is_async = 1;
+	req->user_buf = buf;
+	req->user_tag = user_tag;
+	req->tag = user_tag ? tag : req->slot;
+	req->user_status = status;
+
+	if (status != NULL) {
+		__async_set_status(status, CBLK_ARW_STATUS_PENDING, 0, 0);
+	} else {
+		pthread_mutex_lock(&c->async_m);
+		c->async_in_flight++;
+		pthread_mutex_unlock(&c->async_m);
+	}
+
+	if (cblk_is_write(req)) {
+		dev_stat_inc(c, block_writes);
+		dev_stat_inc(c, awrites);
+		if (req->nblocks == 1)
+			dev_stat_inc(c, block_writes_4k);
+
+		memcpy(req->buf, buf, mem_size);
+		req_setup(req, ACTION_CONFIG_COPY_HN,	/* Host DDR to NVMe */
+			req->lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE, /* dst */
+			(uint64_t)req->buf,		/* src */
+			mem_size);			/* size */
+		snap_probe3(snapblock, block__write__start, req->lba,
+			req->nblocks, req->slot);
+	} else {
+		dev_stat_inc(c, block_reads);
+		dev_stat_inc(c, areads);
+		if (req->nblocks == 1)
+			dev_stat_inc(c, block_reads_4k);
+
+		cache_reserve_req(c, req, 0);
+		req->data = req_read_dst(c, req, buf);
+		req_setup(req, ACTION_CONFIG_COPY_NH,	/* NVMe to Host DDR */
+			(uint64_t)req->data,		/* dst */
+			req->lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE, /* src */
+			mem_size);			/* size */
+		snap_probe3(snapblock, block__read__start, req->lba,
+			req->nblocks, req->slot);
+	}
+}
+
+static int __async_start(struct cblk_dev *c, void *buf, off_t lba,
+			size_t nblocks, int *tag,
+			cblk_arw_status_t *status, int flags,
+			int is_write)
+{
+	struct cblk_req *req;
+
+	if (!(flags & CBLK_ARW_USER_STATUS_FLAG))
+		status = NULL;
+
+	if ((tag == NULL) || __async_check(c, buf, lba, nblocks, is_write)) {
+		if (tag == NULL)
+			errno = EINVAL;
+		goto out_invalid;
+	}
+	if (is_write)
+		cache_clean(c, lba, nblocks);
+
+	req = get_req(c, 0, lba, nblocks, is_write,
+		!(flags & CBLK_ARW_WAIT_CMD_FLAGS),
+		flags_prio(flags, CBLK_ARW_PRIORITY_FLAG));
+	if (req == NULL) {
+		if (errno == EAGAIN) {
+			dev_stat_inc(c, no_cmds_free);
+			dev_stat_inc(c, no_cmds_free_fail);
+		}
+		goto out_invalid;
+	}
+
+	__async_setup(c, req, buf, *tag, flags & CBLK_ARW_USER_TAG_FLAG,
+		status);
+	*tag = req->tag;
+	req_start(req, c);
+
+	if (!is_write)
+		__prefetch_blocks(c, lba, nblocks);
+	return 0;
+
+ out_invalid:
+	__async_set_status(status, (errno == EAGAIN) ?
+			CBLK_ARW_STATUS_FAIL : CBLK_ARW_STATUS_INVALID,
+			0, errno);
+	return -1;
+}
+
+/*
+ * Asynchronous reads are completed immediately if all blocks are in
+ * the cache. Returns 1 in this case.
+ */
+static int __async_cache_read(struct cblk_dev *c, void *buf, off_t lba,
+			size_t nblocks)
+{
+	size_t i;
+	struct timespec stime, etime;
+	long int nsecs;
+
+	if (!cblk_caching || (buf == NULL) || (nblocks == 0))
 		return 0;
+
+	time_now(&stime);
+	for (i = 0; i < nblocks; i++)
+		if (cache_read(c, lba + i, buf + i * __CBLK_BLOCK_SIZE))
+			return 0;
+	time_now(&etime);
+	nsecs = timediff_nsec(&etime, &stime);
+
+	dev_stat_inc(c, block_reads);
+	dev_stat_inc(c, areads);
+	if (nblocks == 1)
+		dev_stat_inc(c, block_reads_4k);
+	dev_stat_inc(c, cache_hits);
+	if (nblocks == 1)
+		dev_stat_inc(c, cache_hits_4k);
+	dev_stat_add(c, blocks_read, nblocks);
+	dev_stat_hist(c, DEV_HIST_READ, nsecs);
+	dev_stat_hist(c, DEV_HIST_CACHE_HIT, nsecs);
+	snap_stats_add(c->stats, cache_hits, 1);
+	snap_stats_add(c->stats, reads, 1);
+	snap_stats_add(c->stats, read_bytes, nblocks * __CBLK_BLOCK_SIZE);
+	pp_add_lba(c->id, lba, nblocks, 0, 1);
+	return 1;
+}
+
+/**
+ * Start an asynchronous read. Returns 0 if the request was issued,
+ * the number of blocks if the data was found in the cache (no tag is
+ * given out then) or -1 with errno set. Without CBLK_ARW_WAIT_CMD_FLAGS
+ * it fails with EAGAIN if all slots are busy.
+ */
+int cblk_aread(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int *tag, cblk_arw_status_t *status, int flags)
+{
+	struct cblk_dev *c = cblk_dev_get(id);
+
+	if (c == NULL)
+		return -1;
+
+	if (__async_cache_read(c, buf, lba, nblocks)) {
+		if (flags & CBLK_ARW_USER_STATUS_FLAG)
+			__async_set_status(status, CBLK_ARW_STATUS_SUCCESS,
+					nblocks, 0);
+		return nblocks;
+	}
+
+	return __async_start(c, buf, lba, nblocks, tag, status, flags, 0);
+}
+
+/**
+ * Start an asynchronous write. The data is copied before returning,
+ * such that the caller can reuse buf right away.
+ */
+int cblk_awrite(chunk_id_t id, void *buf, off_t lba, size_t nblocks,
+		int *tag, cblk_arw_status_t *status, int flags)
+{
+	struct cblk_dev *c = cblk_dev_get(id);
+
+	if (c == NULL)
+		return -1;
+
+	return __async_start(c, buf, lba, nblocks, tag, status, flags, 1);
+}
+
+static inline int __async_done(struct cblk_req *req)
+{
+	return req->is_async && (req->user_status == NULL) &&
+		((cblk_get_status(req) == CBLK_READY) ||
+		 (cblk_get_status(req) == CBLK_ERROR));
+}
+
+/*
+ * Lookup the request for cblk_aresult(), async_m must be held.
+ * Returns NULL if it did not complete yet. *err is set if there is
+ * no such request at all.
+ */
+static struct cblk_req *__async_lookup(struct cblk_dev *c, int tag,
+				int flags, int *err)
+{
+	unsigned int i;
+	struct cblk_req *req;
+
+	*err = 0;
+	if (flags & CBLK_ARESULT_NEXT_TAG) {
+		if (c->async_in_flight == 0) {
+			*err = 1;
+			return NULL;
+		}
+		for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+			req = &c->req[i];
+			if (__async_done(req))
+				return req;
+		}
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(c->req); i++) {
+		req = &c->req[i];
+		if (!req->is_async || (req->user_status != NULL))
+			continue;
+		if (flags & CBLK_ARESULT_USER_TAG) {
+			if (!req->user_tag || (req->tag != tag))
+				continue;
+		} else {
+			if (req->user_tag || (req->slot != tag))
+				continue;
+		}
+		return __async_done(req) ? req : NULL;
+	}
+	*err = 1;
+	return NULL;
+}
+
+/**
+ * Harvest an asynchronous request. With CBLK_ARESULT_NEXT_TAG any
+ * completed request is taken and its tag is stored in *tag.
+ * Returns 0 if the request is not completed yet (without
+ * CBLK_ARESULT_BLOCKING), the number of blocks transferred, which is
+ * also stored in *status, or -1 with errno set. EINVAL means there
+ * is no such tag or nothing in flight.
+ *
+ * Completions are always harvested by the completion thread, so
+ * CBLK_ARESULT_NO_HARVEST makes no difference here.
+ */
+int cblk_aresult(chunk_id_t id, int *tag, uint64_t *status, int flags)
+{
+	int rc, err;
+	struct cblk_req *req;
+	struct cblk_dev *c = cblk_dev_get(id);
+	struct timespec ts;
+
+	if ((c == NULL) || (tag == NULL) || (status == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+	*status = 0;
+
+	pthread_mutex_lock(&c->async_m);
+	while ((req = __async_lookup(c, *tag, flags, &err)) == NULL) {
+		if (err || !(flags & CBLK_ARESULT_BLOCKING)) {
+			pthread_mutex_unlock(&c->async_m);
+			if (err) {
+				errno = EINVAL;
+				return -1;
+			}
+			dev_stat_inc(c, aresult_no_cmplt);
+			return 0;
+		}
+		/* Timeouts are detected by the completion thread */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&c->async_c, &c->async_m, &ts);
+	}
+	req->is_async = 0;	/* harvested, nobody else will find it */
+	c->async_in_flight--;
+	pthread_mutex_unlock(&c->async_m);
+
+	*tag = req->tag;
+	rc = __async_finish(c, req);
+	if (rc < 0)
+		return -1;
+
+	*status = rc;
+	return rc;
+}
+
+static inline int __io_pending(cblk_io_t *io)
+{
+	return io->stat.status == CBLK_ARW_STATUS_PENDING;
+}
+
+/*
+ * Start a batch of at most CBLK_IDX_MAX requests. Each round takes
+ * the free slots and starts them with one dev_lock acquisition.
+ * Without CBLK_LISTIO_WAIT_ISSUE_CMD the requests not getting a slot
+ * fail with EAGAIN. Elements with CBLK_IO_PRIORITY_REQ go first.
+ */
+static int __listio_start(struct cblk_dev *c, cblk_io_t *todo[], int m,
+			int flags)
+{
+	int i, k, u = 0;
+	cblk_io_t *io, *urgent[CBLK_IDX_MAX];
+	struct cblk_req *reqs[CBLK_IDX_MAX];
+
+	for (i = 0, k = 0; i < m; i++) {
+		if (todo[i]->flags & CBLK_IO_PRIORITY_REQ)
+			urgent[u++] = todo[i];
+		else
+			todo[k++] = todo[i];
+	}
+	memmove(todo + u, todo, k * sizeof(todo[0]));
+	memcpy(todo, urgent, u * sizeof(todo[0]));
+
+	while (m > 0) {
+		k = get_reqs(c, todo, reqs, m,
+			flags & CBLK_LISTIO_WAIT_ISSUE_CMD);
+		if (k < 0) {
+			for (i = 0; i < m; i++)
+				__async_set_status(&todo[i]->stat,
+					CBLK_ARW_STATUS_FAIL, 0, errno);
+			return -1;
+		}
+
+		for (i = 0; i < k; i++) {
+			io = todo[i];
+			__async_setup(c, reqs[i], io->buf, io->tag,
+				io->flags & CBLK_IO_USER_TAG, &io->stat);
+			io->tag = reqs[i]->tag;
+		}
+
+		pthread_mutex_lock(&c->dev_lock);
+		for (i = 0; i < k; i++)
+			__req_start(reqs[i], c);
+		pthread_mutex_unlock(&c->dev_lock);
+
+		m -= k;
+		memmove(todo, todo + k, m * sizeof(todo[0]));
+	}
+	return 0;
+}
+
+/*
+ * Start the requests in the issue list. Reads found in the cache are
+ * completed right away, the others are collected and started in
+ * batches.
+ */
+static int __listio_issue(struct cblk_dev *c, cblk_io_t *ios[], int n,
+			int flags)
+{
+	int i, m = 0, rc = 0;
+	int is_read, is_write;
+	cblk_io_t *io, *todo[CBLK_IDX_MAX];
+
+	for (i = 0; i < n; i++) {
+		io = ios[i];
+		if (io == NULL)
+			continue;
+
+		is_read = (io->request_type == CBLK_IO_TYPE_READ);
+		is_write = (io->request_type == CBLK_IO_TYPE_WRITE);
+
+		if (!is_read && !is_write)
+			errno = EINVAL;
+		if ((!is_read && !is_write) ||
+		    __async_check(c, io->buf, io->lba, io->nblocks,
+				is_write)) {
+			__async_set_status(&io->stat, CBLK_ARW_STATUS_INVALID,
+					0, errno);
+			rc = -1;
+			continue;
+		}
+		if (is_read && __async_cache_read(c, io->buf, io->lba,
+						io->nblocks)) {
+			__async_set_status(&io->stat, CBLK_ARW_STATUS_SUCCESS,
+					io->nblocks, 0);
+			continue;
+		}
+
+		if (is_write)
+			cache_clean(c, io->lba, io->nblocks);
+
+		__async_set_status(&io->stat, CBLK_ARW_STATUS_PENDING, 0, 0);
+		todo[m++] = io;
+		if (m == CBLK_IDX_MAX) {
+			if (__listio_start(c, todo, m, flags))
+				rc = -1;
+			m = 0;
+		}
+	}
+	if ((m > 0) && __listio_start(c, todo, m, flags))
+		rc = -1;
+
+	return rc;
+}
+
+static void __listio_collect(cblk_io_t *ios[], int n,
+			cblk_io_t *done[], int *ndone, int max)
+{
+	int i, j;
+
+	for (i = 0; (i < n) && (*ndone < max); i++) {
+		if ((ios[i] == NULL) || __io_pending(ios[i]))
+			continue;
+		for (j = 0; j < *ndone; j++)	/* listed twice? */
+			if (done[j] == ios[i])
+				break;
+		if (j == *ndone)
+			done[(*ndone)++] = ios[i];
 	}
-	if (nblocks > CBLK_NBLOCKS_MAX) {
-		fprintf(stderr, "err: temp buffer too small!\n");
-		errno = EFAULT;
+}
+
+/**
+ * Issue a list of reads and writes and/or wait for earlier ones.
+ * The requests in issue_io_list are started, using one dev_lock
+ * acquisition per batch of free slots to program the action. The
+ * completion of each element is posted in its stat field by the
+ * completion thread. We wait until all elements in wait_io_list
+ * completed or timeout usec expired (0: no limit, request timeouts
+ * still apply). Completed elements of all lists are returned in
+ * completion_io_list, *completion_items is the size of the list on
+ * input and the number of elements on output. Returns 0 or -1 with
+ * errno set if a request could not be issued or the timeout expired.
+ */
+int cblk_listio(chunk_id_t id,
+		cblk_io_t *issue_io_list[], int issue_items,
+		cblk_io_t *pending_io_list[], int pending_items,
+		cblk_io_t *wait_io_list[], int wait_items,
+		cblk_io_t *completion_io_list[], int *completion_items,
+		uint64_t timeout, int flags)
+{
+	int i, rc = 0, err = 0, ndone = 0;
+	struct cblk_dev *c = cblk_dev_get(id);
+	struct timespec ts, deadline;
+
+	if ((c == NULL) ||
+	    ((issue_items > 0) && (issue_io_list == NULL)) ||
+	    ((pending_items > 0) && (pending_io_list == NULL)) ||
+	    ((wait_items > 0) && (wait_io_list == NULL)) ||
+	    ((completion_io_list != NULL) && (completion_items == NULL))) {
+		errno = EINVAL;
 		return -1;
 	}
-	req = get_req(c, 1, lba, nblocks, 0);
-	if (req == NULL)
-		return -1;
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
-		return -1;
+	if (issue_items > 0) {
+		rc = __listio_issue(c, issue_io_list, issue_items, flags);
+		err = errno;
 	}
 
-	req_setup(req, ACTION_CONFIG_COPY_NH,		/* NVMe to Host DDR */
-		(uint64_t)req->buf,			/* dst */
-		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* src */
-		mem_size);				/* size */
-	req_start(req, c);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000000;
+	deadline.tv_nsec += (timeout % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
 
-	__prefetch_blocks(c, lba, nblocks);
+	pthread_mutex_lock(&c->async_m);
+	for (i = 0; i < wait_items; ) {
+		int last = 0;
 
-	while (req->status == CBLK_READING) {
-		/* block_trace("  [%s] sleeping slot %d status: %s\n",
-			__func__, req->slot, cblk_status_str[req->status]); */
-		sem_wait(&req->wait_sem);
-		/* block_trace("  [%s] continuing slot %d\n",
-			__func__, req->slot); */
+		if ((wait_io_list[i] == NULL) ||
+		    !__io_pending(wait_io_list[i])) {
+			i++;
+			continue;
+		}
+		/* Timeouts of the requests are detected by completion thread */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		if (timeout && ((deadline.tv_sec < ts.tv_sec) ||
+				((deadline.tv_sec == ts.tv_sec) &&
+				 (deadline.tv_nsec < ts.tv_nsec)))) {
+			ts = deadline;
+			last = 1;
+		}
+		if ((pthread_cond_timedwait(&c->async_c, &c->async_m,
+					&ts) == ETIMEDOUT) && last) {
+			rc = -1;
+			err = ETIMEDOUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->async_m);
+
+	if (completion_io_list != NULL) {
+		int max = *completion_items;
+
+		__listio_collect(issue_io_list, issue_items,
+				completion_io_list, &ndone, max);
+		__listio_collect(pending_io_list, pending_items,
+				completion_io_list, &ndone, max);
+		__listio_collect(wait_io_list, wait_items,
+				completion_io_list, &ndone, max);
+		*completion_items = ndone;
 	}
 
-	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
-		errno = ETIME;
-		nblocks = 0;
-	} else
-		memcpy(buf, req->buf, nblocks * __CBLK_BLOCK_SIZE);
-
-	__read_complete(c, req, 1);	/* mark as used one time */
-	return nblocks;
+	if (rc != 0)
+		errno = err;
+	return rc;
 }
 
 /*
- * Consider using pthread_cond_wait() and pthread_cond_broadcast()
- * once the data is ready to be absorbed.
+ * Chunk groups stripe their LBA range over several devices (RAID0).
+ * Stripe n of the group is stored on chunk n % nchunks at LBA
+ * (n / nchunks) * stripe. Requests are cut into pieces which fit into
+ * one stripe and one request slot. The pieces are issued round robin
+ * on all devices using cblk_listio() before we wait for any of them,
+ * such that the devices work in parallel.
  */
-static int __cache_try_read(struct cblk_dev *c __attribute__((unused)),
-			off_t lba, void *buf, size_t nblocks,
-			unsigned int timeout_usec)
-{
-	int rc;
-	unsigned long usecs = 0;
-	struct timeval s, e;
-	size_t i;
-	size_t from_cache = 0;
-	int prefetch_requested = 0;
+#define CBLK_CGS_MAX		4
 
-	/* Trying to get data from CACHE if we got all blocks ... */
-	for (i = 0; i < nblocks; i++) {
-		gettimeofday(&s, NULL);
-		while (usecs < timeout_usec) {
-			rc = cache_read(lba + i, buf + i * __CBLK_BLOCK_SIZE);
-			if (rc == 1) {		/* READING LBA was requested */
-				if (!prefetch_requested) {
-					__prefetch_blocks(c, lba, nblocks);
-					prefetch_requested = 1;
-				}
-				gettimeofday(&e, NULL);
-				usecs = timediff_usec(&e, &s);
-				continue;	/* Try again */
-			}
-			if (rc == 0) {		/* Success */
-				block_trace("    [%s] got LBA=%ld after %ld usecs\n",
-					__func__, lba + i, usecs);
-				from_cache++;
-				break;
-			}
-			if (rc < 0)		/* Not in cache, not requested */
-				goto out;
-		}
-		if (usecs >= timeout_usec)
-			dfprintf(stderr, "[%s] LBA=%ld did not arrive "
-				"n time %ld usecs\n", __func__, lba + i, usecs);
-	}
+struct cblk_cg {
+	int nchunks;			/* 0: unused */
+	chunk_id_t id[CBLK_DEVS_MAX];
+	size_t stripe;			/* in blocks */
+};
 
- out:
-	if (!prefetch_requested && (nblocks == from_cache)) {
-		block_trace("    [%s] trigger prefetching for LBA=%ld "
-			"nblocks=%ld from_cache=%ld\n",
-			__func__, lba, nblocks, from_cache);
-		__prefetch_blocks(c, lba, nblocks);
-		prefetch_requested = 1;
+struct cblk_cg_piece {
+	cblk_io_t io;
+	unsigned int dev;		/* index in cblk_cg.id[] */
+};
+
+static struct cblk_cg cgs[CBLK_CGS_MAX];
+static pthread_mutex_t cblk_cgs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct cblk_cg *cblk_cg_get(chunk_cg_id_t cgid)
+{
+	if ((cgid < 0) || (cgid >= CBLK_CGS_MAX) || (cgs[cgid].nchunks == 0)) {
+		errno = EINVAL;
+		return NULL;
 	}
-	return from_cache;
+	return &cgs[cgid];
 }
 
-int cblk_read(chunk_id_t id __attribute__((unused)),
-		void *buf, off_t lba, size_t nblocks,
-		int flags __attribute__((unused)))
+/**
+ * Open a group of devices. path is a comma separated list of devices,
+ * num_chunks must match the number of paths or be 0. ext is the
+ * stripe size in blocks, 0 selects CBLK_STRIPE (default 32).
+ */
+chunk_cg_id_t cblk_cg_open(const char *path, int max_num_requests,
+			int mode, int num_chunks, chunk_ext_arg_t ext,
+			int flags)
 {
-	int rc;
-	struct cblk_dev *c = &chunk;
-	struct timeval start_time, end_time;
-	unsigned long usecs = 0;
-
-	gettimeofday(&start_time, NULL);
-
-	c->block_reads++;
-	if (nblocks == 1)
-		c->block_reads_4k++;
-
-	if (cblk_caching) {
-		/* Trying to get data from CACHE if we got all blocks ... */
-		rc = __cache_try_read(c, lba, buf, nblocks, CONFIG_REQ_DURATION_USEC);
+	int i, n = 0;
+	chunk_cg_id_t cgid;
+	struct cblk_cg *g;
+	char *paths, *p, *saveptr = NULL;
 
-		/* ... we don't need to ask the NVMe hardware */
-		if (rc == (int)nblocks) {
-			block_trace("    [%s] Got %ld..%ld, nice\n", __func__,
-				lba, lba + nblocks - 1);
+	if (path == NULL) {
+		errno = EINVAL;
+		return NULL_CHUNK_CG_ID;
+	}
+	paths = strdup(path);
+	if (paths == NULL)
+		return NULL_CHUNK_CG_ID;
 
-			c->cache_hits++;
-			if (nblocks == 1)
-				c->cache_hits_4k++;
-			goto out;
+	pthread_mutex_lock(&cblk_cgs_lock);
+	for (cgid = 0; cgid < CBLK_CGS_MAX; cgid++)
+		if (cgs[cgid].nchunks == 0)
+			break;
+	if (cgid == CBLK_CGS_MAX) {
+		errno = ENOSPC;
+		goto out_err0;
+	}
+	g = &cgs[cgid];
+	g->stripe = ext ? ext : (size_t)cblk_stripe;
+
+	for (p = strtok_r(paths, ",", &saveptr); p != NULL;
+	     p = strtok_r(NULL, ",", &saveptr)) {
+		if (n == CBLK_DEVS_MAX) {
+			errno = ENOSPC;
+			goto out_err1;
 		}
+		g->id[n] = cblk_open(p, max_num_requests, mode, 0,
+				flags & ~CBLK_OPN_GROUP);
+		if (g->id[n] == NULL_CHUNK_ID)
+			goto out_err1;
+		n++;
+	}
+	if ((n == 0) || ((num_chunks != 0) && (num_chunks != n))) {
+		fprintf(stderr, "err: %d paths given for %d chunks\n",
+			n, num_chunks);
+		errno = EINVAL;
+		goto out_err1;
 	}
 
-	/* Else read them all for simplicity at this point in time ... */
-	rc = block_read(c, buf, lba, nblocks);
-out:
-	gettimeofday(&end_time, NULL);
-	usecs = timediff_usec(&end_time, &start_time);
-	pp_add_lba(lba, nblocks, usecs, 1);
+	g->nchunks = n;
+	pthread_mutex_unlock(&cblk_cgs_lock);
+	free(paths);
+	return cgid;
 
+ out_err1:
+	for (i = 0; i < n; i++)
+		cblk_close(g->id[i], 0);
+ out_err0:
+	pthread_mutex_unlock(&cblk_cgs_lock);
+	free(paths);
+	return NULL_CHUNK_CG_ID;
+}
+
+int cblk_cg_close(chunk_cg_id_t cgid, int flags)
+{
+	int i, rc = 0;
+	struct cblk_cg *g;
+
+	pthread_mutex_lock(&cblk_cgs_lock);
+	g = cblk_cg_get(cgid);
+	if (g == NULL) {
+		pthread_mutex_unlock(&cblk_cgs_lock);
+		return -1;
+	}
+	for (i = 0; i < g->nchunks; i++)
+		if (cblk_close(g->id[i], flags) != 0)
+			rc = -1;
+	g->nchunks = 0;
+	pthread_mutex_unlock(&cblk_cgs_lock);
 	return rc;
 }
 
-static int block_write(struct cblk_dev *c, void *buf, off_t lba,
-		size_t nblocks)
+int cblk_cg_get_num_chunks(chunk_cg_id_t cgid,
+			int flags __attribute__((unused)))
 {
-	uint32_t mem_size = __CBLK_BLOCK_SIZE * nblocks;
-	struct cblk_req *req;
+	struct cblk_cg *g = cblk_cg_get(cgid);
 
-	block_trace("[%s] writing (%p LBA=%zu nblocks=%zu) ...\n",
-		__func__, buf, lba, nblocks);
+	if (g == NULL)
+		return -1;
+	return g->nchunks;
+}
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
-		return 0;
-	}
-	if ((lba < 0) || (lba >= (off_t)c->nblocks)) {	/* no valid LBA */
-		fprintf(stderr, "[%s] err: LBA=%ld out of range (max=%ld)!\n",
-			__func__, lba, c->nblocks);
-		errno = EFAULT;
-		return 0;
-	}
-	if (nblocks > CBLK_NBLOCKS_WRITE_MAX) {
-		fprintf(stderr, "err: just 1 and %u supported for NBLOCKS!\n",
-			CBLK_NBLOCKS_WRITE_MAX);
-		errno = EFAULT;
-		return 0;
-	}
-	req = get_req(c, 1, lba, nblocks, 1);
-	if (req == NULL)
-		return 0;
+/* Sums up the devices, max_num_act_* are the sums of the devices maxima */
+int cblk_cg_get_stats(chunk_cg_id_t cgid, chunk_stats_t *stats, int flags)
+{
+	int i;
+	struct cblk_dev *devs[CBLK_DEVS_MAX];
+	struct cblk_cg *g = cblk_cg_get(cgid);
 
-	if (c->status != CBLK_READY) {	/* device in fatal error */
-		errno = EBADFD;
-		return 0;
+	if ((g == NULL) || (stats == NULL)) {
+		errno = EINVAL;
+		return -1;
 	}
+	for (i = 0; i < g->nchunks; i++) {
+		devs[i] = cblk_dev_get(g->id[i]);
+		if (devs[i] == NULL)
+			return -1;
+	}
+	dev_get_stats(devs, g->nchunks, stats, flags);
+	return 0;
+}
 
-	memcpy(req->buf, buf, nblocks * __CBLK_BLOCK_SIZE);
-	req_setup(req, ACTION_CONFIG_COPY_HN,		/* NVMe to Host DDR */
-		lba * __CBLK_BLOCK_SIZE/NVME_LB_SIZE,	/* dst */
-		(uint64_t)req->buf,			/* src */
-		mem_size);				/* size */
-	req_start(req, c);
+/* Full stripes of the smallest device times the number of devices */
+int cblk_cg_get_lun_size(chunk_cg_id_t cgid, size_t *nblocks, int flags)
+{
+	int i;
+	size_t size, min_size = SIZE_MAX;
+	struct cblk_cg *g = cblk_cg_get(cgid);
 
-	while (req->status == CBLK_WRITING) {
-		/* block_trace("  [%s] sleeping slot %d\n",
-			__func__, req->slot); */
-		sem_wait(&req->wait_sem);
-		/* block_trace("  [%s] continuing slot %d\n",
-			__func__, req->slot); */
+	if ((g == NULL) || (nblocks == NULL)) {
+		errno = EINVAL;
+		return -1;
 	}
-
-	if ((c->status == CBLK_ERROR) || (req->status == CBLK_ERROR)) {
-		errno = ETIME;
-		nblocks = 0;
+	for (i = 0; i < g->nchunks; i++) {
+		if (cblk_get_lun_size(g->id[i], &size, flags) != 0)
+			return -1;
+		min_size = MIN(min_size, size);
 	}
+	*nblocks = (min_size / g->stripe) * g->stripe * g->nchunks;
+	return 0;
+}
 
-	put_req(c, req);
-	/* block_trace("[%s] exit LBA=%zu nblocks=%zu\n", __func__, lba, nblocks); */
-	return nblocks;
+int cblk_cg_get_size(chunk_cg_id_t cgid, size_t *nblocks, int flags)
+{
+	return cblk_cg_get_lun_size(cgid, nblocks, flags);
 }
 
-int cblk_write(chunk_id_t id __attribute__((unused)),
-		void *buf, off_t lba, size_t nblocks,
-		int flags __attribute__((unused)))
+static int __cg_rw(chunk_cg_id_t cgid, void *buf, off_t lba,
+		size_t nblocks, int type, int flags)
 {
-	int rc;
-	unsigned  int i;
-	struct cblk_dev *c = &chunk;
-	struct timeval start_time, end_time;
-	time_t usecs;
+	int rc = 0;
+	unsigned int d, m;
+	size_t i, n, k = 0, done, size, max;
+	size_t cnt[CBLK_DEVS_MAX], first[CBLK_DEVS_MAX], sent[CBLK_DEVS_MAX];
+	struct cblk_cg *g = cblk_cg_get(cgid);
+	struct cblk_cg_piece *pieces;
+	cblk_io_t **list;
+
+	if ((g == NULL) || (buf == NULL) ||
+	    cblk_cg_get_lun_size(cgid, &size, 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((lba < 0) || (lba + nblocks > size)) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (nblocks == 0)
+		return 0;
 
-	gettimeofday(&start_time, NULL);
+	pieces = calloc(nblocks, sizeof(*pieces));
+	list = calloc(nblocks, sizeof(*list));
+	if ((pieces == NULL) || (list == NULL)) {
+		rc = -1;
+		goto out;
+	}
 
-	c->block_writes++;
-	if (nblocks == 1)
-		c->block_writes_4k++;
+	max = (type == CBLK_IO_TYPE_READ) ? CBLK_NBLOCKS_MAX :
+		CBLK_NBLOCKS_WRITE_MAX;
+	memset(cnt, 0, sizeof(cnt));
+	for (done = 0; done < nblocks; done += n) {
+		size_t stripe = (lba + done) / g->stripe;
+		size_t offs = (lba + done) % g->stripe;
+		struct cblk_cg_piece *pc = &pieces[k++];
+
+		n = MIN(MIN(g->stripe - offs, nblocks - done), max);
+		pc->dev = stripe % g->nchunks;
+		pc->io.request_type = type;
+		pc->io.flags = flags & CBLK_IO_PRIORITY_REQ;
+		pc->io.buf = buf + done * __CBLK_BLOCK_SIZE;
+		pc->io.lba = (stripe / g->nchunks) * g->stripe + offs;
+		pc->io.nblocks = n;
+		cnt[pc->dev]++;
+	}
 
-	nblocks = block_write(&chunk, buf, lba, nblocks);
+	/* Sort the pieces by device */
+	for (d = 0, i = 0; d < (unsigned int)g->nchunks; i += cnt[d++]) {
+		first[d] = i;
+		sent[d] = 0;
+	}
+	for (i = 0; i < k; i++) {
+		d = pieces[i].dev;
+		list[first[d] + sent[d]++] = &pieces[i].io;
+	}
+	memset(sent, 0, sizeof(sent));
+
+	/* Keep all devices busy, start a slot table full per round */
+	for (done = 0; done < k; ) {
+		for (d = 0; d < (unsigned int)g->nchunks; d++) {
+			m = MIN(cnt[d] - sent[d], (size_t)CBLK_IDX_MAX);
+			if (m == 0)
+				continue;
+			cblk_listio(g->id[d], list + first[d] + sent[d], m,
+				NULL, 0, NULL, 0, NULL, NULL, 0,
+				CBLK_LISTIO_WAIT_ISSUE_CMD);
+			sent[d] += m;
+			done += m;
+		}
+	}
+	for (d = 0; d < (unsigned int)g->nchunks; d++) {
+		if (cnt[d] == 0)
+			continue;
+		cblk_listio(g->id[d], NULL, 0, NULL, 0, list + first[d],
+			cnt[d], NULL, NULL, 0, 0);
+	}
 
-	if (cblk_caching) {
-		for (i = 0; i < nblocks; i++) {
-			rc = cache_write(lba + i, buf + i * __CBLK_BLOCK_SIZE, 0);
-			if (rc != 0) {
-				dfprintf(stderr, "err: cache_write LBA=%ld "
-					"failed rc=%d!\n", (long int)lba, rc);
-				return 0;
-			}
+	for (i = 0; i < k; i++) {
+		if (pieces[i].io.stat.status != CBLK_ARW_STATUS_SUCCESS) {
+			errno = pieces[i].io.stat.fail_errno;
+			rc = -1;
 		}
 	}
+ out:
+	free(pieces);
+	free(list);
+	return rc ? -1 : (int)nblocks;
+}
 
-	gettimeofday(&end_time, NULL);
-	usecs = timediff_usec(&end_time, &start_time);
-	pp_add_lba(lba, nblocks, usecs, 0);
+int cblk_cg_read(chunk_cg_id_t cgid, void *pbuf, off_t lba,
+		size_t nblocks, int flags)
+{
+	return __cg_rw(cgid, pbuf, lba, nblocks, CBLK_IO_TYPE_READ, flags);
+}
 
-	return nblocks;
+int cblk_cg_write(chunk_cg_id_t cgid, void *pbuf, off_t lba,
+		size_t nblocks, int flags)
+{
+	return __cg_rw(cgid, pbuf, lba, nblocks, CBLK_IO_TYPE_WRITE, flags);
 }
 
 static void _init(void) __attribute__((constructor));
@@ -1882,6 +5602,11 @@ static void _init(void) __attribute__((constructor));
 static void _init(void)
 {
 	const char *env;
+	long int ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (ncpus > 0)
+		cblk_ncpus = ncpus;
 
 	env = getenv("CBLK_MAXRETRIES");
 	if (env != NULL)
@@ -1891,10 +5616,98 @@ static void _init(void)
 	if (env != NULL)
 		cblk_reqtimeout = strtol(env, (char **)NULL, 0);
 
+	env = getenv("CBLK_TIMEOUT_POLICY");
+	if (env != NULL) {
+		if (strcasecmp(env, "FATAL") == 0)
+			cblk_timeout_fatal = 1;
+		else if (strcasecmp(env, "ABORT") == 0)
+			cblk_timeout_fatal = 0;
+		else
+			fprintf(stderr, "[%s] warn: CBLK_TIMEOUT_POLICY=%s "
+				"unknown, using ABORT\n", __func__, env);
+	}
+
 	env = getenv("CBLK_BUSYTIMEOUT");
 	if (env != NULL)
 		cblk_busytimeout = strtol(env, (char **)NULL, 0);
 
+	env = getenv("CBLK_WRITE_DEPTH");
+	if (env != NULL)
+		cblk_write_depth = MAX(MIN(strtol(env, (char **)NULL, 0),
+				CBLK_IDX_MAX), 1);
+
+	env = getenv("CBLK_COMPLETION_THREADS");
+	if (env != NULL)
+		cblk_completion_threads = MAX(MIN(strtol(env, (char **)NULL, 0),
+				CONFIG_COMPLETION_THREADS), 1);
+
+	cblk_completion_cpus = getenv("CBLK_COMPLETION_CPUS");
+
+	cblk_software = getenv("CBLK_SOFTWARE");
+
+	env = getenv("CBLK_SW_THREADS");
+	if (env != NULL)
+		cblk_sw_threads = MAX(MIN(strtol(env, (char **)NULL, 0),
+				CBLK_IDX_MAX), 1);
+
+	env = getenv("CBLK_CACHE_SIZE");
+	if (env != NULL)
+		cblk_cache_size = MAX(strtol(env, (char **)NULL, 0), 1);
+
+	env = getenv("CBLK_CACHE_POLICY");
+	if ((env != NULL) && (cache_set_policy(env) != 0))
+		fprintf(stderr, "warn: unknown CBLK_CACHE_POLICY %s, "
+			"using %s\n", env, cache_pol->name);
+
+	env = getenv("CBLK_CACHE_WAYS");
+	if (env != NULL)
+		cblk_cache_ways = MAX(MIN(strtol(env, (char **)NULL, 0),
+				CACHE_WAYS_MAX), 1);
+
+	env = getenv("CBLK_WRITEBACK");
+	if (env != NULL)
+		cblk_writeback = strtol(env, (char **)NULL, 0);
+
+	env = getenv("CBLK_DIRTY_LIMIT");
+	if (env != NULL)
+		cblk_dirty_limit = MAX(strtol(env, (char **)NULL, 0), 0);
+
+	env = getenv("CBLK_ZEROCOPY");
+	if (env != NULL)
+		cblk_zerocopy = strtol(env, (char **)NULL, 0);
+
+	env = getenv("CBLK_READAHEAD");
+	if (env != NULL)
+		cblk_readahead = strtol(env, (char **)NULL, 0);
+
+	env = getenv("CBLK_READAHEAD_MAX");
+	if (env != NULL)
+		cblk_readahead_max = MAX(strtol(env, (char **)NULL, 0), 0);
+	if ((cblk_readahead_max == 0) ||
+	    (cblk_readahead_max > NVME_MAX_TRANSFER_SIZE / __CBLK_BLOCK_SIZE))
+		cblk_readahead_max = NVME_MAX_TRANSFER_SIZE / __CBLK_BLOCK_SIZE;
+
+	env = getenv("CBLK_URGENT_SLOTS");
+	if (env != NULL)
+		cblk_urgent_slots = MIN(MAX(strtol(env, (char **)NULL, 0), 0),
+					sched_slots() - 1);
+
+	env = getenv("CBLK_BACKGROUND_SLOTS");
+	if (env != NULL)
+		cblk_background_slots = MIN(MAX(strtol(env, (char **)NULL, 0),
+						1), CBLK_IDX_MAX);
+
+	slot_reserve[CBLK_PRIO_URGENT] = 0;
+	slot_reserve[CBLK_PRIO_NORMAL] = cblk_urgent_slots;
+	slot_reserve[CBLK_PRIO_BACKGROUND] = MAX(cblk_urgent_slots,
+				sched_slots() - cblk_background_slots);
+
+	cblk_cache_save = getenv("CBLK_CACHE_SAVE");
+
+	env = getenv("CBLK_STRIPE");
+	if (env != NULL)
+		cblk_stripe = MAX(strtol(env, (char **)NULL, 0), 1);
+
 	env = getenv("CBLK_CACHING");
 	if (env != NULL)
 		cblk_caching = strtol(env, (char **)NULL, 0);
@@ -1923,78 +5736,159 @@ static void _init(void)
 		cblk_prefetch_threshold, cblk_caching);
 }
 
-static void _done(void) __attribute__((destructor));
+/* Upper bound of the bucket which holds the pct percentile */
+static uint64_t dev_hist_pct(cblk_hist_t *h, unsigned int pct)
+{
+	unsigned int i;
+	uint64_t n = 0, limit = (h->count * pct + 99) / 100;
 
-static void _done(void)
+	for (i = 0; i < CBLK_HIST_BUCKETS - 1; i++) {
+		n += h->bucket[i];
+		if (n >= limit)
+			return MIN(2ull << i, h->max_nsec);
+	}
+	return h->max_nsec;
+}
+
+static void cblk_dev_stats(struct cblk_dev *c)
 {
-	struct cblk_dev *c = &chunk;
-	struct timeval end_time;
+	struct timespec end_time;
 	time_t usec;
-
-	gettimeofday(&end_time, NULL);
+	unsigned int i;
+	struct dev_pcpu_stats sum;
+	struct dev_counters *n = &sum.cnt;
+	static const char *hist_str[DEV_HIST_MAX] = {
+		"read_latency:", "write_latency:", "hit_latency:",
+		"miss_latency:"
+	};
+
+	time_now(&end_time);
 	usec = timediff_usec(&end_time, &c->start_time);
-
-	block_trace("[%s] exit\n", __func__);
-
-	stat_trace("Statistics\n"
-		"  prefetches:          %ld\n"
-		"  prefetch_collis_4k:  %ld\n"
-		"  cache_hits:          %ld\n"
-		"    cache_hits_4k:     %ld\n"
-		"  hw_block_reads:      %ld\n"
-		"  hw_block_writes:     %ld\n"
-		"  block_reads:         %ld\n"
-		"    block_reads_4k:    %ld\n"
-		"  block_writes:        %ld\n"
-		"    block_writes_4k:   %ld\n"
+	memset(&sum, 0, sizeof(sum));
+	dev_stats_sum(c, &sum);
+
+	stat_trace("Statistics %s\n"
+		"  prefetches:          %lld\n"
+		"  prefetch_collis_4k:  %lld\n"
+		"  cache_hits:          %lld\n"
+		"    cache_hits_4k:     %lld\n"
+		"  hw_block_reads:      %lld\n"
+		"  hw_block_writes:     %lld\n"
+		"  block_reads:         %lld\n"
+		"    block_reads_4k:    %lld\n"
+		"  block_writes:        %lld\n"
+		"    block_writes_4k:   %lld\n"
+		"  zerocopy_reads:      %lld\n"
+		"  readahead_hits:      %lld %lld/%lld blocks wasted\n"
 		"  idle_wakeups:        %ld\n"
 		"  cache_trashing_4k:   %ld\n"
+		"  wb_flushes:          %lld\n"
+		"  wb_flush_writes:     %lld %lld blocks\n"
+		"  cache_warm_blocks:   %lld\n"
+		"  errors/timeouts:     %lld/%lld %lld retries\n"
+		"  fail_timeouts:       %lld %lld late completions\n"
+		"  no_cmds_free:        %lld %lld failed\n"
+		"  urgent_reqs:         %lld %lld background throttled\n"
 		"  running:             %ld usec\n"
-		"  reading:             %ld usec\n"
-		"  writing:             %ld usec\n"
+		"  reading:             %lld usec\n"
+		"  writing:             %lld usec\n"
 		"  rbytes_total:        %lld %.3f MiB/sec\n"
 		"  wbytes_total:        %lld %.3f MiB/sec\n"
 		"  max_read_usecs:      %ld usec\n"
 		"  max_write_usecs:     %ld usec\n"
-		"  avg_read_usecs:      %ld usec\n"
-		"  avg_write_usecs:     %ld usec\n"
+		"  avg_read_usecs:      %lld usec\n"
+		"  avg_write_usecs:     %lld usec\n"
 		"  min_read_usecs:      %ld usec\n"
 		"  min_write_usecs:     %ld usec\n"
-		"  avg_hw_read_usecs:   %ld usec\n"
-		"  avg_hw_write_usecs:  %ld usec\n",
-		c->prefetches,
-		c->prefetch_collisions,
-		c->cache_hits,
-		c->cache_hits_4k,
-		c->hw_block_reads,
-		c->hw_block_writes,
-		c->block_reads,
-		c->block_reads_4k,
-		c->block_writes,
-		c->block_writes_4k,
+		"  avg_hw_read_usecs:   %lld usec\n"
+		"  avg_hw_write_usecs:  %lld usec\n",
+		c->path,
+		(long long)n->prefetches,
+		(long long)n->prefetch_collisions,
+		(long long)n->cache_hits,
+		(long long)n->cache_hits_4k,
+		(long long)n->hw_block_reads,
+		(long long)n->hw_block_writes,
+		(long long)n->block_reads,
+		(long long)n->block_reads_4k,
+		(long long)n->block_writes,
+		(long long)n->block_writes_4k,
+		(long long)n->zerocopy_reads,
+		(long long)n->ra_hits, (long long)n->ra_wasted,
+		(long long)n->ra_blocks,
 		c->idle_wakeups,
 		cache_trashing,
+		(long long)n->wb_flushes,
+		(long long)n->wb_flush_writes, (long long)n->wb_flush_blocks,
+		(long long)n->warm_blocks,
+		(long long)n->errors, (long long)n->timeouts,
+		(long long)n->retries,
+		(long long)n->fail_timeouts, (long long)n->late_completions,
+		(long long)n->no_cmds_free, (long long)n->no_cmds_free_fail,
+		(long long)n->urgent_reqs, (long long)n->bg_throttled,
 		(long int)usec,
-		c->avg_read_usecs,
-		c->avg_write_usecs,
-		c->rbytes_total, usec ? (double)c->rbytes_total / usec : 0.0,
-		c->wbytes_total, usec ? (double)c->wbytes_total / usec : 0.0,
+		(long long)n->read_usecs,
+		(long long)n->write_usecs,
+		(long long)n->rbytes_total,
+		usec ? (double)n->rbytes_total / usec : 0.0,
+		(long long)n->wbytes_total,
+		usec ? (double)n->wbytes_total / usec : 0.0,
 		c->max_read_usecs,
 		c->max_write_usecs,
-		c->hw_block_reads ? c->avg_read_usecs/c->hw_block_reads : 0,
-		c->hw_block_writes ? c->avg_write_usecs/c->hw_block_writes : 0,
+		n->hw_block_reads ?
+			(long long)(n->read_usecs / n->hw_block_reads) : 0,
+		n->hw_block_writes ?
+			(long long)(n->write_usecs / n->hw_block_writes) : 0,
 		c->min_read_usecs,
 		c->min_write_usecs,
-		c->hw_block_reads ? c->avg_hw_read_usecs/c->hw_block_reads : 0,
-		c->hw_block_writes ? c->avg_hw_write_usecs/c->hw_block_writes : 0);
+		n->hw_block_reads ?
+			(long long)(n->hw_read_usecs / n->hw_block_reads) : 0,
+		n->hw_block_writes ?
+			(long long)(n->hw_write_usecs / n->hw_block_writes) : 0);
+
+	for (i = 0; i < DEV_HIST_MAX; i++) {
+		cblk_hist_t *h = &sum.hist[i];
+
+		if (h->count == 0)
+			continue;
+		stat_trace("  %-20s %lld avg/p50/p99/max %.1f/%.1f/%.1f/%.1f "
+			"usec\n", hist_str[i], (long long)h->count,
+			h->sum_nsec / 1000.0 / h->count,
+			dev_hist_pct(h, 50) / 1000.0,
+			dev_hist_pct(h, 99) / 1000.0,
+			h->max_nsec / 1000.0);
+	}
 
 	stat_req_dump(c);
+}
 
-	cache_trace("Cache Info\n"
-		"  entries/ways:        %d/%d per block %d KiB\n"
-		"  total_size:          %d MiB\n",
-		CACHE_ENTRIES, CACHE_WAYS, __CBLK_BLOCK_SIZE / 1024,
-		CACHE_ENTRIES * CACHE_WAYS * __CBLK_BLOCK_SIZE / (1024*1024));
+static void _done(void) __attribute__((destructor));
 
-	cblk_close(0, 0);
+static void _done(void)
+{
+	unsigned int i;
+	long int hits, misses;
+
+	block_trace("[%s] exit\n", __func__);
+
+	for (i = 0; i < CBLK_DEVS_MAX; i++)
+		if (cblk_dev_used(&chunks[i]))
+			cblk_dev_stats(&chunks[i]);
+
+	cache_counters(&hits, &misses);
+	cache_trace("Cache Info\n"
+		"  entries/ways:        %u/%u per block %d KiB\n"
+		"  total_size:          %zu MiB\n"
+		"  policy:              %s\n"
+		"  hits/misses:         %ld/%ld %.1f%%\n"
+		"  dirty/limit:         %ld/%lu\n",
+		cache_sets, cache_ways, __CBLK_BLOCK_SIZE / 1024,
+		(size_t)cache_sets * cache_ways * __CBLK_BLOCK_SIZE /
+		(1024 * 1024), cache_pol->name, hits, misses,
+		hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+		cache_dirty, cache_dirty_max);
+
+	for (i = 0; i < CBLK_DEVS_MAX; i++)
+		while (cblk_dev_used(&chunks[i]))
+			cblk_close(i, 0);
 }
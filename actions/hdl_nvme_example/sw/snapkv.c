@@ -0,0 +1,1105 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Log-structured key/value store on top of capiblock, see snapkv.h.
+ *
+ * Layout: the superblock at start_lba, the log in the blocks after
+ * it. Positions in the log are virtual block offsets (voff) which
+ * only grow, block voff is at log_start + voff % log_size. A batch
+ * never wraps around the end of the log, it starts at the next lap
+ * instead. Each batch header records its own voff and the id of the
+ * store, so batches of an earlier lap or of a store created before on
+ * the same blocks are recognized as stale. The log is valid from the
+ * head stored in the superblock up to the first batch which is stale
+ * or fails its CRC, that is where appending continues after a restart.
+ *
+ * Threads: callers append records to the batch being filled under
+ * db->lock. The commit thread writes the batch once it is full, a
+ * caller waits for it, or commit_usec passed, while the callers fill
+ * the second buffer. The compaction thread copies the live records
+ * of the oldest batches to the tail. It persists the new head in the
+ * superblock before the space can be written again, such that the
+ * log stays readable from the head on disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <snap_tools.h>
+#include <capiblock.h>
+
+#include "snapkv.h"
+
+#define KV_BLOCK_SIZE		4096
+#define KV_SB_MAGIC		"SNAPKV01"
+#define KV_SB_VERSION		2
+#define KV_BATCH_MAGIC		0x534b5642	/* "SKVB" */
+#define KV_REC_TOMBSTONE	0x0001
+#define KV_HASH_INIT		1024		/* buckets, doubled as needed */
+#define KV_COMPACT_BATCHES	8		/* per superblock update */
+#define KV_LIVE_MAX_PCT		75		/* of the log, then ENOSPC */
+
+#define CONFIG_BATCH_BLOCKS	16
+#define CONFIG_COMPACT_PCT	60
+
+struct kv_sb {
+	char magic[8];
+	uint32_t version;
+	uint32_t crc;			/* of the superblock, crc = 0 */
+	uint64_t log_start;		/* LBA */
+	uint64_t log_size;		/* blocks */
+	uint64_t head;			/* voff of the oldest batch */
+	uint32_t batch_blocks;
+	uint32_t pad;
+	uint64_t store_id;		/* random, set on create */
+};
+
+struct kv_batch_hdr {
+	uint32_t magic;
+	uint32_t crc;			/* of bytes, crc = 0 */
+	uint64_t voff;
+	uint32_t bytes;			/* header and records */
+	uint32_t nblocks;
+	uint32_t nrecords;
+	uint32_t pad;
+	uint64_t store_id;		/* of the superblock */
+};
+
+/* Followed by the key and the value */
+struct kv_rec {
+	uint16_t klen;
+	uint16_t flags;
+	uint32_t vlen;
+};
+
+struct kv_entry {
+	struct kv_entry *next;
+	uint64_t hash;
+	uint64_t voff;			/* batch of the latest record */
+	uint32_t off;			/* of the record in the batch */
+	uint32_t vlen;
+	uint16_t klen;
+	uint8_t key[];
+};
+
+struct kv_buf {
+	uint8_t *data;
+	uint64_t voff;
+	uint32_t bytes;
+	uint32_t nrecords;
+	int open;			/* space in the log reserved */
+	int full;
+};
+
+struct kv_db {
+	chunk_id_t cid;
+	struct kv_options opts;
+	uint64_t log_start;
+	uint64_t log_size;
+	uint64_t store_id;
+	unsigned int batch_bytes;
+
+	pthread_mutex_t lock;
+	pthread_cond_t commit_c;	/* commit thread waits */
+	pthread_cond_t done_c;		/* batch written, space freed */
+	pthread_cond_t compact_c;	/* compaction thread waits */
+
+	struct kv_buf buf[2];
+	struct kv_buf *fill;		/* records go here */
+	struct kv_buf *wr;		/* being written, or NULL */
+	uint64_t head;			/* oldest batch, see superblock */
+	uint64_t tail;			/* behind the last batch */
+	uint64_t committed;		/* all before is on the device */
+	uint64_t fill_first_ns;		/* first record in fill */
+	unsigned int waiters;		/* want fill written now */
+	int compacting;			/* may use the reserve */
+	unsigned int scans;		/* compaction pauses */
+	int stop;
+	int err;			/* errno of a failed log write */
+
+	struct kv_entry **table;
+	size_t nbuckets;
+	uint64_t live_bytes;		/* records the index points to */
+
+	pthread_t commit_tid;
+	pthread_t compact_tid;
+	struct kv_stats st;
+};
+
+static uint32_t kv_crc_table[256];
+static pthread_once_t kv_crc_once = PTHREAD_ONCE_INIT;
+
+static void kv_crc_init(void)
+{
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+		kv_crc_table[i] = c;
+	}
+}
+
+static uint32_t kv_crc32(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	crc = ~crc;
+	while (len--)
+		crc = kv_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static inline uint64_t kv_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static uint64_t kv_hash(const void *key, size_t klen)
+{
+	const uint8_t *p = key;
+	uint64_t h = 0xcbf29ce484222325ull;	/* FNV-1a */
+
+	while (klen--) {
+		h ^= *p++;
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static inline uint64_t kv_lba(struct kv_db *db, uint64_t voff)
+{
+	return db->log_start + voff % db->log_size;
+}
+
+/* Batches do not wrap, move voff to the next lap if needed */
+static inline uint64_t kv_place(struct kv_db *db, uint64_t voff)
+{
+	uint64_t r = voff % db->log_size;
+
+	if (r + db->opts.batch_blocks > db->log_size)
+		voff += db->log_size - r;
+	return voff;
+}
+
+static inline uint32_t kv_rec_size(size_t klen, size_t vlen)
+{
+	return sizeof(struct kv_rec) + klen + vlen;
+}
+
+static inline uint32_t kv_blocks(uint32_t bytes)
+{
+	return (bytes + KV_BLOCK_SIZE - 1) / KV_BLOCK_SIZE;
+}
+
+/* Index, caller holds db->lock */
+
+static struct kv_entry **kv_find(struct kv_db *db, const void *key,
+				 size_t klen, uint64_t hash)
+{
+	struct kv_entry **pe = &db->table[hash & (db->nbuckets - 1)];
+
+	for (; *pe != NULL; pe = &(*pe)->next)
+		if (((*pe)->hash == hash) && ((*pe)->klen == klen) &&
+		    (memcmp((*pe)->key, key, klen) == 0))
+			break;
+	return pe;
+}
+
+static void kv_grow(struct kv_db *db)
+{
+	size_t i, n = db->nbuckets * 2;
+	struct kv_entry **t, *e, *next;
+
+	t = calloc(n, sizeof(*t));
+	if (t == NULL)
+		return;			/* longer chains, still works */
+	for (i = 0; i < db->nbuckets; i++) {
+		for (e = db->table[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = t[e->hash & (n - 1)];
+			t[e->hash & (n - 1)] = e;
+		}
+	}
+	free(db->table);
+	db->table = t;
+	db->nbuckets = n;
+}
+
+static int kv_index_set(struct kv_db *db, const void *key, size_t klen,
+			uint64_t hash, uint64_t voff, uint32_t off,
+			uint32_t vlen)
+{
+	struct kv_entry **pe = kv_find(db, key, klen, hash), *e = *pe;
+
+	if (e == NULL) {
+		e = malloc(sizeof(*e) + klen);
+		if (e == NULL)
+			return -1;
+		e->next = NULL;
+		e->hash = hash;
+		e->klen = klen;
+		memcpy(e->key, key, klen);
+		*pe = e;
+		db->st.keys++;
+		if (db->st.keys > db->nbuckets)
+			kv_grow(db);
+	} else
+		db->live_bytes -= kv_rec_size(e->klen, e->vlen);
+
+	e->voff = voff;
+	e->off = off;
+	e->vlen = vlen;
+	db->live_bytes += kv_rec_size(klen, vlen);
+	return 0;
+}
+
+static void kv_index_del(struct kv_db *db, const void *key, size_t klen,
+			 uint64_t hash)
+{
+	struct kv_entry **pe = kv_find(db, key, klen, hash), *e = *pe;
+
+	if (e == NULL)
+		return;
+	*pe = e->next;
+	db->live_bytes -= kv_rec_size(e->klen, e->vlen);
+	db->st.keys--;
+	free(e);
+}
+
+static void kv_index_free(struct kv_db *db)
+{
+	size_t i;
+	struct kv_entry *e, *next;
+
+	for (i = 0; i < db->nbuckets; i++)
+		for (e = db->table[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e);
+		}
+	free(db->table);
+	db->table = NULL;
+}
+
+/* Log */
+
+static uint64_t kv_used(struct kv_db *db)
+{
+	return db->tail - db->head;
+}
+
+/* Less than the reserve left behind the batch being filled */
+static int kv_space_low(struct kv_db *db)
+{
+	return db->tail + 3 * db->opts.batch_blocks - db->head > db->log_size;
+}
+
+/*
+ * Reserve the space for the next batch. The last two batches of the
+ * log are kept for compaction, which needs them to free space.
+ */
+static int kv_fill_open(struct kv_db *db)
+{
+	struct kv_buf *b = db->fill;
+	uint64_t voff = kv_place(db, db->tail);
+	uint64_t reserve = db->compacting ? 0 : 2 * db->opts.batch_blocks;
+
+	if (voff + db->opts.batch_blocks + reserve - db->head > db->log_size)
+		return -1;
+
+	b->voff = voff;
+	b->bytes = sizeof(struct kv_batch_hdr);
+	b->nrecords = 0;
+	b->full = 0;
+	b->open = 1;
+	db->tail = voff;
+	return 0;
+}
+
+static int kv_write_sb(struct kv_db *db, uint64_t head)
+{
+	int rc;
+	struct kv_sb *sb;
+
+	if (posix_memalign((void **)&sb, KV_BLOCK_SIZE, KV_BLOCK_SIZE) != 0)
+		return -1;
+	memset(sb, 0, KV_BLOCK_SIZE);
+	memcpy(sb->magic, KV_SB_MAGIC, sizeof(sb->magic));
+	sb->version = KV_SB_VERSION;
+	sb->log_start = db->log_start;
+	sb->log_size = db->log_size;
+	sb->head = head;
+	sb->batch_blocks = db->opts.batch_blocks;
+	sb->store_id = db->store_id;
+	sb->crc = kv_crc32(0, sb, sizeof(*sb));
+
+	rc = cblk_write(db->cid, sb, db->opts.start_lba, 1, 0);
+	free(sb);
+	return (rc == 1) ? 0 : -1;
+}
+
+/*
+ * Append a record to the batch being filled, waiting for a buffer
+ * with enough room. Only compaction (reloc) may append to a batch in
+ * the reserve. Caller holds db->lock. Returns the position.
+ */
+static int kv_append(struct kv_db *db, const void *key, size_t klen,
+		     const void *val, size_t vlen, unsigned int flags,
+		     int reloc, uint64_t *voff, uint32_t *off)
+{
+	struct kv_buf *b;
+	struct kv_rec rec;
+	uint32_t size = kv_rec_size(klen, vlen);
+
+	if ((klen == 0) || (klen > KV_KEY_MAX) ||
+	    (size + sizeof(struct kv_batch_hdr) > db->batch_bytes)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (1) {
+		if (db->err) {
+			errno = db->err;
+			return -1;
+		}
+		b = db->fill;
+		if (b->open && !reloc && kv_space_low(db)) {
+			pthread_cond_signal(&db->compact_c);
+			pthread_cond_wait(&db->done_c, &db->lock);
+			continue;
+		}
+		if (b->open && (b->bytes + size <= db->batch_bytes))
+			break;
+		if (b->open)
+			b->full = 1;
+		else
+			pthread_cond_signal(&db->compact_c);	/* space */
+		pthread_cond_signal(&db->commit_c);
+		pthread_cond_wait(&db->done_c, &db->lock);
+	}
+
+	rec.klen = klen;
+	rec.flags = flags;
+	rec.vlen = vlen;
+	*voff = b->voff;
+	*off = b->bytes;
+	memcpy(b->data + b->bytes, &rec, sizeof(rec));
+	memcpy(b->data + b->bytes + sizeof(rec), key, klen);
+	if (vlen)
+		memcpy(b->data + b->bytes + sizeof(rec) + klen, val, vlen);
+	b->bytes += size;
+
+	if (b->nrecords++ == 0) {
+		db->fill_first_ns = kv_now();
+		pthread_cond_signal(&db->commit_c);
+	}
+	return 0;
+}
+
+/* Wait until the batch at voff is written, caller holds db->lock */
+static int kv_wait_durable(struct kv_db *db, uint64_t voff)
+{
+	db->waiters++;
+	pthread_cond_signal(&db->commit_c);
+	while ((db->committed <= voff) && !db->err)
+		pthread_cond_wait(&db->done_c, &db->lock);
+	db->waiters--;
+	if (db->err) {
+		errno = db->err;
+		return -1;
+	}
+	return 0;
+}
+
+static int kv_commit_due(struct kv_db *db)
+{
+	struct kv_buf *b = db->fill;
+
+	if (!b->open || (b->nrecords == 0))
+		return 0;
+	if (b->full || db->waiters || db->stop)
+		return 1;
+	return kv_now() >= db->fill_first_ns + db->opts.commit_usec * 1000ull;
+}
+
+static void *kv_commit_thread(void *arg)
+{
+	struct kv_db *db = (struct kv_db *)arg;
+	struct kv_buf *b;
+	struct kv_batch_hdr *hdr;
+	struct timespec ts;
+	uint64_t due;
+	uint32_t nblocks;
+	int rc;
+
+	pthread_mutex_lock(&db->lock);
+	while (1) {
+		if (!db->fill->open && (kv_fill_open(db) == 0))
+			pthread_cond_broadcast(&db->done_c);
+
+		if (!kv_commit_due(db)) {
+			if (db->stop)
+				break;
+			if (db->fill->open && db->fill->nrecords) {
+				due = db->fill_first_ns +
+					db->opts.commit_usec * 1000ull;
+				ts.tv_sec = due / 1000000000ull;
+				ts.tv_nsec = due % 1000000000ull;
+				pthread_cond_timedwait(&db->commit_c,
+						       &db->lock, &ts);
+			} else
+				pthread_cond_wait(&db->commit_c, &db->lock);
+			continue;
+		}
+
+		/* Swap buffers, callers go on with the other one */
+		b = db->fill;
+		nblocks = kv_blocks(b->bytes);
+		db->wr = b;
+		db->fill = (b == &db->buf[0]) ? &db->buf[1] : &db->buf[0];
+		db->fill->open = 0;
+		db->tail = b->voff + nblocks;
+		if (kv_fill_open(db) == 0)
+			pthread_cond_broadcast(&db->done_c);
+		pthread_mutex_unlock(&db->lock);
+
+		hdr = (struct kv_batch_hdr *)b->data;
+		memset(b->data + b->bytes, 0, nblocks * KV_BLOCK_SIZE -
+		       b->bytes);
+		hdr->magic = KV_BATCH_MAGIC;
+		hdr->crc = 0;
+		hdr->voff = b->voff;
+		hdr->bytes = b->bytes;
+		hdr->nblocks = nblocks;
+		hdr->nrecords = b->nrecords;
+		hdr->pad = 0;
+		hdr->store_id = db->store_id;
+		hdr->crc = kv_crc32(0, b->data, b->bytes);
+
+		rc = cblk_write(db->cid, b->data, kv_lba(db, b->voff),
+				nblocks, 0);
+
+		pthread_mutex_lock(&db->lock);
+		if (rc != (int)nblocks) {
+			fprintf(stderr, "[%s] err: writing batch LBA=%lld "
+				"failed: %s\n", __func__,
+				(long long)kv_lba(db, b->voff),
+				strerror(errno));
+			db->err = EIO;
+		}
+		db->st.batches++;
+		db->st.batch_records += b->nrecords;
+		db->st.batch_blocks += nblocks;
+		db->committed = b->voff + nblocks;
+		b->open = 0;
+		db->wr = NULL;
+		pthread_cond_broadcast(&db->done_c);
+		pthread_cond_signal(&db->compact_c);
+	}
+	pthread_mutex_unlock(&db->lock);
+	return NULL;
+}
+
+/*
+ * Read the batch at voff into buf (batch_blocks blocks) and check it.
+ * Returns the header or NULL if there is no valid batch. Batches of a
+ * store created earlier on the same blocks have another store_id.
+ */
+static struct kv_batch_hdr *kv_read_batch(struct kv_db *db, uint64_t voff,
+					  uint8_t *buf)
+{
+	struct kv_batch_hdr *hdr = (struct kv_batch_hdr *)buf;
+	uint32_t crc, n = db->opts.batch_blocks;
+
+	if (cblk_read(db->cid, buf, kv_lba(db, voff), 1, 0) != 1)
+		return NULL;
+	if ((hdr->magic != KV_BATCH_MAGIC) || (hdr->voff != voff) ||
+	    (hdr->store_id != db->store_id) ||
+	    (hdr->nblocks == 0) || (hdr->nblocks > n) ||
+	    (hdr->bytes > hdr->nblocks * KV_BLOCK_SIZE) ||
+	    (hdr->bytes < sizeof(*hdr)))
+		return NULL;
+	if ((hdr->nblocks > 1) &&
+	    (cblk_read(db->cid, buf + KV_BLOCK_SIZE, kv_lba(db, voff) + 1,
+		       hdr->nblocks - 1, 0) != (int)hdr->nblocks - 1))
+		return NULL;
+
+	crc = hdr->crc;
+	hdr->crc = 0;
+	if (kv_crc32(0, buf, hdr->bytes) != crc)
+		return NULL;
+	hdr->crc = crc;
+	return hdr;
+}
+
+/* Walk the records of a batch, stops at a malformed one */
+static struct kv_rec *kv_next_rec(struct kv_batch_hdr *hdr, uint32_t *off)
+{
+	struct kv_rec *rec;
+
+	if (*off + sizeof(*rec) > hdr->bytes)
+		return NULL;
+	rec = (struct kv_rec *)((uint8_t *)hdr + *off);
+	if (*off + kv_rec_size(rec->klen, rec->vlen) > hdr->bytes)
+		return NULL;
+	return rec;
+}
+
+static void *kv_compact_thread(void *arg)
+{
+	struct kv_db *db = (struct kv_db *)arg;
+	struct kv_batch_hdr *hdr;
+	struct kv_rec *rec;
+	struct kv_entry *e;
+	uint8_t *buf, *key;
+	uint64_t voff, head, end, last, hash;
+	uint32_t off, roff, noff;
+	unsigned int n;
+	int moved, failed = 0, rc;
+
+	if (posix_memalign((void **)&buf, KV_BLOCK_SIZE,
+			   db->batch_bytes) != 0)
+		return NULL;
+
+	pthread_mutex_lock(&db->lock);
+	while (!db->stop && !failed) {
+		if (db->scans || (db->head >= db->committed) ||
+		    (db->fill->open && !kv_space_low(db) &&
+		     (kv_used(db) * 100 <=
+		      (uint64_t)db->opts.compact_pct * db->log_size))) {
+			pthread_cond_wait(&db->compact_c, &db->lock);
+			continue;
+		}
+
+		/* Copy the live records of up to KV_COMPACT_BATCHES */
+		head = db->head;
+		end = db->committed;
+		last = 0;
+		moved = 0;
+		db->compacting = 1;
+		for (n = 0; (n < KV_COMPACT_BATCHES) && (head < end) &&
+			     !failed; n++) {
+			/* Each batch may need a whole batch to relocate */
+			if (n && (kv_place(db, db->tail + db->opts.batch_blocks) +
+				  db->opts.batch_blocks - db->head >
+				  db->log_size))
+				break;
+			pthread_mutex_unlock(&db->lock);
+			hdr = kv_read_batch(db, head, buf);
+			pthread_mutex_lock(&db->lock);
+			if (hdr == NULL) {
+				fprintf(stderr, "[%s] err: batch at LBA=%lld "
+					"unreadable, compaction stopped\n",
+					__func__, (long long)kv_lba(db, head));
+				failed = 1;
+				break;
+			}
+
+			off = sizeof(*hdr);
+			while ((rec = kv_next_rec(hdr, &off)) != NULL) {
+				roff = off;
+				off += kv_rec_size(rec->klen, rec->vlen);
+				if (rec->flags & KV_REC_TOMBSTONE)
+					continue;	/* nothing older left */
+				key = (uint8_t *)(rec + 1);
+				hash = kv_hash(key, rec->klen);
+				e = *kv_find(db, key, rec->klen, hash);
+				if ((e == NULL) || (e->voff != head) ||
+				    (e->off != roff))
+					continue;	/* overwritten */
+				if (kv_append(db, key, rec->klen,
+					      key + rec->klen, rec->vlen, 0, 1,
+					      &voff, &noff) != 0) {
+					failed = 1;
+					break;
+				}
+				last = voff;
+				moved = 1;
+				db->st.relocated++;
+
+				/* kv_append() may have waited */
+				e = *kv_find(db, key, rec->klen, hash);
+				if ((e != NULL) && (e->voff == head) &&
+				    (e->off == roff)) {
+					e->voff = voff;
+					e->off = noff;
+				}
+			}
+			if (failed)
+				break;
+			db->st.compactions++;
+			head = kv_place(db, head + hdr->nblocks);
+		}
+
+		/* Relocated records first, then the superblock */
+		if (failed || (moved && (kv_wait_durable(db, last) != 0)))
+			break;
+		pthread_mutex_unlock(&db->lock);
+		rc = kv_write_sb(db, head);
+		pthread_mutex_lock(&db->lock);
+		if (rc != 0) {
+			fprintf(stderr, "[%s] err: writing superblock failed\n",
+				__func__);
+			break;
+		}
+		db->head = head;
+		db->compacting = 0;
+		pthread_cond_broadcast(&db->done_c);
+		pthread_cond_signal(&db->commit_c);	/* space */
+	}
+	db->compacting = 0;
+	pthread_cond_broadcast(&db->done_c);
+	pthread_mutex_unlock(&db->lock);
+	free(buf);
+	return NULL;
+}
+
+/* Rebuild the index from the log, sets the tail */
+static int kv_recover(struct kv_db *db)
+{
+	struct kv_batch_hdr *hdr;
+	struct kv_rec *rec;
+	uint8_t *buf, *key;
+	uint64_t voff = db->head, stime = kv_now();
+	uint32_t off, roff;
+
+	if (posix_memalign((void **)&buf, KV_BLOCK_SIZE,
+			   db->batch_bytes) != 0)
+		return -1;
+
+	while (1) {
+		voff = kv_place(db, voff);
+		if (voff + db->opts.batch_blocks - db->head > db->log_size)
+			break;
+		hdr = kv_read_batch(db, voff, buf);
+		if (hdr == NULL)
+			break;
+
+		off = sizeof(*hdr);
+		while ((rec = kv_next_rec(hdr, &off)) != NULL) {
+			roff = off;
+			off += kv_rec_size(rec->klen, rec->vlen);
+			key = (uint8_t *)(rec + 1);
+			db->st.recovered++;
+			if (rec->flags & KV_REC_TOMBSTONE)
+				kv_index_del(db, key, rec->klen,
+					     kv_hash(key, rec->klen));
+			else if (kv_index_set(db, key, rec->klen,
+					      kv_hash(key, rec->klen), voff,
+					      roff, rec->vlen) != 0) {
+				free(buf);
+				return -1;
+			}
+		}
+		voff += hdr->nblocks;
+	}
+	free(buf);
+
+	db->tail = voff;
+	db->committed = voff;
+	db->st.recovery_usec = (kv_now() - stime) / 1000;
+	return 0;
+}
+
+/* Tells the batches of this store from those of an earlier one */
+static uint64_t kv_new_store_id(struct kv_db *db)
+{
+	struct {
+		struct timespec rt;
+		uint64_t ns;
+		pid_t pid;
+		void *db;
+	} seed;
+	uint64_t id;
+
+	memset(&seed, 0, sizeof(seed));
+	clock_gettime(CLOCK_REALTIME, &seed.rt);
+	seed.ns = kv_now();
+	seed.pid = getpid();
+	seed.db = db;
+	id = kv_hash(&seed, sizeof(seed));
+	return id ? id : 1;
+}
+
+void kv_options_init(struct kv_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->batch_blocks = CONFIG_BATCH_BLOCKS;
+	opts->sync = 1;
+	opts->compact_pct = CONFIG_COMPACT_PCT;
+}
+
+struct kv_db *kv_open(chunk_id_t cid, const struct kv_options *opts,
+		      int flags)
+{
+	struct kv_db *db;
+	struct kv_sb *sb = NULL;
+	size_t lun_size = 0;
+	uint32_t crc;
+	unsigned int i;
+
+	pthread_once(&kv_crc_once, kv_crc_init);
+	if (cblk_get_lun_size(cid, &lun_size, 0) < 0)
+		return NULL;
+
+	db = calloc(1, sizeof(*db));
+	if (db == NULL)
+		return NULL;
+	db->cid = cid;
+	db->opts = *opts;
+	pthread_mutex_init(&db->lock, NULL);
+	pthread_cond_init(&db->commit_c, NULL);
+	pthread_cond_init(&db->done_c, NULL);
+	pthread_cond_init(&db->compact_c, NULL);
+
+	if (posix_memalign((void **)&sb, KV_BLOCK_SIZE, KV_BLOCK_SIZE) != 0)
+		goto err_out;
+
+	if (flags & KV_CREATE) {
+		if (db->opts.nblocks == 0)
+			db->opts.nblocks = lun_size - db->opts.start_lba;
+		db->log_start = db->opts.start_lba + 1;
+		db->log_size = db->opts.nblocks - 1;
+		if ((db->opts.batch_blocks == 0) ||
+		    (db->opts.batch_blocks > KV_BATCH_BLOCKS_MAX) ||
+		    (db->opts.start_lba + db->opts.nblocks > lun_size) ||
+		    (db->log_size < 8 * db->opts.batch_blocks)) {
+			errno = EINVAL;
+			goto err_out;
+		}
+		db->store_id = kv_new_store_id(db);
+		if (kv_write_sb(db, 0) != 0)
+			goto err_out;
+		db->head = 0;
+		db->tail = 0;
+		db->committed = 0;
+	} else {
+		if (cblk_read(cid, sb, db->opts.start_lba, 1, 0) != 1)
+			goto err_out;
+		crc = sb->crc;
+		sb->crc = 0;
+		if ((memcmp(sb->magic, KV_SB_MAGIC, sizeof(sb->magic)) != 0) ||
+		    (sb->version != KV_SB_VERSION) ||
+		    (kv_crc32(0, sb, sizeof(*sb)) != crc) ||
+		    (sb->batch_blocks == 0) ||
+		    (sb->batch_blocks > KV_BATCH_BLOCKS_MAX) ||
+		    (sb->log_start + sb->log_size > lun_size)) {
+			fprintf(stderr, "[%s] err: no store at LBA=%zu\n",
+				__func__, db->opts.start_lba);
+			errno = EINVAL;
+			goto err_out;
+		}
+		db->log_start = sb->log_start;
+		db->log_size = sb->log_size;
+		db->head = sb->head;
+		db->store_id = sb->store_id;
+		db->opts.batch_blocks = sb->batch_blocks;
+		db->opts.nblocks = sb->log_size + 1;
+	}
+	db->batch_bytes = db->opts.batch_blocks * KV_BLOCK_SIZE;
+	db->st.log_size = db->log_size;
+
+	db->nbuckets = KV_HASH_INIT;
+	db->table = calloc(db->nbuckets, sizeof(*db->table));
+	if (db->table == NULL)
+		goto err_out;
+	for (i = 0; i < 2; i++)
+		if (posix_memalign((void **)&db->buf[i].data, KV_BLOCK_SIZE,
+				   db->batch_bytes) != 0)
+			goto err_out;
+
+	/* A new store starts empty, whatever the log blocks hold */
+	if (!(flags & KV_CREATE) && (kv_recover(db) != 0))
+		goto err_out;
+	db->fill = &db->buf[0];
+	kv_fill_open(db);
+
+	if (pthread_create(&db->commit_tid, NULL, kv_commit_thread, db) != 0)
+		goto err_out;
+	if (pthread_create(&db->compact_tid, NULL, kv_compact_thread,
+			   db) != 0) {
+		pthread_mutex_lock(&db->lock);
+		db->stop = 1;
+		pthread_cond_signal(&db->commit_c);
+		pthread_mutex_unlock(&db->lock);
+		pthread_join(db->commit_tid, NULL);
+		goto err_out;
+	}
+	free(sb);
+	return db;
+
+ err_out:
+	free(sb);
+	if (db->table != NULL)
+		kv_index_free(db);
+	free(db->buf[0].data);
+	free(db->buf[1].data);
+	free(db);
+	return NULL;
+}
+
+int kv_close(struct kv_db *db)
+{
+	int rc = 0;
+
+	if (db == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&db->lock);
+	db->stop = 1;
+	pthread_cond_signal(&db->compact_c);
+	pthread_mutex_unlock(&db->lock);
+	pthread_join(db->compact_tid, NULL);
+
+	/* The commit thread writes what is left before it stops */
+	pthread_mutex_lock(&db->lock);
+	pthread_cond_signal(&db->commit_c);
+	pthread_mutex_unlock(&db->lock);
+	pthread_join(db->commit_tid, NULL);
+
+	if (db->err) {
+		errno = db->err;
+		rc = -1;
+	} else if (kv_write_sb(db, db->head) != 0)
+		rc = -1;
+
+	kv_index_free(db);
+	free(db->buf[0].data);
+	free(db->buf[1].data);
+	pthread_mutex_destroy(&db->lock);
+	pthread_cond_destroy(&db->commit_c);
+	pthread_cond_destroy(&db->done_c);
+	pthread_cond_destroy(&db->compact_c);
+	free(db);
+	return rc;
+}
+
+static int __kv_write(struct kv_db *db, const void *key, size_t klen,
+		      const void *val, size_t vlen, unsigned int flags)
+{
+	uint64_t voff, hash = kv_hash(key, klen);
+	uint32_t off;
+	int rc = 0;
+
+	pthread_mutex_lock(&db->lock);
+	if (!(flags & KV_REC_TOMBSTONE) &&
+	    (db->live_bytes + kv_rec_size(klen, vlen) >
+	     db->log_size * KV_BLOCK_SIZE / 100 * KV_LIVE_MAX_PCT)) {
+		pthread_mutex_unlock(&db->lock);
+		errno = ENOSPC;
+		return -1;
+	}
+	if (kv_append(db, key, klen, val, vlen, flags, 0, &voff, &off) != 0) {
+		pthread_mutex_unlock(&db->lock);
+		return -1;
+	}
+	if (flags & KV_REC_TOMBSTONE) {
+		kv_index_del(db, key, klen, hash);
+		db->st.deletes++;
+	} else {
+		rc = kv_index_set(db, key, klen, hash, voff, off, vlen);
+		db->st.puts++;
+	}
+	if ((rc == 0) && db->opts.sync)
+		rc = kv_wait_durable(db, voff);
+	pthread_mutex_unlock(&db->lock);
+	return rc;
+}
+
+int kv_put(struct kv_db *db, const void *key, size_t klen,
+	   const void *val, size_t vlen)
+{
+	return __kv_write(db, key, klen, val, vlen, 0);
+}
+
+int kv_delete(struct kv_db *db, const void *key, size_t klen)
+{
+	return __kv_write(db, key, klen, NULL, 0, KV_REC_TOMBSTONE);
+}
+
+int kv_sync(struct kv_db *db)
+{
+	int rc = 0;
+	struct kv_buf *b;
+
+	pthread_mutex_lock(&db->lock);
+	b = db->fill;
+	if (b->open && b->nrecords)
+		rc = kv_wait_durable(db, b->voff);
+	else if (db->wr != NULL)
+		rc = kv_wait_durable(db, db->wr->voff);
+	pthread_mutex_unlock(&db->lock);
+	return rc;
+}
+
+int kv_get(struct kv_db *db, const void *key, size_t klen,
+	   void *val, size_t *vlen)
+{
+	struct kv_entry *e;
+	struct kv_buf *b = NULL;
+	struct kv_rec *rec;
+	uint64_t voff, lba, hash = kv_hash(key, klen);
+	uint32_t off, size, nblocks;
+	uint8_t *buf = NULL;
+	int rc = -1;
+
+	__sync_fetch_and_add(&db->st.gets, 1);
+	pthread_mutex_lock(&db->lock);
+	while (1) {
+		e = *kv_find(db, key, klen, hash);
+		if (e == NULL) {
+			errno = ENOENT;
+			break;
+		}
+		if (e->vlen > *vlen) {
+			*vlen = e->vlen;
+			errno = ERANGE;
+			break;
+		}
+
+		/* Not written yet */
+		if (db->fill->open && (e->voff == db->fill->voff))
+			b = db->fill;
+		else if ((db->wr != NULL) && (e->voff == db->wr->voff))
+			b = db->wr;
+		if (b != NULL) {
+			memcpy(val, b->data + e->off + sizeof(*rec) + klen,
+			       e->vlen);
+			*vlen = e->vlen;
+			rc = 0;
+			break;
+		}
+
+		voff = e->voff;
+		off = e->off;
+		size = kv_rec_size(klen, e->vlen);
+		pthread_mutex_unlock(&db->lock);
+
+		lba = kv_lba(db, voff) + off / KV_BLOCK_SIZE;
+		nblocks = kv_blocks(off % KV_BLOCK_SIZE + size);
+		free(buf);
+		if (posix_memalign((void **)&buf, KV_BLOCK_SIZE,
+				   nblocks * KV_BLOCK_SIZE) != 0) {
+			buf = NULL;
+			pthread_mutex_lock(&db->lock);
+			break;
+		}
+		if (cblk_read(db->cid, buf, lba, nblocks, 0) != (int)nblocks) {
+			pthread_mutex_lock(&db->lock);
+			break;
+		}
+
+		/* Compaction might have moved it meanwhile */
+		pthread_mutex_lock(&db->lock);
+		e = *kv_find(db, key, klen, hash);
+		if ((e == NULL) || (e->voff != voff) || (e->off != off))
+			continue;
+		rec = (struct kv_rec *)(buf + off % KV_BLOCK_SIZE);
+		if ((rec->klen != klen) || (rec->vlen != e->vlen) ||
+		    (memcmp(rec + 1, key, klen) != 0)) {
+			fprintf(stderr, "[%s] err: record at LBA=%lld "
+				"does not match the index\n", __func__,
+				(long long)lba);
+			errno = EIO;
+			break;
+		}
+		memcpy(val, (uint8_t *)(rec + 1) + klen, rec->vlen);
+		*vlen = rec->vlen;
+		rc = 0;
+		break;
+	}
+	pthread_mutex_unlock(&db->lock);
+	free(buf);
+	return rc;
+}
+
+int kv_scan(struct kv_db *db, kv_scan_f fn, void *arg)
+{
+	struct kv_batch_hdr *hdr;
+	struct kv_rec *rec;
+	struct kv_entry *e;
+	uint8_t *buf, *key;
+	uint64_t voff, end;
+	uint32_t off, roff;
+	int live, rc = 0;
+
+	if (posix_memalign((void **)&buf, KV_BLOCK_SIZE,
+			   db->batch_bytes) != 0)
+		return -1;
+
+	/* Compaction stays away, the batches do not move */
+	pthread_mutex_lock(&db->lock);
+	while (db->compacting)
+		pthread_cond_wait(&db->done_c, &db->lock);
+	db->scans++;
+	voff = db->head;
+	end = db->committed;
+	pthread_mutex_unlock(&db->lock);
+
+	while ((rc == 0) && (voff < end)) {
+		hdr = kv_read_batch(db, voff, buf);
+		if (hdr == NULL) {
+			errno = EIO;
+			rc = -1;
+			break;
+		}
+		off = sizeof(*hdr);
+		while ((rc == 0) && ((rec = kv_next_rec(hdr, &off)) != NULL)) {
+			roff = off;
+			off += kv_rec_size(rec->klen, rec->vlen);
+			if (rec->flags & KV_REC_TOMBSTONE)
+				continue;
+			key = (uint8_t *)(rec + 1);
+			pthread_mutex_lock(&db->lock);
+			e = *kv_find(db, key, rec->klen,
+				     kv_hash(key, rec->klen));
+			live = (e != NULL) && (e->voff == voff) &&
+				(e->off == roff);
+			pthread_mutex_unlock(&db->lock);
+			if (live)
+				rc = fn(arg, key, rec->klen, key + rec->klen,
+					rec->vlen);
+		}
+		voff = kv_place(db, voff + hdr->nblocks);
+	}
+
+	pthread_mutex_lock(&db->lock);
+	db->scans--;
+	pthread_cond_signal(&db->compact_c);
+	pthread_mutex_unlock(&db->lock);
+	free(buf);
+	return rc;
+}
+
+void kv_get_stats(struct kv_db *db, struct kv_stats *stats)
+{
+	pthread_mutex_lock(&db->lock);
+	*stats = db->st;
+	stats->log_used = kv_used(db);
+	pthread_mutex_unlock(&db->lock);
+}
@@ -0,0 +1,114 @@
+#ifndef __SNAPKV_H__
+#define __SNAPKV_H__
+
+/**
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Log-structured key/value store on top of capiblock
+ *
+ * A reference for a record layer on the NVMe example. All records go
+ * to an append-only circular log on the device, written in batches
+ * with cblk_write(). Puts arriving while a batch is written are
+ * collected into the next one, which is written as one request
+ * (group commit). An in-memory hash index maps each key to its
+ * latest record. A compaction thread copies the live records at the
+ * head of the log to its tail and gives the space back. On open, the
+ * index is rebuilt by reading the log from the head.
+ *
+ * Keys and values are byte strings. A value must fit into one batch.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <capiblock.h>
+
+#define KV_CREATE		0x0001	/* initialize a new store */
+
+#define KV_KEY_MAX		1024	/* bytes */
+#define KV_BATCH_BLOCKS_MAX	32	/* 4 KiB blocks per batch */
+
+struct kv_db;
+
+struct kv_options {
+	size_t start_lba;	/* superblock, the log follows */
+	size_t nblocks;		/* blocks used, 0: up to the end */
+	unsigned int batch_blocks;	/* size of a batch, 1..32 */
+	unsigned int commit_usec;	/* wait for more puts, 0: none */
+	int sync;		/* kv_put() returns once durable */
+	unsigned int compact_pct;	/* start compaction above this */
+};
+
+struct kv_stats {
+	uint64_t puts;
+	uint64_t gets;
+	uint64_t deletes;
+	uint64_t batches;	/* log writes */
+	uint64_t batch_records;	/* records in these writes */
+	uint64_t batch_blocks;
+	uint64_t compactions;	/* batches compacted */
+	uint64_t relocated;	/* live records copied by compaction */
+	uint64_t keys;		/* in the index */
+	uint64_t log_used;	/* blocks between head and tail */
+	uint64_t log_size;
+	uint64_t recovery_usec;	/* rebuilding the index on open */
+	uint64_t recovered;	/* records read on open */
+};
+
+/* Defaults: whole device, 16 blocks per batch, sync puts */
+void kv_options_init(struct kv_options *opts);
+
+/*
+ * Open the store on an opened capiblock chunk. With KV_CREATE a new
+ * store is initialized, else the existing one is recovered.
+ * Returns NULL with errno set on failure.
+ */
+struct kv_db *kv_open(chunk_id_t cid, const struct kv_options *opts,
+		      int flags);
+
+/* Writes what is pending and stops the threads. */
+int kv_close(struct kv_db *db);
+
+/* Returns 0 or -1 with errno set, ENOSPC if the log is full of live data */
+int kv_put(struct kv_db *db, const void *key, size_t klen,
+	   const void *val, size_t vlen);
+
+/*
+ * Copies the value into val, *vlen is its size on input and the
+ * length of the value on return. ENOENT if the key does not exist,
+ * ERANGE if val is too small.
+ */
+int kv_get(struct kv_db *db, const void *key, size_t klen,
+	   void *val, size_t *vlen);
+
+int kv_delete(struct kv_db *db, const void *key, size_t klen);
+
+/* Wait until all puts and deletes before are on the device */
+int kv_sync(struct kv_db *db);
+
+typedef int (* kv_scan_f)(void *arg, const void *key, size_t klen,
+			  const void *val, size_t vlen);
+
+/*
+ * Calls fn for each live record, in log order. The log is read
+ * sequentially, records written during the scan might be missed.
+ * A nonzero return value of fn stops the scan and is returned.
+ */
+int kv_scan(struct kv_db *db, kv_scan_f fn, void *arg);
+
+void kv_get_stats(struct kv_db *db, struct kv_stats *stats);
+
+#endif	/* __SNAPKV_H__ */
@@ -0,0 +1,911 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Workload generator for capiblock, see workload.h.
+ *
+ * Threads do not share a request queue. Each one draws its requests
+ * from its own random number generator, only the number of requests
+ * issued (and the position in a replayed log) is a shared counter.
+ * Requests beyond iodepth 1 use cblk_aread()/cblk_awrite() with user
+ * tags, the thread harvests its own tags only. Latencies are taken
+ * when the thread harvests a request. Only those are limited to
+ * WL_NBLOCKS_MAX blocks, cblk_read()/cblk_write() take any size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <snap_tools.h>
+#include <capiblock.h>
+
+#include "workload.h"
+
+#define __CBLK_BLOCK_SIZE	4096
+#define WL_NBLOCKS_MAX		32	/* cblk_aread() limit */
+#define WL_AWRITE_MAX		2	/* cblk_awrite() limit */
+#define WL_PARTS_MAX		(WL_NBLOCKS_MAX / WL_AWRITE_MAX)
+#define WL_IODEPTH_MAX		16	/* request slots of the action */
+#define WL_ZETA_EXACT		1000000	/* terms summed up, then estimated */
+#define WL_SCRAMBLE		2654435761ull	/* prime, spreads zipf ranks */
+
+/* One request of a replayed log */
+struct wl_trace_op {
+	unsigned long lba;
+	unsigned int nblocks;
+	enum wl_op op;
+};
+
+/*
+ * Zipf ranks as in Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", O(1) per rank after computing zeta(n).
+ */
+struct wl_zipf {
+	unsigned long n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+	double half_pow;
+};
+
+/* A request in flight, writes beyond WL_AWRITE_MAX blocks are split */
+struct wl_io {
+	int busy;
+	enum wl_op op;
+	unsigned long lba;
+	unsigned int nblocks;
+	unsigned int nparts;
+	unsigned int started;		/* parts which got a slot */
+	unsigned int done;		/* parts harvested */
+	int tag[WL_PARTS_MAX];
+	uint64_t stime;			/* nsec */
+	uint8_t *buf;
+};
+
+struct wl_thread {
+	pthread_t tid;
+	unsigned int num;
+	int rc;
+	uint64_t rnd;			/* xorshift64* state */
+	unsigned long seq_lba;		/* next LBA for WL_DIST_SEQ */
+	unsigned long seq_start;	/* part of the range of the thread */
+	unsigned long seq_end;
+	uint64_t next_ns;		/* rate limit: next issue */
+	uint64_t period_ns;
+	uint8_t *buf;
+	struct wl_io io[WL_IODEPTH_MAX];
+	struct wl_stats st[WL_OP_MAX];
+};
+
+static struct wl_config *wl_cfg;
+static struct wl_zipf wl_zipf;
+static struct wl_trace_op *wl_trace;
+static unsigned long wl_trace_n;
+static unsigned long wl_units;		/* bs_min sized units in the range */
+static unsigned long wl_issued;		/* requests taken by all threads */
+static uint64_t wl_deadline;		/* nsec, 0: none */
+static int wl_failed;
+
+static const char *wl_op_name[WL_OP_MAX] = { "read", "write" };
+static const char *wl_dist_name[WL_DIST_MAX] = {
+	"uniform", "seq", "zipf", "hotspot",
+};
+
+static inline uint64_t wl_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static inline uint64_t wl_rand(struct wl_thread *t)
+{
+	t->rnd ^= t->rnd >> 12;
+	t->rnd ^= t->rnd << 25;
+	t->rnd ^= t->rnd >> 27;
+	return t->rnd * 0x2545f4914f6cdd1dull;
+}
+
+/* Uniform in [0, 1) */
+static inline double wl_rand01(struct wl_thread *t)
+{
+	return (wl_rand(t) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Histogram buckets: values below 16 have their own bucket, above
+ * each power of 2 is split into 16 buckets, which keeps the error of
+ * a percentile below 1/16.
+ */
+static inline unsigned int wl_lat_idx(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < 16)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - 3) * 16 + ((v >> (msb - 4)) & 15);
+}
+
+/* Middle of the bucket */
+static uint64_t wl_lat_val(unsigned int idx)
+{
+	unsigned int msb;
+	uint64_t lo;
+
+	if (idx < 16)
+		return idx;
+	msb = idx / 16 + 3;
+	lo = (uint64_t)(16 + idx % 16) << (msb - 4);
+	return lo + ((1ull << (msb - 4)) >> 1);
+}
+
+void wl_stats_add(struct wl_stats *st, unsigned int nblocks, uint64_t nsec)
+{
+	st->ios++;
+	st->blocks += nblocks;
+	st->lat_sum += nsec;
+	if ((st->lat_min == 0) || (nsec < st->lat_min))
+		st->lat_min = nsec;
+	if (nsec > st->lat_max)
+		st->lat_max = nsec;
+	st->hist[wl_lat_idx(nsec)]++;
+}
+
+void wl_stats_merge(struct wl_stats *to, const struct wl_stats *st)
+{
+	unsigned int i;
+
+	if (st->ios && ((to->lat_min == 0) || (st->lat_min < to->lat_min)))
+		to->lat_min = st->lat_min;
+	if (st->lat_max > to->lat_max)
+		to->lat_max = st->lat_max;
+	to->ios += st->ios;
+	to->blocks += st->blocks;
+	to->errors += st->errors;
+	to->lat_sum += st->lat_sum;
+	for (i = 0; i < WL_LAT_BUCKETS; i++)
+		to->hist[i] += st->hist[i];
+}
+
+uint64_t wl_percentile(const struct wl_stats *st, double pct)
+{
+	unsigned int i;
+	uint64_t n = 0, want;
+
+	if (st->ios == 0)
+		return 0;
+	want = (uint64_t)ceil(st->ios * pct / 100.0);
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < WL_LAT_BUCKETS; i++) {
+		n += st->hist[i];
+		if (n >= want)
+			return MIN(MAX(wl_lat_val(i), st->lat_min),
+				   st->lat_max);
+	}
+	return st->lat_max;
+}
+
+/*
+ * sum(1/i^theta) for i = 1..n. Above WL_ZETA_EXACT terms the rest is
+ * estimated with Euler-Maclaurin, such that large ranges do not take
+ * seconds.
+ */
+static double wl_zeta(unsigned long n, double theta)
+{
+	unsigned long i, m = MIN(n, (unsigned long)WL_ZETA_EXACT);
+	double sum = 0.0;
+
+	for (i = 1; i <= m; i++)
+		sum += pow((double)i, -theta);
+	if (n > m)
+		sum += (pow((double)n, 1.0 - theta) -
+			pow((double)m, 1.0 - theta)) / (1.0 - theta) +
+			(pow((double)n, -theta) - pow((double)m, -theta)) / 2;
+	return sum;
+}
+
+static void wl_zipf_init(struct wl_zipf *z, unsigned long n, double theta)
+{
+	z->n = n;
+	z->theta = theta;
+	z->alpha = 1.0 / (1.0 - theta);
+	z->zetan = wl_zeta(n, theta);
+	z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) /
+		(1.0 - wl_zeta(2, theta) / z->zetan);
+	z->half_pow = 1.0 + pow(0.5, theta);
+}
+
+/* Rank 0 is the most popular one */
+static unsigned long wl_zipf_next(struct wl_zipf *z, double u)
+{
+	double uz = u * z->zetan;
+	unsigned long r;
+
+	if (uz < 1.0)
+		return 0;
+	if (uz < z->half_pow)
+		return 1;
+	r = (unsigned long)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+	return MIN(r, z->n - 1);
+}
+
+void wl_config_init(struct wl_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->bs_min = 1;
+	cfg->bs_max = 1;
+	cfg->read_pct = 100;
+	cfg->dist = WL_DIST_UNIFORM;
+	cfg->zipf_theta = 0.99;
+	cfg->hot_range = 0.1;
+	cfg->hot_io = 0.9;
+	cfg->threads = 1;
+	cfg->iodepth = 1;
+}
+
+int wl_parse_dist(struct wl_config *cfg, const char *spec)
+{
+	char *end;
+	double a, b;
+
+	if (strcmp(spec, "uniform") == 0) {
+		cfg->dist = WL_DIST_UNIFORM;
+		return 0;
+	}
+	if (strcmp(spec, "seq") == 0) {
+		cfg->dist = WL_DIST_SEQ;
+		return 0;
+	}
+	if (strncmp(spec, "zipf", 4) == 0) {
+		cfg->dist = WL_DIST_ZIPF;
+		if (spec[4] == '\0')
+			return 0;
+		if (spec[4] != ':')
+			goto err;
+		a = strtod(spec + 5, &end);
+		if ((*end != '\0') || (a <= 0.0) || (a >= 1.0))
+			goto err;
+		cfg->zipf_theta = a;
+		return 0;
+	}
+	if (strncmp(spec, "hotspot", 7) == 0) {
+		cfg->dist = WL_DIST_HOTSPOT;
+		if (spec[7] == '\0')
+			return 0;
+		if (spec[7] != ':')
+			goto err;
+		a = strtod(spec + 8, &end);
+		if (*end != ':')
+			goto err;
+		b = strtod(end + 1, &end);
+		if ((*end != '\0') || (a <= 0.0) || (a >= 100.0) ||
+		    (b < 0.0) || (b > 100.0))
+			goto err;
+		cfg->hot_range = a / 100.0;
+		cfg->hot_io = b / 100.0;
+		return 0;
+	}
+ err:
+	fprintf(stderr, "err: distribution %s not uniform, seq, "
+		"zipf:<0 < theta < 1> or hotspot:<range%%>:<io%%>\n", spec);
+	errno = EINVAL;
+	return -1;
+}
+
+int wl_parse_bs(struct wl_config *cfg, const char *spec)
+{
+	char *end;
+	unsigned long lo, hi;
+
+	lo = strtoul(spec, &end, 0);
+	hi = lo;
+	if (*end == '-')
+		hi = strtoul(end + 1, &end, 0);
+	if ((*end != '\0') || (lo == 0) || (hi < lo)) {
+		fprintf(stderr, "err: block count %s not <n> or <min>-<max> "
+			"starting at 1\n", spec);
+		errno = EINVAL;
+		return -1;
+	}
+	cfg->bs_min = lo;
+	cfg->bs_max = hi;
+	return 0;
+}
+
+/*
+ * Read an LBA log, e.g. the block trace of snapblock filtered for one
+ * kind of line, like the logs tests/lbalog_analysis.py looks at. Each
+ * line with LBA=<n> is one request. nblocks=<n> or n=<bytes> gives
+ * its size, else bs_min. Lines mentioning writes or COPY_HN (host to
+ * NVMe) are writes.
+ */
+static int wl_trace_load(struct wl_config *cfg, size_t lun_size)
+{
+	FILE *fp;
+	char line[512], *p;
+	unsigned long n = 0, max = 0;
+	struct wl_trace_op *op, *ops = NULL;
+
+	fp = fopen(cfg->replay, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "err: Cannot open %s: %s\n", cfg->replay,
+			strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		p = strstr(line, "LBA=");
+		if (p == NULL)
+			continue;
+		if (n == max) {
+			max = max ? max * 2 : 4096;
+			op = realloc(ops, max * sizeof(*ops));
+			if (op == NULL) {
+				fclose(fp);
+				__free(ops);
+				return -1;
+			}
+			ops = op;
+		}
+		op = &ops[n];
+		op->lba = strtoul(p + 4, NULL, 0);
+		op->nblocks = cfg->bs_min;
+		if ((p = strstr(line, "nblocks=")) != NULL)
+			op->nblocks = strtoul(p + 8, NULL, 0);
+		else if ((p = strstr(line, " n=")) != NULL)
+			op->nblocks = strtoul(p + 3, NULL, 0) /
+				__CBLK_BLOCK_SIZE;
+		op->nblocks = MAX(op->nblocks, 1u);
+		if (cfg->iodepth > 1)
+			op->nblocks = MIN(op->nblocks,
+					  (unsigned int)WL_NBLOCKS_MAX);
+		op->op = (strcasestr(line, "writ") ||
+			  strstr(line, "COPY_HN")) ? WL_WRITE : WL_READ;
+
+		if (op->lba + op->nblocks > lun_size) {
+			fprintf(stderr, "warn: LBA=%lu beyond the device, "
+				"skipped\n", op->lba);
+			continue;
+		}
+		cfg->bs_max = MAX(cfg->bs_max, op->nblocks);
+		n++;
+	}
+	fclose(fp);
+
+	if (n == 0) {
+		fprintf(stderr, "err: No LBA=<n> lines in %s\n", cfg->replay);
+		__free(ops);
+		errno = EINVAL;
+		return -1;
+	}
+	wl_trace = ops;
+	wl_trace_n = n;
+	return 0;
+}
+
+/* Pick a unit of bs_min blocks according to the distribution */
+static unsigned long wl_next_unit(struct wl_thread *t)
+{
+	unsigned long hot;
+
+	switch (wl_cfg->dist) {
+	case WL_DIST_ZIPF:
+		return (unsigned __int128)wl_zipf_next(&wl_zipf,
+				wl_rand01(t)) * WL_SCRAMBLE % wl_units;
+	case WL_DIST_HOTSPOT:
+		hot = MAX((unsigned long)(wl_units * wl_cfg->hot_range), 1ul);
+		if ((hot == wl_units) || (wl_rand01(t) < wl_cfg->hot_io))
+			return wl_rand(t) % hot;
+		return hot + wl_rand(t) % (wl_units - hot);
+	default:
+		return wl_rand(t) % wl_units;
+	}
+}
+
+/* Returns 0 if there is one more request for the thread */
+static int wl_next(struct wl_thread *t, unsigned long *lba,
+		   unsigned int *nblocks, enum wl_op *op)
+{
+	struct wl_config *cfg = wl_cfg;
+	unsigned long n, end = cfg->start_lba + cfg->num_lba;
+
+	if (wl_failed || (wl_deadline && (wl_now() >= wl_deadline)))
+		return -1;
+
+	n = __sync_fetch_and_add(&wl_issued, 1);
+	if (cfg->ios && (n >= cfg->ios))
+		return -1;
+
+	if (wl_trace != NULL) {
+		if (n >= wl_trace_n) {
+			if (!cfg->runtime_sec && !cfg->ios)
+				return -1;	/* once through */
+			n %= wl_trace_n;
+		}
+		*lba = wl_trace[n].lba;
+		*nblocks = wl_trace[n].nblocks;
+		*op = wl_trace[n].op;
+		return 0;
+	}
+
+	*op = ((wl_rand(t) % 100) < cfg->read_pct) ? WL_READ : WL_WRITE;
+	*nblocks = cfg->bs_min + wl_rand(t) % (cfg->bs_max - cfg->bs_min + 1);
+
+	if (cfg->dist == WL_DIST_SEQ) {
+		if (t->seq_lba + *nblocks > t->seq_end)
+			t->seq_lba = t->seq_start;
+		*lba = t->seq_lba;
+		t->seq_lba += *nblocks;
+		return 0;
+	}
+
+	*lba = cfg->start_lba + wl_next_unit(t) * cfg->bs_min;
+	if (*lba + *nblocks > end)
+		*lba = end - *nblocks;
+	return 0;
+}
+
+/* Sleep until the next request is due */
+static void wl_pace(struct wl_thread *t)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	if (t->period_ns == 0)
+		return;
+	now = wl_now();
+	if (t->next_ns == 0)
+		t->next_ns = now;
+	if (t->next_ns > now) {
+		ts.tv_sec = t->next_ns / 1000000000ull;
+		ts.tv_nsec = t->next_ns % 1000000000ull;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	t->next_ns += t->period_ns;
+}
+
+static void wl_fail(struct wl_thread *t, enum wl_op op, unsigned long lba,
+		    unsigned int nblocks, int rc)
+{
+	fprintf(stderr, "err: %s LBA=%lu nblocks=%u failed rc=%d: %s\n",
+		wl_op_name[op], lba, nblocks, rc, strerror(errno));
+	t->st[op].errors++;
+	t->rc = -1;
+	wl_failed = 1;			/* inform others to stop */
+}
+
+static void wl_sync_thread(struct wl_thread *t)
+{
+	struct wl_config *cfg = wl_cfg;
+	unsigned long lba;
+	unsigned int nblocks;
+	enum wl_op op;
+	uint64_t stime;
+	int rc;
+
+	while (wl_next(t, &lba, &nblocks, &op) == 0) {
+		wl_pace(t);
+		stime = wl_now();
+		if (op == WL_READ)
+			rc = cblk_read(cfg->cid, t->buf, lba, nblocks, 0);
+		else
+			rc = cblk_write(cfg->cid, t->buf, lba, nblocks, 0);
+		if (rc != (int)nblocks) {
+			wl_fail(t, op, lba, nblocks, rc);
+			break;
+		}
+		wl_stats_add(&t->st[op], nblocks, wl_now() - stime);
+	}
+}
+
+/*
+ * Start the parts of io which are not started yet. Async requests keep
+ * their slot until they are harvested, so threads must not wait for a
+ * slot while they sit on completed ones. A part which finds no free
+ * slot is left for later. Returns -1 on errors.
+ */
+static int wl_issue(struct wl_thread *t, struct wl_io *io)
+{
+	struct wl_config *cfg = wl_cfg;
+	int flags = CBLK_ARW_USER_TAG_FLAG;
+	int base = (t->num * WL_IODEPTH_MAX + (io - t->io)) * WL_PARTS_MAX;
+	unsigned int i, n;
+	int rc;
+
+	for (i = io->started; i < io->nparts; i = ++io->started) {
+		io->tag[i] = base + i;
+		if (io->op == WL_READ) {
+			rc = cblk_aread(cfg->cid, io->buf, io->lba,
+					io->nblocks, &io->tag[i], NULL, flags);
+			if (rc > 0)
+				io->done++;	/* all blocks in the cache */
+		} else {
+			n = MIN(io->nblocks - i * WL_AWRITE_MAX,
+				(unsigned int)WL_AWRITE_MAX);
+			rc = cblk_awrite(cfg->cid, io->buf + i * WL_AWRITE_MAX *
+					 __CBLK_BLOCK_SIZE,
+					 io->lba + i * WL_AWRITE_MAX, n,
+					 &io->tag[i], NULL, flags);
+		}
+		if (rc < 0)
+			return (errno == EAGAIN) ? 0 : -1;
+	}
+	return 0;
+}
+
+/*
+ * Harvest the parts of io which completed, blocking on the first one
+ * still in flight if wait is set. Returns 1 once io is complete.
+ */
+static int wl_harvest(struct wl_thread *t, struct wl_io *io, int wait)
+{
+	struct wl_config *cfg = wl_cfg;
+	int flags = CBLK_ARESULT_USER_TAG | (wait ? CBLK_ARESULT_BLOCKING : 0);
+	uint64_t status;
+	int rc, tag;
+
+	while (io->done < io->started) {
+		tag = io->tag[io->done];
+		rc = cblk_aresult(cfg->cid, &tag, &status, flags);
+		if (rc == 0)
+			return 0;
+		io->done++;
+		if (rc < 0) {
+			wl_fail(t, io->op, io->lba, io->nblocks, rc);
+			io->nparts = io->started;	/* give up the rest */
+		}
+	}
+	if (io->done < io->nparts)
+		return 0;
+	if (t->rc == 0)
+		wl_stats_add(&t->st[io->op], io->nblocks,
+			     wl_now() - io->stime);
+	io->busy = 0;
+	return 1;
+}
+
+/* Rate limit for async threads, which do not sleep while waiting */
+static int wl_due(struct wl_thread *t)
+{
+	if (t->period_ns == 0)
+		return 1;
+	if (t->next_ns == 0)
+		t->next_ns = wl_now();
+	return wl_now() >= t->next_ns;
+}
+
+static void wl_async_thread(struct wl_thread *t)
+{
+	struct wl_config *cfg = wl_cfg;
+	unsigned int i, busy = 0, inflight, progress;
+	struct wl_io *io, *oldest, *partial;
+	int more = 1;
+
+	while (more || busy) {
+		progress = 0;
+		partial = NULL;
+		for (i = 0; i < cfg->iodepth; i++)
+			if (t->io[i].busy &&
+			    (t->io[i].started < t->io[i].nparts))
+				partial = &t->io[i];
+
+		if (partial != NULL) {
+			i = partial->started;
+			if (wl_issue(t, partial) != 0) {
+				wl_fail(t, partial->op, partial->lba,
+					partial->nblocks, -1);
+				partial->nparts = partial->started;
+				more = 0;
+			}
+			progress += (partial->started != i);
+		} else if (more && (busy < cfg->iodepth) && wl_due(t)) {
+			for (io = t->io; io->busy; io++)
+				;
+			if (wl_next(t, &io->lba, &io->nblocks, &io->op)) {
+				more = 0;
+				continue;
+			}
+			io->busy = 1;
+			io->nparts = (io->op == WL_READ) ? 1 :
+				(io->nblocks + WL_AWRITE_MAX - 1) /
+				WL_AWRITE_MAX;
+			io->started = 0;
+			io->done = 0;
+			io->stime = wl_now();
+			t->next_ns += t->period_ns;
+			busy++;
+			progress++;
+			if (wl_issue(t, io) != 0) {
+				wl_fail(t, io->op, io->lba, io->nblocks, -1);
+				io->nparts = io->started;
+				more = 0;
+			}
+		}
+
+		/* Take what completed */
+		oldest = NULL;
+		inflight = 0;
+		for (i = 0; i < cfg->iodepth; i++) {
+			io = &t->io[i];
+			if (!io->busy)
+				continue;
+			if (wl_harvest(t, io, 0)) {
+				busy--;
+				progress++;
+				continue;
+			}
+			if (io->done == io->started)
+				continue;
+			inflight++;
+			if ((oldest == NULL) || (io->stime < oldest->stime))
+				oldest = io;
+		}
+		if (progress)
+			continue;
+
+		/*
+		 * Nothing to do: wait for the oldest request, unless the
+		 * next one is due earlier or none of ours is in flight
+		 * and we are waiting for slots of other threads.
+		 */
+		if (inflight && (!more || (busy == cfg->iodepth) ||
+				 !t->period_ns)) {
+			if (wl_harvest(t, oldest, 1))
+				busy--;
+		} else
+			usleep(10);
+	}
+}
+
+static void *wl_thread(void *data)
+{
+	struct wl_thread *t = (struct wl_thread *)data;
+
+	if (wl_cfg->iodepth > 1)
+		wl_async_thread(t);
+	else
+		wl_sync_thread(t);
+	return NULL;
+}
+
+int wl_run(struct wl_config *cfg, struct wl_result *res)
+{
+	int rc = 0;
+	unsigned int i, j;
+	size_t lun_size = 0;
+	size_t bufsize;
+	struct wl_thread *t, *threads;
+	uint64_t stime;
+
+	memset(res, 0, sizeof(*res));
+	if (cblk_get_lun_size(cfg->cid, &lun_size, 0) < 0)
+		return -1;
+	if ((cfg->threads == 0) || (cfg->iodepth == 0) ||
+	    (cfg->iodepth > WL_IODEPTH_MAX) || (cfg->read_pct > 100) ||
+	    (cfg->num_lba / cfg->threads < cfg->bs_max) ||
+	    (cfg->start_lba + cfg->num_lba > lun_size)) {
+		fprintf(stderr, "err: invalid workload (threads=%u "
+			"iodepth=%u LBAs %lu..%lu of %zu)\n", cfg->threads,
+			cfg->iodepth, cfg->start_lba,
+			cfg->start_lba + cfg->num_lba, lun_size);
+		errno = EINVAL;
+		return -1;
+	}
+	if ((cfg->iodepth > 1) && (cfg->bs_max > WL_NBLOCKS_MAX)) {
+		fprintf(stderr, "err: %u blocks beyond %d, the limit of "
+			"iodepth > 1\n", cfg->bs_max, WL_NBLOCKS_MAX);
+		errno = EINVAL;
+		return -1;
+	}
+
+	wl_cfg = cfg;
+	wl_issued = 0;
+	wl_failed = 0;
+	wl_units = cfg->num_lba / cfg->bs_min;
+	if (cfg->replay && (wl_trace_load(cfg, lun_size) != 0))
+		return -1;
+	if (cfg->dist == WL_DIST_ZIPF)
+		wl_zipf_init(&wl_zipf, wl_units, cfg->zipf_theta);
+
+	threads = calloc(cfg->threads, sizeof(*threads));
+	bufsize = (size_t)cfg->iodepth * cfg->bs_max * __CBLK_BLOCK_SIZE;
+	if (threads == NULL) {
+		rc = -1;
+		goto out;
+	}
+
+	for (i = 0; i < cfg->threads; i++) {
+		t = &threads[i];
+		t->num = i;
+		t->rnd = ((uint64_t)cfg->seed << 32) ^ (0x9e3779b97f4a7c15ull *
+							(i + 1));
+		t->seq_start = cfg->start_lba + cfg->num_lba / cfg->threads * i;
+		t->seq_end = t->seq_start + cfg->num_lba / cfg->threads;
+		t->seq_lba = t->seq_start;
+		if (cfg->rate)
+			t->period_ns = 1000000000ull * cfg->threads /
+				cfg->rate;
+		if (posix_memalign((void **)&t->buf, __CBLK_BLOCK_SIZE,
+				   bufsize) != 0) {
+			rc = -1;
+			goto out;
+		}
+		memset(t->buf, 0x5a + i, bufsize);
+		for (j = 0; j < cfg->iodepth; j++)
+			t->io[j].buf = t->buf + (size_t)j * cfg->bs_max *
+				__CBLK_BLOCK_SIZE;
+	}
+
+	stime = wl_now();
+	wl_deadline = cfg->runtime_sec ?
+		stime + cfg->runtime_sec * 1000000000ull : 0;
+	for (i = 0; i < cfg->threads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, wl_thread,
+				   &threads[i]) != 0) {
+			fprintf(stderr, "err: starting thread %u failed!\n",
+				i);
+			wl_failed = 1;
+			rc = -1;
+			break;
+		}
+	}
+	while (i--)
+		pthread_join(threads[i].tid, NULL);
+	res->usec = (wl_now() - stime) / 1000;
+
+	for (i = 0; i < cfg->threads; i++) {
+		for (j = 0; j < WL_OP_MAX; j++)
+			wl_stats_merge(&res->st[j], &threads[i].st[j]);
+		if (threads[i].rc != 0)
+			rc = -1;
+	}
+
+ out:
+	if (threads != NULL)
+		for (i = 0; i < cfg->threads; i++)
+			__free(threads[i].buf);
+	__free(threads);
+	__free(wl_trace);
+	wl_trace = NULL;
+	wl_trace_n = 0;
+	return rc;
+}
+
+void wl_report(FILE *fp, const struct wl_config *cfg,
+	       const struct wl_result *res)
+{
+	unsigned int i;
+	const struct wl_stats *st;
+	double secs = res->usec / 1e6;
+
+	fprintf(fp, "Workload: %s %u%% reads, %u-%u blocks, %u threads "
+		"x iodepth %u, LBAs %lu..%lu, %.3f sec\n",
+		cfg->replay ? cfg->replay : wl_dist_name[cfg->dist],
+		cfg->read_pct, cfg->bs_min, cfg->bs_max, cfg->threads,
+		cfg->iodepth, cfg->start_lba, cfg->start_lba + cfg->num_lba,
+		secs);
+
+	for (i = 0; i < WL_OP_MAX; i++) {
+		st = &res->st[i];
+		if ((st->ios == 0) && (st->errors == 0))
+			continue;
+		fprintf(fp, "  %-5s: %llu ios %.1f IOPS %.3f MiB/sec "
+			"errors %llu\n"
+			"         lat usec min/avg/max %.1f/%.1f/%.1f "
+			"p50/p99/p99.9 %.1f/%.1f/%.1f\n",
+			wl_op_name[i], (unsigned long long)st->ios,
+			secs ? st->ios / secs : 0.0,
+			secs ? st->blocks * __CBLK_BLOCK_SIZE / secs /
+			(1024 * 1024) : 0.0,
+			(unsigned long long)st->errors,
+			st->lat_min / 1e3,
+			st->ios ? st->lat_sum / 1e3 / st->ios : 0.0,
+			st->lat_max / 1e3,
+			wl_percentile(st, 50.0) / 1e3,
+			wl_percentile(st, 99.0) / 1e3,
+			wl_percentile(st, 99.9) / 1e3);
+	}
+}
+
+/* fname "-" is stdout */
+int wl_report_json(const char *fname, const struct wl_config *cfg,
+		   const struct wl_result *res)
+{
+	FILE *fp;
+	unsigned int i;
+	const struct wl_stats *st;
+	double secs = res->usec / 1e6;
+
+	fp = (strcmp(fname, "-") == 0) ? stdout : fopen(fname, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "err: Cannot open %s: %s\n", fname,
+			strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{\n"
+		"  \"workload\": {\n"
+		"    \"dist\": \"%s\",\n"
+		"    \"zipf_theta\": %g,\n"
+		"    \"hot_range_pct\": %g,\n"
+		"    \"hot_io_pct\": %g,\n"
+		"    \"replay\": %s%s%s,\n"
+		"    \"read_pct\": %u,\n"
+		"    \"bs_min\": %u,\n"
+		"    \"bs_max\": %u,\n"
+		"    \"threads\": %u,\n"
+		"    \"iodepth\": %u,\n"
+		"    \"rate\": %lu,\n"
+		"    \"start_lba\": %lu,\n"
+		"    \"num_lba\": %lu\n"
+		"  },\n"
+		"  \"runtime_usec\": %llu",
+		wl_dist_name[cfg->dist], cfg->zipf_theta,
+		cfg->hot_range * 100.0, cfg->hot_io * 100.0,
+		cfg->replay ? "\"" : "", cfg->replay ? cfg->replay : "null",
+		cfg->replay ? "\"" : "",
+		cfg->read_pct, cfg->bs_min, cfg->bs_max, cfg->threads,
+		cfg->iodepth, cfg->rate, cfg->start_lba, cfg->num_lba,
+		(unsigned long long)res->usec);
+
+	for (i = 0; i < WL_OP_MAX; i++) {
+		st = &res->st[i];
+		fprintf(fp, ",\n"
+			"  \"%s\": {\n"
+			"    \"ios\": %llu,\n"
+			"    \"blocks\": %llu,\n"
+			"    \"errors\": %llu,\n"
+			"    \"iops\": %.1f,\n"
+			"    \"mib_sec\": %.3f,\n"
+			"    \"lat_usec\": {\n"
+			"      \"min\": %.3f,\n"
+			"      \"avg\": %.3f,\n"
+			"      \"max\": %.3f,\n"
+			"      \"p50\": %.3f,\n"
+			"      \"p99\": %.3f,\n"
+			"      \"p999\": %.3f\n"
+			"    }\n"
+			"  }",
+			wl_op_name[i], (unsigned long long)st->ios,
+			(unsigned long long)st->blocks,
+			(unsigned long long)st->errors,
+			secs ? st->ios / secs : 0.0,
+			secs ? st->blocks * __CBLK_BLOCK_SIZE / secs /
+			(1024 * 1024) : 0.0,
+			st->lat_min / 1e3,
+			st->ios ? st->lat_sum / 1e3 / st->ios : 0.0,
+			st->lat_max / 1e3,
+			wl_percentile(st, 50.0) / 1e3,
+			wl_percentile(st, 99.0) / 1e3,
+			wl_percentile(st, 99.9) / 1e3);
+	}
+	fprintf(fp, "\n}\n");
+
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
@@ -0,0 +1,119 @@
+#ifndef __WORKLOAD_H__
+#define __WORKLOAD_H__
+
+/**
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Workload generator for capiblock
+ *
+ * Each thread generates its own requests, a mix of reads and writes
+ * with block counts from a range and LBAs from one of the
+ * distributions below, or replays an LBA log. Up to iodepth requests
+ * per thread are in flight, optionally limited to a rate. Latencies
+ * go into log-linear histograms, which give the percentiles.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <capiblock.h>
+
+enum wl_dist {
+	WL_DIST_UNIFORM = 0,	/* default */
+	WL_DIST_SEQ,		/* each thread its own part of the range */
+	WL_DIST_ZIPF,		/* a few blocks get most of the requests */
+	WL_DIST_HOTSPOT,	/* hot_io of the requests into hot_range */
+	WL_DIST_MAX,
+};
+
+struct wl_config {
+	chunk_id_t cid;
+	unsigned long start_lba;
+	unsigned long num_lba;		/* range the LBAs are taken from */
+	unsigned int bs_min;		/* blocks per request */
+	unsigned int bs_max;
+	unsigned int read_pct;		/* 100: reads only */
+	enum wl_dist dist;
+	double zipf_theta;		/* 0 < theta < 1 */
+	double hot_range;		/* fraction of the range which is hot */
+	double hot_io;			/* fraction of requests going there */
+	unsigned int threads;
+	unsigned int iodepth;		/* requests in flight per thread */
+	unsigned long rate;		/* requests/sec of all threads, 0: max */
+	unsigned long runtime_sec;	/* 0: until ios are done */
+	unsigned long ios;		/* 0: until runtime is over */
+	unsigned int seed;
+	const char *replay;		/* LBA log instead of generating */
+};
+
+enum wl_op {
+	WL_READ = 0,
+	WL_WRITE,
+	WL_OP_MAX,
+};
+
+#define WL_LAT_BUCKETS	976	/* 16 per power of 2 of a uint64_t */
+
+struct wl_stats {
+	uint64_t ios;
+	uint64_t blocks;
+	uint64_t errors;
+	uint64_t lat_min;		/* nsec */
+	uint64_t lat_max;
+	uint64_t lat_sum;
+	uint64_t hist[WL_LAT_BUCKETS];
+};
+
+struct wl_result {
+	uint64_t usec;			/* wall clock time of the run */
+	struct wl_stats st[WL_OP_MAX];
+};
+
+/* Defaults for everything not given, the caller fills in the rest */
+void wl_config_init(struct wl_config *cfg);
+
+/*
+ * Parse a distribution: uniform, seq, zipf:<theta> or
+ * hotspot:<range pct>:<io pct>, e.g. hotspot:10:90 sends 90% of the
+ * requests to the first 10% of the range.
+ */
+int wl_parse_dist(struct wl_config *cfg, const char *spec);
+
+/*
+ * Parse a block count <n> or a range <min>-<max>. wl_run() checks it
+ * against the device, and against 32 blocks for iodepth > 1.
+ */
+int wl_parse_bs(struct wl_config *cfg, const char *spec);
+
+/*
+ * Run the workload on cfg->cid. Returns 0 or -1 if a request failed,
+ * the run stops at the first failure.
+ */
+int wl_run(struct wl_config *cfg, struct wl_result *res);
+
+/* Account one request of nblocks which took nsec, for other tools */
+void wl_stats_add(struct wl_stats *st, unsigned int nblocks, uint64_t nsec);
+void wl_stats_merge(struct wl_stats *to, const struct wl_stats *st);
+
+/* Percentile pct (e.g. 99.9) of the latencies in nsec */
+uint64_t wl_percentile(const struct wl_stats *st, double pct);
+
+void wl_report(FILE *fp, const struct wl_config *cfg,
+	       const struct wl_result *res);
+int wl_report_json(const char *fname, const struct wl_config *cfg,
+		   const struct wl_result *res);
+
+#endif	/* __WORKLOAD_H__ */
@@ -47,7 +47,7 @@ function usage() {
 	echo "    [-H <threads>]    hardware threads per CPU to be used (see ppc64_cpu)"
 	echo "    [-p <prefetch>]   0/1 disable/enable prefetching"
 	echo "    [-R <seed>]       random seed, if not 0, random read odering"
-	echo "    [-T <testcase>]   testcase e.g. NONE, CBLK, READ_BENCHMARK, PERF, READ_WRITE ..."
+	echo "    [-T <testcase>]   testcase e.g. NONE, CBLK, READ_BENCHMARK, PERF, READ_WRITE, WORKLOAD, KV ..."
 	echo
 	echo "  Perform SNAP card initialization and action_type "
 	echo "  detection. Initialize NVMe disk 0 and 1 if existent."
@@ -187,6 +187,63 @@ function cblk_read_write () {
 	done
 }
 
+function cblk_workload () {
+	echo "SNAP NVME WORKLOAD"
+	for d in uniform zipf:0.9 hotspot:10:90 seq ; do
+		for m in 100 70 ; do
+			json="snap_cblk_${d//:/_}_read${m}_threads_${threads}.json"
+
+			echo "DIST: $d ; READS: ${m}% ; THREADS: ${threads} ; PREFETCH: ${prefetch}" ;
+			CBLK_PREFETCH=${prefetch} \
+			snap_cblk -C${card} ${options} --bench -d ${d} -m${m} \
+				-b1-${nblocks} -R${random_seed} -s0 -t${threads} \
+				-Q4 -T10 -J ${json}
+			if [ $? -ne 0 ]; then
+				printf "${bold}ERROR:${normal} bad exit code!\n" >&2
+				exit 1
+			fi
+			echo
+		done
+	done
+
+	# Synchronous requests are split by cblk_read()/cblk_write()
+	echo "SYNC: 1-256 blocks ; THREADS: ${threads}" ;
+	snap_cblk -C${card} ${options} --bench -m70 -b1-256 \
+		-R${random_seed} -s0 -t${threads} -T10
+	if [ $? -ne 0 ]; then
+		printf "${bold}ERROR:${normal} bad exit code!\n" >&2
+		exit 1
+	fi
+	echo
+}
+
+function snap_kv_test () {
+	echo "SNAP NVME KV"
+	for mix in "-g90" "-g50 -D10" ; do
+		for sync in "" "-a" ; do
+			echo "MIX: ${mix} ${sync} ; THREADS: ${threads}" ;
+			snap_kv -C${card} -s0 -n 0x10000 -k 50000 -t${threads} \
+				${mix} ${sync} -R${random_seed} -T10
+			if [ $? -ne 0 ]; then
+				printf "${bold}ERROR:${normal} bad exit code!\n" >&2
+				exit 1
+			fi
+			echo
+		done
+	done
+
+	echo "CREATE OVER AN EXISTING STORE"
+	for keys in 2000 100 ; do
+		snap_kv -C${card} -s0 -n 0x10000 -k ${keys} -t${threads} \
+			-R${random_seed}
+		if [ $? -ne 0 ]; then
+			printf "${bold}ERROR:${normal} bad exit code!\n" >&2
+			exit 1
+		fi
+	done
+	echo
+}
+
 function perf_test () {
 	echo "SNAP NVME PERF BENCHMARK"
 	for p in 0 4 ; do
@@ -305,4 +362,12 @@ if [ "${TEST}" == "READ_WRITE" ]; then
 	cblk_read_write
 fi
 
+if [ "${TEST}" == "WORKLOAD" ]; then
+	cblk_workload
+fi
+
+if [ "${TEST}" == "KV" ]; then
+	snap_kv_test
+fi
+
 exit 0
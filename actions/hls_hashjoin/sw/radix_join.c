@@ -0,0 +1,516 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Radix hash join, see radix_join.h.
+ *
+ * All steps use the same 64-bit hash of the key: the 1st pass
+ * partitions on its low bits1 bits, the 2nd on the bits2 bits above
+ * them, and the bucket in the hash table of a partition is taken
+ * from the upper 32 bits. The partitions of the 1st pass are written
+ * to one array per table. Each thread counts the tuples of its slice
+ * per partition, the prefix sums over partitions and threads give
+ * every thread its own range to scatter into, without locking.
+ *
+ * The 1st pass partitions are then handed out to the threads through
+ * a shared counter, such that a large partition does not hold up the
+ * others. With two passes, a thread splits the partition into its
+ * own scratch buffers and joins each sub-partition while it is still
+ * in the cache.
+ *
+ * The hash table holds no copies of the tuples: bucket[] and next[]
+ * are 32-bit indexes + 1 into the partition, 0 ends a chain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "radix_join.h"
+
+#define RJ_BITS_MAX		24	/* both passes together */
+#define RJ_PASS_BITS		10	/* fanout of one pass, TLB bound */
+#define RJ_TUPLE_FOOTPRINT	32	/* cache bytes per build tuple */
+#define RJ_ROWS_PER_THREAD	16384	/* less is not worth a thread */
+#define RJ_CACHE_DEFAULT	(256 * 1024)
+
+struct rj_ctx;
+
+struct rj_thread {
+	struct rj_ctx *ctx;
+	unsigned int id;
+	pthread_t tid;
+	size_t *hist_r;		/* per partition: count, then offset */
+	size_t *hist_s;
+
+	/* scratch for the 2nd pass and the hash table */
+	rj_tuple_t *tmp_r, *tmp_s;
+	size_t tmp_r_max, tmp_s_max;
+	size_t *sub;		/* 2 x (P2 + 1) starts, P2 cursors */
+	uint32_t *bucket, *next;
+	size_t bucket_max, next_max;
+
+	uint64_t join_start;	/* usec, past the 1st pass */
+	uint64_t matches;
+	int err;
+};
+
+struct rj_ctx {
+	const rj_tuple_t *r, *s;
+	size_t nr, ns;
+	rj_tuple_t *pr, *ps;	/* 1st pass output */
+	size_t *start_r, *start_s;	/* P1 + 1 */
+	unsigned int threads;
+	unsigned int bits1, bits2;
+	pthread_barrier_t barrier;
+	pthread_mutex_t lock;	/* start gate */
+	pthread_cond_t cond;
+	int state;		/* 0: wait, 1: go, -1: give up */
+	unsigned int next_part;
+	rj_match_f fn;
+	void *arg;
+	struct rj_thread *thr;
+};
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Finalizer of MurmurHash3, spreads the key over all 64 bits */
+static inline uint64_t rj_hash(uint32_t key)
+{
+	uint64_t h = key;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint32_t rj_key_hash(const char *key, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len && key[i] != 0; i++) {
+		h ^= (uint8_t)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void rj_options_init(struct rj_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+}
+
+static int grow(void **p, size_t *max, size_t n, size_t size)
+{
+	void *np;
+
+	if (n <= *max)
+		return 0;
+	n = n + n / 4;
+	free(*p);
+	*p = NULL;
+	*max = 0;
+	if (posix_memalign(&np, 64, n * size) != 0)
+		return -1;
+	*p = np;
+	*max = n;
+	return 0;
+}
+
+static void build_probe(struct rj_thread *t, const rj_tuple_t *r, size_t nr,
+			const rj_tuple_t *s, size_t ns)
+{
+	struct rj_ctx *ctx = t->ctx;
+	uint32_t *bucket, *next;
+	size_t nb, mask, i, j;
+
+	if (nr == 0 || ns == 0)
+		return;
+
+	for (nb = 1; nb < nr; nb <<= 1)
+		;
+	if (grow((void **)&t->bucket, &t->bucket_max, nb, sizeof(uint32_t)) ||
+	    grow((void **)&t->next, &t->next_max, nr, sizeof(uint32_t))) {
+		t->err = ENOMEM;
+		return;
+	}
+	bucket = t->bucket;
+	next = t->next;
+	mask = nb - 1;
+
+	memset(bucket, 0, nb * sizeof(uint32_t));
+	for (i = 0; i < nr; i++) {
+		size_t b = (rj_hash(r[i].key) >> 32) & mask;
+
+		next[i] = bucket[b];
+		bucket[b] = i + 1;
+	}
+
+	for (j = 0; j < ns; j++) {
+		uint32_t key = s[j].key;
+		size_t b = (rj_hash(key) >> 32) & mask;
+
+		for (i = bucket[b]; i != 0; i = next[i - 1]) {
+			if (r[i - 1].key != key)
+				continue;
+			t->matches++;
+			if (ctx->fn)
+				ctx->fn(ctx->arg, t->id, r[i - 1].rid,
+					s[j].rid);
+		}
+	}
+}
+
+/* Split src into P2 sub-partitions in dst, starts[] gets P2 + 1 entries */
+static void partition2(struct rj_ctx *ctx, const rj_tuple_t *src, size_t n,
+		       rj_tuple_t *dst, size_t *starts, size_t *cur)
+{
+	size_t parts = (size_t)1 << ctx->bits2;
+	size_t mask = parts - 1, i, q, sum;
+
+	memset(cur, 0, parts * sizeof(size_t));
+	for (i = 0; i < n; i++)
+		cur[(rj_hash(src[i].key) >> ctx->bits1) & mask]++;
+	for (q = 0, sum = 0; q < parts; q++) {
+		starts[q] = sum;
+		sum += cur[q];
+		cur[q] = starts[q];
+	}
+	starts[parts] = sum;
+	for (i = 0; i < n; i++)
+		dst[cur[(rj_hash(src[i].key) >> ctx->bits1) & mask]++] = src[i];
+}
+
+static void join_part(struct rj_thread *t, unsigned int p)
+{
+	struct rj_ctx *ctx = t->ctx;
+	const rj_tuple_t *r = ctx->pr + ctx->start_r[p];
+	const rj_tuple_t *s = ctx->ps + ctx->start_s[p];
+	size_t nr = ctx->start_r[p + 1] - ctx->start_r[p];
+	size_t ns = ctx->start_s[p + 1] - ctx->start_s[p];
+	size_t parts, q, *sr, *ss;
+
+	if (nr == 0 || ns == 0)
+		return;
+	if (ctx->bits2 == 0) {
+		build_probe(t, r, nr, s, ns);
+		return;
+	}
+
+	if (grow((void **)&t->tmp_r, &t->tmp_r_max, nr, sizeof(rj_tuple_t)) ||
+	    grow((void **)&t->tmp_s, &t->tmp_s_max, ns, sizeof(rj_tuple_t))) {
+		t->err = ENOMEM;
+		return;
+	}
+	parts = (size_t)1 << ctx->bits2;
+	sr = t->sub;
+	ss = t->sub + parts + 1;
+	partition2(ctx, r, nr, t->tmp_r, sr, ss + parts + 1);
+	partition2(ctx, s, ns, t->tmp_s, ss, ss + parts + 1);
+
+	for (q = 0; q < parts; q++)
+		build_probe(t, t->tmp_r + sr[q], sr[q + 1] - sr[q],
+			    t->tmp_s + ss[q], ss[q + 1] - ss[q]);
+}
+
+static void count1(struct rj_ctx *ctx, const rj_tuple_t *src,
+		   size_t from, size_t to, size_t *hist)
+{
+	size_t mask = ((size_t)1 << ctx->bits1) - 1, i;
+
+	for (i = from; i < to; i++)
+		hist[rj_hash(src[i].key) & mask]++;
+}
+
+static void scatter1(struct rj_ctx *ctx, const rj_tuple_t *src,
+		     size_t from, size_t to, size_t *cur, rj_tuple_t *dst)
+{
+	size_t mask = ((size_t)1 << ctx->bits1) - 1, i;
+
+	for (i = from; i < to; i++)
+		dst[cur[rj_hash(src[i].key) & mask]++] = src[i];
+}
+
+/* Offsets of each thread per partition, partition major */
+static void prefix1(struct rj_ctx *ctx, size_t *start, int s_side)
+{
+	size_t parts = (size_t)1 << ctx->bits1, p, sum = 0;
+	unsigned int i;
+
+	for (p = 0; p < parts; p++) {
+		start[p] = sum;
+		for (i = 0; i < ctx->threads; i++) {
+			struct rj_thread *t = &ctx->thr[i];
+			size_t *hist = s_side ? t->hist_s : t->hist_r;
+			size_t cnt = hist[p];
+
+			hist[p] = sum;
+			sum += cnt;
+		}
+	}
+	start[parts] = sum;
+}
+
+static void *rj_thread_main(void *arg)
+{
+	struct rj_thread *t = arg;
+	struct rj_ctx *ctx = t->ctx;
+	unsigned int parts = 1u << ctx->bits1, p;
+	size_t r0 = ctx->nr * t->id / ctx->threads;
+	size_t r1 = ctx->nr * (t->id + 1) / ctx->threads;
+	size_t s0 = ctx->ns * t->id / ctx->threads;
+	size_t s1 = ctx->ns * (t->id + 1) / ctx->threads;
+	int state;
+
+	if (t->id != 0) {
+		pthread_mutex_lock(&ctx->lock);
+		while ((state = ctx->state) == 0)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		pthread_mutex_unlock(&ctx->lock);
+		if (state < 0)
+			return NULL;
+	}
+	if (ctx->bits1 != 0) {
+		count1(ctx, ctx->r, r0, r1, t->hist_r);
+		count1(ctx, ctx->s, s0, s1, t->hist_s);
+		pthread_barrier_wait(&ctx->barrier);
+		if (t->id == 0) {
+			prefix1(ctx, ctx->start_r, 0);
+			prefix1(ctx, ctx->start_s, 1);
+		}
+		pthread_barrier_wait(&ctx->barrier);
+		scatter1(ctx, ctx->r, r0, r1, t->hist_r, ctx->pr);
+		scatter1(ctx, ctx->s, s0, s1, t->hist_s, ctx->ps);
+		pthread_barrier_wait(&ctx->barrier);
+	}
+	t->join_start = now_usec();
+
+	while ((p = __sync_fetch_and_add(&ctx->next_part, 1)) < parts) {
+		join_part(t, p);
+		if (t->err)
+			break;
+	}
+	return NULL;
+}
+
+static unsigned int log2_ceil(size_t n)
+{
+	unsigned int bits = 0;
+
+	while (((size_t)1 << bits) < n)
+		bits++;
+	return bits;
+}
+
+static void rj_plan(struct rj_ctx *ctx, const struct rj_options *opts)
+{
+	size_t cache = opts->cache_bytes;
+	size_t rows = cache / RJ_TUPLE_FOOTPRINT;
+	unsigned int bits = opts->radix_bits;
+	unsigned int passes = opts->passes;
+	long n;
+
+	if (cache == 0) {
+		n = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		cache = (n > 0) ? (size_t)n : RJ_CACHE_DEFAULT;
+		rows = cache / RJ_TUPLE_FOOTPRINT;
+	}
+	ctx->threads = opts->threads;
+	if (ctx->threads == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		ctx->threads = (n > 0) ? (unsigned int)n : 1;
+	}
+	n = (ctx->nr + ctx->ns) / RJ_ROWS_PER_THREAD;
+	if ((size_t)ctx->threads > (size_t)n)
+		ctx->threads = (n > 0) ? (unsigned int)n : 1;
+
+	if (bits == 0 && rows != 0) {
+		bits = log2_ceil((ctx->nr + rows - 1) / rows);
+		/* enough partitions to keep the threads busy */
+		if (ctx->threads > 1 && bits < log2_ceil(4 * ctx->threads))
+			bits = log2_ceil(4 * ctx->threads);
+	}
+	if (bits > RJ_BITS_MAX)
+		bits = RJ_BITS_MAX;
+	if (passes == 0)
+		passes = (bits > RJ_PASS_BITS) ? 2 : 1;
+	if (passes >= 2 && bits >= 2) {
+		ctx->bits1 = (bits + 1) / 2;
+		ctx->bits2 = bits - ctx->bits1;
+	} else {
+		ctx->bits1 = bits;
+		ctx->bits2 = 0;
+	}
+}
+
+int rj_join(const rj_tuple_t *r, size_t nr, const rj_tuple_t *s, size_t ns,
+	    const struct rj_options *opts, rj_match_f fn, void *arg,
+	    struct rj_stats *stats)
+{
+	struct rj_options defaults;
+	struct rj_ctx ctx;
+	size_t parts, sub, *hist = NULL, *start = NULL;
+	uint64_t t0, t1, tp;
+	unsigned int i, started;
+	int rc = -1, err = ENOMEM;
+
+	if (nr >= UINT32_MAX || ns >= UINT32_MAX || (nr && !r) ||
+	    (ns && !s)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (opts == NULL) {
+		rj_options_init(&defaults);
+		opts = &defaults;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.r = r;
+	ctx.s = s;
+	ctx.nr = nr;
+	ctx.ns = ns;
+	ctx.fn = fn;
+	ctx.arg = arg;
+	rj_plan(&ctx, opts);
+
+	parts = (size_t)1 << ctx.bits1;
+	sub = ctx.bits2 ? ((size_t)1 << ctx.bits2) : 0;
+	t0 = now_usec();
+
+	ctx.thr = calloc(ctx.threads, sizeof(*ctx.thr));
+	hist = calloc((size_t)ctx.threads * 2 * parts, sizeof(size_t));
+	start = malloc(2 * (parts + 1) * sizeof(size_t));
+	if (!ctx.thr || !hist || !start)
+		goto out;
+	ctx.start_r = start;
+	ctx.start_s = start + parts + 1;
+
+	if (ctx.bits1 == 0) {	/* one partition, no copy */
+		ctx.pr = (rj_tuple_t *)r;
+		ctx.ps = (rj_tuple_t *)s;
+		ctx.start_r[0] = ctx.start_s[0] = 0;
+		ctx.start_r[1] = nr;
+		ctx.start_s[1] = ns;
+	} else {
+		void *p;
+
+		if (posix_memalign(&p, 64, (nr + 1) * sizeof(rj_tuple_t)))
+			goto out;
+		ctx.pr = p;
+		if (posix_memalign(&p, 64, (ns + 1) * sizeof(rj_tuple_t)))
+			goto out;
+		ctx.ps = p;
+	}
+
+	for (i = 0; i < ctx.threads; i++) {
+		struct rj_thread *t = &ctx.thr[i];
+
+		t->ctx = &ctx;
+		t->id = i;
+		t->hist_r = hist + (size_t)i * 2 * parts;
+		t->hist_s = t->hist_r + parts;
+		if (sub) {	/* 2 x starts, 1 x cursors */
+			t->sub = malloc((3 * sub + 2) * sizeof(size_t));
+			if (!t->sub)
+				goto out;
+		}
+	}
+
+	if (pthread_barrier_init(&ctx.barrier, NULL, ctx.threads) != 0)
+		goto out;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	for (started = 1; started < ctx.threads; started++) {
+		err = pthread_create(&ctx.thr[started].tid, NULL,
+				     rj_thread_main, &ctx.thr[started]);
+		if (err != 0)
+			break;
+	}
+	/* The barrier counts on all threads, let them go or give up */
+	pthread_mutex_lock(&ctx.lock);
+	ctx.state = (started == ctx.threads) ? 1 : -1;
+	pthread_cond_broadcast(&ctx.cond);
+	pthread_mutex_unlock(&ctx.lock);
+	if (started == ctx.threads)
+		rj_thread_main(&ctx.thr[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(ctx.thr[i].tid, NULL);
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+	pthread_barrier_destroy(&ctx.barrier);
+	if (started < ctx.threads)
+		goto out;
+	t1 = now_usec();
+	for (i = 1, tp = ctx.thr[0].join_start; i < ctx.threads; i++)
+		if (ctx.thr[i].join_start < tp)
+			tp = ctx.thr[i].join_start;
+
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->threads = ctx.threads;
+		stats->radix_bits = ctx.bits1 + ctx.bits2;
+		stats->passes = ctx.bits2 ? 2 : 1;
+		stats->partition_usec = tp - t0;
+		stats->join_usec = t1 - tp;
+	}
+	rc = 0;
+	for (i = 0; i < ctx.threads; i++) {
+		if (stats)
+			stats->matches += ctx.thr[i].matches;
+		if (ctx.thr[i].err) {
+			err = ctx.thr[i].err;
+			rc = -1;
+		}
+	}
+
+ out:
+	if (ctx.thr) {
+		for (i = 0; i < ctx.threads; i++) {
+			struct rj_thread *t = &ctx.thr[i];
+
+			free(t->tmp_r);
+			free(t->tmp_s);
+			free(t->sub);
+			free(t->bucket);
+			free(t->next);
+		}
+		free(ctx.thr);
+	}
+	if (ctx.bits1 != 0) {
+		free(ctx.pr);
+		free(ctx.ps);
+	}
+	free(start);
+	free(hist);
+	if (rc != 0)
+		errno = err;
+	return rc;
+}
@@ -0,0 +1,79 @@
+#ifndef __RADIX_JOIN_H__
+#define __RADIX_JOIN_H__
+
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Multi-threaded radix hash join on the host
+ *
+ * The CPU baseline for the hashjoin action. Both inputs are reduced
+ * to compact (key, row id) tuples and partitioned on the hash of the
+ * key, in one or two passes, until a partition of the build side and
+ * its hash table fit into the cache. The threads then take the
+ * partitions one by one, build a bucket-chained table on the tuples
+ * of the build side (r) and probe it with those of the probe side (s).
+ *
+ * Tables are limited to 2^32 - 1 rows by the 32-bit row ids. Wider
+ * keys, e.g. the names of table1_t and table2_t, are joined on a hash
+ * with rj_key_hash(), the match callback compares the rows.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct rj_tuple {
+	uint32_t key;
+	uint32_t rid;		/* row id in the original table */
+} rj_tuple_t;
+
+struct rj_options {
+	unsigned int threads;	/* 0: one per online CPU */
+	unsigned int radix_bits;	/* 0: pick from the cache size */
+	unsigned int passes;	/* 1 or 2, 0: pick from radix_bits */
+	size_t cache_bytes;	/* per partition, 0: the L2 size */
+};
+
+struct rj_stats {
+	uint64_t matches;
+	unsigned int threads;
+	unsigned int radix_bits;
+	unsigned int passes;
+	uint64_t partition_usec;	/* 1st pass over r and s */
+	uint64_t join_usec;	/* 2nd pass, build and probe */
+};
+
+/*
+ * Called for each pair of rows with the same key, from the thread
+ * which joins the partition. thread is 0..threads-1.
+ */
+typedef void (* rj_match_f)(void *arg, unsigned int thread,
+			    uint32_t r_rid, uint32_t s_rid);
+
+void rj_options_init(struct rj_options *opts);
+
+/*
+ * Join r and s on the key. fn may be NULL to only count the matches.
+ * Returns 0 or -1 with errno set, EINVAL if a table has too many rows.
+ */
+int rj_join(const rj_tuple_t *r, size_t nr, const rj_tuple_t *s, size_t ns,
+	    const struct rj_options *opts, rj_match_f fn, void *arg,
+	    struct rj_stats *stats);
+
+/* 32-bit FNV-1a of a string key, at most len bytes */
+uint32_t rj_key_hash(const char *key, size_t len);
+
+#endif	/* __RADIX_JOIN_H__ */
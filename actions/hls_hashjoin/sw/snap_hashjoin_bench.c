@@ -0,0 +1,335 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark for the host radix join in radix_join.c, the CPU baseline
+ * for the hashjoin action. Joins a build table r of n rows with a
+ * probe table s of n x ratio rows, for n from 1K up to 100M in steps
+ * of 10. Each key of r occurs dup times, the keys of s are drawn
+ * uniformly from the keys of r, such that every row of s matches.
+ * The row ids of r follow from their key, so the number of matches
+ * and a checksum over the matching row ids are known in advance.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "radix_join.h"
+
+int verbose_flag = 0;
+static const char *version = GIT_VERSION;
+
+struct bench_sum {
+	uint64_t matches;
+	uint64_t checksum;
+	uint8_t pad[48];	/* one cache line per thread */
+};
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static inline uint64_t bench_mix(uint32_t r_rid, uint32_t s_rid)
+{
+	return (uint64_t)r_rid * (s_rid | 1);
+}
+
+static void bench_match(void *arg, unsigned int thread,
+			uint32_t r_rid, uint32_t s_rid)
+{
+	struct bench_sum *sum = (struct bench_sum *)arg + thread;
+
+	sum->matches++;
+	sum->checksum += bench_mix(r_rid, s_rid);
+}
+
+/*
+ * Key k of r is in the rows k * dup ... k * dup + cnt - 1 of the
+ * unshuffled table, which are its row ids.
+ */
+static inline uint64_t key_rows(size_t n, unsigned int dup, uint32_t k)
+{
+	uint64_t first = (uint64_t)k * dup;
+
+	return (n - first < dup) ? n - first : dup;
+}
+
+static void table_r_fill(rj_tuple_t *r, size_t n, unsigned int dup,
+			 uint64_t *seed)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		r[i].key = i / dup;
+		r[i].rid = i;
+	}
+	for (i = n - 1; i > 0; i--) {	/* Fisher-Yates */
+		size_t j = xorshift64(seed) % (i + 1);
+		rj_tuple_t t = r[i];
+
+		r[i] = r[j];
+		r[j] = t;
+	}
+}
+
+/* Fills s and returns the expected matches and checksum */
+static void table_s_fill(rj_tuple_t *s, size_t ns, size_t nr,
+			 unsigned int dup, uint64_t *seed,
+			 uint64_t *matches, uint64_t *checksum)
+{
+	size_t keys = (nr + dup - 1) / dup, i;
+
+	*matches = 0;
+	*checksum = 0;
+	for (i = 0; i < ns; i++) {
+		uint32_t k = xorshift64(seed) % keys;
+		uint64_t cnt = key_rows(nr, dup, k);
+		uint64_t rids = cnt * k * dup + cnt * (cnt - 1) / 2;
+
+		s[i].key = k;
+		s[i].rid = i;
+		*matches += cnt;
+		*checksum += rids * (i | 1);
+	}
+}
+
+/**
+ * @brief	prints valid command line options
+ *
+ * @param prog	current program's name
+ */
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -V, --version             print version.\n"
+	       "  -r, --min_rows <n>        smallest build table, default 1000.\n"
+	       "  -R, --max_rows <n>        largest build table, default 100000000.\n"
+	       "  -f, --ratio <n>           probe rows per build row, default 1.\n"
+	       "  -d, --dup <n>             rows per build key, default 1.\n"
+	       "  -t, --threads <n>         0: one per CPU (default).\n"
+	       "  -b, --bits <n>            radix bits, default from the cache.\n"
+	       "  -p, --passes <n>          partitioning passes, 1 or 2.\n"
+	       "  -c, --cache <KiB>         cache per partition, default L2.\n"
+	       "  -i, --iterations <n>      runs per size, the fastest counts.\n"
+	       "  -n, --count               only count, no match callback.\n"
+	       "  -s, --seed <seed>         random seed.\n"
+	       "\n"
+	       "Example:\n"
+	       "  Join 1K .. 10M rows with 4 probe rows each on 8 threads:\n"
+	       "    snap_hashjoin_bench -R 10000000 -f 4 -t 8\n"
+	       "\n",
+	       prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int ch, rc = 0;
+	struct rj_options opts;
+	struct rj_stats st, best;
+	struct bench_sum *sum = NULL;
+	rj_tuple_t *r = NULL, *s = NULL;
+	size_t min_rows = 1000, max_rows = 100000000, nr, ns;
+	unsigned int ratio = 1, dup = 1, iterations = 1, threads, i, j;
+	unsigned long seed = 1974;
+	int count_only = 0;
+
+	rj_options_init(&opts);
+	memset(&best, 0, sizeof(best));
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "min_rows",	required_argument, NULL, 'r' },
+			{ "max_rows",	required_argument, NULL, 'R' },
+			{ "ratio",	required_argument, NULL, 'f' },
+			{ "dup",	required_argument, NULL, 'd' },
+			{ "threads",	required_argument, NULL, 't' },
+			{ "bits",	required_argument, NULL, 'b' },
+			{ "passes",	required_argument, NULL, 'p' },
+			{ "cache",	required_argument, NULL, 'c' },
+			{ "iterations",	required_argument, NULL, 'i' },
+			{ "count",	no_argument,	   NULL, 'n' },
+			{ "seed",	required_argument, NULL, 's' },
+			{ "version",	no_argument,	   NULL, 'V' },
+			{ "verbose",	no_argument,	   NULL, 'v' },
+			{ "help",	no_argument,	   NULL, 'h' },
+			{ 0,		no_argument,	   NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "r:R:f:d:t:b:p:c:i:ns:Vvh",
+				 long_options, &option_index);
+		if (ch == -1)
+			break;
+
+		switch (ch) {
+		case 'r':
+			min_rows = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			max_rows = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			ratio = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			dup = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			opts.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.radix_bits = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			opts.passes = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.cache_bytes = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count_only = 1;
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((optind != argc) || (min_rows == 0) || (max_rows < min_rows) ||
+	    (ratio == 0) || (dup == 0) || (iterations == 0) ||
+	    (opts.passes > 2) ||
+	    ((uint64_t)max_rows * ratio >= UINT32_MAX)) {
+		fprintf(stderr, "err: invalid rows, ratio, dup or passes!\n");
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	threads = opts.threads;
+	if (threads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = (n > 0) ? n : 1;
+	}
+	sum = calloc(threads, sizeof(*sum));
+	r = malloc(max_rows * sizeof(*r));
+	s = malloc(max_rows * ratio * sizeof(*s));
+	if (!sum || !r || !s) {
+		fprintf(stderr, "err: cannot allocate %zu + %zu rows\n",
+			max_rows, max_rows * ratio);
+		rc = -1;
+		goto out;
+	}
+
+	printf("%10s %11s %3s %4s %4s %10s %10s %9s %s\n",
+	       "build", "probe", "thr", "bits", "pass", "part usec",
+	       "join usec", "Mrows/s", "matches");
+
+	for (nr = min_rows; nr <= max_rows; nr *= 10) {
+		uint64_t state = seed ? seed : 1;
+		uint64_t matches, checksum, usec, best_usec = 0;
+
+		ns = nr * ratio;
+		table_r_fill(r, nr, dup, &state);
+		table_s_fill(s, ns, nr, dup, &state, &matches, &checksum);
+
+		for (i = 0; i < iterations; i++) {
+			uint64_t got = 0, cs = 0;
+
+			memset(sum, 0, threads * sizeof(*sum));
+			rc = rj_join(r, nr, s, ns, &opts,
+				     count_only ? NULL : bench_match, sum,
+				     &st);
+			if (rc != 0) {
+				fprintf(stderr, "err: join of %zu x %zu rows "
+					"failed: %s\n", nr, ns,
+					strerror(errno));
+				goto out;
+			}
+			for (j = 0; j < st.threads; j++) {
+				got += sum[j].matches;
+				cs += sum[j].checksum;
+			}
+			if ((st.matches != matches) ||
+			    (!count_only && ((got != matches) ||
+					     (cs != checksum)))) {
+				fprintf(stderr, "err: %zu x %zu rows: %llu "
+					"matches (%llu called back), "
+					"expected %llu, checksum %016llx "
+					"expected %016llx\n", nr, ns,
+					(long long)st.matches,
+					(long long)got,
+					(long long)matches,
+					(long long)cs,
+					(long long)checksum);
+				rc = -1;
+				goto out;
+			}
+
+			usec = st.partition_usec + st.join_usec;
+			if (i == 0 || usec < best_usec) {
+				best_usec = usec;
+				best = st;
+			}
+			if (verbose_flag)
+				fprintf(stderr, "  run %u: %llu usec\n", i,
+					(long long)usec);
+		}
+
+		printf("%10zu %11zu %3u %4u %4u %10llu %10llu %9.1f %llu\n",
+		       nr, ns, best.threads, best.radix_bits, best.passes,
+		       (long long)best.partition_usec,
+		       (long long)best.join_usec,
+		       best_usec ? (double)(nr + ns) / best_usec : 0.0,
+		       (long long)best.matches);
+
+		if (max_rows / 10 < nr)
+			break;
+	}
+
+ out:
+	free(s);
+	free(r);
+	free(sum);
+	exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -93,6 +93,19 @@ for t2_entries in `seq 1 128` 512 666 888 999 1024 2048 2049 5015 7007 8088 1231
     echo "ok"
 done
 
+echo -n "Doing snap_hashjoin_bench (CPU baseline) ... "
+cmd="snap_hashjoin_bench -R 1000000 >> snap_hashjoin.log 2>&1"
+echo "$cmd" >> snap_hashjoin.log
+eval ${cmd}
+if [ $? -ne 0 ]; then
+	cat snap_hashjoin.log
+	echo
+	echo "cmd: ${cmd}"
+	echo "failed"
+	exit 1
+fi
+echo "ok"
+
 rm -f *.bin *.bin *.out
 echo "Test OK"
 exit 0
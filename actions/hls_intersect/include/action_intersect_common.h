@@ -31,6 +31,10 @@ extern "C" {
 #define NUM_TABLES  2
 #define MAX_TABLE_SIZE (uint64_t)(1<<30)
 
+// Card DRAM from here on holds the hash table of the hash method,
+// tables and result have to stay below
+#define DDR_HASH_TABLE_ADDR ((uint64_t)4 << 30)
+
 #define HT_ENTRY_NUM_EXP 24
 #define HT_ENTRY_NUM (1<<HT_ENTRY_NUM_EXP)
 
@@ -93,7 +93,8 @@ static void snap_prepare_intersect(struct snap_job *cjob,
         value_t * input_addrs_host[],
         uint32_t input_sizes[],
         value_t * output_addr_host,
-        uint32_t actual_output_size)
+        uint32_t actual_output_size,
+        uint64_t ddr_addrs[])
 {
     uint64_t ddr_addr = 0x0ull;
 
@@ -105,11 +106,11 @@ static void snap_prepare_intersect(struct snap_job *cjob,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
 
         //Memcopy, target
-        ddr_addr = 0;
+        ddr_addr = ddr_addrs[0];
         snap_addr_set( &ijob_i->src_tables_ddr[0], (void *)ddr_addr, input_sizes[0], SNAP_ADDRTYPE_CARD_DRAM ,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | SNAP_ADDRFLAG_END);
 
-        ddr_addr = MAX_TABLE_SIZE;
+        ddr_addr = ddr_addrs[1];
         snap_addr_set( &ijob_i->src_tables_ddr[1], (void *)ddr_addr, input_sizes[1], SNAP_ADDRTYPE_CARD_DRAM ,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST | SNAP_ADDRFLAG_END);
 
@@ -117,11 +118,11 @@ static void snap_prepare_intersect(struct snap_job *cjob,
     }
     else if (step == 2) {
         //Memcopy, source
-        ddr_addr = 0;
+        ddr_addr = ddr_addrs[0];
         snap_addr_set( &ijob_i->src_tables_ddr[0], (void *)ddr_addr, input_sizes[0],SNAP_ADDRTYPE_CARD_DRAM ,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
 
-        ddr_addr = MAX_TABLE_SIZE;
+        ddr_addr = ddr_addrs[1];
         snap_addr_set( &ijob_i->src_tables_ddr[1], (void *)ddr_addr, input_sizes[1],SNAP_ADDRTYPE_CARD_DRAM ,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
 
@@ -134,18 +135,18 @@ static void snap_prepare_intersect(struct snap_job *cjob,
         //No relation to result_table
     }
     else if (step == 3) {
-        ddr_addr = 0;
+        ddr_addr = ddr_addrs[0];
         snap_addr_set( &ijob_i->src_tables_ddr[0], (void *)ddr_addr, input_sizes[0],SNAP_ADDRTYPE_CARD_DRAM ,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
 
-        ddr_addr = MAX_TABLE_SIZE;
+        ddr_addr = ddr_addrs[1];
         snap_addr_set( &ijob_i->src_tables_ddr[1], (void *)ddr_addr,
                 input_sizes[1],SNAP_ADDRTYPE_CARD_DRAM ,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
 
         //result_table in DDR
         // 99 is a dummy value. HW will update this field when finished.
-        ddr_addr = 2*MAX_TABLE_SIZE;
+        ddr_addr = ddr_addrs[NUM_TABLES];
         snap_addr_set (&ijob_i->result_table, (void *)ddr_addr,
                 99, SNAP_ADDRTYPE_CARD_DRAM ,
                 SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST |
@@ -154,7 +155,7 @@ static void snap_prepare_intersect(struct snap_job *cjob,
     else if (step == 5) {
         //Memcopy, source
         // reuse src_tables_ddr[0] for the result.
-        ddr_addr = 2*MAX_TABLE_SIZE;
+        ddr_addr = ddr_addrs[NUM_TABLES];
         snap_addr_set( &ijob_i->src_tables_ddr[0],
                 (void *)ddr_addr, actual_output_size,
                 SNAP_ADDRTYPE_CARD_DRAM ,
@@ -254,6 +255,7 @@ int main(int argc, char *argv[])
     intersect_job_t ijob_i, ijob_o;
     value_t * src_tables[NUM_TABLES];
     uint32_t  src_sizes[NUM_TABLES];
+    uint64_t  ddr_addrs[NUM_TABLES + 1];	/* tables + result in card DRAM */
     FILE *fp;
 
     value_t * result_table = NULL;
@@ -366,6 +368,7 @@ int main(int argc, char *argv[])
         //Randomly generate the Table data
         for (i = 0; i < NUM_TABLES; i++) {
             src_sizes[i] = num*sizeof(value_t); //All tables are of same size.
+            min_num = num;
             src_tables[i] = memalign (page_size, src_sizes[i]);
             if(!src_tables[i])
                 goto out_error2;
@@ -470,10 +473,45 @@ int main(int argc, char *argv[])
                 card_no, strerror(errno));
         goto out_error1;
     }
+
+    /*
+     * Card DRAM for both source tables and the result. The hash
+     * method in hardware keeps its hash table at DDR_HASH_TABLE_ADDR,
+     * so the regions must end below that.
+     */
+    for (i = 0; i < NUM_TABLES; i++) {
+        rc = snap_ddr_alloc(card, src_sizes[i], 0, &ddr_addrs[i]);
+        if (rc != SNAP_OK)
+            break;
+    }
+    if (rc == SNAP_OK)
+        rc = snap_ddr_alloc(card, init_result_size, 0,
+                            &ddr_addrs[NUM_TABLES]);
+    if (rc != SNAP_OK) {
+        fprintf(stderr, "err: failed to allocate card DRAM rc=%d: %s\n",
+                rc, strerror(errno));
+        goto out_error2;
+    }
+    if (!sw && (method == HASH_METHOD)) {
+        for (i = 0; i <= NUM_TABLES; i++) {
+            uint64_t size = (i < NUM_TABLES) ? src_sizes[i] :
+                            init_result_size;
+
+            if (ddr_addrs[i] + size > DDR_HASH_TABLE_ADDR) {
+                fprintf(stderr, "err: card DRAM 0x%llx..0x%llx overlaps "
+                        "the hash table at 0x%llx\n",
+                        (long long)ddr_addrs[i],
+                        (long long)(ddr_addrs[i] + size),
+                        (long long)DDR_HASH_TABLE_ADDR);
+                goto out_error2;
+            }
+        }
+    }
+
     //------------------------------------
     printf("Start Step1 (Copy source data from Host to DDR) ..............\n");
     snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-            1, method, src_tables, src_sizes,result_table,99);
+            1, method, src_tables, src_sizes,result_table,99, ddr_addrs);
 
     rc |= run_one_step(action, &cjob, timeout, 1);
     if (rc != 0)
@@ -483,7 +521,7 @@ int main(int argc, char *argv[])
         //------------------------------------
         printf("Start Step2 (Copy source data from DDR to Host) ..............\n");
         snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-                2, method, src_tables, src_sizes,result_table,99);
+                2, method, src_tables, src_sizes,result_table,99, ddr_addrs);
 
         rc |= run_one_step(action, &cjob, timeout, 2);
         if (rc != 0)
@@ -505,7 +543,7 @@ int main(int argc, char *argv[])
         //------------------------------------
         printf("Start Step3 (Do intersection in DDR) ..............\n");
         snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-                3, method, src_tables, src_sizes, result_table, 99);
+                3, method, src_tables, src_sizes, result_table, 99, ddr_addrs);
 
         rc |= run_one_step(action, &cjob, timeout, 3);
         if (rc != 0)
@@ -519,7 +557,7 @@ int main(int argc, char *argv[])
         //------------------------------------
         printf("Start Step5 (Copy result from DDR to Host) ..............\n");
         snap_prepare_intersect(&cjob, &ijob_i, &ijob_o,
-                5, method, src_tables, src_sizes, result_table, result_num * sizeof(value_t));
+                5, method, src_tables, src_sizes, result_table, result_num * sizeof(value_t), ddr_addrs);
 
         rc |= run_one_step(action, &cjob, timeout, 5);
         if (rc != 0)
@@ -548,6 +586,8 @@ int main(int argc, char *argv[])
         printf("\n");
     }
 
+    for(i = 0; i <= NUM_TABLES; i++)
+        snap_ddr_free(card, ddr_addrs[i]);
     snap_detach_action(action);
     snap_card_free(card);
 
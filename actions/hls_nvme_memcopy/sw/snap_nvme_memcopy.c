@@ -55,17 +55,17 @@ static void usage(const char *prog)
 	       "  -n, --drv-id   <0/1>        drive_id if NVME_SSD is used (default: 0)\n"
 	       "  -s, --size <size>           size of data (in bytes).\n"
                "  -S, --maxsize <maxsize>     Maximum size of SDRAM buffer       (default=0x80000000 ie 2GB)\n"
-               "  -F, --buff_fwd_add <offset> Address of SDRAM buffer (to   SSD) (default=0x00000000)\n"
-               "  -R, --buff_rev_add <offset> Address of SDRAM buffer (from SSD) (default=0x80000000 ie 2GB)\n"
+               "  -F, --buff_fwd_add <offset> Address of SDRAM buffer (to   SSD) (default=allocated from card DRAM)\n"
+               "  -R, --buff_rev_add <offset> Address of SDRAM buffer (from SSD) (default=allocated from card DRAM)\n"
 	       "  -m, --mode <mode>           mode flags.\n"
 	       "  -t, --timeout               Timeout in sec to wait for done. (10 sec default)\n"
 	       "  -X, --verify                verify result if possible\n"
 	       "  -N, --no_irq                Disable Interrupts\n"
 	       "\n"
 	       " WARNING : All data transfers to and from NVME_SSDs are buffered in CARD_DRAM :\n"
-	       " By default forward buffer (to SSD) is at address 0x0 of DDR, while return buffer is at address 0x80000000 (2GB)\n"
-               " Buffer default size is also 0x80000000 (2GB) so all the DDR is used as buffer"
-               " Use -S,F,R to change these settings.\n"
+	       " By default forward buffer (to SSD) and return buffer (from SSD) are allocated from card DRAM\n"
+               " Buffer default size is 0x80000000 (2GB) so all of a 4GB DDR is used as buffer.\n"
+               " Use -S to change the size, -F and -R together to place both buffers at fixed addresses.\n"
 	       
 	
 	   " Usage Examples:\n"
@@ -154,8 +154,9 @@ int main(int argc, char *argv[])
 	// the following are default values for a 4GB DDR4 memory
 	ssize_t maxbuffsize  = 0x80000000; // 2GB (half of the memory for each path)
         //uint64_t maxbuffsize  = 0x80000000; // 2GB (half of the memory for each path)
-        uint64_t buff_fwd_add = 0x00000000; // 0   (lower part of memory)
-        uint64_t buff_rev_add = 0x80000000; // 2GB (upper part of memory)
+        uint64_t buff_fwd_add = 0x00000000; // allocated unless -F is given
+        uint64_t buff_rev_add = 0x00000000; // allocated unless -R is given
+	int buff_fwd_alloc = 1, buff_rev_alloc = 1;
 	uint8_t *ibuff = NULL, *obuff = NULL;
 	uint8_t type_in = SNAP_ADDRTYPE_HOST_DRAM;
 	uint64_t addr_in = 0x0ull;
@@ -255,9 +256,11 @@ int main(int argc, char *argv[])
                         break;
 		case 'F':
                         buff_fwd_add = __str_to_num(optarg);
+			buff_fwd_alloc = 0;
                         break;
 		case 'R':
                         buff_rev_add = __str_to_num(optarg);
+			buff_rev_alloc = 0;
                         break;
                 case 'm':
                         mode = strtol(optarg, (char **)NULL, 0);
@@ -299,6 +302,20 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* The allocator does not know about fixed buffers, so no mixing */
+	if (buff_fwd_alloc != buff_rev_alloc) {
+		fprintf(stderr, "err: -F and -R must be given together\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!buff_fwd_alloc &&
+	    (buff_fwd_add < buff_rev_add + maxbuffsize) &&
+	    (buff_rev_add < buff_fwd_add + maxbuffsize)) {
+		fprintf(stderr, "err: buffers at %llx and %llx overlap, "
+			"size %llx\n", (long long)buff_fwd_add,
+			(long long)buff_rev_add, (long long)maxbuffsize);
+		exit(EXIT_FAILURE);
+	}
+
 	/* if input file is defined, use that as input and check it's size is compatible with buffer size */
 		if (input != NULL) {
 		size = __file_size(input);
@@ -381,6 +398,30 @@ int main(int argc, char *argv[])
 			card_no, strerror(errno));
 		goto out_error1;
 	}
+
+	/* Buffers not placed by -F/-R come from the card DRAM allocator */
+	if (buff_fwd_alloc) {
+		rc = snap_ddr_alloc(card, maxbuffsize, 0, &buff_fwd_add);
+		if (rc != SNAP_OK) {
+			fprintf(stderr, "err: cannot allocate fwd buffer "
+				"rc=%d: %s\n", rc, strerror(errno));
+			buff_fwd_alloc = buff_rev_alloc = 0;
+			goto out_error2;
+		}
+	}
+	if (buff_rev_alloc) {
+		rc = snap_ddr_alloc(card, maxbuffsize, 0, &buff_rev_add);
+		if (rc != SNAP_OK) {
+			fprintf(stderr, "err: cannot allocate rev buffer "
+				"rc=%d: %s\n", rc, strerror(errno));
+			buff_rev_alloc = 0;
+			goto out_error2;
+		}
+	}
+	if (verbose_flag)
+		fprintf(stderr, "  FwdBufferAdd: %08llx RevBufferAdd: %08llx\n",
+			(long long)buff_fwd_add, (long long)buff_rev_add);
+
         // The following snap_prepare_nvme_memcopy will fill the software mjob and cjob
         // structures with the appropriate content
 	snap_prepare_nvme_memcopy(&cjob, &mjob,
@@ -457,6 +498,10 @@ int main(int argc, char *argv[])
 		(long long)timediff_usec(&etime, &stime));
         }
 
+	if (buff_rev_alloc)
+		snap_ddr_free(card, buff_rev_add);
+	if (buff_fwd_alloc)
+		snap_ddr_free(card, buff_fwd_add);
 	snap_detach_action(action);
 	snap_card_free(card);
 
@@ -465,6 +510,10 @@ int main(int argc, char *argv[])
 	exit(exit_code);
 
  out_error2:
+	if (buff_rev_alloc)
+		snap_ddr_free(card, buff_rev_add);
+	if (buff_fwd_alloc)
+		snap_ddr_free(card, buff_fwd_add);
 	snap_detach_action(action);
  out_error1:
 	snap_card_free(card);
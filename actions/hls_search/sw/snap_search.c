@@ -109,6 +109,7 @@ static void snap_prepare_search(struct snap_job *cjob,
 				const uint8_t *dbuff, ssize_t dsize,
 				uint64_t *offs, unsigned int items,
 				const uint8_t *pbuff, unsigned int psize,
+				uint64_t ddr_text, uint64_t ddr_offs,
 				const int method, const int step)
 {
     uint64_t ddr_addr;
@@ -127,7 +128,7 @@ static void snap_prepare_search(struct snap_job *cjob,
 		  SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST);
 
      // result will be in DDR
-     ddr_offaddr = (uint64_t) DDR_OFFS_START;
+     ddr_offaddr = ddr_offs;
      snap_addr_set(&sjob_in->ddr_result, (void*) ddr_offaddr, items * sizeof(*offs),
 		      SNAP_ADDRTYPE_CARD_DRAM,
 		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST);
@@ -141,7 +142,7 @@ static void snap_prepare_search(struct snap_job *cjob,
 		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
 
         // text is moved to DDR
-        ddr_addr = (uint64_t) DDR_TEXT_START;
+        ddr_addr = ddr_text;
 	snap_addr_set(&sjob_in->ddr_text1, (void *) ddr_addr, dsize,
 		      SNAP_ADDRTYPE_CARD_DRAM,
 		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_DST);
@@ -150,7 +151,7 @@ static void snap_prepare_search(struct snap_job *cjob,
     {
         // Step2 will copy ddr_text1 to host for SW processing
         // text is in DDR
-        ddr_addr = (uint64_t) DDR_TEXT_START;
+        ddr_addr = ddr_text;
 	snap_addr_set(&sjob_in->ddr_text1, (void *) ddr_addr, dsize,
 		      SNAP_ADDRTYPE_CARD_DRAM,
 		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
@@ -164,7 +165,7 @@ static void snap_prepare_search(struct snap_job *cjob,
     {
         // Step3 hardware doing search in DDR
         // text is in DDR
-        ddr_addr = (uint64_t) DDR_TEXT_START;
+        ddr_addr = ddr_text;
 	snap_addr_set(&sjob_in->ddr_text1, (void *) ddr_addr, dsize,
 		      SNAP_ADDRTYPE_CARD_DRAM,
 		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC);
@@ -174,7 +175,7 @@ static void snap_prepare_search(struct snap_job *cjob,
     {
         // Step5 is copying results in DDR back to Host
         // result is in DDR
-        ddr_offaddr = (uint64_t) DDR_OFFS_START;
+        ddr_offaddr = ddr_offs;
 	snap_addr_set(&sjob_in->ddr_result, (void*) ddr_offaddr, items * sizeof(*offs),
 		      SNAP_ADDRTYPE_CARD_DRAM,
 		      SNAP_ADDRFLAG_ADDR | SNAP_ADDRFLAG_SRC |
@@ -360,6 +361,7 @@ int main(int argc, char *argv[])
 	uint64_t *offs;		/* offset buffer */
 	uint8_t *input_addr;
 	uint32_t input_size;
+	uint64_t ddr_text, ddr_offs;	/* card DRAM for text and offsets */
 	unsigned int attach_timeout = 60;
 	unsigned int timeout = 10;
 	unsigned int items = 42;
@@ -506,6 +508,16 @@ int main(int argc, char *argv[])
 		goto out_error2;
 	}
 
+	/* Get card DRAM for the text and the result offsets */
+	rc = snap_ddr_alloc(card, dsize, 0, &ddr_text);
+	if (rc == SNAP_OK)
+		rc = snap_ddr_alloc(card, items * sizeof(*offs), 0, &ddr_offs);
+	if (rc != SNAP_OK) {
+		fprintf(stderr, "err: failed to allocate card DRAM rc=%d: %s\n",
+			rc, strerror(errno));
+		goto out_error3;
+	}
+
 	run = 0;
     	/*
  	 * Run Step 1, 2, 4 for Software search
@@ -520,6 +532,7 @@ int main(int argc, char *argv[])
 			    dbuff, dsize,
 			    offs, items,
 			    pbuff, psize,
+			    ddr_text, ddr_offs,
 			    method, step);
 
         printf("INITIALIZATION : move %d bytes from Host mem to DDR\n",
@@ -538,6 +551,7 @@ int main(int argc, char *argv[])
 				    dbuff, dsize,
 				    offs, items,
 				    pbuff, psize,
+				    ddr_text, ddr_offs,
 				    method, step);
 
         	printf("Data size = %d - Pattern size = %d \n", (int)dsize, (int)psize);
@@ -590,6 +604,7 @@ int main(int argc, char *argv[])
 					    dbuff, dsize,
 					    offs, items,
 					    pbuff, psize,
+					    ddr_text, ddr_offs,
 					    method, step);
         		printf("Data size = %d - Pattern size = %d \n", (int)dsize, (int)psize);
 
@@ -617,7 +632,8 @@ int main(int argc, char *argv[])
 			step = 5;
 
             		snap_prepare_search(&cjob, &sjob_in, &sjob_out, dbuff, dsize,
-                    		offs, items, pbuff, psize, method, step);
+                    		offs, items, pbuff, psize, ddr_text, ddr_offs,
+				method, step);
         		printf("Data size = %d - Pattern size = %d \n", (int)dsize, (int)psize);
             		snap_print_search_results(&cjob, run);
 			*/
@@ -665,6 +681,8 @@ int main(int argc, char *argv[])
 	free(pbuff);
 	free(offs);
 
+	snap_ddr_free(card, ddr_offs);
+	snap_ddr_free(card, ddr_text);
 	snap_queue_free(queue);
 	snap_card_free(card);
 	exit(exit_code);
@@ -100,6 +100,14 @@ CFLAGS += -DGIT_VERSION=\"$(VERSION)\" \
 # Optimizations
 CFLAGS += -funroll-all-loops
 
+# USDT probes are compiled in when <sys/sdt.h> is installed
+# (systemtap-sdt-devel). Use HAS_SDT=n to force them off.
+HAS_SDT ?= $(shell $(CROSS)gcc -include sys/sdt.h -E -x c /dev/null \
+	> /dev/null 2>&1 && echo y || echo n)
+ifeq ($(HAS_SDT),y)
+CFLAGS += -DCONFIG_SNAP_SDT
+endif
+
 # General settings: Include and library search path
 CFLAGS += -I$(SNAP_ROOT)/software/include 
 LDFLAGS += -L$(SNAP_ROOT)/software/lib
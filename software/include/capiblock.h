@@ -174,6 +174,38 @@ typedef struct chunk_stats_s {
                                     /* has failed over to another path.*/
 } chunk_stats_t;
 
+/************************************************************************/
+/* SNAP: latency histograms, cblk_get_stats with CBLK_STATS_SNAP        */
+/************************************************************************/
+
+#define CBLK_HIST_BUCKETS      32   /* Bucket i counts latencies of     */
+                                    /* 2^i <= nsec < 2^(i+1), the last  */
+                                    /* one all larger latencies.        */
+
+typedef struct cblk_hist_s {
+    uint64_t count;                 /* Number of requests measured     */
+    uint64_t sum_nsec;              /* Sum of their latencies          */
+    uint64_t max_nsec;              /* Largest latency seen            */
+    uint64_t bucket[CBLK_HIST_BUCKETS];
+} cblk_hist_t;
+
+typedef struct chunk_snap_stats_s {
+    chunk_stats_t chunk;            /* Same as without CBLK_STATS_SNAP */
+    uint64_t num_prefetches;        /* Prefetch reads started          */
+    uint64_t num_prefetch_collisions; /* Prefetches found in the cache */
+    uint64_t num_hw_reads;          /* Read requests sent to the card  */
+    uint64_t num_hw_writes;         /* Write requests sent to the card */
+    uint64_t num_dirty_blocks;      /* Current number of dirty blocks  */
+                                    /* in the write-back cache         */
+    uint64_t num_flushes;           /* Write-back cache flushes        */
+    uint64_t num_flush_blocks;      /* Blocks written by the flushes   */
+    cblk_hist_t read;               /* cblk_read, cblk_aread from the  */
+                                    /* call to the data being there    */
+    cblk_hist_t write;              /* cblk_write, cblk_awrite         */
+    cblk_hist_t cache_hit;          /* Reads served from the cache     */
+    cblk_hist_t cache_miss;         /* Reads which went to the device  */
+} chunk_snap_stats_t;
+
 
 /************************************************************************/
 /* General flags                                                        */
@@ -213,11 +245,20 @@ typedef off_t cflash_offset_t;
 
 #define CBLK_OPN_GROUP         0x100  /* Use cblk_group_open            */
 
+#define CBLK_OPN_WRITEBACK    0x1000  /* SNAP: cblk_write leaves dirty  */
+                                      /* blocks in the cache, see       */
+                                      /* cblk_flush                     */
+#define CBLK_OPN_SOFTWARE     0x2000  /* SNAP: path is a file or block */
+                                      /* device, accessed with O_DIRECT */
+                                      /* instead of the card            */
+
 /************************************************************************/
 /* Common flag for non-open APIs                                        */
 /************************************************************************/
 #define CBLK_GROUP_ID           0x100 /* id passed is a chunk group id  */
 #define CBLK_GROUP_RAID0        0x200  /* Use cblk_group_open           */
+#define CBLK_STATS_SNAP        0x1000 /* SNAP: cblk_get_stats fills a   */
+                                      /* chunk_snap_stats_t             */
 
 
 /************************************************************************/
@@ -233,6 +274,8 @@ typedef off_t cflash_offset_t;
                                   /* parameter to the address which it  */
                                   /* expects command completion status  */
                                   /* to be posted.                      */
+#define CBLK_ARW_PRIORITY_FLAG 8  /* SNAP: expedite the request, like   */
+                                  /* CBLK_IO_PRIORITY_REQ.              */
 typedef enum {
 
     CBLK_ARW_STATUS_PENDING = 0, /* Command has not completed           */
@@ -354,6 +397,13 @@ int cblk_listio(chunk_id_t chunk_id,
 /* Clone a chunk (such as a parent and chilld process' chunk */
 int cblk_clone_after_fork(chunk_id_t chunk_id, int mode, int flags);
 
+/* Write dirty blocks of a chunk opened with CBLK_OPN_WRITEBACK */
+int cblk_flush(chunk_id_t chunk_id, int flags);
+
+/* SNAP: timeout in usec for the requests the calling thread starts */
+/* from now on, 0 restores CBLK_REQTIMEOUT. Returns the previous one. */
+uint64_t cblk_set_timeout(uint64_t usec);
+
 
 typedef struct cflsh_cg_tag_s
 {
@@ -91,6 +91,7 @@ extern "C" {
 #define SNAP_EINVAL			-7 /* Invalid parameters */
 #define SNAP_EATTACH                    -8 /* Attach error */
 #define SNAP_EDETACH                    -9 /* Detach error */
+#define SNAP_ENOMEM                     -10 /* Out of card memory */
 
 /**********************************************************************
  * SNAP Common Definitions
@@ -334,6 +335,36 @@ struct snap_action *snap_attach_action(struct snap_card *card,
 			snap_action_flag_t action_flags,
 			int attach_timeout_sec);
 
+/*
+ * Action table as set up by snap_maint: each action type found on the
+ * card together with the short action type used by the job manager.
+ */
+#define SNAP_ACTIONS_MAX	16
+
+struct snap_action_info {
+	snap_action_type_t action_type;
+	uint32_t sat;			/* Short Action Type */
+};
+
+/*
+ * Get the actions available on a card.
+ *
+ * The table is read once per card handle and reused by later calls and
+ * by snap_attach_action(). If SNAP_ACTION_CACHE names a directory, the
+ * table is also kept there per card. A cached table is only used if the
+ * image build date of the card still matches, which costs one MMIO read
+ * instead of reading the whole table.
+ *
+ * @card          Valid SNAP card handle
+ * @actions       Array to store the table in
+ * @num           In: number of entries in actions, out: number of
+ *                actions on the card (can be larger than the input)
+ * @return        SNAP_OK, SNAP_ENODEV if the card was not set up yet,
+ *                SNAP_EINVAL if *num is negative
+ */
+int snap_card_get_actions(struct snap_card *card,
+			  struct snap_action_info *actions, int *num);
+
 /*
  * Detach action from card handle.
  *
@@ -466,6 +497,56 @@ int snap_action_free_irq(struct snap_action *action, int irq);
 
 int snap_card_ioctl(struct snap_card *card, unsigned int cmd, unsigned long parm);
 
+/******************************************************************************
+ * SNAP Card DRAM Allocation
+ *****************************************************************************/
+
+/*
+ * Instead of hard-coding offsets into the card DRAM, applications can
+ * ask libsnap for a region. The allocator manages the card DRAM size
+ * reported by GET_SDRAM_SIZE (or the value configured with
+ * SET_SDRAM_SIZE). In CPU mode, where there is no real card DRAM, an
+ * address range of SNAP_DDR_SW_SIZE_MB is emulated such that the same
+ * application code works in both modes. The bookkeeping is done per
+ * card handle: all jobs using the same handle share the card DRAM.
+ */
+#define SNAP_DDR_ALIGN_DEFAULT	64	/* Card memory bus width in bytes */
+#define SNAP_DDR_SW_SIZE_MB	4096	/* Emulated card DRAM in CPU mode */
+
+/*
+ * Allocate a region in card DRAM.
+ *
+ * @card        snap_card device handle.
+ * @size        size of the region in bytes.
+ * @align       alignment in bytes, must be a power of 2. Use 0 for
+ *              SNAP_DDR_ALIGN_DEFAULT.
+ * @ddr_addr    returns the card DRAM address of the region.
+ * @return      SNAP_OK, SNAP_ENOMEM if no sufficiently large region is
+ *              free, else error.
+ */
+int snap_ddr_alloc(struct snap_card *card, uint64_t size, uint64_t align,
+		   uint64_t *ddr_addr);
+
+/*
+ * Return a region obtained with snap_ddr_alloc().
+ *
+ * @card        snap_card device handle.
+ * @ddr_addr    card DRAM address returned by snap_ddr_alloc().
+ * @return      SNAP_OK, SNAP_ENOENT if the address was not allocated.
+ */
+int snap_ddr_free(struct snap_card *card, uint64_t ddr_addr);
+
+/*
+ * Query free card DRAM.
+ *
+ * @card        snap_card device handle.
+ * @free_bytes  returns total number of free bytes (can be NULL).
+ * @largest     returns size of the largest free region (can be NULL).
+ * @return      SNAP_OK, else error.
+ */
+int snap_ddr_avail(struct snap_card *card, uint64_t *free_bytes,
+		   uint64_t *largest);
+
 /******************************************************************************
  * SNAP Queue Operations
  *****************************************************************************/
@@ -132,6 +132,30 @@ int pp_trace_enabled(void);
 		}                                                      \
 	} while (0)
 
+/**
+ * USDT static probes, e.g. for systemtap or bpftrace:
+ *   bpftrace -e 'usdt:./libsnap.so:libsnap:mmio__read32 { ... }'
+ *
+ * Compiled in only if <sys/sdt.h> was found at build time (see
+ * HAS_SDT in config.mk). A disabled probe is a single nop.
+ */
+#ifdef CONFIG_SNAP_SDT
+#include <sys/sdt.h>
+#  define snap_probe(p, n)		DTRACE_PROBE(p, n)
+#  define snap_probe1(p, n, a)		DTRACE_PROBE1(p, n, a)
+#  define snap_probe2(p, n, a, b)	DTRACE_PROBE2(p, n, a, b)
+#  define snap_probe3(p, n, a, b, c)	DTRACE_PROBE3(p, n, a, b, c)
+#  define snap_probe4(p, n, a, b, c, d)	DTRACE_PROBE4(p, n, a, b, c, d)
+#else
+#  define snap_probe(p, n)		do { } while (0)
+#  define snap_probe1(p, n, a)		do { (void)(a); } while (0)
+#  define snap_probe2(p, n, a, b)	do { (void)(a); (void)(b); } while (0)
+#  define snap_probe3(p, n, a, b, c)	\
+		do { (void)(a); (void)(b); (void)(c); } while (0)
+#  define snap_probe4(p, n, a, b, c, d)	\
+		do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
 /**
  * Register a software version of the FPGA action to enable us
  * simulating high-level behavior of the same and allowing us to
@@ -0,0 +1,107 @@
+#ifndef __SNAP_STATS_H__
+#define __SNAP_STATS_H__
+
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Statistics segment shared between libsnap users and snap_top.
+ *
+ * Each process using a card gets its own POSIX shared memory segment
+ * /dev/shm/snap_stats.<pid>. libsnap creates it when the first card
+ * is opened and removes it on exit. Counters only grow, readers
+ * compute rates from two samples. Set SNAP_STATS=0 to switch off.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAP_STATS_MAGIC	0x53544154	/* "STAT" */
+#define SNAP_STATS_VERSION	2
+#define SNAP_STATS_DIR		"/dev/shm"
+#define SNAP_STATS_PREFIX	"snap_stats."	/* + pid */
+#define SNAP_STATS_CARDS	4		/* Cards per process */
+#define SNAP_STATS_NAME_LEN	32
+
+/* libsnap counters, one set per card opened by the process */
+struct snap_stats_card {
+	char path[SNAP_STATS_NAME_LEN];	/* Device, empty if slot unused */
+	uint64_t jobs;			/* Jobs started */
+	uint64_t job_errors;		/* Jobs failed or timed out */
+	uint64_t sync_jobs;		/* Of these, via sync_execute_job */
+	uint64_t jobs_in_flight;	/* Sync jobs not completed yet */
+	uint64_t set_regs_usec;		/* Time to pass jobs via MMIO */
+	uint64_t wait_usec;		/* Sync jobs, start to completion */
+	uint64_t irq_waits;
+	uint64_t irq_wait_usec;		/* Time blocked waiting for IRQs */
+	uint64_t mmio_reads;
+	uint64_t mmio_writes;
+};
+
+/* capiblock (libsnapcblk) counters */
+struct snap_stats_blk {
+	char path[SNAP_STATS_NAME_LEN];	/* Open devices, comma separated */
+	uint64_t reads;			/* cblk_read() calls */
+	uint64_t writes;		/* cblk_write() calls */
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t read_usec;		/* Total time spent in reads */
+	uint64_t write_usec;		/* Total time spent in writes */
+	uint64_t reqs_in_flight;	/* Hardware requests in flight */
+	uint64_t cache_hits;		/* Reads served from cache */
+	uint64_t prefetches;		/* Prefetch reads started */
+	uint64_t prefetch_collisions;	/* Prefetches not needed */
+	uint64_t cache_trashing;	/* Prefetched but evicted unused */
+};
+
+struct snap_stats {
+	uint32_t magic;
+	uint32_t version;
+	pid_t pid;
+	char comm[16];			/* Process name */
+	struct snap_stats_card card[SNAP_STATS_CARDS];
+	struct snap_stats_blk blk;
+};
+
+/* Lock free counter update, s might be NULL if stats are off */
+#define snap_stats_add(s, field, v) do {				\
+		if (s)							\
+			__sync_fetch_and_add(&(s)->field, (v));		\
+	} while (0)
+
+#define snap_stats_sub(s, field, v) do {				\
+		if (s)							\
+			__sync_fetch_and_sub(&(s)->field, (v));		\
+	} while (0)
+
+/**
+ * Get the statistics segment of the calling process. It is created
+ * if it does not exist yet.
+ *
+ * @return	pointer to the mapped segment or NULL if disabled or
+ *		it could not be created.
+ */
+struct snap_stats *snap_stats_get(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* __SNAP_STATS_H__ */
@@ -23,7 +23,10 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <endian.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 #include <libsnap.h>
 #include <libcxl.h>
@@ -32,12 +35,14 @@
 #include <snap_queue.h>
 #include <snap_s_regs.h>    /* Include SNAP Slave Regs */
 #include <snap_hls_if.h>    /* Include SNAP -> HLS */
+#include <snap_stats.h>
 
 
 /* Trace hardware implementation */
 static unsigned int snap_trace = 0x0;
 static unsigned int snap_config = 0x0;
 static struct snap_sim_action *actions = NULL;
+static const char *snap_action_cache = NULL;	/* Dir for action tables */
 
 #define snap_trace_enabled()  (snap_trace & 0x0001)
 #define reg_trace_enabled()   (snap_trace & 0x0002)
@@ -93,6 +98,21 @@ int pp_trace_enabled(void)
 
 #define	INVALID_SAT 0x0ffffffff
 
+/* Free or allocated region in card DRAM */
+struct snap_ddr_block {
+	uint64_t addr;
+	uint64_t size;
+	struct snap_ddr_block *next;
+};
+
+/* Card DRAM bookkeeping, lists are sorted by address */
+struct snap_ddr_pool {
+	uint64_t size;                  /* Total card DRAM in bytes */
+	uint64_t used;                  /* Allocated bytes */
+	struct snap_ddr_block *free_list;
+	struct snap_ddr_block *used_list;
+};
+
 struct snap_card {
 	void *priv;
 	struct cxl_afu_h *afu_h;
@@ -119,6 +139,16 @@ struct snap_card {
 	unsigned int queue_length;      /* unused */
 	uint64_t cap_reg;               /* Capability Register */
 	const char *name;               /* Card name */
+
+	pthread_mutex_t ddr_lock;       /* Protects ddr */
+	struct snap_ddr_pool *ddr;      /* Card DRAM allocator, lazy setup */
+
+	struct snap_stats_card *stats;  /* Shared stats, NULL if disabled */
+
+	pthread_mutex_t actions_lock;   /* Protects action table */
+	int nactions;                   /* -1 until table was read */
+	struct snap_action_info actions[SNAP_ACTIONS_MAX];
+	char path[64];                  /* Device path, key for cache */
 };
 
 /* Translate Card ID to Name */
@@ -395,10 +425,12 @@ static int hw_wait_irq(struct snap_card *card, int timeout_sec, int expect_irq)
 	fd_set  set;
 	struct  timeval timeout;
 	int rc = 0;
+	long long t0 = card->stats ? __get_usec() : 0;
 
 	snap_trace("  %s: Enter fd: %d Flags: 0x%x Expect irq: %d Timeout: %d sec\n",
 		__func__, card->afu_fd,
 		card->flags, expect_irq, timeout_sec);
+	snap_probe2(libsnap, irq__wait__start, expect_irq, timeout_sec);
 
 __hw_wait_irq_retry:
 	if (!cxl_event_pending(card->afu_h)) {
@@ -465,9 +497,195 @@ __hw_wait_irq_retry:
  err_out:
 	snap_trace("  %s: Exit fd: %d rc: %d\n", __func__,
 		card->afu_fd, rc);
+	snap_probe2(libsnap, irq__wait__done, expect_irq, rc);
+	snap_stats_add(card->stats, irq_waits, 1);
+	snap_stats_add(card->stats, irq_wait_usec, __get_usec() - t0);
+	return rc;
+}
+
+/*
+ * On-disk copy of the action table. It is only valid for the same
+ * card and image, cap_reg and the build date register must match.
+ */
+#define SNAP_ACTION_CACHE_MAGIC		0x41435443	/* "ACTC" */
+#define SNAP_ACTION_CACHE_VERSION	1
+
+struct snap_action_cache {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t cap_reg;
+	uint64_t bdr;
+	uint32_t nactions;
+	uint32_t reserved;
+	struct snap_action_info actions[SNAP_ACTIONS_MAX];
+};
+
+static int __actions_fname(struct snap_card *card, char *fname, size_t len)
+{
+	int card_no;
+	const char *base;
+
+	if (snap_action_cache == NULL)
+		return -1;
+
+	/* afu0.0s and afu0.0m are the same card */
+	base = strrchr(card->path, '/');
+	base = base ? base + 1 : card->path;
+	if (sscanf(base, "afu%d", &card_no) == 1)
+		snprintf(fname, len, "%s/snap_actions.card%d",
+			 snap_action_cache, card_no);
+	else
+		snprintf(fname, len, "%s/snap_actions.%s",
+			 snap_action_cache, base);
+	return 0;
+}
+
+static int __actions_load(struct snap_card *card, const char *fname,
+			  uint64_t bdr)
+{
+	FILE *fp;
+	size_t n;
+	struct snap_action_cache ac;
+
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		return -1;
+	n = fread(&ac, sizeof(ac), 1, fp);
+	fclose(fp);
+
+	if ((n != 1) || (ac.magic != SNAP_ACTION_CACHE_MAGIC) ||
+	    (ac.version != SNAP_ACTION_CACHE_VERSION) ||
+	    (ac.cap_reg != card->cap_reg) || (ac.bdr != bdr) ||
+	    (ac.nactions == 0) || (ac.nactions > SNAP_ACTIONS_MAX)) {
+		snap_trace("  %s: %s is stale\n", __func__, fname);
+		return -1;
+	}
+
+	memcpy(card->actions, ac.actions, sizeof(card->actions));
+	card->nactions = ac.nactions;
+	return 0;
+}
+
+static void __actions_save(struct snap_card *card, const char *fname,
+			   uint64_t bdr)
+{
+	FILE *fp;
+	size_t n;
+	char tmp[PATH_MAX + 16];
+	struct snap_action_cache ac;
+
+	memset(&ac, 0, sizeof(ac));
+	ac.magic = SNAP_ACTION_CACHE_MAGIC;
+	ac.version = SNAP_ACTION_CACHE_VERSION;
+	ac.cap_reg = card->cap_reg;
+	ac.bdr = bdr;
+	ac.nactions = card->nactions;
+	memcpy(ac.actions, card->actions, sizeof(ac.actions));
+
+	/* Other processes must never see a partially written file */
+	snprintf(tmp, sizeof(tmp), "%s.%d", fname, (int)getpid());
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		snap_trace("  %s: cannot write %s: %s\n", __func__, tmp,
+			   strerror(errno));
+		return;
+	}
+	n = fwrite(&ac, sizeof(ac), 1, fp);
+	if ((fclose(fp) != 0) || (n != 1) || (rename(tmp, fname) != 0))
+		unlink(tmp);
+}
+
+static int __actions_read_hw(struct snap_card *card)
+{
+	int i, maid;
+	uint64_t data;
+
+	hw_snap_mmio_read64(card, SNAP_S_SSR, &data);
+	/* Check if configure Slave s done */
+	if (0x100 != (data & 0x100)) {
+		snap_trace("  %s: Error AFU SLAVE need's setup\n", __func__);
+		return SNAP_ENODEV;
+	}
+	maid = (int)(data & 0xf) + 1;	/* Max Actions */
+
+	for (i = 0; i < maid; i++) {
+		hw_snap_mmio_read64(card, SNAP_S_ATRI + i*8, &data);
+		card->actions[i].action_type =
+			(snap_action_type_t)(data & 0xffffffff);
+		card->actions[i].sat = (uint32_t)(data >> 32ll);
+	}
+	card->nactions = maid;
+	return SNAP_OK;
+}
+
+static void __actions_read_sw(struct snap_card *card)
+{
+	int n = 0;
+	struct snap_sim_action *a;
+
+	for (a = actions; (a != NULL) && (n < SNAP_ACTIONS_MAX); a = a->next) {
+		card->actions[n].action_type = a->action_type;
+		card->actions[n].sat = n;
+		n++;
+	}
+	card->nactions = n;
+}
+
+/* Read the action table once per card handle */
+static int __actions_setup(struct snap_card *card)
+{
+	int rc = SNAP_OK;
+	uint64_t bdr;
+	char fname[PATH_MAX];
+
+	pthread_mutex_lock(&card->actions_lock);
+	if (card->nactions >= 0)
+		goto out;
+
+	if (software_action_enabled()) {
+		__actions_read_sw(card);
+		goto out;
+	}
+
+	if (__actions_fname(card, fname, sizeof(fname)) == 0) {
+		hw_snap_mmio_read64(card, SNAP_S_BDR, &bdr);
+		if (__actions_load(card, fname, bdr) == 0) {
+			snap_trace("  %s: %d actions from %s\n", __func__,
+				   card->nactions, fname);
+			goto out;
+		}
+		rc = __actions_read_hw(card);
+		if (rc == SNAP_OK)
+			__actions_save(card, fname, bdr);
+		goto out;
+	}
+	rc = __actions_read_hw(card);
+ out:
+	pthread_mutex_unlock(&card->actions_lock);
 	return rc;
 }
 
+int snap_card_get_actions(struct snap_card *card,
+			  struct snap_action_info *info, int *num)
+{
+	int rc;
+
+	if ((card == NULL) || (num == NULL) || (*num < 0)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	rc = __actions_setup(card);
+	if (rc != SNAP_OK) {
+		errno = ENODEV;
+		return rc;
+	}
+	if (info != NULL)
+		memcpy(info, card->actions, MIN(*num, card->nactions) *
+		       sizeof(*info));
+	*num = card->nactions;
+	return SNAP_OK;
+}
+
 static struct snap_action *hw_attach_action(struct snap_card *card,
 				snap_action_type_t action_type,
 				snap_action_flag_t action_flags,
@@ -477,7 +695,6 @@ static struct snap_action *hw_attach_action(struct snap_card *card,
 	uint64_t data;
 	uint32_t mode;
 	uint32_t sat = INVALID_SAT;     /* Invalid short Action type */
-	int maid;                       /* Max Acition Id's */
 	unsigned long t0;               /* Time in msec */
 	int dt;
 	struct snap_action *action = NULL;
@@ -514,15 +731,15 @@ static struct snap_action *hw_attach_action(struct snap_card *card,
 			errno = ENODEV;
 			return NULL;
 		}
-		maid = (int)(data & 0xf) + 1;	/* Max Actions */
+		if (__actions_setup(card) != SNAP_OK) {
+			errno = ENODEV;
+			return NULL;
+		}
 
 		/* Search action to get Short Action type */
-		for (i = 0; i < maid; i++) {
-			hw_snap_mmio_read64(card, SNAP_S_ATRI + i*8, &data);
-			if (action_type ==
-			    (snap_action_type_t)(data & 0xffffffff)) {
-				sat = (uint32_t)(data >>  32ll);
-				/* Short Action Type */
+		for (i = 0; i < card->nactions; i++) {
+			if (action_type == card->actions[i].action_type) {
+				sat = card->actions[i].sat;
 				break;	/* Found */
 			}
 		}
@@ -714,11 +931,159 @@ static struct snap_funcs hardware_funcs = {
 /* We access the hardware via this function pointer struct */
 static struct snap_funcs *df = &hardware_funcs;
 
+/******************************************************************************
+ * STATISTICS SEGMENT
+ *****************************************************************************/
+
+static struct snap_stats *snap_stats = NULL;
+static int snap_stats_enabled = 1;	/* SNAP_STATS=0 disables */
+static pthread_mutex_t snap_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int snap_stats_card_refs[SNAP_STATS_CARDS];
+
+static void __stats_name(char *name, size_t len, pid_t pid)
+{
+	snprintf(name, len, "/" SNAP_STATS_PREFIX "%d", (int)pid);
+}
+
+struct snap_stats *snap_stats_get(void)
+{
+	int fd;
+	char name[64];
+	struct snap_stats *stats;
+
+	if (!snap_stats_enabled)
+		return NULL;
+	if (snap_stats != NULL)
+		return snap_stats;
+
+	pthread_mutex_lock(&snap_stats_lock);
+	if (snap_stats != NULL)
+		goto out;
+
+	__stats_name(name, sizeof(name), getpid());
+	fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		snap_trace("%s: shm_open %s failed: %s\n", __func__,
+			   name, strerror(errno));
+		snap_stats_enabled = 0;
+		goto out;
+	}
+	if (ftruncate(fd, sizeof(*stats)) != 0) {
+		snap_trace("%s: ftruncate failed: %s\n", __func__,
+			   strerror(errno));
+		goto out_unlink;
+	}
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, fd, 0);
+	if (stats == MAP_FAILED) {
+		snap_trace("%s: mmap failed: %s\n", __func__, strerror(errno));
+		goto out_unlink;
+	}
+	close(fd);
+
+	stats->pid = getpid();
+	strncpy(stats->comm, program_invocation_short_name,
+		sizeof(stats->comm) - 1);
+	stats->version = SNAP_STATS_VERSION;
+	__sync_synchronize();
+	stats->magic = SNAP_STATS_MAGIC;	/* Readers check this last */
+	snap_stats = stats;
+	goto out;
+
+ out_unlink:
+	close(fd);
+	shm_unlink(name);
+	snap_stats_enabled = 0;
+ out:
+	pthread_mutex_unlock(&snap_stats_lock);
+	return snap_stats;
+}
+
+/* Find or get a free counter set for the card opened via path */
+static struct snap_stats_card *__stats_card(const char *path)
+{
+	unsigned int i;
+	struct snap_stats *stats = snap_stats_get();
+	struct snap_stats_card *free_slot = NULL;
+
+	if ((stats == NULL) || (path == NULL))
+		return NULL;
+
+	pthread_mutex_lock(&snap_stats_lock);
+	for (i = 0; i < SNAP_STATS_CARDS; i++) {
+		if (strncmp(stats->card[i].path, path,
+			    SNAP_STATS_NAME_LEN - 1) == 0) {
+			snap_stats_card_refs[i]++;
+			pthread_mutex_unlock(&snap_stats_lock);
+			return &stats->card[i];
+		}
+		if ((free_slot == NULL) && (stats->card[i].path[0] == 0))
+			free_slot = &stats->card[i];
+	}
+	if (free_slot) {
+		strncpy(free_slot->path, path, SNAP_STATS_NAME_LEN - 1);
+		snap_stats_card_refs[free_slot - stats->card] = 1;
+	}
+	pthread_mutex_unlock(&snap_stats_lock);
+	return free_slot;
+}
+
+/* The last card using a counter set gives it back */
+static void __stats_card_put(struct snap_stats_card *st)
+{
+	unsigned int i;
+
+	if (st == NULL)
+		return;
+
+	pthread_mutex_lock(&snap_stats_lock);
+	i = st - snap_stats->card;
+	if (--snap_stats_card_refs[i] == 0)
+		memset(st, 0, sizeof(*st));
+	pthread_mutex_unlock(&snap_stats_lock);
+}
+
+/*
+ * Only removes the name. Threads of other libraries, e.g. the
+ * completion threads of snapblock, may still update their counters
+ * while the process exits, the kernel drops the mapping after them.
+ */
+static void snap_stats_done(void)
+{
+	char name[64];
+
+	if (snap_stats == NULL)
+		return;
+
+	/* A forked child must not remove the segment of its parent */
+	if (snap_stats->pid != getpid())
+		return;
+
+	__stats_name(name, sizeof(name), snap_stats->pid);
+	shm_unlink(name);
+}
+
+static void snap_ddr_done(struct snap_card *card);
+
 struct snap_card *snap_card_alloc_dev(const char *path,
 				      uint16_t vendor_id,
 				      uint16_t device_id)
 {
-	return df->card_alloc_dev(path, vendor_id, device_id);
+	struct snap_card *card;
+
+	card = df->card_alloc_dev(path, vendor_id, device_id);
+	if (card == NULL)
+		return NULL;
+
+	pthread_mutex_init(&card->ddr_lock, NULL);
+	card->ddr = NULL;
+	card->stats = __stats_card(path);
+
+	pthread_mutex_init(&card->actions_lock, NULL);
+	card->nactions = -1;
+	if (path != NULL)
+		strncpy(card->path, path, sizeof(card->path) - 1);
+	return card;
 }
 
 struct snap_action *snap_attach_action(struct snap_card *card,
@@ -726,10 +1091,15 @@ struct snap_action *snap_attach_action(struct snap_card *card,
 				       snap_action_flag_t action_flags,
 				       int timeout_ms)
 {
+	struct snap_action *action;
+
 	if (software_action_enabled())
 		snap_map_funcs(card, action_type);
 
-	return df->attach_action(card, action_type, action_flags, timeout_ms);
+	snap_probe2(libsnap, action__attach__start, action_type, timeout_ms);
+	action = df->attach_action(card, action_type, action_flags, timeout_ms);
+	snap_probe2(libsnap, action__attach__done, action_type, action);
+	return action;
 }
 
 int snap_detach_action(struct snap_action *action)
@@ -737,7 +1107,9 @@ int snap_detach_action(struct snap_action *action)
 	int rc;
 
 	snap_trace("%s Enter\n", __func__);
+	snap_probe1(libsnap, action__detach__start, action);
 	rc = df->detach_action(action);
+	snap_probe2(libsnap, action__detach__done, action, rc);
 	snap_trace("%s Exit rc: %d\n", __func__, rc);
 	return rc;
 }
@@ -747,6 +1119,8 @@ int snap_mmio_write32(struct snap_card *_card,
 {
 	int rc;
 	rc = df->mmio_write32(_card, offset, data);
+	snap_probe3(libsnap, mmio__write32, offset, data, rc);
+	snap_stats_add(_card->stats, mmio_writes, 1);
 	return rc;
 }
 
@@ -755,6 +1129,8 @@ int snap_mmio_read32(struct snap_card *_card,
 {
 	int rc;
 	rc = df->mmio_read32(_card, offset, data);
+	snap_probe3(libsnap, mmio__read32, offset, rc ? 0 : *data, rc);
+	snap_stats_add(_card->stats, mmio_reads, 1);
 	return rc;
 }
 
@@ -771,6 +1147,9 @@ int snap_action_write32(struct snap_action *action,
 		return SNAP_EATTACH;
 
 	rc = df->mmio_write32(card, card->action_base + offset, data);
+	snap_probe3(libsnap, mmio__write32, card->action_base + offset,
+		    data, rc);
+	snap_stats_add(card->stats, mmio_writes, 1);
 	return rc;
 }
 
@@ -784,6 +1163,9 @@ int snap_action_read32(struct snap_action *action,
 		return SNAP_EATTACH;
 
 	rc = df->mmio_read32(card, card->action_base + offset, data);
+	snap_probe3(libsnap, mmio__read32, card->action_base + offset,
+		    rc ? 0 : *data, rc);
+	snap_stats_add(card->stats, mmio_reads, 1);
 	return rc;
 }
 
@@ -793,6 +1175,8 @@ int snap_mmio_write64(struct snap_card *_card,
 	int rc;
 
 	rc = df->mmio_write64(_card, offset, data);
+	snap_probe3(libsnap, mmio__write64, offset, data, rc);
+	snap_stats_add(_card->stats, mmio_writes, 1);
 	return rc;
 }
 
@@ -802,12 +1186,21 @@ int snap_mmio_read64(struct snap_card *_card,
 	int rc;
 
 	rc = df->mmio_read64(_card, offset, data);
+	snap_probe3(libsnap, mmio__read64, offset, rc ? 0 : *data, rc);
+	snap_stats_add(_card->stats, mmio_reads, 1);
 	return rc;
 }
 
 
 void snap_card_free(struct snap_card *_card)
 {
+	if (_card) {
+		__stats_card_put(_card->stats);
+		_card->stats = NULL;
+		snap_ddr_done(_card);
+		pthread_mutex_destroy(&_card->ddr_lock);
+		pthread_mutex_destroy(&_card->actions_lock);
+	}
 	df->card_free(_card);
 }
 
@@ -816,6 +1209,262 @@ int snap_card_ioctl(struct snap_card *_card, unsigned int cmd, unsigned long arg
 	return df->card_ioctl(_card, cmd, arg);
 }
 
+/******************************************************************************
+ * CARD DRAM ALLOCATION
+ *****************************************************************************/
+
+static void __ddr_list_free(struct snap_ddr_block *b)
+{
+	struct snap_ddr_block *next;
+
+	for (; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+}
+
+static void snap_ddr_done(struct snap_card *card)
+{
+	if (card->ddr == NULL)
+		return;
+
+	if (card->ddr->used_list != NULL)
+		snap_trace("%s: %lld bytes card DRAM still allocated\n",
+			   __func__, (long long)card->ddr->used);
+
+	__ddr_list_free(card->ddr->free_list);
+	__ddr_list_free(card->ddr->used_list);
+	free(card->ddr);
+	card->ddr = NULL;
+}
+
+/*
+ * Setup allocator on first use, such that SET_SDRAM_SIZE done by the
+ * application after opening the card is still taken into account.
+ * Must be called with card->ddr_lock held.
+ */
+static int __ddr_setup(struct snap_card *card)
+{
+	unsigned long size_mb = 0;
+	struct snap_ddr_pool *ddr;
+
+	if (card->ddr != NULL)
+		return SNAP_OK;
+
+	df->card_ioctl(card, GET_SDRAM_SIZE, (unsigned long)&size_mb);
+	if ((size_mb == 0) && software_action_enabled())
+		size_mb = SNAP_DDR_SW_SIZE_MB;
+	if (size_mb == 0) {
+		snap_trace("%s: Card %s has no DRAM\n", __func__, card->name);
+		errno = ENODEV;
+		return SNAP_ENODEV;
+	}
+
+	ddr = calloc(1, sizeof(*ddr));
+	if (ddr == NULL)
+		return SNAP_ENOMEM;
+
+	ddr->size = (uint64_t)size_mb * 1024 * 1024;
+	ddr->free_list = calloc(1, sizeof(*ddr->free_list));
+	if (ddr->free_list == NULL) {
+		free(ddr);
+		return SNAP_ENOMEM;
+	}
+	ddr->free_list->addr = 0;
+	ddr->free_list->size = ddr->size;
+
+	snap_trace("%s: Card %s %ld MB DRAM\n", __func__, card->name, size_mb);
+	card->ddr = ddr;
+	return SNAP_OK;
+}
+
+/* Insert into address sorted list, merge with neighbours if requested */
+static void __ddr_insert(struct snap_ddr_block **list,
+			 struct snap_ddr_block *b, bool merge)
+{
+	struct snap_ddr_block *prev = NULL, *next = *list;
+
+	while ((next != NULL) && (next->addr < b->addr)) {
+		prev = next;
+		next = next->next;
+	}
+
+	b->next = next;
+	if (prev)
+		prev->next = b;
+	else	*list = b;
+
+	if (!merge)
+		return;
+
+	if ((next != NULL) && (b->addr + b->size == next->addr)) {
+		b->size += next->size;
+		b->next = next->next;
+		free(next);
+	}
+	if ((prev != NULL) && (prev->addr + prev->size == b->addr)) {
+		prev->size += b->size;
+		prev->next = b->next;
+		free(b);
+	}
+}
+
+int snap_ddr_alloc(struct snap_card *card, uint64_t size, uint64_t align,
+		   uint64_t *ddr_addr)
+{
+	int rc;
+	uint64_t start, end;
+	struct snap_ddr_block *b, *prev = NULL, *head = NULL, *used;
+
+	if ((card == NULL) || (ddr_addr == NULL) || (size == 0)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	if (align == 0)
+		align = SNAP_DDR_ALIGN_DEFAULT;
+	if (align & (align - 1)) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+	/* Keep regions multiples of the memory bus width */
+	size = (size + SNAP_DDR_ALIGN_DEFAULT - 1) &
+		~((uint64_t)SNAP_DDR_ALIGN_DEFAULT - 1);
+
+	pthread_mutex_lock(&card->ddr_lock);
+	rc = __ddr_setup(card);
+	if (rc != SNAP_OK)
+		goto out;
+
+	/* First fit */
+	for (b = card->ddr->free_list; b != NULL; prev = b, b = b->next) {
+		start = (b->addr + align - 1) & ~(align - 1);
+		end = b->addr + b->size;
+		if ((start >= b->addr) && (start < end) && (end - start >= size))
+			break;
+	}
+	if (b == NULL) {
+		snap_trace("%s: No %lld bytes free (align %lld)\n", __func__,
+			   (long long)size, (long long)align);
+		errno = ENOMEM;
+		rc = SNAP_ENOMEM;
+		goto out;
+	}
+
+	used = calloc(1, sizeof(*used));
+	if (start != b->addr)
+		head = calloc(1, sizeof(*head));
+	if ((used == NULL) || ((start != b->addr) && (head == NULL))) {
+		__free(used);
+		__free(head);
+		errno = ENOMEM;
+		rc = SNAP_ENOMEM;
+		goto out;
+	}
+
+	/* Keep alignment gap in front as separate free block */
+	if (head) {
+		head->addr = b->addr;
+		head->size = start - b->addr;
+		head->next = b;
+		if (prev)
+			prev->next = head;
+		else	card->ddr->free_list = head;
+		prev = head;
+	}
+
+	b->addr = start + size;
+	b->size = end - b->addr;
+	if (b->size == 0) {
+		if (prev)
+			prev->next = b->next;
+		else	card->ddr->free_list = b->next;
+		free(b);
+	}
+
+	used->addr = start;
+	used->size = size;
+	__ddr_insert(&card->ddr->used_list, used, false);
+	card->ddr->used += size;
+
+	*ddr_addr = start;
+	snap_trace("%s: %016llx size %lld\n", __func__,
+		   (long long)start, (long long)size);
+ out:
+	pthread_mutex_unlock(&card->ddr_lock);
+	return rc;
+}
+
+int snap_ddr_free(struct snap_card *card, uint64_t ddr_addr)
+{
+	struct snap_ddr_block *b, *prev = NULL;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	pthread_mutex_lock(&card->ddr_lock);
+	if (card->ddr == NULL)
+		goto err_out;
+
+	for (b = card->ddr->used_list; b != NULL; prev = b, b = b->next)
+		if (b->addr == ddr_addr)
+			break;
+	if (b == NULL)
+		goto err_out;
+
+	if (prev)
+		prev->next = b->next;
+	else	card->ddr->used_list = b->next;
+
+	card->ddr->used -= b->size;
+	snap_trace("%s: %016llx size %lld\n", __func__,
+		   (long long)b->addr, (long long)b->size);
+	__ddr_insert(&card->ddr->free_list, b, true);
+
+	pthread_mutex_unlock(&card->ddr_lock);
+	return SNAP_OK;
+
+ err_out:
+	pthread_mutex_unlock(&card->ddr_lock);
+	snap_trace("%s: %016llx not allocated\n", __func__,
+		   (long long)ddr_addr);
+	errno = ENOENT;
+	return SNAP_ENOENT;
+}
+
+int snap_ddr_avail(struct snap_card *card, uint64_t *free_bytes,
+		   uint64_t *largest)
+{
+	int rc;
+	uint64_t max = 0;
+	struct snap_ddr_block *b;
+
+	if (card == NULL) {
+		errno = EINVAL;
+		return SNAP_EINVAL;
+	}
+
+	pthread_mutex_lock(&card->ddr_lock);
+	rc = __ddr_setup(card);
+	if (rc != SNAP_OK) {
+		pthread_mutex_unlock(&card->ddr_lock);
+		return rc;
+	}
+
+	for (b = card->ddr->free_list; b != NULL; b = b->next)
+		if (b->size > max)
+			max = b->size;
+
+	if (free_bytes)
+		*free_bytes = card->ddr->size - card->ddr->used;
+	if (largest)
+		*largest = max;
+
+	pthread_mutex_unlock(&card->ddr_lock);
+	return SNAP_OK;
+}
+
 /******************************************************************************
  * JOB QUEUE Operations
  *****************************************************************************/
@@ -876,6 +1525,7 @@ int snap_action_start(struct snap_action *action)
 		snap_mmio_write32(card, ACTION_IRQ_APP, ACTION_IRQ_APP_DONE);
 		snap_mmio_write32(card, ACTION_IRQ_CONTROL, ACTION_IRQ_CONTROL_ON);
 	}
+	snap_stats_add(card->stats, jobs, 1);
 	return snap_mmio_write32(card, ACTION_CONTROL, ACTION_CONTROL_START);
 }
 
@@ -966,6 +1616,7 @@ int snap_action_sync_execute_job_set_regs(struct snap_action *action,
 	uint32_t action_addr;
 	uint32_t *job_data;
 	unsigned int mmio_in, mmio_out;
+	long long t0 = card->stats ? __get_usec() : 0;
 
 	/* Size must be less than addr[6] */
 	if (cjob->wout_size > SNAP_JOBSIZE) {
@@ -1023,6 +1674,7 @@ int snap_action_sync_execute_job_set_regs(struct snap_action *action,
 	}
 
 __snap_action_sync_execute_job_exit:
+	snap_stats_add(card->stats, set_regs_usec, __get_usec() - t0);
 	snap_action_stop(action);
 	return rc;
 }
@@ -1115,6 +1767,8 @@ int snap_action_sync_execute_job_check_completion(struct snap_action *action,
 	}
 
 __snap_action_sync_execute_job_exit:
+	if (rc != 0)
+		snap_stats_add(card->stats, job_errors, 1);
 	snap_action_stop(action);
 	return rc;
 }
@@ -1138,11 +1792,24 @@ int snap_action_sync_execute_job(struct snap_action *action,
 				 unsigned int timeout_sec)
 {
 	int rc;
+	struct snap_card *card = (struct snap_card *)action;
+	long long t0;
+
+	snap_probe3(libsnap, job__submit, action, cjob->win_size,
+		    timeout_sec);
 
 	/* Set action registers through MMIO */
 	rc = snap_action_sync_execute_job_set_regs(action, cjob);
 	if (rc != 0)
-		return rc;
+		goto out;
+
+	/*
+	 * Jobs in flight and their wait time are only known here, callers
+	 * of snap_action_start() like snapblock complete jobs themselves.
+	 */
+	t0 = card->stats ? __get_usec() : 0;
+	snap_stats_add(card->stats, sync_jobs, 1);
+	snap_stats_add(card->stats, jobs_in_flight, 1);
 
 	/* Start Action */
 	snap_action_start(action);
@@ -1150,6 +1817,11 @@ int snap_action_sync_execute_job(struct snap_action *action,
 	/* Wait for finish */
 	rc = snap_action_sync_execute_job_check_completion(action, cjob, 
 				timeout_sec);
+
+	snap_stats_add(card->stats, wait_usec, __get_usec() - t0);
+	snap_stats_sub(card->stats, jobs_in_flight, 1);
+ out:
+	snap_probe3(libsnap, job__done, action, cjob->retc, rc);
 	return rc;
 }
 
@@ -1455,6 +2127,7 @@ static void _init(void)
 {
 	const char *trace_env;
 	const char *config_env;
+	const char *stats_env;
 
 	trace_env = getenv("SNAP_TRACE");
 	if (trace_env != NULL)
@@ -1475,4 +2148,17 @@ static void _init(void)
 
 	if (software_action_enabled())
 		df = &software_funcs; /* Map Software Functions */
+
+	snap_action_cache = getenv("SNAP_ACTION_CACHE");
+
+	stats_env = getenv("SNAP_STATS");
+	if (stats_env != NULL)
+		snap_stats_enabled = strtol(stats_env, (char **)NULL, 0);
+}
+
+static void _done(void) __attribute__((destructor));
+
+static void _done(void)
+{
+	snap_stats_done();
 }
@@ -0,0 +1,335 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Live monitor for processes using SNAP cards. Reads the statistics
+ * segments libsnap publishes in /dev/shm (see snap_stats.h), sums up
+ * the counters per card and prints rates for the last interval.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <snap_tools.h>
+#include <snap_stats.h>
+
+#define MAX_PROCS	256
+
+int verbose_flag = 0;
+
+static const char *version = GIT_VERSION;
+
+struct proc_sample {
+	int valid;
+	struct snap_stats s;
+};
+
+static struct proc_sample cur[MAX_PROCS];
+static struct proc_sample prev[MAX_PROCS];
+
+/**
+ * @brief	prints valid command line options
+ *
+ * @param prog	current program's name
+ */
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-h] [-v,--verbose]\n"
+	       "  -V, --version             print version.\n"
+	       "  -i, --interval <sec>      refresh interval, 1: default.\n"
+	       "  -c, --count <num>         number of updates, 0: forever.\n"
+	       "  -b, --batch               do not clear the screen.\n"
+	       "\n"
+	       "Shows jobs, MMIO and block I/O statistics of all processes\n"
+	       "using SNAP cards. Processes with SNAP_STATS=0 are not shown.\n"
+	       "\n",
+	       prog);
+}
+
+/* Read one segment, returns 0 if it belongs to a running process */
+static int read_segment(const char *fname, struct snap_stats *s)
+{
+	int fd, rc = -1;
+	struct stat st;
+	struct snap_stats *m;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(*m)))
+		goto out;
+
+	m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		goto out;
+
+	if ((m->magic == SNAP_STATS_MAGIC) &&
+	    (m->version == SNAP_STATS_VERSION)) {
+		memcpy(s, m, sizeof(*s));
+		rc = 0;
+	}
+	munmap(m, sizeof(*m));
+
+	/* Remove leftovers of processes which were killed */
+	if ((rc == 0) && (kill(s->pid, 0) != 0) && (errno == ESRCH)) {
+		if (verbose_flag)
+			fprintf(stderr, "removing stale %s\n", fname);
+		unlink(fname);
+		rc = -1;
+	}
+ out:
+	close(fd);
+	return rc;
+}
+
+static unsigned int scan_segments(void)
+{
+	DIR *d;
+	struct dirent *e;
+	unsigned int n = 0;
+	char fname[PATH_MAX];
+
+	d = opendir(SNAP_STATS_DIR);
+	if (d == NULL)
+		return 0;
+
+	memset(cur, 0, sizeof(cur));
+	while (((e = readdir(d)) != NULL) && (n < MAX_PROCS)) {
+		if (strncmp(e->d_name, SNAP_STATS_PREFIX,
+			    strlen(SNAP_STATS_PREFIX)) != 0)
+			continue;
+		snprintf(fname, sizeof(fname), "%s/%s", SNAP_STATS_DIR,
+			 e->d_name);
+		if (read_segment(fname, &cur[n].s) == 0)
+			cur[n++].valid = 1;
+	}
+	closedir(d);
+	return n;
+}
+
+static struct snap_stats *find_prev(pid_t pid)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_PROCS; i++)
+		if (prev[i].valid && (prev[i].s.pid == pid))
+			return &prev[i].s;
+	return NULL;
+}
+
+static double per_sec(uint64_t d, double secs)
+{
+	return (secs > 0.0) ? (double)d / secs : 0.0;
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+	return b ? (double)a / (double)b : 0.0;
+}
+
+/* Sum up the deltas of all processes for each card */
+static void print_cards(unsigned int n, double secs)
+{
+	unsigned int i, j, k, ncards = 0;
+	struct snap_stats_card sum[MAX_PROCS], *c, *p;
+	struct snap_stats_card zero;
+	struct snap_stats *ps;
+	uint64_t infl[MAX_PROCS];
+
+	memset(&zero, 0, sizeof(zero));
+	memset(sum, 0, sizeof(sum));
+	memset(infl, 0, sizeof(infl));
+
+	for (i = 0; i < n; i++) {
+		ps = find_prev(cur[i].s.pid);
+		for (j = 0; j < SNAP_STATS_CARDS; j++) {
+			c = &cur[i].s.card[j];
+			if (c->path[0] == 0)
+				continue;
+			p = ps ? &ps->card[j] : c;	/* new: no delta yet */
+
+			for (k = 0; k < ncards; k++)
+				if (strcmp(sum[k].path, c->path) == 0)
+					break;
+			if (k == ncards) {
+				if (ncards == MAX_PROCS)
+					continue;
+				memcpy(sum[k].path, c->path, sizeof(c->path));
+				ncards++;
+			}
+			sum[k].jobs += c->jobs - p->jobs;
+			sum[k].sync_jobs += c->sync_jobs - p->sync_jobs;
+			sum[k].job_errors += c->job_errors - p->job_errors;
+			sum[k].set_regs_usec += c->set_regs_usec -
+				p->set_regs_usec;
+			sum[k].wait_usec += c->wait_usec - p->wait_usec;
+			sum[k].irq_waits += c->irq_waits - p->irq_waits;
+			sum[k].irq_wait_usec += c->irq_wait_usec -
+				p->irq_wait_usec;
+			sum[k].mmio_reads += c->mmio_reads - p->mmio_reads;
+			sum[k].mmio_writes += c->mmio_writes - p->mmio_writes;
+			infl[k] += c->jobs_in_flight;
+		}
+	}
+
+	printf("%-20s %9s %5s %5s %10s %10s %10s %10s\n", "CARD",
+	       "JOBS/s", "INFL", "ERR", "REGS us/j", "WAIT us/j",
+	       "IRQ us/w", "MMIO/s");
+	for (k = 0; k < ncards; k++) {
+		c = &sum[k];
+		printf("%-20s %9.1f %5lld %5lld %10.1f %10.1f %10.1f %10.1f\n",
+		       c->path, per_sec(c->jobs, secs),
+		       (long long)infl[k], (long long)c->job_errors,
+		       ratio(c->set_regs_usec, c->jobs),
+		       ratio(c->wait_usec, c->sync_jobs),
+		       ratio(c->irq_wait_usec, c->irq_waits),
+		       per_sec(c->mmio_reads + c->mmio_writes, secs));
+	}
+}
+
+static void print_blk(unsigned int n, double secs)
+{
+	unsigned int i;
+	struct snap_stats_blk *b, *p;
+	struct snap_stats *ps;
+	uint64_t reads, writes, prefetches;
+
+	printf("\n%-7s %-15s %-20s %8s %8s %9s %9s %8s %8s %4s %5s %6s\n",
+	       "PID", "COMMAND", "BLOCK DEVICE", "RD/s", "WR/s",
+	       "RD MiB/s", "WR MiB/s", "RD us", "WR us", "INFL",
+	       "HIT%", "PFUSE%");
+	for (i = 0; i < n; i++) {
+		b = &cur[i].s.blk;
+		if (b->path[0] == 0)
+			continue;
+		ps = find_prev(cur[i].s.pid);
+		p = ps ? &ps->blk : b;
+
+		reads = b->reads - p->reads;
+		writes = b->writes - p->writes;
+		prefetches = b->prefetches - p->prefetches;
+
+		printf("%-7d %-15.15s %-20s %8.1f %8.1f %9.2f %9.2f "
+		       "%8.1f %8.1f %4lld %5.1f %6.1f\n",
+		       (int)cur[i].s.pid, cur[i].s.comm, b->path,
+		       per_sec(reads, secs), per_sec(writes, secs),
+		       per_sec(b->read_bytes - p->read_bytes, secs) /
+		       (1024 * 1024),
+		       per_sec(b->write_bytes - p->write_bytes, secs) /
+		       (1024 * 1024),
+		       ratio(b->read_usec - p->read_usec, reads),
+		       ratio(b->write_usec - p->write_usec, writes),
+		       (long long)b->reqs_in_flight,
+		       100.0 * ratio(b->cache_hits - p->cache_hits, reads),
+		       prefetches ? 100.0 - 100.0 *
+		       ratio(b->cache_trashing - p->cache_trashing,
+			     prefetches) : 0.0);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int ch;
+	unsigned int n, interval = 1;
+	unsigned long i, count = 0;
+	int batch = 0;
+	struct timespec t0, t1;
+	double secs;
+	char tstr[32];
+	time_t now;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "interval",	 required_argument, NULL, 'i' },
+			{ "count",	 required_argument, NULL, 'c' },
+			{ "batch",	 no_argument,	    NULL, 'b' },
+
+			/* misc/support */
+			{ "version",	 no_argument,	    NULL, 'V' },
+			{ "verbose",	 no_argument,	    NULL, 'v' },
+			{ "help",	 no_argument,	    NULL, 'h' },
+			{ 0,		 no_argument,	    NULL, 0   },
+		};
+
+		ch = getopt_long(argc, argv, "i:c:bVvh",
+				 long_options, &option_index);
+		if (ch == -1)	/* all params processed ? */
+			break;
+
+		switch (ch) {
+		case 'i':
+			interval = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'c':
+			count = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'V':
+			printf("%s\n", version);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose_flag++;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (interval == 0)
+		interval = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; (count == 0) || (i < count); i++) {
+		sleep(interval);
+
+		n = scan_segments();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		secs = (t1.tv_sec - t0.tv_sec) +
+			(t1.tv_nsec - t0.tv_nsec) / 1e9;
+		t0 = t1;
+
+		now = time(NULL);
+		strftime(tstr, sizeof(tstr), "%H:%M:%S", localtime(&now));
+		if (!batch)
+			printf("\033[H\033[2J");
+		printf("snap_top - %s  processes: %u  interval: %.2f sec\n\n",
+		       tstr, n, secs);
+		print_cards(n, secs);
+		print_blk(n, secs);
+		printf("\n");
+		fflush(stdout);
+
+		memcpy(prev, cur, sizeof(prev));
+	}
+
+	exit(EXIT_SUCCESS);
+}